@@ -0,0 +1,139 @@
+// Usage: elysia_bench [--json FILE] [--filter TEXT] [--seconds N] [posts.json ...]
+//
+// Runs the parse, filter and download suites and prints a table. With
+// --json the results are also written as JSON ("-" for stdout), one object
+// per benchmark keyed by a stable name, so runs of different commits can
+// be diffed. Without posts.json arguments the fixtures in bench/fixtures
+// are used.
+
+#include "bench.h"
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+
+namespace {
+
+std::string json_string(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Swallows everything written to it
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+};
+
+} // namespace
+
+BenchRun::BenchRun(double min_seconds, std::string filter) : min_seconds(min_seconds), filter(std::move(filter)) {
+}
+
+bool BenchRun::selected(const std::string& name) const {
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+void BenchRun::write_json(std::ostream& out) const {
+    out << std::setprecision(6) << "{\n"
+        << "  \"timestamp\": " << static_cast<long long>(std::time(nullptr)) << ",\n"
+#ifdef NDEBUG
+        << "  \"optimized\": true,\n"
+#else
+        << "  \"optimized\": false,\n"
+#endif
+        << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& result = results[i];
+        out << (i > 0 ? "," : "") << "\n    {\"name\": " << json_string(result.name)
+            << ", \"iterations\": " << result.iterations
+            << ", \"mean_us\": " << result.mean_us
+            << ", \"median_us\": " << result.median_us
+            << ", \"min_us\": " << result.min_us;
+        for (const auto& counter : result.counters) {
+            out << ", " << json_string(counter.first) << ": " << counter.second;
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void BenchRun::print_table(std::ostream& out) const {
+    out << std::left << std::setw(44) << "benchmark" << std::right
+        << std::setw(12) << "median us" << std::setw(12) << "min us" << "  counters\n";
+    for (const auto& result : results) {
+        out << std::left << std::setw(44) << result.name << std::right << std::fixed << std::setprecision(2)
+            << std::setw(12) << result.median_us << std::setw(12) << result.min_us << " ";
+        for (const auto& counter : result.counters) {
+            out << " " << counter.first << "=" << counter.second;
+        }
+        out << "\n";
+    }
+}
+
+std::string read_fixture(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+int main(int argc, char* argv[]) {
+    std::string json_path;
+    std::string filter;
+    double seconds = 1.0;
+    std::vector<std::filesystem::path> fixtures;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--seconds" && i + 1 < argc) {
+            seconds = std::atof(argv[++i]);
+        } else {
+            fixtures.emplace_back(arg);
+        }
+    }
+    if (fixtures.empty()) {
+        for (const auto& entry : std::filesystem::directory_iterator(ELYSIA_BENCH_FIXTURES_DIR)) {
+            if (entry.path().extension() == ".json") {
+                fixtures.push_back(entry.path());
+            }
+        }
+        std::sort(fixtures.begin(), fixtures.end());
+    }
+
+    // The code under test logs to stdout; keep it out of the results
+    NullBuffer sink;
+    std::streambuf* stdout_buf = std::cout.rdbuf(&sink);
+
+    BenchRun run(seconds, filter);
+    run_parse_benchmarks(run, fixtures);
+    run_filter_benchmarks(run, fixtures);
+    run_download_benchmarks(run);
+
+    std::cout.rdbuf(stdout_buf);
+    run.print_table(json_path == "-" ? std::cerr : std::cout);
+
+    if (json_path == "-") {
+        run.write_json(std::cout);
+    } else if (!json_path.empty()) {
+        std::ofstream out(json_path);
+        run.write_json(out);
+        if (!out.flush()) {
+            std::cerr << "Failed to write " << json_path << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// One measured benchmark. Times are per call. `counters` carries derived
+// figures such as throughput, named with their unit.
+struct BenchResult {
+    std::string name;
+    size_t iterations = 0;
+    double mean_us = 0;
+    double median_us = 0;
+    double min_us = 0;
+    std::vector<std::pair<std::string, double>> counters;
+};
+
+// Collects the results of one elysia_bench run
+class BenchRun {
+public:
+    BenchRun(double min_seconds, std::string filter);
+
+    // Whether `name` passes the --filter substring
+    bool selected(const std::string& name) const;
+
+    // Calls `fn` repeatedly for at least min_seconds, split into samples of
+    // several calls each. The median and minimum are over the per-call time
+    // of each sample, so a single slow call can't skew them.
+    template <typename Fn>
+    BenchResult* measure(const std::string& name, Fn&& fn);
+
+    void write_json(std::ostream& out) const;
+    void print_table(std::ostream& out) const;
+
+private:
+    double min_seconds;
+    std::string filter;
+    std::vector<BenchResult> results;
+};
+
+// The suites, one per file. `fixtures` are posts.json pages.
+void run_parse_benchmarks(BenchRun& run, const std::vector<std::filesystem::path>& fixtures);
+void run_filter_benchmarks(BenchRun& run, const std::vector<std::filesystem::path>& fixtures);
+void run_download_benchmarks(BenchRun& run);
+
+std::string read_fixture(const std::filesystem::path& path);
+
+template <typename Fn>
+BenchResult* BenchRun::measure(const std::string& name, Fn&& fn) {
+    if (!selected(name)) {
+        return nullptr;
+    }
+    using clock = std::chrono::steady_clock;
+    constexpr size_t min_samples = 5;
+
+    // Warm up, and size the samples so there are about 20 of them
+    auto start = clock::now();
+    fn();
+    double first = std::chrono::duration<double>(clock::now() - start).count();
+    size_t calls_per_sample = std::max<size_t>(1, static_cast<size_t>(min_seconds / 20 / std::max(first, 1e-9)));
+
+    std::vector<double> samples;
+    double total = 0;
+    size_t iterations = 0;
+    while (total < min_seconds || samples.size() < min_samples) {
+        start = clock::now();
+        for (size_t i = 0; i < calls_per_sample; ++i) {
+            fn();
+        }
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        samples.push_back(elapsed * 1e6 / calls_per_sample);
+        total += elapsed;
+        iterations += calls_per_sample;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    BenchResult result;
+    result.name = name;
+    result.iterations = iterations;
+    result.mean_us = total * 1e6 / iterations;
+    result.median_us = samples[samples.size() / 2];
+    result.min_us = samples.front();
+    results.push_back(std::move(result));
+    return &results.back();
+}
@@ -0,0 +1,106 @@
+// Download throughput through TransferEngine and ImageDownloader, against
+// MockServer on the loopback interface, so the numbers measure the client
+// rather than the network.
+
+#include "bench.h"
+#include "image_downloader.h"
+#include "mock_server.h"
+#include "transfer_engine.h"
+#include <glib.h>
+#include <cstdio>
+#include <functional>
+#include <string>
+
+namespace {
+
+struct DownloadCase {
+    const char* name;
+    bool to_file;
+    size_t bytes;
+    size_t count;
+    size_t parallel;
+};
+
+// Downloads `count` files, `parallel` at a time, the way the prefetch
+// queue and the mirror drive the engine. Returns the number that failed.
+size_t run_batch(TransferEngine& engine, const MockServer& server, const DownloadCase& test,
+                 const std::string& directory) {
+    GMainLoop* loop = g_main_loop_new(nullptr, FALSE);
+    std::string url = server.base_url() + "/bytes/" + std::to_string(test.bytes);
+    size_t started = 0;
+    size_t finished = 0;
+    size_t failed = 0;
+
+    std::function<void()> start_next = [&] {
+        size_t index = started++;
+        auto done = [&](bool success) {
+            failed += success ? 0 : 1;
+            if (++finished == test.count) {
+                g_main_loop_quit(loop);
+            } else if (started < test.count) {
+                start_next();
+            }
+        };
+        if (test.to_file) {
+            std::string path = directory + "/" + std::to_string(index);
+            ImageDownloader::download_image_async(engine, url, path, [done, path](bool success) {
+                std::remove(path.c_str());
+                done(success);
+            });
+        } else {
+            ImageDownloader::download_to_memory_async(engine, url, [done](GBytes* bytes, const std::string&) {
+                done(bytes != nullptr);
+            });
+        }
+    };
+    for (size_t i = 0; i < test.parallel && i < test.count; ++i) {
+        start_next();
+    }
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+    return failed;
+}
+
+} // namespace
+
+void run_download_benchmarks(BenchRun& run) {
+    const DownloadCase cases[] = {
+        {"download/memory/64KiB_x64_j8", false, 64 * 1024, 64, 8},
+        {"download/memory/4MiB_x16_j4", false, 4 * 1024 * 1024, 16, 4},
+        {"download/file/64KiB_x64_j8", true, 64 * 1024, 64, 8},
+        {"download/file/4MiB_x16_j4", true, 4 * 1024 * 1024, 16, 4},
+    };
+    bool wanted = false;
+    for (const auto& test : cases) {
+        wanted = wanted || run.selected(test.name);
+    }
+    if (!wanted) {
+        return;
+    }
+
+    MockServer server(MockOptions{});
+    gchar* directory = g_dir_make_tmp("elysia-bench-XXXXXX", nullptr);
+    if (!server.ok() || !directory) {
+        g_free(directory);
+        return;
+    }
+    {
+        TransferEngine engine;
+        for (const auto& test : cases) {
+            size_t failed = 0;
+            BenchResult* result = run.measure(test.name, [&] {
+                failed += run_batch(engine, server, test, directory);
+            });
+            if (result) {
+                double seconds = result->median_us / 1e6;
+                double megabytes = test.bytes * test.count / (1024.0 * 1024.0);
+                result->counters = {{"files/s", test.count / seconds},
+                                    {"MiB/s", megabytes / seconds},
+                                    {"failed", static_cast<double>(failed)}};
+            }
+        }
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(directory, ec);
+    g_free(directory);
+}
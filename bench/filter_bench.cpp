@@ -0,0 +1,148 @@
+// Candidate filtering and selection: the quality filter over a page, by row
+// and by copying, and tag queries over a local index of index_posts posts
+// built from the fixtures.
+
+#include "bench.h"
+#include "danbooru_client.h"
+#include "post_index.h"
+#include "post_set.h"
+#include "tag_query.h"
+#include <glib.h>
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr size_t index_posts = 100000;
+
+// The filter MainWindow applies to every search
+const char* const quality_filter = "width:500..4000 height:600..3000";
+
+TagQuery parse_query(const std::string& text) {
+    TagQuery query;
+    std::string error;
+    if (!TagQuery::parse(text, query, error)) {
+        std::cerr << error << std::endl;
+    }
+    return query;
+}
+
+// `count` posts cycling through those of `source`, under ids from `first_id` on
+PostSet replicate(const PostSet& source, uint64_t first_id, size_t count) {
+    PostSet posts;
+    if (source.empty()) {
+        return posts;
+    }
+    posts.reserve(count, 0);
+    for (size_t i = 0; i < count; ++i) {
+        size_t row = (first_id + i) % source.size();
+        std::array<std::string_view, PostSet::field_count> texts;
+        for (size_t field = 0; field < texts.size(); ++field) {
+            texts[field] = source.text(row, static_cast<PostSet::Field>(field));
+        }
+        posts.add(first_id + i, source.width(row), source.height(row), source.rating(row), texts);
+    }
+    return posts;
+}
+
+void run_page_benchmarks(BenchRun& run, const std::string& stem, const std::string& json) {
+    PostSet posts = DanbooruClient::parse_post_set(json);
+    std::vector<DanbooruImage> images = posts.to_vector();
+    TagQuery quality = parse_query(quality_filter);
+    std::string prefix = "filter/" + stem + "/";
+
+    PostSet::Selection rows;
+    auto filter_rows = [&] {
+        rows.clear();
+        for (size_t row = 0; row < posts.size(); ++row) {
+            if (quality.matches(posts, row)) {
+                rows.push_back(static_cast<uint32_t>(row));
+            }
+        }
+    };
+    filter_rows();
+    if (BenchResult* result = run.measure(prefix + "quality_rows", filter_rows)) {
+        result->counters = {{"posts", static_cast<double>(posts.size())},
+                            {"kept", static_cast<double>(rows.size())}};
+    }
+
+    // The filter as it was before PostSet: copies of the images kept
+    run.measure(prefix + "quality_copies", [&] {
+        std::vector<DanbooruImage> kept;
+        for (const auto& image : images) {
+            if (quality.matches(image)) {
+                kept.push_back(image);
+            }
+        }
+    });
+
+    run.measure("select/" + stem + "/materialize", [&] { posts.posts(rows); });
+    run.measure("select/" + stem + "/copy_set", [&] { PostSet copy = posts; });
+}
+
+void run_index_benchmarks(BenchRun& run, const PostSet& source) {
+    std::string prefix = "query/index_" + std::to_string(index_posts) + "/";
+    const std::vector<std::pair<std::string, std::string>> queries = {
+        {"tag", "elysia_(honkai_impact) -video"},
+        {"any_of", "~solo ~2girls ~multiple_girls rating:g,s"},
+        {"quality", quality_filter},
+    };
+    // Building the index takes a while; skip it if nothing would use it
+    bool wanted = run.selected(prefix + "sample_20");
+    for (const auto& query : queries) {
+        wanted = wanted || run.selected(prefix + "evaluate_" + query.first);
+    }
+    if (!wanted || source.empty()) {
+        return;
+    }
+
+    gchar* directory = g_dir_make_tmp("elysia-bench-XXXXXX", nullptr);
+    if (!directory) {
+        std::cerr << "Failed to create a temporary index directory" << std::endl;
+        return;
+    }
+    {
+        PostIndex index(directory);
+        for (size_t added = 0; added < index_posts; added += 10000) {
+            index.add(replicate(source, added + 1, std::min<size_t>(10000, index_posts - added)));
+        }
+        QueryEngine engine(index);
+        std::mt19937 random(1);
+        for (const auto& query : queries) {
+            TagQuery parsed = parse_query(query.second);
+            size_t matches = QueryEngine::count(engine.evaluate(parsed));
+            if (BenchResult* result = run.measure(prefix + "evaluate_" + query.first,
+                                                  [&] { engine.evaluate(parsed); })) {
+                result->counters = {{"matches", static_cast<double>(matches)}};
+            }
+        }
+
+        TagQuery tag = parse_query(queries.front().second);
+        run.measure(prefix + "sample_20", [&] { engine.sample(tag, 20, random); });
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(directory, ec);
+    g_free(directory);
+}
+
+} // namespace
+
+void run_filter_benchmarks(BenchRun& run, const std::vector<std::filesystem::path>& fixtures) {
+    PostSet largest;
+    for (const auto& path : fixtures) {
+        std::string json = read_fixture(path);
+        if (json.empty()) {
+            continue;
+        }
+        run_page_benchmarks(run, path.stem().string(), json);
+        PostSet posts = DanbooruClient::parse_post_set(json);
+        if (posts.size() > largest.size()) {
+            largest = std::move(posts);
+        }
+    }
+    run_index_benchmarks(run, largest);
+}
@@ -0,0 +1,112 @@
+// Usage: elysia_mock_server [options] [posts.json ...]
+//
+// Runs MockServer until interrupted, then prints what it served. Point the
+// downloader at it with ELYSIA_API_URL=http://127.0.0.1:<port> (or
+// --api-url for --mirror). Without posts.json arguments the fixtures in
+// bench/fixtures are served.
+
+#include "mock_server.h"
+#include <signal.h>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+namespace {
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options] [posts.json ...]\n"
+              << "\n"
+              << "  --port N            port on 127.0.0.1 (default: any free one)\n"
+              << "  --posts N           repeat the fixture posts under new ids up to N posts\n"
+              << "  --images DIR        serve the files in DIR as post images (default: filler)\n"
+              << "  --image-bytes N     size of filler images (default 262144)\n"
+              << "  --latency MS        delay before every response\n"
+              << "  --jitter MS         up to MS more, at random\n"
+              << "  --bandwidth KIB     per-connection limit in KiB/s\n"
+              << "  --error-rate F      fraction of requests answered 503\n"
+              << "  --throttle-rate F   fraction answered 429 with Retry-After\n"
+              << "  --retry-after S     Retry-After of those (default 1)\n"
+              << "  --rate-limit N      searches and counts per second before 429s\n"
+              << "  --truncate-rate F   fraction of bodies cut off halfway\n"
+              << "  --no-etags          no ETags and no 304 answers\n"
+              << "  --seed N            seed for the injected faults (default 1)" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    MockOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(arg, "--port") == 0 && has_value) {
+            options.port = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--posts") == 0 && has_value) {
+            options.posts = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(arg, "--images") == 0 && has_value) {
+            options.image_directory = argv[++i];
+        } else if (std::strcmp(arg, "--image-bytes") == 0 && has_value) {
+            options.image_bytes = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(arg, "--latency") == 0 && has_value) {
+            options.latency_ms = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--jitter") == 0 && has_value) {
+            options.jitter_ms = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--bandwidth") == 0 && has_value) {
+            options.bytes_per_second = std::strtoul(argv[++i], nullptr, 10) * 1024;
+        } else if (std::strcmp(arg, "--error-rate") == 0 && has_value) {
+            options.error_rate = std::atof(argv[++i]);
+        } else if (std::strcmp(arg, "--throttle-rate") == 0 && has_value) {
+            options.throttle_rate = std::atof(argv[++i]);
+        } else if (std::strcmp(arg, "--rate-limit") == 0 && has_value) {
+            options.api_rate_limit = std::atof(argv[++i]);
+        } else if (std::strcmp(arg, "--retry-after") == 0 && has_value) {
+            options.retry_after_seconds = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--truncate-rate") == 0 && has_value) {
+            options.truncate_rate = std::atof(argv[++i]);
+        } else if (std::strcmp(arg, "--no-etags") == 0) {
+            options.etags = false;
+        } else if (std::strcmp(arg, "--seed") == 0 && has_value) {
+            options.seed = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg[0] == '-') {
+            print_usage(argv[0]);
+            return 2;
+        } else {
+            options.fixtures.push_back(arg);
+        }
+    }
+    if (options.fixtures.empty()) {
+        for (const auto& entry : std::filesystem::directory_iterator(ELYSIA_BENCH_FIXTURES_DIR)) {
+            if (entry.path().extension() == ".json") {
+                options.fixtures.push_back(entry.path().string());
+            }
+        }
+    }
+
+    // Blocked before the server starts, so its threads inherit the mask
+    // and the signals are only taken by sigwait() below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    MockServer::Stats stats;
+    {
+        MockServer server(options);
+        if (!server.ok()) {
+            return 1;
+        }
+        std::cout << "Serving on " << server.base_url() << std::endl;
+
+        int signal = 0;
+        sigwait(&signals, &signal);
+        stats = server.stats();
+    }
+
+    std::cout << "\nrequests: " << stats.requests << ", bytes sent: " << stats.bytes_sent
+              << "\n  injected: " << stats.errors << " errors, " << stats.throttled << " 429s, "
+              << stats.truncated << " truncated bodies"
+              << "\n  not modified: " << stats.not_modified << ", partial: " << stats.partial << std::endl;
+    return 0;
+}
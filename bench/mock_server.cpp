@@ -0,0 +1,637 @@
+#include "mock_server.h"
+#include "http_header.h"
+#include "post_json_parser.h"
+#include "tag_query.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+
+namespace {
+
+// Where the recorded fixtures keep their files
+const std::string fixture_image_host = "https://cdn.donmai.us/";
+
+constexpr int default_limit = 20;
+constexpr int max_limit = 200;
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+// FNV-1a, for ETags that only change with the content
+std::string make_etag(std::string_view data) {
+    uint64_t hash = 1469598103934665603ull;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    char text[24];
+    std::snprintf(text, sizeof(text), "\"%016llx\"", static_cast<unsigned long long>(hash));
+    return text;
+}
+
+// The top-level objects of a JSON array, as slices of `json`
+std::vector<std::string_view> split_objects(std::string_view json) {
+    std::vector<std::string_view> objects;
+    int depth = 0;
+    bool in_string = false;
+    size_t start = 0;
+    for (size_t i = 0; i < json.size(); ++i) {
+        char c = json[i];
+        if (in_string) {
+            if (c == '\\') {
+                ++i;
+            } else if (c == '"') {
+                in_string = false;
+            }
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            if (c == '{' && depth == 1) {
+                start = i;
+            }
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            --depth;
+            if (c == '}' && depth == 1) {
+                objects.push_back(json.substr(start, i + 1 - start));
+            }
+        }
+    }
+    return objects;
+}
+
+void replace_all(std::string& text, const std::string& from, const std::string& to) {
+    for (size_t at = text.find(from); at != std::string::npos; at = text.find(from, at + to.size())) {
+        text.replace(at, from.size(), to);
+    }
+}
+
+// "%2B" and "+" decoding of a query string value
+std::string url_decode(std::string_view text) {
+    std::string out;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '+') {
+            out += ' ';
+        } else if (text[i] == '%' && i + 2 < text.size()) {
+            int value = 0;
+            std::from_chars(text.data() + i + 1, text.data() + i + 3, value, 16);
+            out += static_cast<char>(value);
+            i += 2;
+        } else {
+            out += text[i];
+        }
+    }
+    return out;
+}
+
+std::string query_value(const std::string& query, const std::string& name) {
+    std::string_view rest(query);
+    while (!rest.empty()) {
+        size_t amp = rest.find('&');
+        std::string_view pair = rest.substr(0, amp);
+        rest = amp == std::string_view::npos ? std::string_view() : rest.substr(amp + 1);
+        size_t equals = pair.find('=');
+        if (pair.substr(0, equals) == name) {
+            return equals == std::string_view::npos ? "" : url_decode(pair.substr(equals + 1));
+        }
+    }
+    return "";
+}
+
+const char* reason_phrase(int status) {
+    switch (status) {
+    case 200:
+        return "OK";
+    case 206:
+        return "Partial Content";
+    case 304:
+        return "Not Modified";
+    case 404:
+        return "Not Found";
+    case 416:
+        return "Range Not Satisfiable";
+    case 422:
+        return "Unprocessable Entity";
+    case 429:
+        return "Too Many Requests";
+    default:
+        return "Service Unavailable";
+    }
+}
+
+std::string content_type_for(const std::string& name) {
+    std::string ext = std::filesystem::path(name).extension().string();
+    if (ext == ".png") {
+        return "image/png";
+    }
+    if (ext == ".gif") {
+        return "image/gif";
+    }
+    if (ext == ".webp") {
+        return "image/webp";
+    }
+    return "image/jpeg";
+}
+
+// Collects the fields of a post the tag search needs, and its md5
+class PostFields : public PostJsonHandler {
+public:
+    uint64_t id = 0;
+    DanbooruImage image{};
+
+    void begin_post() override {}
+
+    void field(std::string_view key, const JsonValue& value) override {
+        const char* end = value.text.data() + value.text.size();
+        if (key == "id") {
+            std::from_chars(value.text.data(), end, id);
+        } else if (key == "tag_string") {
+            image.tags = value.to_string();
+        } else if (key == "rating") {
+            image.rating = value.to_string();
+        } else if (key == "image_width") {
+            std::from_chars(value.text.data(), end, image.width);
+        } else if (key == "image_height") {
+            std::from_chars(value.text.data(), end, image.height);
+        } else if (key == "md5") {
+            image.md5 = value.to_string();
+        }
+    }
+
+    void end_post() override {}
+};
+
+} // namespace
+
+MockServer::MockServer(MockOptions options)
+    : options(std::move(options)), listen_fd(-1), port(0), stopping(false), random(this->options.seed),
+      api_tokens(this->options.api_rate_limit), api_refilled(std::chrono::steady_clock::now()) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(this->options.port));
+    socklen_t length = sizeof(address);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 128) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        std::cerr << "Failed to listen on 127.0.0.1:" << this->options.port << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    listen_fd = fd;
+    port = ntohs(address.sin_port);
+
+    load_posts();
+    if (!this->options.image_directory.empty()) {
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(this->options.image_directory, ec)) {
+            if (entry.is_regular_file()) {
+                image_files.push_back(entry.path().string());
+            }
+        }
+        std::sort(image_files.begin(), image_files.end());
+    }
+
+    acceptor = std::thread([this] { accept_loop(); });
+}
+
+MockServer::~MockServer() {
+    if (listen_fd < 0) {
+        return;
+    }
+    // Wakes accept() and every recv() with an error or end of stream
+    shutdown(listen_fd, SHUT_RDWR);
+    acceptor.join();
+    close(listen_fd);
+    std::vector<std::thread> running;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for (int fd : connections) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        for (auto& handler : handlers) {
+            running.push_back(std::move(handler.second));
+        }
+        handlers.clear();
+        for (auto& handler : finished) {
+            running.push_back(std::move(handler));
+        }
+        finished.clear();
+    }
+    for (auto& handler : running) {
+        handler.join();
+    }
+    for (int fd : connections) {
+        close(fd);
+    }
+}
+
+std::string MockServer::base_url() const {
+    return "http://127.0.0.1:" + std::to_string(port);
+}
+
+MockServer::Stats MockServer::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void MockServer::load_posts() {
+    std::vector<Post> recorded;
+    for (const auto& path : options.fixtures) {
+        std::string json = read_file(path);
+        if (json.empty()) {
+            std::cerr << "Skipping empty or unreadable fixture " << path << std::endl;
+            continue;
+        }
+        for (std::string_view object : split_objects(json)) {
+            Post post;
+            post.json = std::string(object);
+            PostFields fields;
+            parse_posts_json("[" + post.json + "]", fields);
+            post.id = fields.id;
+            post.image = std::move(fields.image);
+            replace_all(post.json, fixture_image_host, base_url() + "/images/");
+            recorded.push_back(std::move(post));
+        }
+    }
+    // Fixtures may overlap; each post is served once
+    std::stable_sort(recorded.begin(), recorded.end(), [](const Post& a, const Post& b) { return a.id > b.id; });
+    recorded.erase(std::unique(recorded.begin(), recorded.end(), [](const Post& a, const Post& b) { return a.id == b.id; }),
+                   recorded.end());
+
+    if (options.posts == 0 || recorded.empty()) {
+        posts = std::move(recorded);
+    } else {
+        // Copies get ids counting down from the number of posts, newest first
+        const std::string id_prefix = "{\"id\":";
+        posts.reserve(options.posts);
+        for (size_t i = 0; i < options.posts; ++i) {
+            Post post = recorded[i % recorded.size()];
+            post.id = options.posts - i;
+            if (post.json.compare(0, id_prefix.size(), id_prefix) == 0) {
+                size_t digits = std::min(post.json.find_first_not_of("0123456789", id_prefix.size()), post.json.size());
+                post.json.replace(id_prefix.size(), digits - id_prefix.size(), std::to_string(post.id));
+            }
+            posts.push_back(std::move(post));
+        }
+    }
+
+    // Danbooru names files by md5 and clients, the mirror among them, rely
+    // on it being unique; copies and reposts get one made up from their id
+    std::unordered_set<std::string> seen;
+    for (auto& post : posts) {
+        std::string md5 = post.image.md5;
+        if (md5.empty() || seen.insert(md5).second) {
+            continue;
+        }
+        char unique[33];
+        std::snprintf(unique, sizeof(unique), "%016llx%016llx", 0xe1751aull,
+                      static_cast<unsigned long long>(post.id));
+        replace_all(post.json, md5, unique);
+        post.image.md5 = unique;
+        seen.insert(unique);
+    }
+}
+
+void MockServer::accept_loop() {
+    for (;;) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            return;
+        }
+        std::vector<std::thread> ended;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                close(fd);
+                return;
+            }
+            connections.push_back(fd);
+            handlers.emplace(fd, std::thread([this, fd] {
+                serve(fd);
+                end_connection(fd);
+            }));
+            ended.swap(finished);
+        }
+        // Done serving, so these return at once
+        for (auto& handler : ended) {
+            handler.join();
+        }
+    }
+}
+
+void MockServer::end_connection(int fd) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) {
+        // The destructor closes every connection and joins every thread
+        return;
+    }
+    connections.erase(std::find(connections.begin(), connections.end(), fd));
+    auto handler = handlers.find(fd);
+    finished.push_back(std::move(handler->second));
+    handlers.erase(handler);
+    close(fd);
+}
+
+void MockServer::serve(int fd) {
+    std::string buffer;
+    char data[4096];
+    for (;;) {
+        size_t end;
+        while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t received = recv(fd, data, sizeof(data), 0);
+            if (received <= 0) {
+                return;
+            }
+            buffer.append(data, static_cast<size_t>(received));
+        }
+        std::istringstream head(buffer.substr(0, end + 2));
+        buffer.erase(0, end + 4);
+
+        Request request;
+        std::string line;
+        std::getline(head, line);
+        std::istringstream request_line(line);
+        std::string method;
+        std::string target;
+        request_line >> method >> target;
+        size_t question = target.find('?');
+        request.path = target.substr(0, question);
+        request.query = question == std::string::npos ? "" : target.substr(question + 1);
+        while (std::getline(head, line)) {
+            std::string_view trimmed = trim_header(line);
+            std::string_view value;
+            if (header_value(trimmed, "if-none-match", value)) {
+                request.if_none_match = std::string(value);
+            } else if (header_value(trimmed, "if-range", value)) {
+                request.if_range = std::string(value);
+            } else if (header_value(trimmed, "range", value)) {
+                request.range = std::string(value);
+            }
+        }
+
+        count_event(&Stats::requests);
+        if (options.latency_ms > 0 || options.jitter_ms > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(options.latency_ms + jitter()));
+        }
+        if (!send_response(fd, request, handle(request))) {
+            // The connection is closed, as after a truncated body
+            shutdown(fd, SHUT_RDWR);
+            return;
+        }
+    }
+}
+
+MockServer::Response MockServer::handle(const Request& request) {
+    Response response;
+    if (options.error_rate > 0 && chance() < options.error_rate) {
+        count_event(&Stats::errors);
+        response.status = 503;
+        response.body = "{\"success\":false,\"message\":\"injected error\"}";
+        return response;
+    }
+    if (options.throttle_rate > 0 && chance() < options.throttle_rate) {
+        count_event(&Stats::throttled);
+        response.status = 429;
+        response.retry_after = options.retry_after_seconds;
+        response.body = "{\"success\":false,\"message\":\"injected rate limit\"}";
+        return response;
+    }
+
+    bool api = request.path == "/posts.json" || request.path == "/counts/posts.json";
+    if (api && options.api_rate_limit > 0 && !take_api_token()) {
+        count_event(&Stats::throttled);
+        response.status = 429;
+        response.body = "{\"success\":false,\"message\":\"rate limit exceeded\"}";
+        return response;
+    }
+
+    if (request.path == "/posts.json") {
+        response = search(request.query);
+    } else if (request.path == "/counts/posts.json") {
+        response = count(request.query);
+    } else if (request.path.compare(0, 8, "/images/") == 0) {
+        response = image(request.path.substr(8));
+    } else if (request.path.compare(0, 7, "/bytes/") == 0) {
+        response = filler(std::strtoull(request.path.c_str() + 7, nullptr, 10));
+    } else {
+        response.status = 404;
+        response.body = "{\"success\":false,\"message\":\"not found\"}";
+        return response;
+    }
+
+    if (options.etags && response.status == 200 && !request.if_none_match.empty() &&
+        request.if_none_match == response.etag) {
+        count_event(&Stats::not_modified);
+        response.status = 304;
+        response.body.clear();
+    }
+    return response;
+}
+
+MockServer::Response MockServer::search(const std::string& query) {
+    Response response;
+    TagQuery tags;
+    std::string error;
+    if (!TagQuery::parse(query_value(query, "tags"), tags, error)) {
+        response.status = 422;
+        response.body = "{\"success\":false,\"message\":\"" + error + "\"}";
+        return response;
+    }
+    std::string limit_text = query_value(query, "limit");
+    int limit = limit_text.empty() ? default_limit : std::clamp(std::atoi(limit_text.c_str()), 1, max_limit);
+    std::string page = query_value(query, "page");
+
+    std::vector<const Post*> matching;
+    for (const auto& post : posts) {
+        if (tags.matches(post.image)) {
+            matching.push_back(&post);
+        }
+    }
+
+    // Numbered pages count from the newest post; b<id> continues below an
+    // id and a<id> above it
+    auto first = matching.begin();
+    if (!page.empty() && (page[0] == 'b' || page[0] == 'a')) {
+        uint64_t id = std::strtoull(page.c_str() + 1, nullptr, 10);
+        auto below = std::find_if(matching.begin(), matching.end(), [id](const Post* p) { return p->id < id; });
+        if (page[0] == 'b') {
+            first = below;
+        } else {
+            auto above = std::find_if(matching.begin(), matching.end(), [id](const Post* p) { return p->id <= id; });
+            first = above - std::min<std::ptrdiff_t>(limit, above - matching.begin());
+        }
+    } else {
+        size_t number = page.empty() ? 1 : std::max(1UL, std::strtoul(page.c_str(), nullptr, 10));
+        first += std::min(matching.size(), (number - 1) * static_cast<size_t>(limit));
+    }
+    auto last = first + std::min<std::ptrdiff_t>(limit, matching.end() - first);
+
+    response.body = "[";
+    for (auto it = first; it != last; ++it) {
+        if (it != first) {
+            response.body += ',';
+        }
+        response.body += (*it)->json;
+    }
+    response.body += "]";
+    response.etag = make_etag(response.body);
+    return response;
+}
+
+MockServer::Response MockServer::count(const std::string& query) {
+    Response response;
+    TagQuery tags;
+    std::string error;
+    if (!TagQuery::parse(query_value(query, "tags"), tags, error)) {
+        response.status = 422;
+        response.body = "{\"success\":false,\"message\":\"" + error + "\"}";
+        return response;
+    }
+    size_t matching = std::count_if(posts.begin(), posts.end(), [&tags](const Post& p) { return tags.matches(p.image); });
+    response.body = "{\"counts\":{\"posts\":" + std::to_string(matching) + "}}";
+    response.etag = make_etag(response.body);
+    return response;
+}
+
+MockServer::Response MockServer::image(const std::string& name) {
+    if (image_files.empty()) {
+        Response response = filler(options.image_bytes);
+        response.content_type = content_type_for(name);
+        return response;
+    }
+    const std::string& file = image_files[std::hash<std::string>()(name) % image_files.size()];
+    Response response;
+    response.content_type = content_type_for(file);
+    response.body = read_file(file);
+    response.etag = make_etag(response.body);
+    response.total_size = response.body.size();
+    return response;
+}
+
+MockServer::Response MockServer::filler(size_t size) {
+    Response response;
+    response.content_type = "application/octet-stream";
+    response.body.assign(size, 'x');
+    response.etag = make_etag("filler " + std::to_string(size));
+    response.total_size = size;
+    return response;
+}
+
+bool MockServer::send_response(int fd, const Request& request, Response response) {
+    // Resuming: "Range: bytes=N-", honoured unless If-Range names another version
+    size_t total = response.body.size();
+    if (response.status == 200 && response.total_size > 0 && request.range.compare(0, 6, "bytes=") == 0 &&
+        (request.if_range.empty() || request.if_range == response.etag)) {
+        size_t start = std::strtoull(request.range.c_str() + 6, nullptr, 10);
+        if (start >= total) {
+            response.status = 416;
+            response.body.clear();
+        } else {
+            count_event(&Stats::partial);
+            response.status = 206;
+            response.range_start = start;
+            response.body.erase(0, start);
+        }
+    }
+
+    std::string header = "HTTP/1.1 " + std::to_string(response.status) + " " + reason_phrase(response.status) + "\r\n";
+    header += "Content-Type: " + response.content_type + "\r\n";
+    header += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+    if (options.etags && !response.etag.empty()) {
+        header += "ETag: " + response.etag + "\r\n";
+    }
+    if (response.retry_after > 0) {
+        header += "Retry-After: " + std::to_string(response.retry_after) + "\r\n";
+    }
+    if (response.status == 206) {
+        header += "Content-Range: bytes " + std::to_string(response.range_start) + "-" +
+                  std::to_string(total - 1) + "/" + std::to_string(total) + "\r\n";
+    } else if (response.status == 416) {
+        header += "Content-Range: bytes */" + std::to_string(total) + "\r\n";
+    }
+    header += "\r\n";
+    if (!send_body(fd, header.data(), header.size())) {
+        return false;
+    }
+
+    size_t length = response.body.size();
+    bool truncate = length > 1 && options.truncate_rate > 0 && chance() < options.truncate_rate;
+    if (truncate) {
+        count_event(&Stats::truncated);
+        length /= 2;
+    }
+    return send_body(fd, response.body.data(), length) && !truncate;
+}
+
+bool MockServer::send_body(int fd, const char* data, size_t length) {
+    using clock = std::chrono::steady_clock;
+    // Throttled bodies go out in 20 ms slices
+    size_t slice = options.bytes_per_second > 0 ? std::max<size_t>(options.bytes_per_second / 50, 1024) : length;
+    auto start = clock::now();
+    size_t sent_total = 0;
+    while (sent_total < length) {
+        size_t part = std::min(slice, length - sent_total);
+        ssize_t sent = send(fd, data + sent_total, part, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        sent_total += static_cast<size_t>(sent);
+        count_event(&Stats::bytes_sent, static_cast<uint64_t>(sent));
+        if (options.bytes_per_second > 0) {
+            auto due = start + std::chrono::duration<double>(static_cast<double>(sent_total) / options.bytes_per_second);
+            std::this_thread::sleep_until(std::chrono::time_point_cast<clock::duration>(due));
+        }
+    }
+    return true;
+}
+
+bool MockServer::take_api_token() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - api_refilled;
+    api_refilled = now;
+    api_tokens = std::min(options.api_rate_limit, api_tokens + elapsed.count() * options.api_rate_limit);
+    if (api_tokens < 1.0) {
+        return false;
+    }
+    api_tokens -= 1.0;
+    return true;
+}
+
+double MockServer::chance() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::uniform_real_distribution<double>(0, 1)(random);
+}
+
+int MockServer::jitter() {
+    if (options.jitter_ms <= 0) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::uniform_int_distribution<int>(0, options.jitter_ms)(random);
+}
+
+void MockServer::count_event(uint64_t Stats::*counter, uint64_t amount) {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.*counter += amount;
+}
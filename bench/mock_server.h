@@ -0,0 +1,152 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "danbooru_client.h"
+
+struct MockOptions {
+    // 0 picks a free port
+    int port = 0;
+    // posts.json files whose posts are served, each post once; without
+    // any, searches are empty
+    std::vector<std::string> fixtures;
+    // Repeat the fixture posts under new ids until there are this many;
+    // 0 serves them as they are
+    size_t posts = 0;
+    // Files served as post images, picked by a hash of the requested name.
+    // Without one, images are `image_bytes` of filler.
+    std::string image_directory;
+    size_t image_bytes = 256 * 1024;
+
+    // Added before every response, plus up to `jitter_ms` at random
+    int latency_ms = 0;
+    int jitter_ms = 0;
+    // Per connection; 0 is unthrottled
+    size_t bytes_per_second = 0;
+    // Fractions of requests answered with a 503, a 429 carrying
+    // Retry-After, or a body cut off halfway
+    double error_rate = 0;
+    double throttle_rate = 0;
+    int retry_after_seconds = 1;
+    double truncate_rate = 0;
+    // Searches and counts allowed per second, over all connections, with a
+    // second's worth of burst; beyond it they get a 429 without Retry-After,
+    // as a real rate limit would. 0 is unlimited.
+    double api_rate_limit = 0;
+    // ETag on every response, and 304 for a matching If-None-Match
+    bool etags = true;
+    unsigned seed = 1;
+};
+
+// Stand-in for the Danbooru API on 127.0.0.1, so searching, downloading,
+// retries, resume and caching can be exercised without a network and with
+// reproducible faults. It answers:
+//
+//   /posts.json?tags=T&limit=N&page=P   fixture posts matching T (see
+//                                       TagQuery), page P a number or b<id>/a<id>
+//   /counts/posts.json?tags=T           {"counts":{"posts":N}}
+//   /images/...                         the image of a post; file URLs in
+//                                       served posts are rewritten to point here
+//   /bytes/N                            N bytes of filler
+//
+// Images and /bytes honour Range (with If-Range). Each connection gets a
+// thread, and connections are kept alive; a connection's socket and thread
+// are released as soon as it ends, so long runs don't pile them up.
+class MockServer {
+public:
+    struct Stats {
+        uint64_t requests = 0;
+        uint64_t errors = 0;
+        uint64_t throttled = 0;
+        uint64_t truncated = 0;
+        uint64_t not_modified = 0;
+        uint64_t partial = 0;
+        uint64_t bytes_sent = 0;
+    };
+
+    explicit MockServer(MockOptions options);
+    ~MockServer();
+
+    MockServer(const MockServer&) = delete;
+    MockServer& operator=(const MockServer&) = delete;
+
+    bool ok() const { return listen_fd >= 0; }
+    // "http://127.0.0.1:<port>", for DanbooruClient::set_base_url()
+    std::string base_url() const;
+    Stats stats() const;
+
+private:
+    struct Post {
+        uint64_t id;
+        // Only what searches filter on, tags, rating and size, and the md5
+        DanbooruImage image;
+        // The post's JSON object, URLs already pointing at this server
+        std::string json;
+    };
+
+    struct Request {
+        std::string path;
+        std::string query;
+        std::string if_none_match;
+        std::string if_range;
+        std::string range;
+    };
+
+    struct Response {
+        int status = 200;
+        std::string content_type = "application/json";
+        std::string body;
+        std::string etag;
+        // Set for Retry-After on 429
+        int retry_after = 0;
+        size_t range_start = 0;
+        size_t total_size = 0;
+    };
+
+    MockOptions options;
+    int listen_fd;
+    int port;
+    // Newest first, like Danbooru
+    std::vector<Post> posts;
+    std::vector<std::string> image_files;
+
+    std::thread acceptor;
+    mutable std::mutex mutex;
+    bool stopping;
+    std::vector<int> connections;
+    // By connection fd; threads whose connection ended wait in `finished`
+    // until the acceptor or the destructor joins them
+    std::map<int, std::thread> handlers;
+    std::vector<std::thread> finished;
+    std::mt19937 random;
+    Stats counters;
+    double api_tokens;
+    std::chrono::steady_clock::time_point api_refilled;
+
+    void load_posts();
+    void accept_loop();
+    void serve(int fd);
+    void end_connection(int fd);
+    bool send_response(int fd, const Request& request, Response response);
+    bool send_body(int fd, const char* data, size_t length);
+
+    Response handle(const Request& request);
+    Response search(const std::string& query);
+    Response count(const std::string& query);
+    Response image(const std::string& name);
+    Response filler(size_t size);
+
+    // Takes one of the api_rate_limit tokens; false if there is none
+    bool take_api_token();
+    // Locked draws from `random`
+    double chance();
+    int jitter();
+    void count_event(uint64_t Stats::*counter, uint64_t amount = 1);
+};
@@ -0,0 +1,119 @@
+// JSON parsing on recorded posts.json pages: the columnar PostSet parser,
+// the vector of DanbooruImages built from it, and the regex scanner the
+// streaming parser replaced.
+
+#include "bench.h"
+#include "danbooru_client.h"
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace {
+
+// The previous implementation: seven independent regex scans zipped by index
+std::vector<DanbooruImage> legacy_regex_parse(const std::string& json_str) {
+    std::vector<DanbooruImage> images;
+
+    std::regex id_regex("\"id\"\\s*:\\s*(\\d+)");
+    std::regex file_url_regex("\"file_url\"\\s*:\\s*\"([^\"]*)\"");
+    std::regex file_ext_regex("\"file_ext\"\\s*:\\s*\"([^\"]*)\"");
+    std::regex tag_string_regex("\"tag_string\"\\s*:\\s*\"([^\"]*)\"");
+    std::regex rating_regex("\"rating\"\\s*:\\s*\"([^\"]*)\"");
+    std::regex width_regex("\"image_width\"\\s*:\\s*(\\d+)");
+    std::regex height_regex("\"image_height\"\\s*:\\s*(\\d+)");
+
+    std::sregex_iterator end;
+    std::vector<std::string> ids, file_urls, file_exts, tag_strings, ratings, widths, heights;
+
+    for (std::sregex_iterator it(json_str.begin(), json_str.end(), id_regex); it != end; ++it) ids.push_back((*it)[1].str());
+    for (std::sregex_iterator it(json_str.begin(), json_str.end(), file_url_regex); it != end; ++it) file_urls.push_back((*it)[1].str());
+    for (std::sregex_iterator it(json_str.begin(), json_str.end(), file_ext_regex); it != end; ++it) file_exts.push_back((*it)[1].str());
+    for (std::sregex_iterator it(json_str.begin(), json_str.end(), tag_string_regex); it != end; ++it) tag_strings.push_back((*it)[1].str());
+    for (std::sregex_iterator it(json_str.begin(), json_str.end(), rating_regex); it != end; ++it) ratings.push_back((*it)[1].str());
+    for (std::sregex_iterator it(json_str.begin(), json_str.end(), width_regex); it != end; ++it) widths.push_back((*it)[1].str());
+    for (std::sregex_iterator it(json_str.begin(), json_str.end(), height_regex); it != end; ++it) heights.push_back((*it)[1].str());
+
+    size_t min_size = std::min({ids.size(), file_urls.size(), file_exts.size(),
+                                tag_strings.size(), ratings.size(), widths.size(), heights.size()});
+
+    for (size_t i = 0; i < min_size; ++i) {
+        DanbooruImage image;
+        image.id = ids[i];
+        image.file_url = file_urls[i];
+        std::string url = file_urls[i];
+        size_t last_slash = url.find_last_of('/');
+        if (last_slash != std::string::npos) {
+            std::string url_filename = url.substr(last_slash + 1);
+            size_t question_mark = url_filename.find('?');
+            if (question_mark != std::string::npos) {
+                url_filename = url_filename.substr(0, question_mark);
+            }
+            image.filename = url_filename;
+        } else {
+            image.filename = "elysia_" + ids[i] + "." + file_exts[i];
+        }
+        image.tags = tag_strings[i];
+        image.rating = ratings[i];
+        image.width = std::stoi(widths[i]);
+        image.height = std::stoi(heights[i]);
+        if (!image.file_url.empty()) {
+            images.push_back(image);
+        }
+    }
+
+    return images;
+}
+
+// Counts posts whose id and file_url really belong together
+size_t count_consistent(const std::vector<DanbooruImage>& images, const std::string& json) {
+    size_t consistent = 0;
+    for (const auto& img : images) {
+        std::string needle = "{\"id\":" + img.id + ",";
+        size_t post_start = json.find(needle);
+        if (post_start == std::string::npos) continue;
+        size_t next_post = json.find("},{\"id\":", post_start + needle.size());
+        size_t url_pos = json.find("\"file_url\":\"" + img.file_url + "\"", post_start);
+        if (url_pos != std::string::npos && url_pos < next_post) ++consistent;
+    }
+    return consistent;
+}
+
+} // namespace
+
+void run_parse_benchmarks(BenchRun& run, const std::vector<std::filesystem::path>& fixtures) {
+    for (const auto& path : fixtures) {
+        std::string json = read_fixture(path);
+        if (json.empty()) {
+            std::cerr << "Skipping empty or unreadable file: " << path << std::endl;
+            continue;
+        }
+        std::string prefix = "parse/" + path.stem().string() + "/";
+        double megabytes = json.size() / (1024.0 * 1024.0);
+
+        auto add_counters = [megabytes](BenchResult* result, const std::vector<DanbooruImage>& images,
+                                        size_t consistent) {
+            if (result) {
+                result->counters = {{"posts", static_cast<double>(images.size())},
+                                    {"consistent", static_cast<double>(consistent)},
+                                    {"MiB/s", megabytes / (result->median_us / 1e6)}};
+            }
+        };
+
+        size_t posts = DanbooruClient::parse_post_set(json).size();
+        if (BenchResult* result = run.measure(prefix + "post_set", [&] { DanbooruClient::parse_post_set(json); })) {
+            result->counters = {{"posts", static_cast<double>(posts)},
+                                {"MiB/s", megabytes / (result->median_us / 1e6)}};
+        }
+
+        auto images = DanbooruClient::parse_json_response(json);
+        add_counters(run.measure(prefix + "vector", [&] { DanbooruClient::parse_json_response(json); }),
+                     images, count_consistent(images, json));
+
+        auto legacy = legacy_regex_parse(json);
+        add_counters(run.measure(prefix + "legacy_regex", [&] { legacy_regex_parse(json); }),
+                     legacy, count_consistent(legacy, json));
+    }
+}
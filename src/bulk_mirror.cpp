@@ -0,0 +1,215 @@
+#include "bulk_mirror.h"
+#include "danbooru_client.h"
+#include "download_directory.h"
+#include "image_downloader.h"
+#include "post_index.h"
+#include "transfer_engine.h"
+#include "transfer_timings.h"
+#include <glib.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+
+namespace {
+
+// Failed searches in a row before the mirror gives up on the rest
+constexpr size_t max_failed_pages = 3;
+
+// A failed search is retried after this, times the failures in a row
+constexpr guint page_retry_seconds = 2;
+
+class Mirror {
+public:
+    Mirror(TransferEngine& engine, GMainLoop* loop, const MirrorOptions& options, std::string output_dir)
+        : engine(engine), loop(loop), options(options), output_dir(std::move(output_dir)),
+          index(PostIndex::default_directory()) {}
+
+    void start() {
+        started = std::chrono::steady_clock::now();
+        // Runs once the loop is up, so an immediate quit isn't lost
+        g_idle_add([](gpointer user_data) -> gboolean {
+            static_cast<Mirror*>(user_data)->pump();
+            return G_SOURCE_REMOVE;
+        }, this);
+    }
+
+    int print_summary() const {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        double seconds = std::max(elapsed.count(), 1e-6);
+        double megabytes = bytes / (1024.0 * 1024.0);
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << "\nMirrored " << downloaded << " files (" << megabytes << " MiB) in " << seconds << " s\n"
+                  << "  throughput: " << downloaded / seconds << " files/s, " << megabytes / seconds << " MiB/s\n"
+                  << "  posts seen: " << posts_seen << ", already present: " << skipped
+                  << ", failed: " << failed << ", failed pages: " << failed_pages << std::endl;
+
+        return (failed > 0 || gave_up) ? 1 : 0;
+    }
+
+private:
+    TransferEngine& engine;
+    GMainLoop* loop;
+    const MirrorOptions& options;
+    std::string output_dir;
+    // Every page seen is recorded for offline use
+    PostIndex index;
+
+    std::deque<DanbooruImage> queue;
+    std::string cursor;
+    bool page_in_flight = false;
+    bool exhausted = false;
+    int active = 0;
+
+    size_t posts_seen = 0;
+    size_t downloaded = 0;
+    size_t skipped = 0;
+    size_t failed = 0;
+    size_t failed_pages = 0;
+    size_t failed_pages_in_a_row = 0;
+    bool gave_up = false;
+    uintmax_t bytes = 0;
+    std::chrono::steady_clock::time_point started;
+
+    void pump() {
+        while (active < options.jobs && !queue.empty()) {
+            DanbooruImage post = std::move(queue.front());
+            queue.pop_front();
+            start_download(post);
+        }
+
+        // Fetch the next page while the current one is still downloading
+        if (!exhausted && !page_in_flight && queue.size() < static_cast<size_t>(options.jobs) * 2) {
+            fetch_page();
+        }
+
+        if (active == 0 && queue.empty() && !page_in_flight && exhausted) {
+            g_main_loop_quit(loop);
+        }
+    }
+
+    void fetch_page() {
+        page_in_flight = true;
+        try {
+            DanbooruClient::search_images_async(engine, options.tags, options.page_size, cursor,
+                [this](PostSet posts, const std::string& error) {
+                    if (!error.empty()) {
+                        page_failed(error);
+                        return;
+                    }
+                    page_in_flight = false;
+                    failed_pages_in_a_row = 0;
+                    add_page(posts);
+                    pump();
+                });
+        } catch (const std::exception& e) {
+            page_failed(e.what());
+        }
+    }
+
+    // Tries the same page again later, unless too many have failed in a
+    // row. The page stays in flight meanwhile, so nothing else fetches it.
+    void page_failed(const std::string& error) {
+        std::cerr << "Failed to fetch page: " << error << std::endl;
+        ++failed_pages;
+        if (++failed_pages_in_a_row >= max_failed_pages) {
+            std::cerr << "Giving up after " << failed_pages_in_a_row << " failed pages in a row" << std::endl;
+            page_in_flight = false;
+            exhausted = true;
+            gave_up = true;
+            pump();
+            return;
+        }
+        g_timeout_add_seconds(page_retry_seconds * static_cast<guint>(failed_pages_in_a_row),
+            [](gpointer user_data) -> gboolean {
+                static_cast<Mirror*>(user_data)->fetch_page();
+                return G_SOURCE_REMOVE;
+            }, this);
+    }
+
+    void add_page(const PostSet& posts) {
+        if (!DanbooruClient::next_cursor(posts, cursor)) {
+            exhausted = true;
+            return;
+        }
+        index.add(posts);
+        for (size_t row = 0; row < posts.size(); ++row) {
+            if (options.max_posts == 0 || posts_seen < options.max_posts) {
+                ++posts_seen;
+                queue.push_back(posts.post(row));
+            }
+        }
+
+        if (options.max_posts != 0 && posts_seen >= options.max_posts) {
+            exhausted = true;
+        }
+    }
+
+    void start_download(const DanbooruImage& post) {
+        std::string filepath = output_dir + "/" + post.filename;
+
+        std::error_code ec;
+        if (std::filesystem::exists(filepath, ec)) {
+            ++skipped;
+            return;
+        }
+
+        try {
+            ImageDownloader::download_image_async(engine, post.file_url, filepath,
+                [this, filepath](bool success) {
+                    --active;
+                    if (success) {
+                        ++downloaded;
+                        std::error_code size_ec;
+                        uintmax_t size = std::filesystem::file_size(filepath, size_ec);
+                        if (size_ec) {
+                            size = 0;
+                        }
+                        bytes += size;
+                        std::cout << "Saved " << filepath << " (" << size / 1024 << " KiB)" << std::endl;
+                    } else {
+                        std::cerr << "Failed to download " << filepath << std::endl;
+                        ++failed;
+                    }
+                    pump();
+                });
+            ++active;
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to start download: " << e.what() << std::endl;
+            ++failed;
+        }
+    }
+};
+
+} // namespace
+
+int run_bulk_mirror(const MirrorOptions& options) {
+    std::string output_dir = options.output_dir.empty() ? default_download_directory() : options.output_dir;
+
+    std::error_code ec;
+    std::filesystem::create_directories(output_dir, ec);
+    if (ec) {
+        std::cerr << "Failed to create directory " << output_dir << ": " << ec.message() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Mirroring posts into " << output_dir << " with " << options.jobs << " parallel transfers" << std::endl;
+
+    GMainLoop* loop = g_main_loop_new(nullptr, FALSE);
+    int status;
+    {
+        TransferEngine engine;
+        Mirror mirror(engine, loop, options, output_dir);
+        mirror.start();
+        g_main_loop_run(loop);
+        status = mirror.print_summary();
+    }
+    TransferTimings::instance().print_summary(std::cout);
+    TransferTimings::instance().write_trace();
+    g_main_loop_unref(loop);
+
+    return status;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct MirrorOptions {
+    std::vector<std::string> tags;
+    // Empty means default_download_directory()
+    std::string output_dir;
+    int jobs = 4;
+    int page_size = 200;
+    // Stop after this many posts; 0 mirrors everything
+    size_t max_posts = 0;
+};
+
+// Pages through every post matching `options.tags` and downloads the files
+// into `options.output_dir` with up to `options.jobs` transfers in flight.
+// Files that already exist are skipped. Runs its own main loop without
+// GTK and prints a throughput summary; returns the process exit status.
+int run_bulk_mirror(const MirrorOptions& options);
@@ -0,0 +1,11 @@
+#include "context_call.h"
+
+void call_on_context(GMainContext* context, GSourceFunc callback, gpointer data, gint priority) {
+    // Not g_main_context_invoke(), which would call back right here on the
+    // calling thread whenever the context happens to be free
+    GSource* source = g_idle_source_new();
+    g_source_set_priority(source, priority);
+    g_source_set_callback(source, callback, data, nullptr);
+    g_source_attach(source, context);
+    g_source_unref(source);
+}
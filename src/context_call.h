@@ -0,0 +1,8 @@
+#pragma once
+
+#include <glib.h>
+
+// Calls `callback` with `data` once from `context`, for handing a worker
+// thread's result back to the thread running that context. The callback
+// should return G_SOURCE_REMOVE.
+void call_on_context(GMainContext* context, GSourceFunc callback, gpointer data, gint priority = G_PRIORITY_DEFAULT);
@@ -1,37 +1,291 @@
 #include "danbooru_client.h"
+#include "http_header.h"
+#include "post_json_parser.h"
+#include "search_cache.h"
+#include "transfer_context.h"
 #include <iostream>
 #include <random>
 #include <sstream>
-#include <regex>
+#include <charconv>
+#include <memory>
 #include <algorithm>
+#include <array>
 
-DanbooruClient::DanbooruClient() {
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-    if (!curl) {
-        throw std::runtime_error("Failed to initialize CURL");
+namespace {
+
+struct SearchResponse {
+    std::string body;
+    std::string etag;
+    std::string last_modified;
+    curl_slist* request_headers = nullptr;
+
+    ~SearchResponse() {
+        if (request_headers) {
+            curl_slist_free_all(request_headers);
+        }
+    }
+};
+
+size_t search_header_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    SearchResponse* response = static_cast<SearchResponse*>(userdata);
+    size_t length = size * nitems;
+    std::string_view line = trim_header(std::string_view(buffer, length));
+    std::string_view value;
+
+    if (line.compare(0, 5, "HTTP/") == 0) {
+        // Only the validators of the final response in a redirect chain count
+        response->etag.clear();
+        response->last_modified.clear();
+    } else if (header_value(line, "etag", value)) {
+        response->etag = std::string(value);
+    } else if (header_value(line, "last-modified", value)) {
+        response->last_modified = std::string(value);
     }
+    return length;
+}
+
+// Leaves `out` alone unless `value` is a number of its type
+template <typename T>
+void parse_number(const JsonValue& value, T& out) {
+    std::from_chars(value.text.data(), value.text.data() + value.text.size(), out);
+}
+
+// Empty if `result` carries an answer worth parsing. Error pages (429s,
+// 5xx from an overloaded server) are JSON too and must not be read as an
+// empty result.
+std::string request_error(const TransferResult& result) {
+    if (!result.ok()) {
+        return "CURL request failed: " + result.error;
+    }
+    if (result.http_status >= 400) {
+        return "API answered HTTP " + std::to_string(result.http_status);
+    }
+    return "";
+}
+
+const char* const default_base_url = "https://danbooru.donmai.us";
+
+std::string without_trailing_slash(std::string url) {
+    while (!url.empty() && url.back() == '/') {
+        url.pop_back();
+    }
+    return url;
+}
+
+std::string& configured_base_url() {
+    static std::string url = [] {
+        const char* value = g_getenv("ELYSIA_API_URL");
+        return without_trailing_slash(value && *value ? value : default_base_url);
+    }();
+    return url;
+}
+
+} // namespace
+
+const std::string& image_url(const DanbooruImage& post, ImageVariant variant) {
+    if (variant == ImageVariant::preview && !post.preview_file_url.empty()) {
+        return post.preview_file_url;
+    }
+    if (variant != ImageVariant::original && !post.large_file_url.empty()) {
+        return post.large_file_url;
+    }
+    return post.file_url;
+}
+
+std::string default_filename(const DanbooruImage& post) {
+    // Extract filename from URL
+    size_t last_slash = post.file_url.find_last_of('/');
+    if (last_slash != std::string::npos) {
+        std::string_view url_filename(post.file_url);
+        url_filename.remove_prefix(last_slash + 1);
+        // Remove any query parameters
+        size_t question_mark = url_filename.find('?');
+        if (question_mark != std::string_view::npos) {
+            url_filename = url_filename.substr(0, question_mark);
+        }
+        return std::string(url_filename);
+    }
+    // Fallback: use ID + extension
+    return "elysia_" + post.id + "." + post.file_ext;
+}
+
+DanbooruClient::DanbooruClient() {
+    curl = TransferContext::instance().acquire();
 }
 
 DanbooruClient::~DanbooruClient() {
-    if (curl) {
-        curl_easy_cleanup(curl);
+    TransferContext::instance().release(curl);
+}
+
+const std::string& DanbooruClient::base_url() {
+    return configured_base_url();
+}
+
+void DanbooruClient::set_base_url(std::string url) {
+    configured_base_url() = without_trailing_slash(std::move(url));
+}
+
+std::vector<DanbooruImage> DanbooruClient::search_images(const std::vector<std::string>& tags, int limit,
+                                                         const std::string& page) {
+    std::string response = make_request(build_search_url(tags, limit, page));
+    return parse_json_response(response);
+}
+
+TransferEngine::TransferId DanbooruClient::search_images_async(TransferEngine& engine,
+                                                               const std::vector<std::string>& tags,
+                                                               int limit, const std::string& page,
+                                                               SearchCallback on_done,
+                                                               SearchCache* cache) {
+    if (!page.empty() && page[0] == 'b') {
+        // Cursor pages are walked once, not asked for again
+        cache = nullptr;
     }
-    curl_global_cleanup();
+    std::string key;
+    const SearchCache::Entry* cached = nullptr;
+    if (cache) {
+        key = SearchCache::make_key(tags, limit, page);
+        if (base_url() != default_base_url) {
+            // Another server's answers must not stand in for Danbooru's
+            key = base_url() + " " + key;
+        }
+        cached = cache->find(key);
+        if (cached && cache->is_fresh(*cached)) {
+            std::cout << "Using cached search results for " << key << std::endl;
+            on_done(cached->posts, "");
+            return 0;
+        }
+    }
+    
+    std::string url = build_search_url(tags, limit, page);
+    std::cout << "Making request to: " << url << std::endl;
+    
+    auto response = std::make_shared<SearchResponse>();
+    if (cache) {
+        // Lets the server answer 304 instead of resending an unchanged page
+        if (cached && !cached->etag.empty()) {
+            response->request_headers = curl_slist_append(response->request_headers,
+                                                          ("If-None-Match: " + cached->etag).c_str());
+        }
+        if (cached && !cached->last_modified.empty()) {
+            response->request_headers = curl_slist_append(response->request_headers,
+                                                          ("If-Modified-Since: " + cached->last_modified).c_str());
+        }
+    }
+    
+    auto make_request = [response, url, cache]() {
+        CURL* handle = TransferContext::instance().acquire();
+        response->body.clear();
+        configure_request(handle, url, &response->body);
+        if (cache) {
+            curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, search_header_callback);
+            curl_easy_setopt(handle, CURLOPT_HEADERDATA, response.get());
+            curl_easy_setopt(handle, CURLOPT_HTTPHEADER, response->request_headers);
+        }
+        return handle;
+    };
+    
+    return engine.submit(url, make_request, [response, on_done, cache, key](const TransferResult& result) {
+        std::string error = request_error(result);
+        if (!error.empty()) {
+            // A stale page beats no page when the API can't be reached
+            const SearchCache::Entry* entry = cache ? cache->find(key) : nullptr;
+            if (entry) {
+                std::cerr << "Search failed (" << error << "), using stale results for " << key << std::endl;
+                on_done(entry->posts, "");
+                return;
+            }
+            on_done({}, error);
+            return;
+        }
+        
+        if (cache && result.http_status == 304) {
+            if (const SearchCache::Entry* entry = cache->find(key)) {
+                std::cout << "Search results for " << key << " unchanged" << std::endl;
+                cache->revalidated(key);
+                on_done(entry->posts, "");
+                return;
+            }
+        }
+        
+        std::cout << "Response length: " << response->body.length() << " characters" << std::endl;
+        PostSet posts = parse_post_set(response->body);
+        if (cache && result.http_status == 200) {
+            cache->store(key, std::move(response->body), posts, response->etag, response->last_modified);
+        }
+        on_done(std::move(posts), "");
+    });
+}
+
+bool DanbooruClient::next_cursor(const PostSet& page, std::string& cursor) {
+    // Posts without a file_url are dropped by the parser, so this goes by
+    // what the page held: the oldest post on it, dropped or not, is where
+    // the next page starts
+    if (page.page_rows() == 0 || page.page_oldest_id() == 0) {
+        return false;
+    }
+    std::string next = "b" + std::to_string(page.page_oldest_id());
+    if (next == cursor) {
+        return false;
+    }
+    cursor = std::move(next);
+    return true;
+}
+
+TransferEngine::TransferId DanbooruClient::count_posts_async(TransferEngine& engine,
+                                                             const std::vector<std::string>& tags,
+                                                             CountCallback on_done) {
+    std::string url = build_count_url(tags);
+    std::cout << "Making request to: " << url << std::endl;
+    
+    auto body = std::make_shared<std::string>();
+    auto make_request = [body, url]() {
+        CURL* handle = TransferContext::instance().acquire();
+        body->clear();
+        configure_request(handle, url, body.get());
+        return handle;
+    };
+    
+    return engine.submit(url, make_request, [body, on_done](const TransferResult& result) {
+        std::string error = request_error(result);
+        if (!error.empty()) {
+            on_done(-1, error);
+            return;
+        }
+        long posts = parse_count_response(*body);
+        if (posts < 0) {
+            on_done(-1, "Unexpected post count response");
+            return;
+        }
+        on_done(posts, "");
+    });
 }
 
-std::vector<DanbooruImage> DanbooruClient::search_images(const std::vector<std::string>& tags, int limit) {
+std::string DanbooruClient::build_search_url(const std::vector<std::string>& tags, int limit, const std::string& page) {
     std::ostringstream url_stream;
-    url_stream << "https://danbooru.donmai.us/posts.json?tags=";
+    url_stream << base_url() << "/posts.json?tags=";
     
     for (size_t i = 0; i < tags.size(); ++i) {
         if (i > 0) url_stream << "+";
         url_stream << tags[i];
     }
     url_stream << "&limit=" << limit;
+    if (!page.empty()) {
+        url_stream << "&page=" << page;
+    }
     
-    std::string response = make_request(url_stream.str());
-    return parse_json_response(response);
+    return url_stream.str();
+}
+
+std::string DanbooruClient::build_count_url(const std::vector<std::string>& tags) {
+    std::ostringstream url_stream;
+    url_stream << base_url() << "/counts/posts.json?tags=";
+    
+    for (size_t i = 0; i < tags.size(); ++i) {
+        if (i > 0) url_stream << "+";
+        url_stream << tags[i];
+    }
+    
+    return url_stream.str();
 }
 
 DanbooruImage DanbooruClient::get_random_image(const std::vector<std::string>& tags) {
@@ -58,100 +312,151 @@ std::string DanbooruClient::make_request(const std::string& url) {
     
     std::cout << "Making request to: " << url << std::endl;
     
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "ElysiaDownloader/1.0");
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+    configure_request(curl, url, &response);
     
     CURLcode res = curl_easy_perform(curl);
+    TransferContext::instance().record_transfer(curl, res);
     if (res != CURLE_OK) {
         throw std::runtime_error("CURL request failed: " + std::string(curl_easy_strerror(res)));
     }
+    long http_status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+    if (http_status >= 400) {
+        throw std::runtime_error("API answered HTTP " + std::to_string(http_status));
+    }
     
     std::cout << "Response length: " << response.length() << " characters" << std::endl;
     
     return response;
 }
 
-std::vector<DanbooruImage> DanbooruClient::parse_json_response(const std::string& json_str) {
-    std::vector<DanbooruImage> images;
-    
-    // Debug: Print the response to see what we're getting
-    std::cout << "Received JSON response: " << json_str.substr(0, 500) << "..." << std::endl;
-    
-    // Simpler regex patterns for individual fields
-    std::regex id_regex("\"id\"\\s*:\\s*(\\d+)");
-    std::regex file_url_regex("\"file_url\"\\s*:\\s*\"([^\"]*)\"");
-    std::regex file_ext_regex("\"file_ext\"\\s*:\\s*\"([^\"]*)\"");
-    std::regex tag_string_regex("\"tag_string\"\\s*:\\s*\"([^\"]*)\"");
-    std::regex rating_regex("\"rating\"\\s*:\\s*\"([^\"]*)\"");
-    std::regex width_regex("\"image_width\"\\s*:\\s*(\\d+)");
-    std::regex height_regex("\"image_height\"\\s*:\\s*(\\d+)");
-    
-    // Find all matches for each field
-    std::sregex_iterator id_iter(json_str.begin(), json_str.end(), id_regex);
-    std::sregex_iterator file_url_iter(json_str.begin(), json_str.end(), file_url_regex);
-    std::sregex_iterator file_ext_iter(json_str.begin(), json_str.end(), file_ext_regex);
-    std::sregex_iterator tag_string_iter(json_str.begin(), json_str.end(), tag_string_regex);
-    std::sregex_iterator rating_iter(json_str.begin(), json_str.end(), rating_regex);
-    std::sregex_iterator width_iter(json_str.begin(), json_str.end(), width_regex);
-    std::sregex_iterator height_iter(json_str.begin(), json_str.end(), height_regex);
-    
-    std::sregex_iterator end;
-    
-    // Collect all matches
-    std::vector<std::string> ids, file_urls, file_exts, tag_strings, ratings, widths, heights;
-    
-    for (; id_iter != end; ++id_iter) ids.push_back((*id_iter)[1].str());
-    for (; file_url_iter != end; ++file_url_iter) file_urls.push_back((*file_url_iter)[1].str());
-    for (; file_ext_iter != end; ++file_ext_iter) file_exts.push_back((*file_ext_iter)[1].str());
-    for (; tag_string_iter != end; ++tag_string_iter) tag_strings.push_back((*tag_string_iter)[1].str());
-    for (; rating_iter != end; ++rating_iter) ratings.push_back((*rating_iter)[1].str());
-    for (; width_iter != end; ++width_iter) widths.push_back((*width_iter)[1].str());
-    for (; height_iter != end; ++height_iter) heights.push_back((*height_iter)[1].str());
-    
-    // Create images from matched data
-    size_t min_size = std::min({ids.size(), file_urls.size(), file_exts.size(), 
-                                tag_strings.size(), ratings.size(), widths.size(), heights.size()});
-    
-    std::cout << "Found " << min_size << " images" << std::endl;
-    
-    for (size_t i = 0; i < min_size; ++i) {
-        DanbooruImage image;
-        image.id = ids[i];
-        image.file_url = file_urls[i];
+void DanbooruClient::configure_request(CURL* handle, const std::string& url, std::string* response) {
+    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, response);
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, "ElysiaDownloader/1.0");
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT, 30L);
+}
+
+std::vector<DanbooruImage> DanbooruClient::parse_json_response(std::string_view json_str) {
+    return parse_post_set(json_str).to_vector();
+}
+
+PostSet DanbooruClient::parse_post_set(std::string_view json_str) {
+    PostSet posts;
+    // Roughly what survives of a page once the fields nobody reads are gone
+    posts.reserve(json_str.size() / 2048 + 1, json_str.size() / 4);
+    
+    // Fields are collected per post object, so a post missing one of them
+    // can't shift the values of its neighbours. The buffers are reused from
+    // post to post, so after the first one collecting allocates nothing.
+    class PostCollector : public PostJsonHandler {
+    public:
+        explicit PostCollector(PostSet& out) : posts(out) {}
+        
+        void begin_post() override {
+            for (auto& text : texts) {
+                text.clear();
+            }
+            id = 0;
+            width = 0;
+            height = 0;
+            rating = '\0';
+        }
+        
+        void field(std::string_view key, const JsonValue& value) override {
+            if (key == "id") {
+                parse_number(value, id);
+            } else if (key == "file_url") {
+                set(PostSet::Field::file_url, value);
+            } else if (key == "large_file_url") {
+                set(PostSet::Field::large_file_url, value);
+            } else if (key == "preview_file_url") {
+                set(PostSet::Field::preview_file_url, value);
+            } else if (key == "file_ext") {
+                set(PostSet::Field::file_ext, value);
+            } else if (key == "md5") {
+                set(PostSet::Field::md5, value);
+            } else if (key == "tag_string") {
+                set(PostSet::Field::tags, value);
+            } else if (key == "rating") {
+                rating = value.is_string && !value.text.empty() ? value.text[0] : '\0';
+            } else if (key == "image_width") {
+                parse_number(value, width);
+            } else if (key == "image_height") {
+                parse_number(value, height);
+            }
+        }
         
-        // Extract filename from URL and add proper extension
-        std::string url = file_urls[i];
-        size_t last_slash = url.find_last_of('/');
-        if (last_slash != std::string::npos) {
-            std::string url_filename = url.substr(last_slash + 1);
-            // Remove any query parameters
-            size_t question_mark = url_filename.find('?');
-            if (question_mark != std::string::npos) {
-                url_filename = url_filename.substr(0, question_mark);
+        void end_post() override {
+            ++rows;
+            if (id != 0 && (oldest_id == 0 || id < oldest_id)) {
+                oldest_id = id;
+            }
+            // Posts hidden from anonymous users (or deleted) come without a file_url
+            if (id == 0 || texts[static_cast<size_t>(PostSet::Field::file_url)].empty()) {
+                return;
             }
-            image.filename = url_filename;
-        } else {
-            // Fallback: use ID + extension
-            image.filename = "elysia_" + ids[i] + "." + file_exts[i];
+            std::array<std::string_view, PostSet::field_count> views;
+            for (size_t i = 0; i < views.size(); ++i) {
+                views[i] = texts[i];
+            }
+            posts.add(id, width, height, rating, views);
         }
         
-        image.tags = tag_strings[i];
-        image.rating = ratings[i];
-        image.width = std::stoi(widths[i]);
-        image.height = std::stoi(heights[i]);
+        // Every post object seen, kept or not
+        size_t rows = 0;
+        uint64_t oldest_id = 0;
+        
+    private:
+        PostSet& posts;
+        std::array<std::string, PostSet::field_count> texts;
+        uint64_t id = 0;
+        int width = 0;
+        int height = 0;
+        char rating = '\0';
         
-        // Add all images since we're filtering at the API level with -video tag
-        if (!image.file_url.empty()) {
-            images.push_back(image);
-            std::cout << "Added image: " << image.file_url << " (format: " << file_exts[i] << ")" << std::endl;
+        void set(PostSet::Field field, const JsonValue& value) {
+            std::string& text = texts[static_cast<size_t>(field)];
+            if (!value.is_string) {
+                // null
+                text.clear();
+            } else if (value.has_escapes) {
+                text = json_unescape(value.text);
+            } else {
+                text.assign(value.text);
+            }
         }
+
+    };
+    
+    PostCollector collector(posts);
+    if (!parse_posts_json(json_str, collector)) {
+        std::cerr << "Malformed JSON response, using the " << posts.size() << " posts parsed before the error" << std::endl;
     }
+    posts.set_page(collector.rows, collector.oldest_id);
     
-    return images;
+    std::cout << "Found " << posts.size() << " images" << std::endl;
+    
+    return posts;
 }
 
-
+long DanbooruClient::parse_count_response(std::string_view json) {
+    // {"counts":{"posts":1234}}
+    size_t key = json.find("\"posts\"");
+    if (key == std::string_view::npos) {
+        return -1;
+    }
+    size_t colon = json.find(':', key);
+    if (colon == std::string_view::npos) {
+        return -1;
+    }
+    size_t start = json.find_first_not_of(" \t\r\n", colon + 1);
+    if (start == std::string_view::npos) {
+        return -1;
+    }
+    long posts = -1;
+    auto parsed = std::from_chars(json.data() + start, json.data() + json.size(), posts);
+    return parsed.ec == std::errc() ? posts : -1;
+}
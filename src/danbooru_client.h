@@ -1,33 +1,104 @@
 #pragma once
 
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <curl/curl.h>
+#include "post_set.h"
+#include "transfer_engine.h"
+
+class SearchCache;
+
+// Sizes Danbooru serves each post in
+enum class ImageVariant {
+    // Thumbnail, at most 180x180
+    preview,
+    // At most 850 pixels wide; the original itself for smaller posts
+    sample,
+    original
+};
 
 struct DanbooruImage {
     std::string id;
     std::string file_url;
+    std::string large_file_url;
+    std::string preview_file_url;
     std::string filename;
     std::string tags;
     std::string rating;
+    // Hex digest of the original file; empty if the API withheld it
+    std::string md5;
+    std::string file_ext;
     int width;
     int height;
 };
 
+// URL of `variant`, or of the next larger one if the API left it out
+const std::string& image_url(const DanbooruImage& post, ImageVariant variant);
+
+// Name to save `post` under: the last segment of its file URL, or
+// "elysia_<id>.<ext>" if the URL has none
+std::string default_filename(const DanbooruImage& post);
+
 class DanbooruClient {
 public:
+    using SearchCallback = std::function<void(PostSet posts, const std::string& error)>;
+    using CountCallback = std::function<void(long posts, const std::string& error)>;
+    
     DanbooruClient();
     ~DanbooruClient();
     
-    std::vector<DanbooruImage> search_images(const std::vector<std::string>& tags, int limit = 100);
+    // Root of the API that searches and counts go to: the ELYSIA_API_URL
+    // environment variable if set, https://danbooru.donmai.us otherwise.
+    // Pointing it at a stand-in server (see bench/mock_server.h) lets
+    // everything run without a network. Not thread-safe; set it at startup.
+    static const std::string& base_url();
+    static void set_base_url(std::string url);
+    
+    // `page` is passed through to the API: a page number, or a cursor such
+    // as "b<id>" (posts older than id) for paging deep into a tag
+    std::vector<DanbooruImage> search_images(const std::vector<std::string>& tags, int limit = 100,
+                                             const std::string& page = "");
     DanbooruImage get_random_image(const std::vector<std::string>& tags);
     
+    // Non-blocking variant of search_images. `on_done` runs from the engine's
+    // main context with either the parsed posts or an error message. The
+    // request goes through TransferEngine::submit(), so it is rate limited
+    // and retried while the API throttles it.
+    // With a `cache`, a fresh stored response completes the call before it
+    // returns (with id 0) and a stale one is revalidated conditionally.
+    // Cursor pages ("b<id>") bypass the cache.
+    static TransferEngine::TransferId search_images_async(TransferEngine& engine,
+                                                          const std::vector<std::string>& tags,
+                                                          int limit, const std::string& page,
+                                                          SearchCallback on_done,
+                                                          SearchCache* cache = nullptr);
+    
+    // Moves `cursor` on to the page after `page`, for a search walked with
+    // "b<id>" cursors. False at the end of the results: a page that held no
+    // posts, or the same page again from a server that ignores the cursor.
+    static bool next_cursor(const PostSet& page, std::string& cursor);
+    
+    // Asks /counts/posts.json how many posts match `tags`, without listing
+    // them; paced and retried like searches
+    static TransferEngine::TransferId count_posts_async(TransferEngine& engine, const std::vector<std::string>& tags,
+                                                        CountCallback on_done);
+    
+    static std::vector<DanbooruImage> parse_json_response(std::string_view json);
+    // Same, into columns; posts without a file_url or a numeric id are dropped
+    static PostSet parse_post_set(std::string_view json);
+    // The post count in a /counts/posts.json response, or -1 if there is none
+    static long parse_count_response(std::string_view json);
+    
 private:
     CURL* curl;
     
     static size_t write_callback(void* contents, size_t size, size_t nmemb, std::string* userp);
     std::string make_request(const std::string& url);
-    std::vector<DanbooruImage> parse_json_response(const std::string& json);
+    static std::string build_search_url(const std::vector<std::string>& tags, int limit, const std::string& page);
+    static std::string build_count_url(const std::vector<std::string>& tags);
+    static void configure_request(CURL* handle, const std::string& url, std::string* response);
 };
 
 
@@ -0,0 +1,29 @@
+#include "download_directory.h"
+#include <glib.h>
+#include <filesystem>
+
+std::string default_download_directory() {
+    // For simplicity, use Downloads directory
+    // In a real application, you'd want to use a proper file chooser dialog
+    const char* home_dir = g_get_home_dir();
+    if (home_dir) {
+        char* downloads_path = g_build_filename(home_dir, "Pictures/Elysia", NULL);
+        std::string path = downloads_path;
+        g_free(downloads_path);
+        
+        // Create directory if it doesn't exist
+        std::error_code ec;
+        if (!std::filesystem::exists(path)) {
+            if (!std::filesystem::create_directories(path, ec)) {
+                // If directory creation fails, fall back to current directory
+                g_warning("Failed to create directory %s: %s", path.c_str(), ec.message().c_str());
+                return std::filesystem::current_path().string();
+            }
+        }
+        
+        return path;
+    }
+    
+    // Fallback to current directory
+    return std::filesystem::current_path().string();
+}
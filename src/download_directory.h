@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+
+// ~/Pictures/Elysia, created on demand. Falls back to the current directory
+// if it can't be created.
+std::string default_download_directory();
@@ -0,0 +1,314 @@
+#include "duplicate_finder.h"
+#include "context_call.h"
+#include "perceptual_hash.h"
+#include "thread_priority.h"
+#include <glib/gstdio.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <unordered_set>
+
+namespace {
+
+constexpr const char* cache_header = "elysia-image-hashes 1";
+
+// Images are decoded to about this size for hashing. The hash only looks
+// at 32x32, and JPEGs decode this small in a fraction of the time.
+constexpr int decode_size = 128;
+
+// Hashes are handed to the main context this many at a time
+constexpr size_t batch_size = 64;
+
+} // namespace
+
+DuplicateFinder::Batch::~Batch() {
+    g_object_unref(alive);
+}
+
+DuplicateFinder::Scan::~Scan() {
+    g_object_unref(alive);
+}
+
+DuplicateFinder::DuplicateFinder(ThumbnailCache thumbnails, std::string cache_path, int max_distance)
+    : thumbnails(std::move(thumbnails)), cache_path(std::move(cache_path)), max_distance(max_distance),
+      dirty(false), context(g_main_context_ref_thread_default()), alive(g_cancellable_new()), scanner(nullptr) {
+    load();
+}
+
+DuplicateFinder::~DuplicateFinder() {
+    g_cancellable_cancel(alive);
+    if (scanner) {
+        // Stops after the image being hashed
+        g_thread_join(scanner);
+    }
+    flush();
+    g_object_unref(alive);
+    g_main_context_unref(context);
+}
+
+std::string DuplicateFinder::default_cache_path() {
+    char* path = g_build_filename(g_get_user_cache_dir(), "elysia", "hashes", NULL);
+    std::string result = path;
+    g_free(path);
+    return result;
+}
+
+void DuplicateFinder::scan(const std::string& directory) {
+    if (max_distance < 0) {
+        return;
+    }
+    if (scanner) {
+        rescan_directory = directory;
+        return;
+    }
+    Scan* scan = new Scan;
+    scan->finder = this;
+    scan->directory = directory;
+    scan->known = records;
+    scan->context = context;
+    scan->alive = G_CANCELLABLE(g_object_ref(alive));
+    scanner = g_thread_new("elysia-hashes", run_scan, scan);
+}
+
+bool DuplicateFinder::hash_image(GBytes* bytes, uint64_t& hash) {
+    GInputStream* stream = g_memory_input_stream_new_from_bytes(bytes);
+    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_stream_at_scale(stream, decode_size, decode_size, TRUE, nullptr, nullptr);
+    g_object_unref(stream);
+    if (!pixbuf) {
+        return false;
+    }
+    bool hashed = hash_pixbuf(pixbuf, hash);
+    g_object_unref(pixbuf);
+    return hashed;
+}
+
+bool DuplicateFinder::find(uint64_t hash, Duplicate& duplicate) {
+    HashIndex::Match match;
+    while (max_distance >= 0 && index.nearest(hash, max_distance, match)) {
+        // Deleted since the last scan
+        if (!g_file_test(match.name.c_str(), G_FILE_TEST_IS_REGULAR)) {
+            forget(match.name);
+            // Otherwise the same match would come back forever
+            index.remove(match.name);
+            continue;
+        }
+        duplicate.path = match.name;
+        duplicate.distance = match.distance;
+        return true;
+    }
+    return false;
+}
+
+void DuplicateFinder::add(const std::string& path, uint64_t hash) {
+    GStatBuf info;
+    if (g_stat(path.c_str(), &info) != 0) {
+        return;
+    }
+    store(path, Record{static_cast<long long>(info.st_mtime), static_cast<unsigned long long>(info.st_size), hash});
+}
+
+void DuplicateFinder::flush() {
+    if (dirty) {
+        save();
+    }
+}
+
+void DuplicateFinder::load() {
+    std::ifstream file(cache_path);
+    std::string line;
+    // Anything else is rehashed by the next scan
+    if (!std::getline(file, line) || line != cache_header) {
+        return;
+    }
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string hash;
+        Record record;
+        std::string path;
+        if (!(fields >> hash >> record.mtime >> record.size) || !std::getline(fields >> std::ws, path) || path.empty()) {
+            continue;
+        }
+        record.hash = g_ascii_strtoull(hash.c_str(), nullptr, 16);
+        records[path] = record;
+        index.add(path, record.hash);
+    }
+}
+
+void DuplicateFinder::save() {
+    std::ostringstream contents;
+    contents << cache_header << "\n";
+    char hash[17];
+    for (const auto& entry : records) {
+        g_snprintf(hash, sizeof(hash), "%016" G_GINT64_MODIFIER "x", static_cast<guint64>(entry.second.hash));
+        contents << hash << " " << entry.second.mtime << " " << entry.second.size << " " << entry.first << "\n";
+    }
+    std::string data = contents.str();
+
+    char* directory = g_path_get_dirname(cache_path.c_str());
+    g_mkdir_with_parents(directory, 0755);
+    g_free(directory);
+    // Written to a temporary file and renamed over the old one
+    GError* error = nullptr;
+    if (!g_file_set_contents(cache_path.c_str(), data.data(), static_cast<gssize>(data.size()), &error)) {
+        std::cerr << "Failed to write " << cache_path << ": " << error->message << std::endl;
+        g_error_free(error);
+        return;
+    }
+    dirty = false;
+}
+
+void DuplicateFinder::store(const std::string& path, const Record& record) {
+    records[path] = record;
+    index.add(path, record.hash);
+    dirty = true;
+}
+
+void DuplicateFinder::forget(const std::string& path) {
+    if (records.erase(path) != 0) {
+        index.remove(path);
+        dirty = true;
+    }
+}
+
+bool DuplicateFinder::hash_file(const std::string& path, uint64_t& hash) const {
+    // A current thumbnail is the same picture, and much quicker to decode
+    std::string source = path;
+    ThumbnailCache::Entry entry;
+    if (thumbnails.describe(path, ThumbnailSize::large, entry) &&
+        ThumbnailCache::is_current(entry.thumbnail_path, entry)) {
+        source = entry.thumbnail_path;
+    }
+    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file_at_scale(source.c_str(), decode_size, decode_size, TRUE, nullptr);
+    if (!pixbuf) {
+        return false;
+    }
+    bool hashed = hash_pixbuf(pixbuf, hash);
+    g_object_unref(pixbuf);
+    return hashed;
+}
+
+bool DuplicateFinder::hash_pixbuf(GdkPixbuf* pixbuf, uint64_t& hash) {
+    // Previews and thumbnails are upright, so the originals must be too
+    GdkPixbuf* upright = gdk_pixbuf_apply_embedded_orientation(pixbuf);
+    // perceptual_hash() takes four bytes a pixel
+    GdkPixbuf* rgba = gdk_pixbuf_get_has_alpha(upright) ? GDK_PIXBUF(g_object_ref(upright))
+                                                        : gdk_pixbuf_add_alpha(upright, FALSE, 0, 0, 0);
+    g_object_unref(upright);
+    if (!rgba) {
+        return false;
+    }
+    bool hashed = gdk_pixbuf_get_n_channels(rgba) == 4 && gdk_pixbuf_get_bits_per_sample(rgba) == 8;
+    if (hashed) {
+        hash = perceptual_hash(gdk_pixbuf_read_pixels(rgba), gdk_pixbuf_get_width(rgba), gdk_pixbuf_get_height(rgba),
+                               gdk_pixbuf_get_rowstride(rgba));
+    }
+    g_object_unref(rgba);
+    return hashed;
+}
+
+gpointer DuplicateFinder::run_scan(gpointer data) {
+    std::unique_ptr<Scan> scan(static_cast<Scan*>(data));
+    lower_thread_priority();
+
+    auto new_batch = [&scan]() {
+        Batch* batch = new Batch;
+        batch->finder = scan->finder;
+        batch->alive = G_CANCELLABLE(g_object_ref(scan->alive));
+        batch->directory = scan->directory;
+        return batch;
+    };
+    Batch* batch = new_batch();
+    std::vector<std::string> present;
+
+    GDir* directory = g_dir_open(scan->directory.c_str(), 0, nullptr);
+    if (directory) {
+        while (const char* name = g_dir_read_name(directory)) {
+            if (g_cancellable_is_cancelled(scan->alive)) {
+                break;
+            }
+            // Guessed from the name, as the library view does; this also
+            // leaves out the ".part" files of downloads in progress
+            char* type = g_content_type_guess(name, nullptr, 0, nullptr);
+            bool image = g_str_has_prefix(type, "image/");
+            g_free(type);
+            if (!image) {
+                continue;
+            }
+
+            std::string path = scan->directory + "/" + name;
+            GStatBuf info;
+            if (g_stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+                continue;
+            }
+            present.push_back(path);
+            Record record{static_cast<long long>(info.st_mtime), static_cast<unsigned long long>(info.st_size), 0};
+            auto known = scan->known.find(path);
+            if (known != scan->known.end() && known->second.mtime == record.mtime &&
+                known->second.size == record.size) {
+                continue;
+            }
+            if (!scan->finder->hash_file(path, record.hash)) {
+                continue;
+            }
+            batch->hashed.emplace_back(path, record);
+            if (batch->hashed.size() >= batch_size) {
+                call_on_context(scan->context, deliver, batch, G_PRIORITY_DEFAULT_IDLE);
+                batch = new_batch();
+            }
+        }
+        g_dir_close(directory);
+        batch->listed = !g_cancellable_is_cancelled(scan->alive);
+    }
+    batch->done = true;
+    batch->present = std::move(present);
+    call_on_context(scan->context, deliver, batch, G_PRIORITY_DEFAULT_IDLE);
+    return nullptr;
+}
+
+gboolean DuplicateFinder::deliver(gpointer data) {
+    std::unique_ptr<Batch> batch(static_cast<Batch*>(data));
+    if (g_cancellable_is_cancelled(batch->alive)) {
+        // The finder has been destroyed
+        return G_SOURCE_REMOVE;
+    }
+    batch->finder->finish_batch(*batch);
+    return G_SOURCE_REMOVE;
+}
+
+void DuplicateFinder::finish_batch(Batch& batch) {
+    for (const auto& entry : batch.hashed) {
+        store(entry.first, entry.second);
+    }
+    if (!batch.done) {
+        return;
+    }
+
+    // Files of the directory that weren't found have been deleted or moved
+    if (batch.listed) {
+        std::unordered_set<std::string> present(batch.present.begin(), batch.present.end());
+        std::string prefix = batch.directory + "/";
+        std::vector<std::string> gone;
+        for (auto it = records.lower_bound(prefix); it != records.end(); ++it) {
+            if (it->first.compare(0, prefix.size(), prefix) != 0) {
+                break;
+            }
+            // Only the directory itself was listed, not its subdirectories
+            if (it->first.find('/', prefix.size()) == std::string::npos && !present.count(it->first)) {
+                gone.push_back(it->first);
+            }
+        }
+        for (const std::string& path : gone) {
+            forget(path);
+        }
+    }
+    flush();
+
+    g_thread_join(scanner);
+    scanner = nullptr;
+    if (!rescan_directory.empty()) {
+        std::string directory = std::move(rescan_directory);
+        rescan_directory.clear();
+        scan(directory);
+    }
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <gtk/gtk.h>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "hash_index.h"
+#include "thumbnail_cache.h"
+
+// Recognizes images that are already saved, even under another name,
+// resampled or recompressed, by their perceptual hashes. Danbooru has many
+// reposts of the same picture under different ids, and a post's preview is
+// enough to tell, before its original is downloaded.
+//
+// The hashes of the saved images are kept in a HashIndex, and on disk with
+// the size and modification time of the file each was made from. scan()
+// hashes whatever is new or changed on a thread of its own at idle
+// priority, from the file's freedesktop thumbnail when there is a current
+// one, and forgets files that are gone; results come in on the main
+// context of the thread that created the finder.
+class DuplicateFinder {
+public:
+    struct Duplicate {
+        std::string path;
+        // Bits in which the hashes differ; 0 is the same picture
+        int distance = 0;
+    };
+
+    // `max_distance` below 0 turns detection off
+    DuplicateFinder(ThumbnailCache thumbnails, std::string cache_path, int max_distance);
+    ~DuplicateFinder();
+
+    DuplicateFinder(const DuplicateFinder&) = delete;
+    DuplicateFinder& operator=(const DuplicateFinder&) = delete;
+
+    // $XDG_CACHE_HOME/elysia/hashes
+    static std::string default_cache_path();
+
+    // Brings the hashes of the images in `directory` up to date. A scan
+    // asked for while one runs starts when it is done.
+    void scan(const std::string& directory);
+
+    // Hash of an encoded image; false if it can't be decoded
+    static bool hash_image(GBytes* bytes, uint64_t& hash);
+
+    // The saved image most like the one hashed to `hash`, if any is within
+    // `max_distance`
+    bool find(uint64_t hash, Duplicate& duplicate);
+
+    // Records a file just saved, with the hash of what it was saved from
+    void add(const std::string& path, uint64_t hash);
+
+    // Writes the hashes now instead of after the next scan
+    void flush();
+
+    size_t size() const { return index.size(); }
+
+private:
+    struct Record {
+        long long mtime;
+        unsigned long long size;
+        uint64_t hash;
+    };
+
+    // What a scan hands back to the main context; `done` comes last, with
+    // every image that was found if the directory could be listed
+    struct Batch {
+        DuplicateFinder* finder;
+        GCancellable* alive;
+        std::string directory;
+        std::vector<std::pair<std::string, Record>> hashed;
+        bool done = false;
+        bool listed = false;
+        std::vector<std::string> present;
+
+        ~Batch();
+    };
+
+    // Owned by the scan thread
+    struct Scan {
+        DuplicateFinder* finder;
+        std::string directory;
+        // The records when the scan started, so unchanged files are skipped
+        std::map<std::string, Record> known;
+        GMainContext* context;
+        GCancellable* alive;
+
+        ~Scan();
+    };
+
+    ThumbnailCache thumbnails;
+    std::string cache_path;
+    int max_distance;
+    HashIndex index;
+    std::map<std::string, Record> records;
+    bool dirty;
+
+    GMainContext* context;
+    // Cancelled when the finder goes away; stops the scan
+    GCancellable* alive;
+    GThread* scanner;
+    std::string rescan_directory;
+
+    void load();
+    void save();
+    void store(const std::string& path, const Record& record);
+    void forget(const std::string& path);
+    void finish_batch(Batch& batch);
+
+    bool hash_file(const std::string& path, uint64_t& hash) const;
+    static bool hash_pixbuf(GdkPixbuf* pixbuf, uint64_t& hash);
+    static gpointer run_scan(gpointer data);
+    static gboolean deliver(gpointer data);
+};
@@ -0,0 +1,434 @@
+#include "gallery_view.h"
+#include "post_index.h"
+#include "search_cache.h"
+#include "texture_decoder.h"
+#include "thumbnail_grid.h"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+namespace {
+
+// Posts asked for per search; the most Danbooru serves without paging is 200
+constexpr int gallery_page_size = 100;
+
+// Thumbnails fetched or decoded at once. Enough to fill a screen quickly,
+// few enough that a fast scroll doesn't queue up hundreds of transfers.
+constexpr size_t max_loads = 12;
+
+// Failed searches in a row before paging stops until the next reload
+constexpr size_t max_failed_pages = 3;
+
+} // namespace
+
+// A GListModel over the posts of a GalleryView. Items are only made when
+// GTK asks for one, as GtkStringObjects holding the post id, so the model
+// itself costs nothing per post.
+#define ELYSIA_TYPE_POST_MODEL (elysia_post_model_get_type())
+G_DECLARE_FINAL_TYPE(ElysiaPostModel, elysia_post_model, ELYSIA, POST_MODEL, GObject)
+
+struct _ElysiaPostModel {
+    GObject parent_instance;
+    // Borrowed from the GalleryView; only the first `size` rows are exposed
+    const PostSet* posts;
+    guint size;
+};
+
+static GType elysia_post_model_get_item_type(GListModel* list) {
+    return GTK_TYPE_STRING_OBJECT;
+}
+
+static guint elysia_post_model_get_n_items(GListModel* list) {
+    return ELYSIA_POST_MODEL(list)->size;
+}
+
+static gpointer elysia_post_model_get_item(GListModel* list, guint position) {
+    ElysiaPostModel* self = ELYSIA_POST_MODEL(list);
+    if (position >= self->size) {
+        return nullptr;
+    }
+    return gtk_string_object_new(std::to_string(self->posts->id(position)).c_str());
+}
+
+static void elysia_post_model_list_model_init(GListModelInterface* iface) {
+    iface->get_item_type = elysia_post_model_get_item_type;
+    iface->get_n_items = elysia_post_model_get_n_items;
+    iface->get_item = elysia_post_model_get_item;
+}
+
+G_DEFINE_TYPE_WITH_CODE(ElysiaPostModel, elysia_post_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL, elysia_post_model_list_model_init))
+
+static void elysia_post_model_class_init(ElysiaPostModelClass* klass) {
+}
+
+static void elysia_post_model_init(ElysiaPostModel* self) {
+    self->posts = nullptr;
+    self->size = 0;
+}
+
+// Exposes the first `size` rows of the posts, announcing the change
+static void elysia_post_model_resize(ElysiaPostModel* self, guint size) {
+    guint old_size = self->size;
+    self->size = size;
+    if (size > old_size) {
+        g_list_model_items_changed(G_LIST_MODEL(self), old_size, 0, size - old_size);
+    } else if (size < old_size) {
+        g_list_model_items_changed(G_LIST_MODEL(self), size, old_size - size, 0);
+    }
+}
+
+GalleryView::GalleryView(TransferEngine& engine, ImageStore& store, SearchCache* cache, PostIndex& index,
+                         std::vector<std::string> tags, size_t max_texture_bytes)
+    : engine(engine), store(store), cache(cache), index(index), tags(std::move(tags)),
+      max_texture_bytes(max_texture_bytes), page_in_flight(false), page_transfer(0), exhausted(false),
+      failed_pages(0), cached_bytes(0), loading(0), previous_first(0), scrolling_back(false), update_source(0),
+      generation(1), cancellable(g_cancellable_new()) {
+    ElysiaPostModel* post_model = ELYSIA_POST_MODEL(g_object_new(ELYSIA_TYPE_POST_MODEL, nullptr));
+    post_model->posts = &posts;
+    model = G_LIST_MODEL(post_model);
+
+    // The selection model takes over the reference. The scroller is kept
+    // alive until the destructor has disconnected from it, whenever its
+    // container goes away.
+    g_object_ref(model);
+    grid = new_thumbnail_grid(model, G_CALLBACK(on_bind), G_CALLBACK(on_unbind), G_CALLBACK(on_grid_activate),
+                              this, scroller);
+}
+
+GalleryView::~GalleryView() {
+    // Unbinds every tile while the handlers can still see this object
+    elysia_post_model_resize(ELYSIA_POST_MODEL(model), 0);
+    g_signal_handlers_disconnect_by_data(grid, this);
+    GtkListItemFactory* factory = nullptr;
+    g_object_get(grid, "factory", &factory, nullptr);
+    if (factory) {
+        g_signal_handlers_disconnect_by_data(factory, this);
+        g_object_unref(factory);
+    }
+
+    clear();
+    g_cancellable_cancel(cancellable);
+    g_object_unref(cancellable);
+    g_object_unref(model);
+    g_object_unref(scroller);
+}
+
+void GalleryView::start() {
+    if (posts.empty() && !page_in_flight) {
+        fetch_page();
+    }
+}
+
+void GalleryView::reload() {
+    elysia_post_model_resize(ELYSIA_POST_MODEL(model), 0);
+    clear();
+    posts = PostSet();
+    cursor.clear();
+    exhausted = false;
+    failed_pages = 0;
+    previous_first = 0;
+    scrolling_back = false;
+    fetch_page();
+}
+
+void GalleryView::clear() {
+    if (update_source) {
+        g_source_remove(update_source);
+        update_source = 0;
+    }
+    if (page_in_flight && page_transfer) {
+        engine.cancel(page_transfer);
+    }
+    page_in_flight = false;
+    page_transfer = 0;
+
+    for (auto& entry : thumbnails) {
+        if (entry.second.fetch) {
+            store.cancel(entry.second.fetch);
+        }
+        if (entry.second.texture) {
+            g_object_unref(entry.second.texture);
+        }
+    }
+    thumbnails.clear();
+    lru.clear();
+    cached_bytes = 0;
+    loading = 0;
+    // Decodes still running finish into nothing
+    ++generation;
+}
+
+void GalleryView::schedule_update() {
+    // Binding a screenful of tiles is one update, not one per tile
+    if (!update_source) {
+        update_source = g_idle_add(on_update, this);
+    }
+}
+
+gboolean GalleryView::on_update(gpointer user_data) {
+    GalleryView* self = static_cast<GalleryView*>(user_data);
+    self->update_source = 0;
+    self->update();
+    return G_SOURCE_REMOVE;
+}
+
+void GalleryView::update() {
+    if (bound.empty()) {
+        return;
+    }
+    uint32_t first = bound.begin()->first;
+    uint32_t last = bound.rbegin()->first;
+    if (first != previous_first) {
+        scrolling_back = first < previous_first;
+        previous_first = first;
+    }
+
+    // One screenful past the bound rows, in the direction of scrolling
+    uint32_t screen = last - first + 1;
+    uint32_t ahead_begin = scrolling_back ? first - std::min(first, screen) : last + 1;
+    uint32_t ahead_end = scrolling_back ? first : std::min<uint32_t>(last + 1 + screen, posts.size());
+
+    // Loads that have fallen out of the window make room for ones in it
+    std::vector<uint32_t> stale;
+    for (const auto& entry : thumbnails) {
+        uint32_t row = entry.first;
+        bool wanted = (row >= first && row <= last) || (row >= ahead_begin && row < ahead_end);
+        if (entry.second.state == State::fetching && !wanted) {
+            stale.push_back(row);
+        }
+    }
+    for (uint32_t row : stale) {
+        drop(row);
+    }
+
+    // Bound rows first, then the ones about to scroll into view
+    bool room = true;
+    for (const auto& entry : bound) {
+        if (!(room = request(entry.first))) {
+            break;
+        }
+    }
+    if (scrolling_back) {
+        for (uint32_t row = ahead_end; room && row > ahead_begin; --row) {
+            room = request(row - 1);
+        }
+    } else {
+        for (uint32_t row = ahead_begin; room && row < ahead_end; ++row) {
+            room = request(row);
+        }
+    }
+
+    // The next page is searched while there are still two screens to go
+    if (!exhausted && !page_in_flight && last + 2 * screen >= posts.size()) {
+        fetch_page();
+    }
+}
+
+bool GalleryView::request(uint32_t row) {
+    auto it = thumbnails.find(row);
+    if (it != thumbnails.end()) {
+        if (it->second.state == State::ready) {
+            lru.splice(lru.begin(), lru, it->second.used);
+        }
+        return true;
+    }
+    if (loading >= max_loads) {
+        return false;
+    }
+
+    thumbnails.emplace(row, Thumbnail());
+    ++loading;
+    guint64 current = generation;
+    try {
+        ImageStore::FetchId id = store.fetch(posts.post(row), ImageVariant::preview,
+            [this, row, current](const ImageStore::StoredImage& image, const std::string& error) {
+                auto it = thumbnails.find(row);
+                if (current != generation || it == thumbnails.end()) {
+                    return;
+                }
+                it->second.fetch = 0;
+                if (!error.empty()) {
+                    std::cerr << "Failed to fetch thumbnail of post " << posts.id(row) << ": " << error << std::endl;
+                    finish(row, nullptr);
+                    return;
+                }
+                it->second.state = State::decoding;
+                int pixels = tile_pixels();
+                decode_texture_async(image.bytes, pixels, pixels, cancellable, on_decoded,
+                                     new DecodeJob{this, generation, row});
+            });
+        // Stored thumbnails have already moved on to decoding
+        it = thumbnails.find(row);
+        if (it != thumbnails.end() && it->second.state == State::fetching) {
+            it->second.fetch = id;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error fetching thumbnail: " << e.what() << std::endl;
+        finish(row, nullptr);
+    }
+    return true;
+}
+
+void GalleryView::drop(uint32_t row) {
+    auto it = thumbnails.find(row);
+    if (it->second.fetch) {
+        store.cancel(it->second.fetch);
+    }
+    thumbnails.erase(it);
+    --loading;
+}
+
+void GalleryView::on_decoded(GObject* source_object, GAsyncResult* result, gpointer user_data) {
+    std::unique_ptr<DecodeJob> job(static_cast<DecodeJob*>(user_data));
+
+    GError* error = nullptr;
+    GdkTexture* texture = decode_texture_finish(result, &error);
+    if (error) {
+        bool cancelled = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+        if (!cancelled) {
+            std::cerr << "Failed to decode thumbnail: " << error->message << std::endl;
+        }
+        g_error_free(error);
+        if (cancelled) {
+            // The view has been destroyed
+            return;
+        }
+    }
+
+    if (job->generation != job->view->generation) {
+        if (texture) {
+            g_object_unref(texture);
+        }
+        return;
+    }
+    job->view->finish(job->row, texture);
+}
+
+void GalleryView::finish(uint32_t row, GdkTexture* texture) {
+    Thumbnail& thumbnail = thumbnails.at(row);
+    --loading;
+    if (!texture) {
+        thumbnail.state = State::failed;
+        schedule_update();
+        return;
+    }
+
+    thumbnail.state = State::ready;
+    thumbnail.texture = texture;
+    thumbnail.bytes = static_cast<size_t>(gdk_texture_get_width(texture)) * gdk_texture_get_height(texture) * 4;
+    lru.push_front(row);
+    thumbnail.used = lru.begin();
+    cached_bytes += thumbnail.bytes;
+
+    auto tile = bound.find(row);
+    if (tile != bound.end()) {
+        gtk_picture_set_paintable(GTK_PICTURE(tile->second), GDK_PAINTABLE(texture));
+    }
+    evict();
+    schedule_update();
+}
+
+void GalleryView::evict() {
+    // Least recently shown first; tiles on screen keep theirs
+    auto it = lru.end();
+    while (cached_bytes > max_texture_bytes && it != lru.begin()) {
+        --it;
+        uint32_t row = *it;
+        if (bound.count(row)) {
+            continue;
+        }
+        auto thumbnail = thumbnails.find(row);
+        cached_bytes -= thumbnail->second.bytes;
+        g_object_unref(thumbnail->second.texture);
+        thumbnails.erase(thumbnail);
+        it = lru.erase(it);
+    }
+}
+
+void GalleryView::fetch_page() {
+    if (failed_pages >= max_failed_pages) {
+        return;
+    }
+    page_in_flight = true;
+    guint64 current = generation;
+    try {
+        TransferEngine::TransferId id = DanbooruClient::search_images_async(engine, tags, gallery_page_size, cursor,
+            [this, current](PostSet page, const std::string& error) {
+                if (current != generation) {
+                    return;
+                }
+                page_in_flight = false;
+                page_transfer = 0;
+                if (!error.empty()) {
+                    std::cerr << "Failed to fetch gallery page: " << error << std::endl;
+                    ++failed_pages;
+                    return;
+                }
+                failed_pages = 0;
+                add_page(page);
+            }, cache);
+        if (page_in_flight) {
+            page_transfer = id;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Failed to fetch gallery page: " << e.what() << std::endl;
+        page_in_flight = false;
+        ++failed_pages;
+    }
+}
+
+void GalleryView::add_page(const PostSet& page) {
+    if (!DanbooruClient::next_cursor(page, cursor)) {
+        exhausted = true;
+        return;
+    }
+    index.add(page);
+
+    posts.append(page);
+    elysia_post_model_resize(ELYSIA_POST_MODEL(model), static_cast<guint>(posts.size()));
+    // A page that doesn't fill the screen yet asks for the next right away
+    schedule_update();
+}
+
+int GalleryView::tile_pixels() const {
+    // In device pixels, so HiDPI screens get sharp thumbnails
+    return thumbnail_tile_size * gtk_widget_get_scale_factor(grid);
+}
+
+void GalleryView::on_bind(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer user_data) {
+    GalleryView* self = static_cast<GalleryView*>(user_data);
+    uint32_t row = gtk_list_item_get_position(item);
+    GtkWidget* picture = gtk_list_item_get_child(item);
+
+    auto it = self->thumbnails.find(row);
+    GdkTexture* texture = it != self->thumbnails.end() ? it->second.texture : nullptr;
+    gtk_picture_set_paintable(GTK_PICTURE(picture), texture ? GDK_PAINTABLE(texture) : nullptr);
+    // The item may have no position left by the time it is unbound
+    g_object_set_data(G_OBJECT(picture), "gallery-row", GUINT_TO_POINTER(row));
+    self->bound[row] = picture;
+    self->schedule_update();
+}
+
+void GalleryView::on_unbind(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer user_data) {
+    GalleryView* self = static_cast<GalleryView*>(user_data);
+    GtkWidget* picture = gtk_list_item_get_child(item);
+    uint32_t row = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(picture), "gallery-row"));
+
+    // Lets the texture go once it is evicted
+    gtk_picture_set_paintable(GTK_PICTURE(picture), nullptr);
+    auto it = self->bound.find(row);
+    if (it != self->bound.end() && it->second == picture) {
+        self->bound.erase(it);
+    }
+    self->schedule_update();
+}
+
+void GalleryView::on_grid_activate(GtkGridView* grid, guint position, gpointer user_data) {
+    GalleryView* self = static_cast<GalleryView*>(user_data);
+    if (!self->on_activate || position >= self->posts.size()) {
+        return;
+    }
+    auto it = self->thumbnails.find(position);
+    self->on_activate(self->posts.post(position), it != self->thumbnails.end() ? it->second.texture : nullptr);
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <gtk/gtk.h>
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "danbooru_client.h"
+#include "image_store.h"
+#include "post_set.h"
+#include "transfer_engine.h"
+
+class PostIndex;
+class SearchCache;
+
+// Thumbnail grid over every post of a tag search, for browsing instead of
+// refreshing one image at a time. Pages are searched with an id cursor as
+// the end of the grid comes into view, and appended to one PostSet that a
+// GListModel exposes to a GtkGridView, so only the rows on screen have
+// widgets or even list items.
+//
+// Thumbnails are fetched through the ImageStore and decoded on worker
+// threads, for the rows GTK has bound and then one screenful further in
+// the direction of scrolling; loads for rows that have scrolled out of
+// that window are cancelled. Decoded textures are kept in LRU order up to
+// `max_texture_bytes`, evicting those of rows off screen, so memory stays
+// bounded however long the result set grows: beyond the budget each post
+// costs only its PostSet columns.
+class GalleryView {
+public:
+    // `thumbnail` is borrowed, null if it isn't decoded yet
+    using ActivateCallback = std::function<void(const DanbooruImage& post, GdkTexture* thumbnail)>;
+
+    GalleryView(TransferEngine& engine, ImageStore& store, SearchCache* cache, PostIndex& index,
+                std::vector<std::string> tags, size_t max_texture_bytes);
+    ~GalleryView();
+
+    GalleryView(const GalleryView&) = delete;
+    GalleryView& operator=(const GalleryView&) = delete;
+
+    // The scrollable grid; owned by whatever container it is added to
+    GtkWidget* widget() const { return scroller; }
+
+    // Searches the first page unless posts are already loaded
+    void start();
+    // Drops every post and thumbnail and searches again from the newest
+    void reload();
+
+    // Called when a tile is clicked
+    void set_on_activate(ActivateCallback callback) { on_activate = std::move(callback); }
+
+    size_t post_count() const { return posts.size(); }
+    size_t texture_bytes() const { return cached_bytes; }
+
+private:
+    enum class State {
+        fetching,
+        decoding,
+        ready,
+        // Not retried until the next reload
+        failed
+    };
+
+    struct Thumbnail {
+        State state = State::fetching;
+        ImageStore::FetchId fetch = 0;
+        GdkTexture* texture = nullptr;
+        size_t bytes = 0;
+        // Position in `lru` while ready
+        std::list<uint32_t>::iterator used;
+    };
+
+    struct DecodeJob {
+        GalleryView* view;
+        guint64 generation;
+        uint32_t row;
+    };
+
+    TransferEngine& engine;
+    ImageStore& store;
+    SearchCache* cache;
+    PostIndex& index;
+    std::vector<std::string> tags;
+    size_t max_texture_bytes;
+
+    GtkWidget* scroller;
+    GtkWidget* grid;
+    // An ElysiaPostModel over `posts`
+    GListModel* model;
+
+    PostSet posts;
+    std::string cursor;
+    bool page_in_flight;
+    // 0 if the page came from the search cache
+    TransferEngine::TransferId page_transfer;
+    bool exhausted;
+    size_t failed_pages;
+
+    // Thumbnails loading, ready or failed, by row
+    std::unordered_map<uint32_t, Thumbnail> thumbnails;
+    // Rows with a texture, most recently shown first
+    std::list<uint32_t> lru;
+    size_t cached_bytes;
+    size_t loading;
+
+    // Picture of every row GTK has bound, i.e. on or near the screen
+    std::map<uint32_t, GtkWidget*> bound;
+    uint32_t previous_first;
+    bool scrolling_back;
+    guint update_source;
+
+    // Bumped on reload, so loads for the old rows are dropped
+    guint64 generation;
+    GCancellable* cancellable;
+    ActivateCallback on_activate;
+
+    void clear();
+    void schedule_update();
+    void update();
+    bool request(uint32_t row);
+    void drop(uint32_t row);
+    void finish(uint32_t row, GdkTexture* texture);
+    void evict();
+    void fetch_page();
+    void add_page(const PostSet& page);
+    int tile_pixels() const;
+
+    static void on_bind(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer user_data);
+    static void on_unbind(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer user_data);
+    static void on_grid_activate(GtkGridView* grid, guint position, gpointer user_data);
+    static gboolean on_update(gpointer user_data);
+    static void on_decoded(GObject* source_object, GAsyncResult* result, gpointer user_data);
+};
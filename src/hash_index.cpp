@@ -0,0 +1,189 @@
+#include "hash_index.h"
+#include "perceptual_hash.h"
+#include <algorithm>
+
+namespace {
+
+constexpr int part_bits = 16;
+constexpr size_t part_values = size_t(1) << part_bits;
+
+// Hashes added since the last rebuild are compared one by one; the tables
+// are rebuilt once there are more of them than this, or than a 32nd of
+// what is filed, whichever is larger, so rebuilding stays rare and cheap
+// per hash
+constexpr size_t min_unfiled = 1024;
+
+// Comparing a hash costs about half a nanosecond, a table lookup a few
+// cache misses; one lookup is taken to be worth this many comparisons
+constexpr size_t comparisons_per_lookup = 128;
+
+// Distances are worked out this many at a time
+constexpr size_t compare_block = 256;
+
+// Calls `visit` with every value within `flips` bits of `value`, each once,
+// by flipping bits in increasing order from `first_bit` on
+template <typename Visit>
+void for_each_neighbour(uint16_t value, int first_bit, int flips, Visit& visit) {
+    visit(value);
+    if (flips == 0) {
+        return;
+    }
+    for (int bit = first_bit; bit < part_bits; ++bit) {
+        for_each_neighbour(static_cast<uint16_t>(value ^ (1u << bit)), bit + 1, flips - 1, visit);
+    }
+}
+
+// How many values lie within `flips` bits of a quarter
+size_t neighbour_count(int flips) {
+    size_t count = 0;
+    size_t ways = 1;
+    for (int k = 0; k <= flips; ++k) {
+        count += ways;
+        ways = ways * (part_bits - k) / (k + 1);
+    }
+    return count;
+}
+
+} // namespace
+
+HashIndex::HashIndex() : removed_count(0), filed(0) {
+}
+
+void HashIndex::add(const std::string& name, uint64_t hash) {
+    auto it = by_name.find(name);
+    if (it != by_name.end()) {
+        if (hashes[it->second] == hash) {
+            return;
+        }
+        remove(name);
+    }
+    by_name[name] = static_cast<uint32_t>(names.size());
+    names.push_back(name);
+    hashes.push_back(hash);
+    removed.push_back(false);
+
+    if (hashes.size() - filed > std::max(min_unfiled, filed / 32)) {
+        rebuild();
+    }
+}
+
+void HashIndex::remove(const std::string& name) {
+    auto it = by_name.find(name);
+    if (it == by_name.end()) {
+        return;
+    }
+    removed[it->second] = true;
+    by_name.erase(it);
+    ++removed_count;
+    if (removed_count > names.size() / 2) {
+        rebuild();
+    }
+}
+
+bool HashIndex::nearest(uint64_t hash, int max_distance, Match& match) const {
+    if (max_distance < 0 || by_name.empty()) {
+        return false;
+    }
+    max_distance = std::min(max_distance, 64);
+    Search search{hash, max_distance + 1, 0};
+
+    int flips = max_distance / parts;
+    bool use_tables = filed > 0 && flips < part_bits &&
+                      neighbour_count(flips) * parts * comparisons_per_lookup < filed;
+    if (use_tables) {
+        // An item matching in several quarters is compared more than once,
+        // which costs less than remembering what was compared
+        for (int part = 0; part < parts; ++part) {
+            const Table& table = tables[part];
+            auto visit = [&](uint16_t value) {
+                uint32_t begin = table.starts[value];
+                uint32_t end = table.starts[value + 1];
+                if (begin != end) {
+                    compare(search, table.hashes.data() + begin, table.items.data() + begin, end - begin, 0);
+                }
+            };
+            for_each_neighbour(part_of(hash, part), 0, flips, visit);
+        }
+        compare(search, hashes.data() + filed, nullptr, hashes.size() - filed, static_cast<uint32_t>(filed));
+    } else {
+        compare(search, hashes.data(), nullptr, hashes.size(), 0);
+    }
+
+    if (search.best > max_distance) {
+        return false;
+    }
+    match.name = names[search.best_item];
+    match.hash = hashes[search.best_item];
+    match.distance = search.best;
+    return true;
+}
+
+void HashIndex::rebuild() {
+    if (removed_count > 0) {
+        size_t kept = 0;
+        for (size_t item = 0; item < names.size(); ++item) {
+            if (removed[item]) {
+                continue;
+            }
+            // Moving a string onto itself empties it
+            if (kept != item) {
+                names[kept] = std::move(names[item]);
+                hashes[kept] = hashes[item];
+            }
+            ++kept;
+        }
+        names.resize(kept);
+        hashes.resize(kept);
+        removed.assign(kept, false);
+        removed_count = 0;
+        by_name.clear();
+        for (size_t item = 0; item < kept; ++item) {
+            by_name[names[item]] = static_cast<uint32_t>(item);
+        }
+    }
+
+    // A counting sort of the items by each quarter
+    filed = hashes.size();
+    for (int part = 0; part < parts; ++part) {
+        Table& table = tables[part];
+        table.starts.assign(part_values + 1, 0);
+        for (uint64_t hash : hashes) {
+            ++table.starts[part_of(hash, part) + 1];
+        }
+        for (size_t value = 0; value < part_values; ++value) {
+            table.starts[value + 1] += table.starts[value];
+        }
+        table.hashes.resize(filed);
+        table.items.resize(filed);
+        std::vector<uint32_t> next(table.starts.begin(), table.starts.end() - 1);
+        for (size_t item = 0; item < filed; ++item) {
+            uint32_t slot = next[part_of(hashes[item], part)]++;
+            table.hashes[slot] = hashes[item];
+            table.items[slot] = static_cast<uint32_t>(item);
+        }
+    }
+}
+
+void HashIndex::compare(Search& search, const uint64_t* candidates, const uint32_t* items, size_t count,
+                        uint32_t first_item) const {
+    uint8_t distances[compare_block];
+    for (size_t start = 0; start < count; start += compare_block) {
+        size_t length = std::min(compare_block, count - start);
+        // Most blocks have nothing close enough to look at one by one
+        if (hash_distances(candidates + start, length, search.hash, distances) > search.best) {
+            continue;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            int distance = distances[i];
+            if (distance > search.best) {
+                continue;
+            }
+            uint32_t item = items ? items[start + i] : static_cast<uint32_t>(first_item + start + i);
+            if (removed[item] || (distance == search.best && item > search.best_item)) {
+                continue;
+            }
+            search.best = distance;
+            search.best_item = item;
+        }
+    }
+}
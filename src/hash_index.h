@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Perceptual hashes by name, searchable by Hamming distance with
+// multi-index hashing: each hash is also filed under each of its four
+// 16-bit quarters. Two hashes within distance d agree to within d / 4 bits
+// in at least one quarter, so a search only looks up the few quarter
+// values that close to the query's, in each of the four tables, and
+// compares the whole hash of what it finds there.
+//
+// The tables are flat arrays sorted by quarter value, holding copies of
+// the hashes so a bucket is compared without touching anything else.
+// They are rebuilt in one pass now and then rather than kept sorted;
+// hashes added since are compared one by one, as is everything while the
+// index is small enough for that to be faster than the lookups.
+class HashIndex {
+public:
+    struct Match {
+        std::string name;
+        uint64_t hash = 0;
+        int distance = 0;
+    };
+
+    HashIndex();
+
+    size_t size() const { return by_name.size(); }
+
+    // Replaces the hash of `name` if it has one
+    void add(const std::string& name, uint64_t hash);
+    void remove(const std::string& name);
+    bool contains(const std::string& name) const { return by_name.count(name) != 0; }
+
+    // The closest hash within `max_distance` of `hash`, if any. Ties go to
+    // the hash added first.
+    bool nearest(uint64_t hash, int max_distance, Match& match) const;
+
+private:
+    static constexpr int parts = 4;
+
+    struct Table {
+        // Where the entries with each quarter value start, plus the end
+        std::vector<uint32_t> starts;
+        std::vector<uint64_t> hashes;
+        std::vector<uint32_t> items;
+    };
+
+    // By item, in the order added. Removed items keep their place until
+    // they are the majority.
+    std::vector<std::string> names;
+    std::vector<uint64_t> hashes;
+    std::vector<bool> removed;
+    size_t removed_count;
+    std::unordered_map<std::string, uint32_t> by_name;
+
+    // Items before `filed` are in the tables
+    size_t filed;
+    Table tables[parts];
+
+    static uint16_t part_of(uint64_t hash, int part) { return static_cast<uint16_t>(hash >> (part * 16)); }
+    // Drops removed items and files everything in the tables
+    void rebuild();
+
+    struct Search {
+        uint64_t hash;
+        int best;
+        uint32_t best_item;
+    };
+    // Compares `count` hashes, the first of which belongs to item
+    // `first_item` if `items` is null and to `items[0]` otherwise
+    void compare(Search& search, const uint64_t* candidates, const uint32_t* items, size_t count,
+                 uint32_t first_item) const;
+};
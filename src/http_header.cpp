@@ -0,0 +1,38 @@
+#include "http_header.h"
+#include <cctype>
+
+std::string_view trim_header(std::string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r' || text.back() == '\n')) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+bool starts_with_nocase(std::string_view text, std::string_view prefix) {
+    if (text.size() < prefix.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < prefix.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(text[i])) != prefix[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool header_value(std::string_view line, std::string_view name, std::string_view& value) {
+    if (!starts_with_nocase(line, name) || line.size() <= name.size() || line[name.size()] != ':') {
+        return false;
+    }
+    value = trim_header(line.substr(name.size() + 1));
+    return true;
+}
+
+std::string_view url_origin(std::string_view url) {
+    size_t scheme = url.find("://");
+    size_t host = scheme == std::string_view::npos ? 0 : scheme + 3;
+    return url.substr(0, url.find_first_of("/?", host));
+}
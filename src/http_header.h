@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string_view>
+
+// Small helpers for CURLOPT_HEADERFUNCTION callbacks and request URLs
+
+// Strips surrounding spaces, tabs and the trailing CRLF
+std::string_view trim_header(std::string_view text);
+
+// Compares against a lowercase `prefix`, ignoring the case of `text`
+bool starts_with_nocase(std::string_view text, std::string_view prefix);
+
+// Matches a "Name: value" line against a lowercase `name` and sets `value`
+bool header_value(std::string_view line, std::string_view name, std::string_view& value);
+
+// "https://host:port/path?query" -> "https://host:port", the part that
+// requests to the same server share
+std::string_view url_origin(std::string_view url);
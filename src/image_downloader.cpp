@@ -1,61 +1,610 @@
 #include "image_downloader.h"
+#include "http_header.h"
+#include "transfer_context.h"
+#include <glib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <algorithm>
 #include <iomanip>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
 
-ImageDownloader::ImageDownloader() {
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-    if (!curl) {
-        throw std::runtime_error("Failed to initialize CURL");
-    }
+namespace {
+
+constexpr int max_attempts = 3;
+
+// Instead of capping the whole transfer, give up only when it stalls below
+// this rate, so large originals on slow links still finish
+constexpr long low_speed_limit = 1024;
+constexpr long low_speed_time = 30;
+
+enum class AttemptResult { complete, retry, failed };
+
+curl_off_t parse_offset(std::string_view text) {
+    std::string digits(text);
+    char* end = nullptr;
+    long long value = std::strtoll(digits.c_str(), &end, 10);
+    return (end == digits.c_str() || value < 0) ? -1 : static_cast<curl_off_t>(value);
 }
 
-ImageDownloader::~ImageDownloader() {
-    if (curl) {
-        curl_easy_cleanup(curl);
+// "bytes <first>-<last>/<total>"; a 416 sends "bytes */<total>" and the total
+// may be "*" when the server doesn't know it
+void parse_content_range(std::string_view value, curl_off_t& first, curl_off_t& total) {
+    if (!starts_with_nocase(value, "bytes ")) {
+        return;
+    }
+    value = trim_header(value.substr(6));
+    size_t slash = value.find('/');
+    if (slash == std::string_view::npos) {
+        return;
+    }
+    std::string_view range = value.substr(0, slash);
+    std::string_view size = value.substr(slash + 1);
+    if (range != "*") {
+        first = parse_offset(range.substr(0, range.find('-')));
+    }
+    if (size != "*") {
+        total = parse_offset(size);
     }
-    curl_global_cleanup();
 }
 
-bool ImageDownloader::download_image(const std::string& url, const std::string& filepath) {
-    FILE* file = fopen(filepath.c_str(), "wb");
+// One download into "<path>.part", carried across attempts
+class PartialDownload {
+public:
+    explicit PartialDownload(const std::string& filepath)
+        : final_path(filepath), part_path(filepath + ".part"), meta_path(filepath + ".part.meta") {}
+
+    ~PartialDownload() {
+        close();
+        if (headers) {
+            curl_slist_free_all(headers);
+        }
+    }
+
+    PartialDownload(const PartialDownload&) = delete;
+    PartialDownload& operator=(const PartialDownload&) = delete;
+
+    const std::string& path() const { return final_path; }
+    const std::string& staging_path() const { return part_path; }
+
+    // Opens the .part file and sets the body and header callbacks on
+    // `handle`, plus Range/If-Range when there is data to resume from
+    bool begin_attempt(CURL* handle);
+
+    // Checks what the attempt left on disk and moves it into place once complete
+    AttemptResult finish_attempt(CURLcode code, long http_status);
+
+private:
+    std::string final_path;
+    std::string part_path;
+    std::string meta_path;
+    FILE* file = nullptr;
+    curl_slist* headers = nullptr;
+
+    // From the sidecar, or from the response that started the .part file
+    std::string validator;
+    curl_off_t expected_length = -1;
+    // Bytes already on disk when the request went out
+    curl_off_t resume_from = 0;
+
+    // Headers of the current response
+    long status = 0;
+    curl_off_t content_length = -1;
+    curl_off_t range_first = -1;
+    curl_off_t range_total = -1;
+    std::string etag;
+    std::string last_modified;
+
+    bool body_started = false;
+    bool range_mismatch = false;
+    bool write_failed = false;
+
+    void close();
+    void load_meta();
+    void save_meta() const;
+    void reset_response();
+    bool start_body();
+    bool commit();
+    void discard();
+
+    static size_t on_header(char* buffer, size_t size, size_t nitems, void* userdata);
+    static size_t on_body(char* ptr, size_t size, size_t nmemb, void* userdata);
+};
+
+bool PartialDownload::begin_attempt(CURL* handle) {
+    close();
+    reset_response();
+    body_started = false;
+    range_mismatch = false;
+    write_failed = false;
+
+    file = fopen(part_path.c_str(), "ab");
     if (!file) {
-        std::cerr << "Failed to open file for writing: " << filepath << std::endl;
         return false;
     }
-    
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "ElysiaDownloader/1.0");
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
-    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
-    
-    CURLcode res = curl_easy_perform(curl);
-    fclose(file);
-    
-    if (res != CURLE_OK) {
-        std::cerr << "Download failed: " << curl_easy_strerror(res) << std::endl;
-        // Remove the failed download file
-        std::filesystem::remove(filepath);
+    fseeko(file, 0, SEEK_END);
+    resume_from = ftello(file);
+    load_meta();
+
+    // Without a sidecar there is nothing to check old bytes against
+    if (resume_from > 0 && validator.empty() && expected_length < 0) {
+        if (ftruncate(fileno(file), 0) != 0) {
+            return false;
+        }
+        resume_from = 0;
+    }
+
+    if (headers) {
+        curl_slist_free_all(headers);
+        headers = nullptr;
+    }
+    if (resume_from > 0) {
+        std::string range = std::to_string(resume_from) + "-";
+        curl_easy_setopt(handle, CURLOPT_RANGE, range.c_str());
+        // If the file changed since, the server sends all of it with a 200
+        if (!validator.empty()) {
+            headers = curl_slist_append(nullptr, ("If-Range: " + validator).c_str());
+        }
+        std::cout << "Resuming " << final_path << " at " << resume_from << " bytes" << std::endl;
+    } else {
+        curl_easy_setopt(handle, CURLOPT_RANGE, nullptr);
+    }
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+
+    // Error bodies must not end up in the .part file
+    curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, on_header);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, this);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, on_body);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, this);
+    return true;
+}
+
+AttemptResult PartialDownload::finish_attempt(CURLcode code, long http_status) {
+    // An empty body never reaches on_body
+    if (code == CURLE_OK && !body_started) {
+        body_started = true;
+        start_body();
+    }
+    close();
+
+    std::error_code ec;
+    uintmax_t size = std::filesystem::file_size(part_path, ec);
+    curl_off_t on_disk = ec ? 0 : static_cast<curl_off_t>(size);
+
+    if (write_failed) {
+        std::cerr << "Failed to write " << part_path << std::endl;
+        return AttemptResult::failed;
+    }
+    if (range_mismatch) {
+        std::cerr << "Server did not continue " << final_path << " where it left off, restarting" << std::endl;
+        discard();
+        return AttemptResult::retry;
+    }
+
+    if (http_status == 416) {
+        // The previous attempt may have got every byte before it was cut off
+        if (expected_length >= 0 && on_disk == expected_length &&
+            (range_total < 0 || range_total == expected_length)) {
+            return commit() ? AttemptResult::complete : AttemptResult::failed;
+        }
+        discard();
+        return AttemptResult::retry;
+    }
+
+    if (code != CURLE_OK) {
+        if (http_status >= 400 && http_status < 500) {
+            std::cerr << "Download failed: HTTP " << http_status << std::endl;
+            discard();
+            return AttemptResult::failed;
+        }
+        std::cerr << "Download failed: " << curl_easy_strerror(code)
+                  << " (" << on_disk << " bytes kept for resuming)" << std::endl;
+        return AttemptResult::retry;
+    }
+
+    if (expected_length >= 0 && on_disk != expected_length) {
+        std::cerr << "Download of " << final_path << " ended at " << on_disk
+                  << " of " << expected_length << " bytes" << std::endl;
+        if (on_disk > expected_length) {
+            discard();
+        }
+        return AttemptResult::retry;
+    }
+
+    return commit() ? AttemptResult::complete : AttemptResult::failed;
+}
+
+void PartialDownload::close() {
+    if (file) {
+        if (fclose(file) != 0) {
+            write_failed = true;
+        }
+        file = nullptr;
+    }
+}
+
+void PartialDownload::load_meta() {
+    validator.clear();
+    expected_length = -1;
+
+    std::ifstream meta(meta_path);
+    std::string key;
+    std::string value;
+    while (meta >> key && std::getline(meta, value)) {
+        if (key == "validator") {
+            validator = std::string(trim_header(value));
+        } else if (key == "length") {
+            expected_length = parse_offset(trim_header(value));
+        }
+    }
+}
+
+void PartialDownload::save_meta() const {
+    std::ofstream meta(meta_path, std::ios::trunc);
+    if (!validator.empty()) {
+        meta << "validator " << validator << "\n";
+    }
+    if (expected_length >= 0) {
+        meta << "length " << expected_length << "\n";
+    }
+}
+
+void PartialDownload::reset_response() {
+    status = 0;
+    content_length = -1;
+    range_first = -1;
+    range_total = -1;
+    etag.clear();
+    last_modified.clear();
+}
+
+bool PartialDownload::start_body() {
+    if (status == 206) {
+        if (range_first != resume_from ||
+            (expected_length >= 0 && range_total >= 0 && range_total != expected_length)) {
+            range_mismatch = true;
+            return false;
+        }
+        if (range_total >= 0) {
+            expected_length = range_total;
+        }
+        return true;
+    }
+
+    // A full response: a fresh download, or the file changed and the server
+    // answered If-Range with all of it
+    if (resume_from > 0) {
+        fflush(file);
+        if (ftruncate(fileno(file), 0) != 0) {
+            write_failed = true;
+            return false;
+        }
+        resume_from = 0;
+    }
+
+    // Weak ETags can't be used with If-Range
+    bool strong_etag = !etag.empty() && etag.compare(0, 2, "W/") != 0;
+    validator = strong_etag ? etag : last_modified;
+    expected_length = content_length;
+    save_meta();
+    return true;
+}
+
+bool PartialDownload::commit() {
+    // Data reaches the disk before the name does, so a crash can't leave a
+    // truncated file under the final path
+    int fd = open(part_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+
+    // Same directory, so the rename is atomic
+    std::error_code ec;
+    std::filesystem::rename(part_path, final_path, ec);
+    if (ec) {
+        std::cerr << "Failed to move " << part_path << " into place: " << ec.message() << std::endl;
         return false;
     }
-    
+    std::filesystem::remove(meta_path, ec);
     return true;
 }
 
-size_t ImageDownloader::write_data(void* ptr, size_t size, size_t nmemb, FILE* stream) {
-    return fwrite(ptr, size, nmemb, stream);
+void PartialDownload::discard() {
+    close();
+    std::error_code ec;
+    std::filesystem::remove(part_path, ec);
+    std::filesystem::remove(meta_path, ec);
+    validator.clear();
+    expected_length = -1;
 }
 
-int ImageDownloader::progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+size_t PartialDownload::on_header(char* buffer, size_t size, size_t nitems, void* userdata) {
+    PartialDownload* self = static_cast<PartialDownload*>(userdata);
+    size_t length = size * nitems;
+    std::string_view line = trim_header(std::string_view(buffer, length));
+    std::string_view value;
+
+    if (line.compare(0, 5, "HTTP/") == 0) {
+        // Each response in a redirect chain starts over
+        self->reset_response();
+        size_t space = line.find(' ');
+        if (space != std::string_view::npos) {
+            self->status = std::atol(std::string(line.substr(space + 1, 3)).c_str());
+        }
+    } else if (header_value(line, "content-length", value)) {
+        self->content_length = parse_offset(value);
+    } else if (header_value(line, "content-range", value)) {
+        parse_content_range(value, self->range_first, self->range_total);
+    } else if (header_value(line, "etag", value)) {
+        self->etag = std::string(value);
+    } else if (header_value(line, "last-modified", value)) {
+        self->last_modified = std::string(value);
+    }
+    return length;
+}
+
+size_t PartialDownload::on_body(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    PartialDownload* self = static_cast<PartialDownload*>(userdata);
+    if (!self->body_started) {
+        self->body_started = true;
+        if (!self->start_body()) {
+            return 0;
+        }
+    }
+
+    size_t written = fwrite(ptr, size, nmemb, self->file);
+    if (written != nmemb) {
+        self->write_failed = true;
+    }
+    return written * size;
+}
+
+int progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
     if (dltotal > 0) {
         double progress = (dlnow * 100.0) / dltotal;
         std::cout << "\rDownload progress: " << std::fixed << std::setprecision(1) << progress << "%" << std::flush;
     }
     return 0;
 }
+
+void configure_download(CURL* handle, const std::string& url) {
+    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, "ElysiaDownloader/1.0");
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 30L);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, low_speed_time);
+    // Engine transfers run many at a time, where a progress line each would
+    // only interleave; download_image() turns it back on
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+}
+
+// The first attempt gets a new transfer id, retries run under the same one
+TransferEngine::TransferId start_attempt(TransferEngine& engine, TransferEngine::TransferId id, const std::string& url,
+                                         std::shared_ptr<PartialDownload> download,
+                                         ImageDownloader::DownloadCallback on_done, int attempt) {
+    CURL* handle = TransferContext::instance().acquire();
+    if (!download->begin_attempt(handle)) {
+        TransferContext::instance().release(handle);
+        throw std::runtime_error("Failed to open file for writing: " + download->staging_path());
+    }
+    configure_download(handle, url);
+
+    auto completion = [&engine, url, download, on_done, attempt](const TransferResult& result) {
+        switch (download->finish_attempt(result.code, result.http_status)) {
+        case AttemptResult::complete:
+            on_done(true);
+            return;
+        case AttemptResult::failed:
+            on_done(false);
+            return;
+        case AttemptResult::retry:
+            break;
+        }
+
+        if (attempt >= max_attempts) {
+            std::cerr << "Giving up on " << download->path() << " after " << attempt << " attempts" << std::endl;
+            on_done(false);
+            return;
+        }
+        try {
+            start_attempt(engine, result.id, url, download, on_done, attempt + 1);
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to retry download: " << e.what() << std::endl;
+            on_done(false);
+        }
+    };
+
+    if (id == 0) {
+        return engine.start(handle, std::move(completion));
+    }
+    engine.restart(id, handle, std::move(completion));
+    return id;
+}
+
+// Body collected in one g_malloc'd block, so it can become a GBytes
+// without another copy
+class MemoryDownload {
+public:
+    ~MemoryDownload() { g_free(data); }
+
+    void begin_attempt(CURL* handle) {
+        size = 0;
+        content_length = -1;
+        write_failed = false;
+        curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, on_header);
+        curl_easy_setopt(handle, CURLOPT_HEADERDATA, this);
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, on_body);
+        curl_easy_setopt(handle, CURLOPT_WRITEDATA, this);
+    }
+
+    // Hands the buffer over; the download can't be used afterwards
+    GBytes* take_bytes() {
+        GBytes* bytes = g_bytes_new_take(data, size);
+        data = nullptr;
+        size = capacity = 0;
+        return bytes;
+    }
+
+    bool out_of_memory() const { return write_failed; }
+
+private:
+    guint8* data = nullptr;
+    size_t size = 0;
+    size_t capacity = 0;
+    curl_off_t content_length = -1;
+    bool write_failed = false;
+
+    bool reserve(size_t wanted) {
+        if (wanted <= capacity) {
+            return true;
+        }
+        guint8* grown = static_cast<guint8*>(g_try_realloc(data, wanted));
+        if (!grown) {
+            return false;
+        }
+        data = grown;
+        capacity = wanted;
+        return true;
+    }
+
+    static size_t on_header(char* buffer, size_t size, size_t nitems, void* userdata) {
+        MemoryDownload* self = static_cast<MemoryDownload*>(userdata);
+        size_t length = size * nitems;
+        std::string_view line = trim_header(std::string_view(buffer, length));
+        std::string_view value;
+        if (line.compare(0, 5, "HTTP/") == 0) {
+            self->content_length = -1;
+        } else if (header_value(line, "content-length", value)) {
+            self->content_length = parse_offset(value);
+        }
+        return length;
+    }
+
+    static size_t on_body(char* ptr, size_t size, size_t nmemb, void* userdata) {
+        MemoryDownload* self = static_cast<MemoryDownload*>(userdata);
+        size_t length = size * nmemb;
+
+        // Sized once from Content-Length, capped so a bogus header can't
+        // ask for an absurd block up front
+        if (self->capacity == 0 && self->content_length > 0) {
+            self->reserve(static_cast<size_t>(std::min<curl_off_t>(self->content_length, max_presize)));
+        }
+        if (self->size + length > self->capacity &&
+            !self->reserve(std::max(self->size + length, self->capacity * 2))) {
+            self->write_failed = true;
+            return 0;
+        }
+
+        memcpy(self->data + self->size, ptr, length);
+        self->size += length;
+        return length;
+    }
+
+    static constexpr curl_off_t max_presize = 256 * 1024 * 1024;
+};
+
+TransferEngine::TransferId start_memory_attempt(TransferEngine& engine, TransferEngine::TransferId id,
+                                                const std::string& url, std::shared_ptr<MemoryDownload> download,
+                                                ImageDownloader::MemoryCallback on_done, int attempt) {
+    CURL* handle = TransferContext::instance().acquire();
+    download->begin_attempt(handle);
+    configure_download(handle, url);
+
+    auto completion = [&engine, url, download, on_done, attempt](const TransferResult& result) {
+        if (result.ok()) {
+            GBytes* bytes = download->take_bytes();
+            on_done(bytes, "");
+            g_bytes_unref(bytes);
+            return;
+        }
+
+        std::string error = download->out_of_memory() ? "Out of memory" : result.error;
+        bool permanent = download->out_of_memory() || (result.http_status >= 400 && result.http_status < 500);
+        if (permanent || attempt >= max_attempts) {
+            std::cerr << "Download failed: " << error << std::endl;
+            on_done(nullptr, error);
+            return;
+        }
+
+        std::cerr << "Download failed: " << error << ", retrying" << std::endl;
+        try {
+            start_memory_attempt(engine, result.id, url, download, on_done, attempt + 1);
+        } catch (const std::exception& e) {
+            on_done(nullptr, e.what());
+        }
+    };
+
+    if (id == 0) {
+        return engine.start(handle, std::move(completion));
+    }
+    engine.restart(id, handle, std::move(completion));
+    return id;
+}
+
+} // namespace
+
+ImageDownloader::ImageDownloader() {
+    curl = TransferContext::instance().acquire();
+}
+
+ImageDownloader::~ImageDownloader() {
+    TransferContext::instance().release(curl);
+}
+
+bool ImageDownloader::download_image(const std::string& url, const std::string& filepath) {
+    PartialDownload download(filepath);
+
+    for (int attempt = 1; attempt <= max_attempts; ++attempt) {
+        if (!download.begin_attempt(curl)) {
+            std::cerr << "Failed to open file for writing: " << download.staging_path() << std::endl;
+            return false;
+        }
+        configure_download(curl, url);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+
+        CURLcode res = curl_easy_perform(curl);
+        long http_status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+        TransferContext::instance().record_transfer(curl, res);
+
+        switch (download.finish_attempt(res, http_status)) {
+        case AttemptResult::complete:
+            return true;
+        case AttemptResult::failed:
+            return false;
+        case AttemptResult::retry:
+            break;
+        }
+    }
+
+    std::cerr << "Giving up on " << filepath << " after " << max_attempts << " attempts" << std::endl;
+    return false;
+}
+
+TransferEngine::TransferId ImageDownloader::download_image_async(TransferEngine& engine, const std::string& url,
+                                                                const std::string& filepath, DownloadCallback on_done) {
+    return start_attempt(engine, 0, url, std::make_shared<PartialDownload>(filepath), std::move(on_done), 1);
+}
+
+TransferEngine::TransferId ImageDownloader::download_to_memory_async(TransferEngine& engine, const std::string& url,
+                                                                    MemoryCallback on_done) {
+    return start_memory_attempt(engine, 0, url, std::make_shared<MemoryDownload>(), std::move(on_done), 1);
+}
+
+void ImageDownloader::discard_partial(const std::string& filepath) {
+    std::error_code ec;
+    std::filesystem::remove(filepath + ".part", ec);
+    std::filesystem::remove(filepath + ".part.meta", ec);
+}
@@ -1,18 +1,43 @@
 #pragma once
 
+#include <functional>
 #include <string>
 #include <curl/curl.h>
+#include <glib.h>
+#include "transfer_engine.h"
 
+// Downloads are staged in "<filepath>.part" next to a "<filepath>.part.meta"
+// sidecar holding the server's validator (ETag or Last-Modified) and the
+// expected length. An interrupted download resumes with a Range request
+// guarded by If-Range, both within one call and on the next call for the
+// same path, and the file only appears under `filepath` once its length
+// has been verified.
 class ImageDownloader {
 public:
+    using DownloadCallback = std::function<void(bool success)>;
+    // `bytes` is null on failure; it is only borrowed, so take a reference to keep it
+    using MemoryCallback = std::function<void(GBytes* bytes, const std::string& error)>;
+
     ImageDownloader();
     ~ImageDownloader();
-    
+
     bool download_image(const std::string& url, const std::string& filepath);
-    
+
+    // Non-blocking variant of download_image. Retries stay under the
+    // returned id. A failed or cancelled download leaves its .part file
+    // behind for the next attempt; callers using throwaway paths should
+    // call discard_partial().
+    static TransferEngine::TransferId download_image_async(TransferEngine& engine, const std::string& url,
+                                                           const std::string& filepath, DownloadCallback on_done);
+
+    // Downloads into memory instead of a file, for data that is used right
+    // away. Retries restart from the beginning under the same id.
+    static TransferEngine::TransferId download_to_memory_async(TransferEngine& engine, const std::string& url,
+                                                               MemoryCallback on_done);
+
+    // Removes the staging files of an unfinished download of `filepath`
+    static void discard_partial(const std::string& filepath);
+
 private:
     CURL* curl;
-    
-    static size_t write_data(void* ptr, size_t size, size_t nmemb, FILE* stream);
-    static int progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
 };
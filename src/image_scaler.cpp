@@ -0,0 +1,276 @@
+#include "image_scaler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Weights are fixed point with this many fractional bits; small enough
+// that two 8-bit samples times their weights fit _mm_madd_epi16
+constexpr int weight_bits = 14;
+constexpr int32_t weight_one = 1 << weight_bits;
+constexpr int32_t weight_rounding = 1 << (weight_bits - 1);
+
+// Which source pixels each destination pixel covers along one axis, and
+// how much of each
+struct Taps {
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<size_t> offset;
+    std::vector<int16_t> weights;
+};
+
+Taps compute_taps(int src_size, int dst_size) {
+    Taps taps;
+    taps.first.resize(dst_size);
+    taps.count.resize(dst_size);
+    taps.offset.resize(dst_size);
+
+    double scale = static_cast<double>(src_size) / dst_size;
+    for (int i = 0; i < dst_size; ++i) {
+        double start = i * scale;
+        double end = std::min((i + 1) * scale, static_cast<double>(src_size));
+        int first = static_cast<int>(start);
+        int last = std::min(static_cast<int>(std::ceil(end)), src_size);
+
+        taps.first[i] = first;
+        taps.count[i] = last - first;
+        taps.offset[i] = taps.weights.size();
+
+        // Rounding can leave the weights a little off; the largest one
+        // absorbs the difference so every pixel's weights sum to exactly one
+        int32_t total = 0;
+        size_t largest = taps.offset[i];
+        for (int j = first; j < last; ++j) {
+            double cover = std::min(end, j + 1.0) - std::max(start, static_cast<double>(j));
+            auto weight = static_cast<int16_t>(std::lround(cover / scale * weight_one));
+            taps.weights.push_back(weight);
+            total += weight;
+            if (weight > taps.weights[largest]) {
+                largest = taps.weights.size() - 1;
+            }
+        }
+        taps.weights[largest] = static_cast<int16_t>(taps.weights[largest] + weight_one - total);
+    }
+    return taps;
+}
+
+// Blends `count` rows (always even) into `out`, byte by byte
+using BlendRows = void (*)(const uint8_t* const* rows, const int16_t* weights, int count,
+                           uint8_t* out, size_t length);
+// Shrinks one row of pixels horizontally
+using ShrinkRow = void (*)(const uint8_t* src, const Taps& columns, uint8_t* out);
+
+void blend_rows_from(const uint8_t* const* rows, const int16_t* weights, int count,
+                     uint8_t* out, size_t start, size_t length) {
+    for (size_t x = start; x < length; ++x) {
+        int32_t sum = weight_rounding;
+        for (int k = 0; k < count; ++k) {
+            sum += rows[k][x] * weights[k];
+        }
+        out[x] = static_cast<uint8_t>(std::min(sum >> weight_bits, 255));
+    }
+}
+
+void blend_rows_scalar(const uint8_t* const* rows, const int16_t* weights, int count, uint8_t* out, size_t length) {
+    blend_rows_from(rows, weights, count, out, 0, length);
+}
+
+void shrink_row_scalar(const uint8_t* src, const Taps& columns, uint8_t* out) {
+    for (size_t i = 0; i < columns.first.size(); ++i) {
+        const uint8_t* pixel = src + static_cast<size_t>(columns.first[i]) * 4;
+        const int16_t* weights = columns.weights.data() + columns.offset[i];
+        int32_t sums[4] = {weight_rounding, weight_rounding, weight_rounding, weight_rounding};
+        for (int k = 0; k < columns.count[i]; ++k, pixel += 4) {
+            for (int c = 0; c < 4; ++c) {
+                sums[c] += pixel[c] * weights[k];
+            }
+        }
+        for (int c = 0; c < 4; ++c) {
+            out[i * 4 + c] = static_cast<uint8_t>(std::min(sums[c] >> weight_bits, 255));
+        }
+    }
+}
+
+#if defined(__SSE2__)
+
+// Two 16-bit weights per 32-bit lane, matching the (a, b) sample pairs
+// _mm_madd_epi16 multiplies
+inline int32_t weight_pair(int16_t a, int16_t b) {
+    return static_cast<int32_t>(static_cast<uint16_t>(a)) | (static_cast<int32_t>(b) << 16);
+}
+
+// Interleaves two rows 16 bytes at a time so one multiply-add handles both
+void blend_rows_sse2_from(const uint8_t* const* rows, const int16_t* weights, int count,
+                          uint8_t* out, size_t x, size_t length) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi32(weight_rounding);
+    for (; x + 16 <= length; x += 16) {
+        __m128i acc0 = rounding, acc1 = rounding, acc2 = rounding, acc3 = rounding;
+        for (int k = 0; k < count; k += 2) {
+            __m128i w = _mm_set1_epi32(weight_pair(weights[k], weights[k + 1]));
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + x));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k + 1] + x));
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+        }
+        __m128i low = _mm_packs_epi32(_mm_srai_epi32(acc0, weight_bits), _mm_srai_epi32(acc1, weight_bits));
+        __m128i high = _mm_packs_epi32(_mm_srai_epi32(acc2, weight_bits), _mm_srai_epi32(acc3, weight_bits));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(low, high));
+    }
+    blend_rows_from(rows, weights, count, out, x, length);
+}
+
+void blend_rows_sse2(const uint8_t* const* rows, const int16_t* weights, int count, uint8_t* out, size_t length) {
+    blend_rows_sse2_from(rows, weights, count, out, 0, length);
+}
+
+// Handles a pixel's four channels in one register, two source pixels per
+// multiply-add
+void shrink_row_sse2(const uint8_t* src, const Taps& columns, uint8_t* out) {
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t i = 0; i < columns.first.size(); ++i) {
+        const uint8_t* pixel = src + static_cast<size_t>(columns.first[i]) * 4;
+        const int16_t* weights = columns.weights.data() + columns.offset[i];
+        int count = columns.count[i];
+
+        __m128i acc = _mm_set1_epi32(weight_rounding);
+        int k = 0;
+        for (; k + 1 < count; k += 2, pixel += 8) {
+            __m128i wide = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixel)), zero);
+            // r0 r1 g0 g1 b0 b1 a0 a1
+            __m128i pairs = _mm_unpacklo_epi16(wide, _mm_srli_si128(wide, 8));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(pairs, _mm_set1_epi32(weight_pair(weights[k], weights[k + 1]))));
+        }
+        if (k < count) {
+            int32_t value;
+            std::memcpy(&value, pixel, 4);
+            __m128i wide = _mm_unpacklo_epi8(_mm_cvtsi32_si128(value), zero);
+            __m128i pairs = _mm_unpacklo_epi16(wide, zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(pairs, _mm_set1_epi32(weight_pair(weights[k], 0))));
+        }
+
+        __m128i packed = _mm_srai_epi32(acc, weight_bits);
+        packed = _mm_packus_epi16(_mm_packs_epi32(packed, packed), zero);
+        int32_t result = _mm_cvtsi128_si32(packed);
+        std::memcpy(out + i * 4, &result, 4);
+    }
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ELYSIA_HAVE_AVX2_PATH 1
+
+// The SSE2 row blend at twice the width. Unpacking and packing both work
+// within 128-bit lanes, so the bytes come out in their original order.
+__attribute__((target("avx2")))
+void blend_rows_avx2(const uint8_t* const* rows, const int16_t* weights, int count, uint8_t* out, size_t length) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i rounding = _mm256_set1_epi32(weight_rounding);
+    size_t x = 0;
+    for (; x + 32 <= length; x += 32) {
+        __m256i acc0 = rounding, acc1 = rounding, acc2 = rounding, acc3 = rounding;
+        for (int k = 0; k < count; k += 2) {
+            __m256i w = _mm256_set1_epi32(weight_pair(weights[k], weights[k + 1]));
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k] + x));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k + 1] + x));
+            __m256i lo = _mm256_unpacklo_epi8(a, b);
+            __m256i hi = _mm256_unpackhi_epi8(a, b);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+        }
+        __m256i low = _mm256_packs_epi32(_mm256_srai_epi32(acc0, weight_bits), _mm256_srai_epi32(acc1, weight_bits));
+        __m256i high = _mm256_packs_epi32(_mm256_srai_epi32(acc2, weight_bits), _mm256_srai_epi32(acc3, weight_bits));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm256_packus_epi16(low, high));
+    }
+    blend_rows_sse2_from(rows, weights, count, out, x, length);
+}
+
+bool cpu_has_avx2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+#endif
+
+#endif
+
+void downscale_with(BlendRows blend, ShrinkRow shrink,
+                    const uint8_t* src, int src_width, int src_height, size_t src_stride,
+                    uint8_t* dst, int dst_width, int dst_height, size_t dst_stride) {
+    if (src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0) {
+        return;
+    }
+    dst_width = std::min(dst_width, src_width);
+    dst_height = std::min(dst_height, src_height);
+
+    // Rows are blended first, over the full source width, since that pass
+    // touches the most data and vectorizes best; the much smaller result is
+    // then shrunk horizontally
+    Taps columns = compute_taps(src_width, dst_width);
+    Taps rows = compute_taps(src_height, dst_height);
+    std::vector<uint8_t> line(static_cast<size_t>(src_width) * 4);
+    std::vector<const uint8_t*> row_pointers;
+    std::vector<int16_t> row_weights;
+
+    for (int y = 0; y < dst_height; ++y) {
+        row_pointers.clear();
+        row_weights.clear();
+        for (int k = 0; k < rows.count[y]; ++k) {
+            row_pointers.push_back(src + static_cast<size_t>(rows.first[y] + k) * src_stride);
+            row_weights.push_back(rows.weights[rows.offset[y] + k]);
+        }
+        // The kernels take rows in pairs
+        if (row_pointers.size() % 2 != 0) {
+            row_pointers.push_back(row_pointers.back());
+            row_weights.push_back(0);
+        }
+
+        blend(row_pointers.data(), row_weights.data(), static_cast<int>(row_pointers.size()), line.data(), line.size());
+        shrink(line.data(), columns, dst + static_cast<size_t>(y) * dst_stride);
+    }
+}
+
+} // namespace
+
+void fit_within(int width, int height, int max_width, int max_height, int& out_width, int& out_height) {
+    double scale = 1.0;
+    if (max_width > 0 && width > max_width) {
+        scale = std::min(scale, static_cast<double>(max_width) / width);
+    }
+    if (max_height > 0 && height > max_height) {
+        scale = std::min(scale, static_cast<double>(max_height) / height);
+    }
+    out_width = std::clamp(static_cast<int>(std::lround(width * scale)), 1, std::max(width, 1));
+    out_height = std::clamp(static_cast<int>(std::lround(height * scale)), 1, std::max(height, 1));
+}
+
+void downscale_area(const uint8_t* src, int src_width, int src_height, size_t src_stride,
+                    uint8_t* dst, int dst_width, int dst_height, size_t dst_stride) {
+#if defined(__SSE2__)
+    BlendRows blend = blend_rows_sse2;
+#if defined(ELYSIA_HAVE_AVX2_PATH)
+    if (cpu_has_avx2()) {
+        blend = blend_rows_avx2;
+    }
+#endif
+    downscale_with(blend, shrink_row_sse2, src, src_width, src_height, src_stride,
+                   dst, dst_width, dst_height, dst_stride);
+#else
+    downscale_area_scalar(src, src_width, src_height, src_stride, dst, dst_width, dst_height, dst_stride);
+#endif
+}
+
+void downscale_area_scalar(const uint8_t* src, int src_width, int src_height, size_t src_stride,
+                           uint8_t* dst, int dst_width, int dst_height, size_t dst_stride) {
+    downscale_with(blend_rows_scalar, shrink_row_scalar, src, src_width, src_height, src_stride,
+                   dst, dst_width, dst_height, dst_stride);
+}
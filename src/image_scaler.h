@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Largest size that fits `width`x`height` inside `max_width`x`max_height`
+// with the same aspect ratio. Never scales up; a bound of 0 means
+// unbounded in that direction.
+void fit_within(int width, int height, int max_width, int max_height, int& out_width, int& out_height);
+
+// Shrinks an image of 4-byte pixels with an area filter: every destination
+// pixel is the average of the source pixels it covers, weighted by how
+// much of each it covers. Channels are treated alike, so premultiplied
+// alpha stays correct. The destination must not be larger than the source
+// in either direction.
+//
+// Uses AVX2 or SSE2 where available, with a scalar fallback elsewhere.
+void downscale_area(const uint8_t* src, int src_width, int src_height, size_t src_stride,
+                    uint8_t* dst, int dst_width, int dst_height, size_t dst_stride);
+
+// Same, without SIMD; the reference the vector paths must match
+void downscale_area_scalar(const uint8_t* src, int src_width, int src_height, size_t src_stride,
+                           uint8_t* dst, int dst_width, int dst_height, size_t dst_stride);
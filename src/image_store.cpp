@@ -0,0 +1,741 @@
+#include "image_store.h"
+#include "context_call.h"
+#include "image_downloader.h"
+#include <glib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+constexpr const char* index_header = "elysia-image-cache 1";
+
+// Index writes are batched; losing the last moments of LRU order in a
+// crash costs nothing but a slightly worse eviction choice
+constexpr guint index_save_delay_seconds = 2;
+
+// Partial downloads nobody came back to within this long are removed
+constexpr auto stale_partial_age = std::chrono::hours(24);
+
+bool ends_with(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool is_md5(const std::string& text) {
+    if (text.size() != 32) {
+        return false;
+    }
+    for (char c : text) {
+        if (!std::isxdigit(static_cast<unsigned char>(c))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Keeps only characters that are safe in a file name
+std::string sanitize(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (std::isalnum(static_cast<unsigned char>(c))) {
+            out += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+    }
+    return out;
+}
+
+std::string store_key(const DanbooruImage& post) {
+    if (is_md5(post.md5)) {
+        return sanitize(post.md5);
+    }
+    // Posts whose md5 is withheld can still be stored, just not shared
+    // between posts with identical files
+    return "post" + sanitize(post.id);
+}
+
+std::string store_extension(const DanbooruImage& post) {
+    std::string ext = sanitize(post.file_ext);
+    if (ext.empty()) {
+        size_t dot = post.filename.find_last_of('.');
+        if (dot != std::string::npos) {
+            ext = sanitize(post.filename.substr(dot + 1));
+        }
+    }
+    return ext.empty() ? "bin" : ext;
+}
+
+// Extension of the last path segment of `url`, ignoring any query
+std::string url_extension(const std::string& url) {
+    std::string path = url.substr(0, url.find_first_of("?#"));
+    size_t slash = path.find_last_of('/');
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return "";
+    }
+    return sanitize(path.substr(dot + 1));
+}
+
+const char* variant_suffix(ImageVariant variant) {
+    switch (variant) {
+    case ImageVariant::preview:
+        return "-preview";
+    case ImageVariant::sample:
+        return "-sample";
+    case ImageVariant::original:
+        break;
+    }
+    return "";
+}
+
+std::string errno_message(const std::string& what) {
+    return what + ": " + std::strerror(errno);
+}
+
+// Shares the source's extents copy-on-write (btrfs, XFS, bcachefs)
+bool reflink(const std::string& source, const std::string& target) {
+#ifdef FICLONE
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+    int out = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool cloned = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    if (out >= 0) {
+        close(out);
+    }
+    close(in);
+    if (!cloned) {
+        unlink(target.c_str());
+    }
+    return cloned;
+#else
+    return false;
+#endif
+}
+
+// copy_file_range keeps the data in the kernel; filesystems that can't do
+// it across devices fall back to a plain read/write loop
+bool copy_bytes(const std::string& source, const std::string& target, std::string& error) {
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        error = errno_message("Failed to open " + source);
+        return false;
+    }
+    int out = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        error = errno_message("Failed to open " + target);
+        close(in);
+        return false;
+    }
+
+    struct stat info;
+    bool ok = fstat(in, &info) == 0;
+    off_t remaining = ok ? info.st_size : 0;
+    bool in_kernel = true;
+
+    while (ok && remaining > 0) {
+        ssize_t copied = -1;
+#ifdef __linux__
+        if (in_kernel) {
+            copied = copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(remaining), 0);
+            if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                in_kernel = false;
+                continue;
+            }
+        } else
+#endif
+        {
+            char buffer[64 * 1024];
+            ssize_t got = read(in, buffer, sizeof(buffer));
+            copied = got > 0 ? write(out, buffer, static_cast<size_t>(got)) : got;
+            if (got > 0 && copied != got) {
+                copied = -1;
+            }
+        }
+        if (copied <= 0) {
+            error = errno_message("Failed to copy " + source);
+            ok = false;
+            break;
+        }
+        remaining -= copied;
+    }
+
+    if (close(out) != 0 && ok) {
+        error = errno_message("Failed to write " + target);
+        ok = false;
+    }
+    close(in);
+    return ok;
+}
+
+// Writes to "<path>.part", syncs and renames, so the store never holds a
+// truncated file under its final name
+bool write_file(const std::string& path, GBytes* bytes, std::string& error) {
+    std::string part_path = path + ".part";
+    int fd = open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = errno_message("Failed to open " + part_path);
+        return false;
+    }
+
+    gsize size = 0;
+    const char* data = static_cast<const char*>(g_bytes_get_data(bytes, &size));
+    bool ok = true;
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            ok = false;
+            break;
+        }
+        data += written;
+        size -= static_cast<gsize>(written);
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+
+    if (!ok || rename(part_path.c_str(), path.c_str()) != 0) {
+        error = errno_message("Failed to write " + path);
+        unlink(part_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+ImageStore::Write::~Write() {
+    g_bytes_unref(bytes);
+}
+
+ImageStore::ImageStore(TransferEngine& engine, std::string root, uintmax_t max_bytes)
+    : engine(engine), root(std::move(root)), max_bytes(max_bytes), next_fetch_id(1),
+      stored_bytes(0), use_counter(1), save_source(0), context(g_main_context_ref_thread_default()),
+      alive(std::make_shared<bool>(true)) {
+    // One thread: the writes are mostly waiting for fsync, which several
+    // at once wouldn't make any faster
+    writer = g_thread_pool_new(run_write, nullptr, 1, TRUE, nullptr);
+    load_index();
+    adopt_untracked_files();
+    evict("");
+}
+
+ImageStore::~ImageStore() {
+    for (auto& entry : pending) {
+        engine.cancel(entry.second.transfer);
+    }
+    // Lets the queued writes finish, so nothing downloaded is lost; they
+    // are picked up by adopt_untracked_files() on the next run
+    *alive = false;
+    g_thread_pool_free(writer, FALSE, TRUE);
+    for (auto& entry : writing) {
+        g_bytes_unref(entry.second);
+    }
+    if (save_source) {
+        flush_index();
+    }
+    g_main_context_unref(context);
+}
+
+std::string ImageStore::default_root() {
+    char* path = g_build_filename(g_get_user_cache_dir(), "elysia", "images", NULL);
+    std::string result = path;
+    g_free(path);
+    return result;
+}
+
+std::string ImageStore::relative_path(const DanbooruImage& post, ImageVariant variant) const {
+    std::string key = store_key(post);
+    const std::string& url = image_url(post, variant);
+    std::string ext = store_extension(post);
+    // Small posts have no separate sample; their "sample" is the original
+    // and shares its file
+    if (variant != ImageVariant::original && url != post.file_url) {
+        key += variant_suffix(variant);
+        std::string url_ext = url_extension(url);
+        if (!url_ext.empty()) {
+            ext = url_ext;
+        }
+    }
+    return key.substr(0, 2) + "/" + key + "." + ext;
+}
+
+std::string ImageStore::path_for(const DanbooruImage& post, ImageVariant variant) const {
+    return root + "/" + relative_path(post, variant);
+}
+
+bool ImageStore::contains(const DanbooruImage& post, ImageVariant variant) const {
+    std::error_code ec;
+    return std::filesystem::is_regular_file(path_for(post, variant), ec);
+}
+
+ImageStore::FetchId ImageStore::fetch(const DanbooruImage& post, ImageVariant variant, FetchCallback on_done) {
+    std::string relative = relative_path(post, variant);
+    std::string path = root + "/" + relative;
+    auto written = writing.find(path);
+    if (written != writing.end()) {
+        // Downloaded, and not on disk yet
+        StoredImage image;
+        image.bytes = written->second;
+        ++counters.hits;
+        counters.hit_bytes += g_bytes_get_size(written->second);
+        log_lookup("hit", relative);
+        on_done(image, "");
+        return 0;
+    }
+    if (lookup(relative)) {
+        // Mapped rather than read, so the decoder works on the page cache
+        GError* error = nullptr;
+        GMappedFile* mapped = g_mapped_file_new(path.c_str(), FALSE, &error);
+        if (mapped) {
+            StoredImage image;
+            image.path = path;
+            image.bytes = g_mapped_file_get_bytes(mapped);
+            g_mapped_file_unref(mapped);
+
+            ++counters.hits;
+            counters.hit_bytes += entries[relative].size;
+            log_lookup("hit", relative);
+            on_done(image, "");
+            g_bytes_unref(image.bytes);
+            return 0;
+        }
+        std::cerr << "Failed to map " << path << ": " << error->message << std::endl;
+        g_error_free(error);
+    }
+    ++counters.misses;
+    log_lookup("miss", relative);
+
+    FetchId id = next_fetch_id++;
+    auto it = pending.find(path);
+    if (it != pending.end()) {
+        it->second.waiters.emplace_back(id, std::move(on_done));
+        fetch_paths[id] = path;
+        return id;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    if (ec) {
+        throw std::runtime_error("Failed to create " + root + ": " + ec.message());
+    }
+
+    // A dropped original resumes from its .part file, also on the next
+    // fetch; the small variants are simply downloaded again
+    TransferEngine::TransferId transfer;
+    if (variant == ImageVariant::original) {
+        transfer = ImageDownloader::download_image_async(engine, image_url(post, variant), path,
+            [this, path](bool success) {
+                finish_file(path, success);
+            });
+    } else {
+        transfer = ImageDownloader::download_to_memory_async(engine, image_url(post, variant),
+            [this, path](GBytes* bytes, const std::string& error) {
+                finish(path, bytes, error);
+            });
+    }
+
+    PendingFetch& fetch = pending[path];
+    fetch.transfer = transfer;
+    fetch.waiters.emplace_back(id, std::move(on_done));
+    fetch_paths[id] = path;
+    return id;
+}
+
+void ImageStore::cancel(FetchId id) {
+    auto path_it = fetch_paths.find(id);
+    if (path_it == fetch_paths.end()) {
+        return;
+    }
+    auto it = pending.find(path_it->second);
+    fetch_paths.erase(path_it);
+    if (it == pending.end()) {
+        return;
+    }
+
+    auto& waiters = it->second.waiters;
+    for (auto waiter = waiters.begin(); waiter != waiters.end(); ++waiter) {
+        if (waiter->first == id) {
+            waiters.erase(waiter);
+            break;
+        }
+    }
+    if (waiters.empty()) {
+        engine.cancel(it->second.transfer);
+        pending.erase(it);
+    }
+}
+
+bool ImageStore::export_to(const DanbooruImage& post, const std::string& destination, std::string& error) {
+    std::string source = path_for(post, ImageVariant::original);
+    auto written = writing.find(source);
+    if (written != writing.end()) {
+        // Downloaded as a small post's sample and not on disk yet
+        if (!write_file(destination, written->second, error)) {
+            return false;
+        }
+        std::cout << "Saved " << destination << " from the image store (written)" << std::endl;
+        return true;
+    }
+    if (!lookup(relative_path(post, ImageVariant::original))) {
+        error = "Image is not in the local store";
+        return false;
+    }
+
+    // Built next to the destination and renamed over it, so an existing
+    // file is either fully replaced or left alone
+    std::string temp = destination + ".tmp";
+    unlink(temp.c_str());
+
+    const char* method = nullptr;
+    if (reflink(source, temp)) {
+        method = "reflink";
+    } else if (link(source.c_str(), temp.c_str()) == 0) {
+        method = "hard link";
+    } else if (copy_bytes(source, temp, error)) {
+        method = "copy";
+    } else {
+        unlink(temp.c_str());
+        return false;
+    }
+
+    if (rename(temp.c_str(), destination.c_str()) != 0) {
+        error = errno_message("Failed to move " + temp + " into place");
+        unlink(temp.c_str());
+        return false;
+    }
+    // rename() is a no-op when both names already link to the same file
+    unlink(temp.c_str());
+
+    std::cout << "Saved " << destination << " from the image store (" << method << ")" << std::endl;
+    return true;
+}
+
+ImageCacheStats ImageStore::stats() const {
+    ImageCacheStats result = counters;
+    result.entries = entries.size();
+    result.stored_bytes = stored_bytes;
+    return result;
+}
+
+void ImageStore::flush_index() {
+    if (save_source) {
+        g_source_remove(save_source);
+        save_source = 0;
+    }
+    save_index();
+}
+
+bool ImageStore::lookup(const std::string& relative) {
+    std::error_code ec;
+    bool on_disk = std::filesystem::is_regular_file(root + "/" + relative, ec);
+    auto it = entries.find(relative);
+
+    if (it == entries.end()) {
+        // Written by another instance sharing the cache directory
+        if (on_disk) {
+            insert(relative);
+        }
+        return on_disk;
+    }
+    if (!on_disk) {
+        // Deleted behind our back
+        erase_entry(it);
+        schedule_save();
+        return false;
+    }
+
+    it->second.last_used = use_counter++;
+    schedule_save();
+    return true;
+}
+
+void ImageStore::insert(const std::string& relative) {
+    std::error_code ec;
+    uintmax_t size = std::filesystem::file_size(root + "/" + relative, ec);
+    if (ec) {
+        return;
+    }
+
+    auto it = entries.find(relative);
+    if (it != entries.end()) {
+        erase_entry(it);
+    }
+    entries[relative] = Entry{size, use_counter++};
+    stored_bytes += size;
+    schedule_save();
+}
+
+void ImageStore::evict(const std::string& keep) {
+    if (max_bytes == 0) {
+        return;
+    }
+
+    while (stored_bytes > max_bytes) {
+        // A linear scan is fine: there are at most a few thousand entries
+        // and this only runs after a download
+        auto victim = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->first != keep && (victim == entries.end() || it->second.last_used < victim->second.last_used)) {
+                victim = it;
+            }
+        }
+        if (victim == entries.end()) {
+            break;
+        }
+
+        std::error_code ec;
+        std::filesystem::remove(root + "/" + victim->first, ec);
+        ++counters.evictions;
+        erase_entry(victim);
+        schedule_save();
+    }
+}
+
+void ImageStore::erase_entry(std::map<std::string, Entry>::iterator it) {
+    stored_bytes -= it->second.size;
+    entries.erase(it);
+}
+
+void ImageStore::finish(const std::string& path, GBytes* bytes, const std::string& error) {
+    if (!pending.count(path)) {
+        return;
+    }
+
+    StoredImage image;
+    image.bytes = bytes;
+    if (bytes) {
+        // The waiters get the downloaded buffer itself; the file is only
+        // written, never read back
+        counters.downloaded_bytes += g_bytes_get_size(bytes);
+        writing[path] = g_bytes_ref(bytes);
+        Write* write = new Write{this, alive, path, g_bytes_ref(bytes), ""};
+        g_thread_pool_push(writer, write, nullptr);
+    }
+    notify(path, image, error);
+}
+
+void ImageStore::finish_file(const std::string& path, bool success) {
+    if (!pending.count(path)) {
+        return;
+    }
+
+    StoredImage image;
+    std::string error;
+    if (success) {
+        std::string relative = path.substr(root.size() + 1);
+        insert(relative);
+        auto it = entries.find(relative);
+        if (it != entries.end()) {
+            counters.downloaded_bytes += it->second.size;
+        }
+        evict(relative);
+
+        GError* map_error = nullptr;
+        GMappedFile* mapped = g_mapped_file_new(path.c_str(), FALSE, &map_error);
+        if (mapped) {
+            image.path = path;
+            image.bytes = g_mapped_file_get_bytes(mapped);
+            g_mapped_file_unref(mapped);
+        } else {
+            error = "Failed to map " + path + ": " + map_error->message;
+            g_error_free(map_error);
+        }
+    } else {
+        error = "Download failed";
+    }
+    notify(path, image, error);
+    if (image.bytes) {
+        g_bytes_unref(image.bytes);
+    }
+}
+
+void ImageStore::notify(const std::string& path, const StoredImage& image, const std::string& error) {
+    auto node = pending.extract(path);
+    if (node.empty()) {
+        return;
+    }
+    // Callbacks may start or cancel other fetches
+    for (auto& waiter : node.mapped().waiters) {
+        fetch_paths.erase(waiter.first);
+    }
+    for (auto& waiter : node.mapped().waiters) {
+        waiter.second(image, error);
+    }
+}
+
+void ImageStore::finish_write(Write& write) {
+    auto it = writing.find(write.path);
+    if (it != writing.end()) {
+        g_bytes_unref(it->second);
+        writing.erase(it);
+    }
+    if (!write.error.empty()) {
+        std::cerr << "Failed to store image: " << write.error << std::endl;
+        return;
+    }
+    std::string relative = write.path.substr(root.size() + 1);
+    insert(relative);
+    evict(relative);
+}
+
+void ImageStore::run_write(gpointer data, gpointer user_data) {
+    Write* write = static_cast<Write*>(data);
+    write_file(write->path, write->bytes, write->error);
+    call_on_context(write->store->context, deliver_write, write);
+}
+
+gboolean ImageStore::deliver_write(gpointer data) {
+    std::unique_ptr<Write> write(static_cast<Write*>(data));
+    if (*write->alive) {
+        write->store->finish_write(*write);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+void ImageStore::log_lookup(const char* outcome, const std::string& relative) const {
+    std::ostringstream message;
+    message << "Image cache " << outcome << " for " << relative
+            << " (hit rate " << std::fixed << std::setprecision(1) << counters.hit_rate() * 100.0
+            << "% over " << counters.hits + counters.misses << " lookups, "
+            << stored_bytes / (1024 * 1024) << " MiB in " << entries.size() << " files)";
+    std::cout << message.str() << std::endl;
+}
+
+void ImageStore::load_index() {
+    std::ifstream index(root + "/index");
+    std::string line;
+    // A missing index, or one from another version, is rebuilt from the
+    // files on disk by adopt_untracked_files()
+    if (!std::getline(index, line) || line != index_header) {
+        return;
+    }
+
+    while (std::getline(index, line)) {
+        std::istringstream fields(line);
+        guint64 last_used = 0;
+        uintmax_t size = 0;
+        std::string relative;
+        if (!(fields >> last_used >> size) || !std::getline(fields >> std::ws, relative) || relative.empty()) {
+            continue;
+        }
+
+        std::string path = root + "/" + relative;
+        std::error_code ec;
+        uintmax_t actual = std::filesystem::file_size(path, ec);
+        if (ec) {
+            continue;
+        }
+        if (actual != size) {
+            // Not the file that was recorded; don't trust it
+            std::filesystem::remove(path, ec);
+            continue;
+        }
+
+        entries[relative] = Entry{size, last_used};
+        stored_bytes += size;
+        use_counter = std::max(use_counter, last_used + 1);
+    }
+}
+
+void ImageStore::adopt_untracked_files() {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    auto now = fs::file_time_type::clock::now();
+
+    for (auto it = fs::recursive_directory_iterator(root, ec); !ec && it != fs::recursive_directory_iterator();
+         it.increment(ec)) {
+        if (it.depth() == 0 || !it->is_regular_file(ec)) {
+            continue;
+        }
+
+        std::string name = it->path().filename().string();
+        if (ends_with(name, ".part") || ends_with(name, ".part.meta")) {
+            std::error_code time_ec;
+            auto modified = it->last_write_time(time_ec);
+            if (!time_ec && now - modified > stale_partial_age) {
+                fs::remove(it->path(), time_ec);
+            }
+            continue;
+        }
+
+        // Finished downloads whose index update was lost, e.g. in a crash.
+        // They are complete (see ImageDownloader) and go to the back of
+        // the LRU order.
+        std::string relative = it->path().lexically_relative(root).string();
+        if (entries.count(relative)) {
+            continue;
+        }
+        std::error_code size_ec;
+        uintmax_t size = it->file_size(size_ec);
+        if (size_ec) {
+            continue;
+        }
+        entries[relative] = Entry{size, 0};
+        stored_bytes += size;
+        schedule_save();
+    }
+}
+
+bool ImageStore::save_index() {
+    std::error_code ec;
+    std::filesystem::create_directories(root, ec);
+
+    std::ostringstream contents;
+    contents << index_header << "\n";
+    for (auto& entry : entries) {
+        contents << entry.second.last_used << " " << entry.second.size << " " << entry.first << "\n";
+    }
+    std::string data = contents.str();
+
+    // Synced and renamed over the old index, so a crash leaves one or the other
+    std::string index_path = root + "/index";
+    std::string temp_path = index_path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "w");
+    if (!file) {
+        std::cerr << "Failed to write " << temp_path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fflush(file) == 0 && ok;
+    ok = fsync(fileno(file)) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path.c_str(), index_path.c_str()) != 0) {
+        std::cerr << "Failed to write " << index_path << ": " << std::strerror(errno) << std::endl;
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void ImageStore::schedule_save() {
+    if (!save_source) {
+        save_source = g_timeout_add_seconds(index_save_delay_seconds, on_save_timeout, this);
+    }
+}
+
+gboolean ImageStore::on_save_timeout(gpointer user_data) {
+    ImageStore* self = static_cast<ImageStore*>(user_data);
+    self->save_source = 0;
+    self->save_index();
+    return G_SOURCE_REMOVE;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "danbooru_client.h"
+#include "transfer_engine.h"
+
+struct ImageCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    // Bytes served from disk, and bytes that had to be downloaded
+    uintmax_t hit_bytes = 0;
+    uintmax_t downloaded_bytes = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    uintmax_t stored_bytes = 0;
+
+    double hit_rate() const { return hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses); }
+};
+
+// Content-addressed store for downloaded images. Each post lives at
+// "<root>/<xx>/<md5>.<ext>", with its smaller variants next to it as
+// "<md5>-sample.<ext>" and "<md5>-preview.<ext>", so displaying and saving
+// a post share one copy of its bytes. Files only appear once complete and
+// are never modified in place, which is what makes handing out hard links
+// safe. Previews and samples are downloaded into memory and handed to
+// callers directly, then written by a thread of the store's own so the
+// fsync never holds up the main loop. Originals are large and only fetched
+// to be saved, so they are staged in a .part file that an interrupted
+// download resumes from. Hits and originals are mapped instead of read.
+//
+// The store persists across runs as a cache: "<root>/index" records the
+// size and last use of every file, and the least recently used files are
+// removed once the total exceeds `max_bytes`.
+class ImageStore {
+public:
+    using FetchId = guint64;
+
+    struct StoredImage {
+        // Empty if the image isn't in the store yet: freshly downloaded
+        // bytes are written after the callbacks have run, or not at all if
+        // that fails
+        std::string path;
+        // The image's bytes, mapped from the stored file or straight from
+        // the download buffer. Borrowed; take a reference to keep them.
+        GBytes* bytes = nullptr;
+    };
+    // `error` is empty on success
+    using FetchCallback = std::function<void(const StoredImage& image, const std::string& error)>;
+
+    // `max_bytes` of 0 means unbounded
+    ImageStore(TransferEngine& engine, std::string root, uintmax_t max_bytes = 0);
+    ~ImageStore();
+
+    ImageStore(const ImageStore&) = delete;
+    ImageStore& operator=(const ImageStore&) = delete;
+
+    // $XDG_CACHE_HOME/elysia/images
+    static std::string default_root();
+
+    std::string path_for(const DanbooruImage& post, ImageVariant variant = ImageVariant::original) const;
+    bool contains(const DanbooruImage& post, ImageVariant variant = ImageVariant::original) const;
+
+    // Calls `on_done` with the stored image, downloading it first if needed.
+    // Runs immediately and returns 0 if the post is already stored;
+    // concurrent fetches of one post share a single transfer.
+    FetchId fetch(const DanbooruImage& post, ImageVariant variant, FetchCallback on_done);
+
+    // Drops a waiting fetch; its callback is never called. The transfer is
+    // stopped once nobody waits for it.
+    void cancel(FetchId id);
+
+    // Gives `destination` the stored original of `post` without any network
+    // traffic, preferring a reflink, then a hard link, then an in-kernel copy
+    bool export_to(const DanbooruImage& post, const std::string& destination, std::string& error);
+
+    ImageCacheStats stats() const;
+
+    // Writes the index now instead of waiting for the scheduled write
+    void flush_index();
+
+private:
+    struct PendingFetch {
+        TransferEngine::TransferId transfer = 0;
+        std::vector<std::pair<FetchId, FetchCallback>> waiters;
+    };
+
+    struct Entry {
+        uintmax_t size;
+        // Higher is more recent; only the order matters
+        guint64 last_used;
+    };
+
+    // A download on its way to disk, owned by the writer thread until it
+    // comes back to the main context
+    struct Write {
+        ImageStore* store;
+        // False once the store is gone
+        std::shared_ptr<bool> alive;
+        std::string path;
+        GBytes* bytes;
+        std::string error;
+
+        ~Write();
+    };
+
+    TransferEngine& engine;
+    std::string root;
+    uintmax_t max_bytes;
+    FetchId next_fetch_id;
+    // Keyed by store path
+    std::map<std::string, PendingFetch> pending;
+    std::map<FetchId, std::string> fetch_paths;
+
+    // Keyed by path relative to `root`
+    std::map<std::string, Entry> entries;
+    uintmax_t stored_bytes;
+    guint64 use_counter;
+    ImageCacheStats counters;
+    guint save_source;
+
+    GMainContext* context;
+    GThreadPool* writer;
+    std::shared_ptr<bool> alive;
+    // Downloads being written, by store path; fetches meanwhile get these
+    std::map<std::string, GBytes*> writing;
+
+    std::string relative_path(const DanbooruImage& post, ImageVariant variant) const;
+    bool lookup(const std::string& relative);
+    void insert(const std::string& relative);
+    void evict(const std::string& keep);
+    void erase_entry(std::map<std::string, Entry>::iterator it);
+    void finish(const std::string& path, GBytes* bytes, const std::string& error);
+    void finish_file(const std::string& path, bool success);
+    void notify(const std::string& path, const StoredImage& image, const std::string& error);
+    void finish_write(Write& write);
+    void log_lookup(const char* outcome, const std::string& relative) const;
+
+    void load_index();
+    void adopt_untracked_files();
+    bool save_index();
+    void schedule_save();
+    static gboolean on_save_timeout(gpointer user_data);
+    static void run_write(gpointer data, gpointer user_data);
+    static gboolean deliver_write(gpointer data);
+};
@@ -0,0 +1,117 @@
+#include "library_view.h"
+#include "thumbnail_grid.h"
+
+namespace {
+
+// Only what sorting and filtering need; content types are guessed from the
+// name rather than sniffed, so listing never reads the files
+constexpr const char* listed_attributes = "standard::name,standard::fast-content-type,time::modified";
+
+} // namespace
+
+LibraryView::LibraryView(ThumbnailPool& thumbnails) : thumbnails(thumbnails) {
+    files = gtk_directory_list_new(listed_attributes, nullptr);
+    // Listing tens of thousands of files doesn't hold up anything on screen
+    gtk_directory_list_set_io_priority(files, G_PRIORITY_LOW);
+    gtk_directory_list_set_monitored(files, TRUE);
+
+    // Each model takes over the reference to the one it wraps; filtering
+    // and sorting run in steps between frames, not in one long pass
+    GtkFilterListModel* filtered = gtk_filter_list_model_new(
+        G_LIST_MODEL(files), GTK_FILTER(gtk_custom_filter_new(is_image, nullptr, nullptr)));
+    gtk_filter_list_model_set_incremental(filtered, TRUE);
+    GtkSortListModel* sorted = gtk_sort_list_model_new(
+        G_LIST_MODEL(filtered), GTK_SORTER(gtk_custom_sorter_new(newest_first, nullptr, nullptr)));
+    gtk_sort_list_model_set_incremental(sorted, TRUE);
+    images = G_LIST_MODEL(sorted);
+
+    grid = new_thumbnail_grid(images, G_CALLBACK(on_bind), G_CALLBACK(on_unbind), G_CALLBACK(on_grid_activate),
+                              this, scroller);
+}
+
+LibraryView::~LibraryView() {
+    g_signal_handlers_disconnect_by_data(grid, this);
+    GtkListItemFactory* factory = nullptr;
+    g_object_get(grid, "factory", &factory, nullptr);
+    if (factory) {
+        g_signal_handlers_disconnect_by_data(factory, this);
+        g_object_unref(factory);
+    }
+    for (const auto& entry : requests) {
+        thumbnails.cancel(entry.second);
+    }
+    g_object_unref(scroller);
+}
+
+void LibraryView::open(const std::string& path) {
+    if (path == directory) {
+        return;
+    }
+    directory = path;
+    GFile* file = g_file_new_for_path(path.c_str());
+    gtk_directory_list_set_file(files, file);
+    g_object_unref(file);
+}
+
+std::string LibraryView::path_of(GFileInfo* info) {
+    // GtkDirectoryList adds the GFile of every entry to its info
+    GFile* file = G_FILE(g_file_info_get_attribute_object(info, "standard::file"));
+    char* path = file ? g_file_get_path(file) : nullptr;
+    std::string result = path ? path : "";
+    g_free(path);
+    return result;
+}
+
+gboolean LibraryView::is_image(gpointer item, gpointer user_data) {
+    // Also leaves out the ".part" files of downloads in progress
+    const char* type = g_file_info_get_attribute_string(G_FILE_INFO(item), "standard::fast-content-type");
+    return type && g_str_has_prefix(type, "image/");
+}
+
+int LibraryView::newest_first(gconstpointer a, gconstpointer b, gpointer user_data) {
+    guint64 first = g_file_info_get_attribute_uint64(G_FILE_INFO(const_cast<gpointer>(a)), "time::modified");
+    guint64 second = g_file_info_get_attribute_uint64(G_FILE_INFO(const_cast<gpointer>(b)), "time::modified");
+    return first > second ? GTK_ORDERING_SMALLER : (first < second ? GTK_ORDERING_LARGER : GTK_ORDERING_EQUAL);
+}
+
+void LibraryView::on_bind(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer user_data) {
+    LibraryView* self = static_cast<LibraryView*>(user_data);
+    GtkWidget* picture = gtk_list_item_get_child(item);
+    std::string path = path_of(G_FILE_INFO(gtk_list_item_get_item(item)));
+    gtk_picture_set_paintable(GTK_PICTURE(picture), nullptr);
+    if (path.empty()) {
+        return;
+    }
+    // Cancelled on unbind, so this always finds the tile still showing `path`
+    self->requests[picture] = self->thumbnails.request(path, [self, picture](GdkTexture* texture) {
+        self->requests.erase(picture);
+        if (texture) {
+            gtk_picture_set_paintable(GTK_PICTURE(picture), GDK_PAINTABLE(texture));
+            g_object_unref(texture);
+        }
+    });
+}
+
+void LibraryView::on_unbind(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer user_data) {
+    LibraryView* self = static_cast<LibraryView*>(user_data);
+    GtkWidget* picture = gtk_list_item_get_child(item);
+    auto it = self->requests.find(picture);
+    if (it != self->requests.end()) {
+        self->thumbnails.cancel(it->second);
+        self->requests.erase(it);
+    }
+    gtk_picture_set_paintable(GTK_PICTURE(picture), nullptr);
+}
+
+void LibraryView::on_grid_activate(GtkGridView* grid, guint position, gpointer user_data) {
+    LibraryView* self = static_cast<LibraryView*>(user_data);
+    GFileInfo* info = G_FILE_INFO(g_list_model_get_item(self->images, position));
+    if (!info) {
+        return;
+    }
+    std::string path = path_of(info);
+    g_object_unref(info);
+    if (self->on_activate && !path.empty()) {
+        self->on_activate(path);
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <gtk/gtk.h>
+#include <functional>
+#include <map>
+#include <string>
+#include "thumbnail_pool.h"
+
+// Thumbnail grid of the images saved in a directory, newest first. The
+// listing is read asynchronously and watched, so saved images show up
+// without a reload, and only the tiles GTK has bound ask the
+// ThumbnailPool for a thumbnail; a tile that scrolls away before its
+// thumbnail is ready cancels the request. Textures are only held by the
+// tiles showing them.
+class LibraryView {
+public:
+    using ActivateCallback = std::function<void(const std::string& path)>;
+
+    explicit LibraryView(ThumbnailPool& thumbnails);
+    ~LibraryView();
+
+    LibraryView(const LibraryView&) = delete;
+    LibraryView& operator=(const LibraryView&) = delete;
+
+    // The scrollable grid; owned by whatever container it is added to
+    GtkWidget* widget() const { return scroller; }
+
+    // Lists the images in `directory`, unless it is listed already
+    void open(const std::string& directory);
+
+    // Called with the path of a clicked tile
+    void set_on_activate(ActivateCallback callback) { on_activate = std::move(callback); }
+
+private:
+    ThumbnailPool& thumbnails;
+    GtkWidget* scroller;
+    GtkWidget* grid;
+    // Borrowed from the models feeding the grid
+    GtkDirectoryList* files;
+    // The images among `files`, sorted
+    GListModel* images;
+    std::string directory;
+
+    // Outstanding thumbnail request of each bound tile
+    std::map<GtkWidget*, ThumbnailPool::RequestId> requests;
+    ActivateCallback on_activate;
+
+    static std::string path_of(GFileInfo* info);
+    static gboolean is_image(gpointer item, gpointer user_data);
+    static int newest_first(gconstpointer a, gconstpointer b, gpointer user_data);
+    static void on_bind(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer user_data);
+    static void on_unbind(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer user_data);
+    static void on_grid_activate(GtkGridView* grid, guint position, gpointer user_data);
+};
@@ -1,8 +1,80 @@
 #include "main_window.h"
+#include "bulk_mirror.h"
+#include "danbooru_client.h"
+#include "transfer_timings.h"
 #include <gtk/gtk.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+
+namespace {
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--mirror \"TAGS\" [--jobs N] [--output DIR] [--max-posts N] [--api-url URL] [--trace FILE]]\n"
+              << "\n"
+              << "Without --mirror the graphical downloader starts.\n"
+              << "\n"
+              << "  --mirror TAGS    download every post matching the space-separated tag query\n"
+              << "  --jobs N         parallel transfers (default 4)\n"
+              << "  --output DIR     target directory (default ~/Pictures/Elysia)\n"
+              << "  --max-posts N    stop after N posts (default: all)\n"
+              << "  --api-url URL    API to search (default $ELYSIA_API_URL or https://danbooru.donmai.us)\n"
+              << "  --trace FILE     write a Chrome trace of every transfer (default $ELYSIA_TRACE)" << std::endl;
+}
+
+// Returns -1 to start the GUI, otherwise the exit status of the headless run
+int run_headless(int argc, char* argv[]) {
+    // Without --mirror the arguments belong to the GUI, which ignores them
+    if (std::none_of(argv + 1, argv + argc, [](const char* arg) { return std::strcmp(arg, "--mirror") == 0; })) {
+        return -1;
+    }
+
+    MirrorOptions options;
+    bool mirror = false;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(arg, "--mirror") == 0 && has_value) {
+            mirror = true;
+            std::istringstream tags(argv[++i]);
+            std::string tag;
+            while (tags >> tag) {
+                options.tags.push_back(tag);
+            }
+        } else if (std::strcmp(arg, "--jobs") == 0 && has_value) {
+            options.jobs = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(arg, "--output") == 0 && has_value) {
+            options.output_dir = argv[++i];
+        } else if (std::strcmp(arg, "--max-posts") == 0 && has_value) {
+            options.max_posts = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(arg, "--api-url") == 0 && has_value) {
+            DanbooruClient::set_base_url(argv[++i]);
+        } else if (std::strcmp(arg, "--trace") == 0 && has_value) {
+            TransferTimings::instance().set_trace_path(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (!mirror || options.tags.empty()) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    return run_bulk_mirror(options);
+}
+
+} // namespace
 
 int main(int argc, char* argv[]) {
+    int headless_status = run_headless(argc, argv);
+    if (headless_status >= 0) {
+        return headless_status;
+    }
+    
     // Initialize GTK
     gtk_init();
     
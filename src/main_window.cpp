@@ -1,18 +1,167 @@
 #include "main_window.h"
 #include "danbooru_client.h"
-#include "image_downloader.h"
+#include "download_directory.h"
+#include "texture_decoder.h"
+#include "transfer_timings.h"
 #include <gtk/gtk.h>
 #include <glib.h>
 #include <iostream>
 #include <random>
 #include <filesystem>
 #include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <unordered_set>
 
-MainWindow::MainWindow() {
+namespace {
+
+// In priority order; the first one that returns images is used
+const std::vector<std::string> elysia_tags = {
+    "elysia_(honkai_impact)",
+    "elysia_(herrscher_of_human:_ego)_(honkai_impact)",
+    "elysia_(miss_pink)_(honkai_impact)"
+};
+
+// How many images are kept downloaded and decoded ahead of Refresh
+size_t prefetch_depth() {
+    const char* value = g_getenv("ELYSIA_PREFETCH_DEPTH");
+    return value ? std::strtoul(value, nullptr, 10) : 3;
+}
+
+// Posts fetched per random page; small, since each refresh only needs a few
+constexpr int sample_page_size = 20;
+
+// How long a tag's post count is trusted before it is asked for again
+constexpr int tag_count_ttl_seconds = 60 * 60;
+
+// How many refreshes must pass before a post may be shown again
+size_t no_repeat_window() {
+    const char* value = g_getenv("ELYSIA_NO_REPEAT");
+    return value ? std::strtoul(value, nullptr, 10) : 50;
+}
+
+// Whether posts are only picked from the local index, without searching
+bool offline_mode() {
+    const char* value = g_getenv("ELYSIA_OFFLINE");
+    return value && g_strcmp0(value, "0") != 0;
+}
+
+// Upper bound for the decoded textures waiting in the prefetch queue
+size_t prefetch_memory_budget() {
+    const char* value = g_getenv("ELYSIA_PREFETCH_MEMORY_MB");
+    return (value ? std::strtoul(value, nullptr, 10) : 256) * 1024 * 1024;
+}
+
+// Upper bound for the decoded thumbnails the gallery keeps
+size_t gallery_memory_budget() {
+    const char* value = g_getenv("ELYSIA_GALLERY_MEMORY_MB");
+    return (value ? std::strtoul(value, nullptr, 10) : 64) * 1024 * 1024;
+}
+
+// How long a search result is used without asking the API again
+int search_cache_ttl() {
+    const char* value = g_getenv("ELYSIA_SEARCH_TTL_SECONDS");
+    return value ? std::atoi(value) : 300;
+}
+
+// Disk space for downloaded originals kept in the image cache
+uintmax_t image_cache_budget() {
+    const char* value = g_getenv("ELYSIA_CACHE_MAX_MB");
+    return static_cast<uintmax_t>(value ? std::strtoull(value, nullptr, 10) : 1024) * 1024 * 1024;
+}
+
+// How many of the 64 bits of perceptual hash a post may differ in from a
+// saved image and still be taken for the same picture; below 0 turns the
+// check off
+int duplicate_distance() {
+    const char* value = g_getenv("ELYSIA_DUPLICATE_DISTANCE");
+    return value ? std::atoi(value) : 8;
+}
+
+// Whether images from lower priority tags are added to the winning tag's pool
+bool merge_tag_results() {
+    const char* value = g_getenv("ELYSIA_MERGE_TAG_RESULTS");
+    return value && g_strcmp0(value, "0") != 0;
+}
+
+// Images with reasonable dimensions (not too small, not too large)
+const TagQuery& quality_query() {
+    static const TagQuery query = [] {
+        TagQuery parsed;
+        std::string error;
+        TagQuery::parse("width:500..4000 height:600..3000", parsed, error);
+        return parsed;
+    }();
+    return query;
+}
+
+// The quality posts of `pools`, in order, each post once even if several
+// pools have it. Rows are picked first, so only the posts kept are copied
+// out of the pools.
+std::vector<DanbooruImage> filter_quality_images(const std::vector<const PostSet*>& pools) {
+    // Filter for higher quality images
+    std::vector<PostSet::Selection> quality_rows(pools.size());
+    std::vector<PostSet::Selection> all_rows(pools.size());
+    std::unordered_set<uint64_t> seen;
+    size_t quality_count = 0;
+    for (size_t i = 0; i < pools.size(); ++i) {
+        const PostSet& pool = *pools[i];
+        for (size_t row = 0; row < pool.size(); ++row) {
+            if (!seen.insert(pool.id(row)).second) {
+                continue;
+            }
+            all_rows[i].push_back(static_cast<uint32_t>(row));
+            if (quality_query().matches(pool, row)) {
+                quality_rows[i].push_back(static_cast<uint32_t>(row));
+                ++quality_count;
+            }
+        }
+    }
+    
+    if (quality_count == 0) {
+        // If no quality images found, use all images
+        quality_rows = std::move(all_rows);
+    } else {
+        std::cout << "Found " << quality_count << " quality images" << std::endl;
+    }
+    
+    std::vector<DanbooruImage> images;
+    images.reserve(seen.size());
+    for (size_t i = 0; i < pools.size(); ++i) {
+        for (uint32_t row : quality_rows[i]) {
+            images.push_back(pools[i]->post(row));
+        }
+    }
+    return images;
+}
+
+} // namespace
+
+MainWindow::MainWindow()
+    : search_cache(SearchCache::default_directory(), search_cache_ttl()),
+      post_index(PostIndex::default_directory()),
+      post_queries(post_index),
+      sampler(engine, &search_cache, sample_page_size, tag_count_ttl_seconds),
+      store(engine, ImageStore::default_root(), image_cache_budget()),
+      prefetch(store,
+               [this](PrefetchQueue::CandidatesCallback on_done) { search_candidates(std::move(on_done)); },
+               prefetch_depth(), prefetch_memory_budget(), no_repeat_window()),
+      gallery(engine, store, &search_cache, post_index, {elysia_tags.front(), "-video"}, gallery_memory_budget()),
+      thumbnails(ThumbnailCache(), ThumbnailSize::large),
+      library(thumbnails),
+      duplicates(ThumbnailCache(), DuplicateFinder::default_cache_path(), duplicate_distance()) {
     is_dark_theme = false;
     theme_provider = nullptr;
     theme_check_id = 0;
     setup_ui();
+    gallery.set_on_activate([this](const DanbooruImage& post, GdkTexture* thumbnail) {
+        show_post(post, thumbnail);
+    });
+    library.set_on_activate([this](const std::string& path) {
+        show_file(path);
+    });
+    // Catches up with images saved or deleted while the app wasn't running
+    duplicates.scan(select_download_directory());
     
     // Auto-detect and apply theme
     detect_and_apply_theme();
@@ -105,6 +254,26 @@ void MainWindow::setup_ui() {
     g_signal_connect(download_button, "clicked", G_CALLBACK(on_download_clicked), this);
     gtk_box_append(GTK_BOX(button_box), download_button);
     
+    // Create gallery toggle with glass button style (icon only)
+    gallery_button = gtk_toggle_button_new();
+    gtk_button_set_icon_name(GTK_BUTTON(gallery_button), "view-grid-symbolic");
+    gtk_widget_add_css_class(gallery_button, "glass-button");
+    gtk_widget_add_css_class(gallery_button, "icon-button");
+    gtk_widget_set_size_request(gallery_button, 50, 50);
+    gtk_widget_set_tooltip_text(gallery_button, "Browse Gallery");
+    g_signal_connect(gallery_button, "toggled", G_CALLBACK(on_view_toggled), this);
+    gtk_box_append(GTK_BOX(button_box), gallery_button);
+    
+    // Create library toggle with glass button style (icon only)
+    library_button = gtk_toggle_button_new();
+    gtk_button_set_icon_name(GTK_BUTTON(library_button), "folder-pictures-symbolic");
+    gtk_widget_add_css_class(library_button, "glass-button");
+    gtk_widget_add_css_class(library_button, "icon-button");
+    gtk_widget_set_size_request(library_button, 50, 50);
+    gtk_widget_set_tooltip_text(library_button, "Saved Images");
+    g_signal_connect(library_button, "toggled", G_CALLBACK(on_view_toggled), this);
+    gtk_box_append(GTK_BOX(button_box), library_button);
+    
     gtk_box_append(GTK_BOX(main_box), button_box);
     
     // Create image container with proper styling
@@ -124,7 +293,18 @@ void MainWindow::setup_ui() {
     
     gtk_box_append(GTK_BOX(image_container), image_widget);
     
-    gtk_box_append(GTK_BOX(main_box), image_container);
+    // The gallery and library share the image's place and frame
+    GtkWidget* gallery_widget = gallery.widget();
+    gtk_widget_add_css_class(gallery_widget, "image-container");
+    GtkWidget* library_widget = library.widget();
+    gtk_widget_add_css_class(library_widget, "image-container");
+    
+    view_stack = gtk_stack_new();
+    gtk_stack_set_transition_type(GTK_STACK(view_stack), GTK_STACK_TRANSITION_TYPE_CROSSFADE);
+    gtk_stack_add_named(GTK_STACK(view_stack), image_container, "single");
+    gtk_stack_add_named(GTK_STACK(view_stack), gallery_widget, "gallery");
+    gtk_stack_add_named(GTK_STACK(view_stack), library_widget, "library");
+    gtk_box_append(GTK_BOX(main_box), view_stack);
     
     // Apply CSS styling
     setup_css();
@@ -237,6 +417,10 @@ void MainWindow::update_theme_css() {
             "  max-width: 100%;"
             "  max-height: 100%;"
             "}"
+            ".gallery-tile {"
+            "  border-radius: 8px;"
+            "  margin: 4px;"
+            "}"
             ".loading-label {"
             "  font-size: 18px;"
             "  color: #cccccc;"
@@ -325,6 +509,10 @@ void MainWindow::update_theme_css() {
             "  max-width: 100%;"
             "  max-height: 100%;"
             "}"
+            ".gallery-tile {"
+            "  border-radius: 8px;"
+            "  margin: 4px;"
+            "}"
             ".loading-label {"
             "  font-size: 18px;"
             "  color: #666;"
@@ -363,125 +551,307 @@ void MainWindow::show() {
 }
 
 void MainWindow::refresh_image() {
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gallery_button))) {
+        // Newest posts first, as if the gallery had just been opened
+        gallery.reload();
+        return;
+    }
+    // The library keeps itself up to date; Refresh goes back to browsing
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(library_button), FALSE);
     load_random_image();
 }
 
 void MainWindow::load_random_image() {
     std::cout << "Loading random image..." << std::endl;
     
-    // Show loading indicator
-    GtkWidget* loading_label = gtk_label_new("Loading Elysia image...\nPlease wait...");
-    gtk_widget_set_hexpand(loading_label, TRUE);
-    gtk_widget_set_vexpand(loading_label, TRUE);
-    gtk_label_set_wrap(GTK_LABEL(loading_label), TRUE);
-    gtk_label_set_justify(GTK_LABEL(loading_label), GTK_JUSTIFY_CENTER);
-    gtk_widget_add_css_class(loading_label, "loading-label");
+    // Show loading indicator unless an image is already waiting
+    if (prefetch.ready_count() == 0) {
+        show_status_label("Loading Elysia image...\nPlease wait...", "loading-label");
+    }
     
-    // Replace the image widget inside the image container
+    update_display_size();
+    prefetch.take_next([this](PrefetchResult result) {
+        show_prefetched(std::move(result));
+    });
+}
+
+void MainWindow::update_display_size() {
+    int width = 0;
+    int height = 0;
+    display_size(width, height);
+    prefetch.set_display_size(width, height);
+}
+
+void MainWindow::display_size(int& width, int& height) {
     GtkWidget* image_container = gtk_widget_get_parent(image_widget);
-    if (image_container) {
-        gtk_box_remove(GTK_BOX(image_container), image_widget);
-    image_widget = loading_label;
-        gtk_box_append(GTK_BOX(image_container), image_widget);
+    width = image_container ? gtk_widget_get_width(image_container) : 0;
+    height = image_container ? gtk_widget_get_height(image_container) : 0;
+    if (width <= 0 || height <= 0) {
+        // Not laid out yet
+        width = 600;
+        height = 750;
+    }
+    // In device pixels, so HiDPI screens get full-resolution textures
+    int scale = gtk_widget_get_scale_factor(window);
+    width *= scale;
+    height *= scale;
+}
+
+void MainWindow::search_candidates(PrefetchQueue::CandidatesCallback on_done) {
+    // All tags are searched at once, each for a random page of its posts
+    // (see TagSampler). The first tag in priority order that returns images
+    // wins as soon as every tag ahead of it has come back empty, and the
+    // searches still running are cancelled.
+    if (offline_mode()) {
+        on_done(offline_candidates(), "");
+        return;
     }
     
-    try {
-        DanbooruClient client;
-        std::vector<std::string> tags = {
-            "elysia_(honkai_impact)",
-            "elysia_(herrscher_of_human:_ego)_(honkai_impact)",
-            "elysia_(miss_pink)_(honkai_impact)"
-        };
-        
-        // Try each tag one by one until we find an image
-        DanbooruImage image;
-        std::string used_tag;
+    struct TagSearch {
+        PrefetchQueue::CandidatesCallback on_done;
+        std::vector<TagSampler::SampleId> samples;
+        std::vector<bool> finished;
+        std::vector<PostSet> results;
+        std::vector<std::string> errors;
+        bool decided = false;
+    };
+    
+    auto search = std::make_shared<TagSearch>();
+    search->on_done = std::move(on_done);
+    search->samples.resize(elysia_tags.size(), 0);
+    search->finished.resize(elysia_tags.size(), false);
+    search->results.resize(elysia_tags.size());
+    search->errors.resize(elysia_tags.size());
+    
+    auto decide = [this](const std::shared_ptr<TagSearch>& search) {
+        if (search->decided) {
+            return;
+        }
         
-        for (const auto& tag : tags) {
-            std::cout << "Trying tag: " << tag << std::endl;
+        for (size_t i = 0; i < elysia_tags.size(); ++i) {
+            if (!search->finished[i]) {
+                // A higher priority tag may still produce images
+                return;
+            }
+            if (search->results[i].empty()) {
+                continue;
+            }
             
-            // Use Danbooru's built-in tag filtering to exclude videos
-            std::vector<std::string> search_tags = {tag, "-video"};
+            search->decided = true;
+            for (size_t j = 0; j < elysia_tags.size(); ++j) {
+                if (!search->finished[j]) {
+                    sampler.cancel(search->samples[j]);
+                }
+            }
             
-            auto images = client.search_images(search_tags, 50);
+            std::vector<const PostSet*> pools = {&search->results[i]};
+            std::cout << "Using tag: " << elysia_tags[i] << std::endl;
             
-            if (!images.empty()) {
-                // Filter for higher quality images and pick the best one
-                std::vector<DanbooruImage> quality_images;
-                for (const auto& img : images) {
-                    // Prefer images with reasonable dimensions (not too small, not too large)
-                    if (img.width >= 500 && img.height >= 600 && 
-                        img.width <= 4000 && img.height <= 3000) {
-                        quality_images.push_back(img);
+            if (merge_tag_results()) {
+                // Add whatever the other tags already returned, minus duplicates
+                for (size_t j = 0; j < elysia_tags.size(); ++j) {
+                    if (j != i) {
+                        pools.push_back(&search->results[j]);
                     }
                 }
-                
-                if (quality_images.empty()) {
-                    // If no quality images found, use all images
-                    quality_images = images;
-                }
-                
-                // Pick a random image from quality results
-                std::random_device rd;
-                std::mt19937 gen(rd());
-                std::uniform_int_distribution<> dis(0, quality_images.size() - 1);
-                image = quality_images[dis(gen)];
-                used_tag = tag;
-                std::cout << "Found " << quality_images.size() << " quality images with tag: " << tag << std::endl;
-                break;
-            } else {
-                std::cout << "No images found with tag: " << tag << std::endl;
             }
+            
+            search->on_done(filter_quality_images(pools), "");
+            return;
         }
         
-        if (!image.file_url.empty()) {
-            std::cout << "Got image: " << image.file_url << " using tag: " << used_tag << std::endl;
-            current_image_url = image.file_url;
-            current_image_filename = image.filename;
-            set_image_from_url(image.file_url);
-        } else {
+        // Every tag came back empty or failed
+        search->decided = true;
+        std::string error;
+        for (const auto& e : search->errors) {
+            if (!e.empty()) {
+                error = e;
+                break;
+            }
+        }
+        if (error.empty()) {
             std::cout << "No image found with any tag!" << std::endl;
-            // Show a message that no image was found
-            GtkWidget* label = gtk_label_new("No images found with any of the specified tags.\nTry clicking Refresh again.");
-            gtk_widget_set_hexpand(label, TRUE);
-            gtk_widget_set_vexpand(label, TRUE);
-            gtk_label_set_wrap(GTK_LABEL(label), TRUE);
-            gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
-            gtk_widget_add_css_class(label, "info-label");
-            
-            // Replace the image widget inside the image container
-            GtkWidget* image_container = gtk_widget_get_parent(image_widget);
-            if (image_container) {
-                gtk_box_remove(GTK_BOX(image_container), image_widget);
-            image_widget = label;
-                gtk_box_append(GTK_BOX(image_container), image_widget);
+        } else {
+            // The API is unreachable; stored posts can still be shown
+            std::vector<DanbooruImage> pool = offline_candidates();
+            if (!pool.empty()) {
+                search->on_done(std::move(pool), "");
+                return;
             }
         }
-    } catch (const std::exception& e) {
-        std::cerr << "Error loading image: " << e.what() << std::endl;
-        // Show error message in UI
-        GtkWidget* label = gtk_label_new(("Error loading image: " + std::string(e.what())).c_str());
-        gtk_widget_set_hexpand(label, TRUE);
-        gtk_widget_set_vexpand(label, TRUE);
-        gtk_label_set_wrap(GTK_LABEL(label), TRUE);
-        gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
-        gtk_widget_add_css_class(label, "error-label");
+        search->on_done({}, error);
+    };
+    
+    for (size_t i = 0; i < elysia_tags.size(); ++i) {
+        // Use Danbooru's built-in tag filtering to exclude videos
+        std::vector<std::string> search_tags = {elysia_tags[i], "-video"};
         
-        // Replace the image widget inside the image container
-        GtkWidget* image_container = gtk_widget_get_parent(image_widget);
-        if (image_container) {
-            gtk_box_remove(GTK_BOX(image_container), image_widget);
-        image_widget = label;
-            gtk_box_append(GTK_BOX(image_container), image_widget);
+        try {
+            search->samples[i] = sampler.sample(search_tags,
+                [this, search, i, decide](PostSet posts, const std::string& error) {
+                    if (!error.empty()) {
+                        std::cerr << "Search for " << elysia_tags[i] << " failed: " << error << std::endl;
+                    } else if (posts.empty()) {
+                        std::cout << "No images found with tag: " << elysia_tags[i] << std::endl;
+                    }
+                    post_index.add(posts);
+                    search->finished[i] = true;
+                    search->results[i] = std::move(posts);
+                    search->errors[i] = error;
+                    decide(search);
+                });
+        } catch (const std::exception& e) {
+            search->finished[i] = true;
+            search->errors[i] = e.what();
+        }
+        
+        // A cached result for a higher priority tag can settle the search
+        // before the remaining tags are even requested
+        if (search->decided) {
+            break;
         }
     }
+    
+    // Covers the case where every search failed to start
+    decide(search);
 }
 
-void MainWindow::set_image_from_url(const std::string& url) {
-    std::cout << "Setting image from URL: " << url << std::endl;
+std::vector<DanbooruImage> MainWindow::offline_candidates() {
+    // Only posts whose displayed variant is already stored can be shown
+    auto stored = [this](const DanbooruImage& post) { return store.contains(post, ImageVariant::sample); };
+    static std::mt19937 random{std::random_device{}()};
+    for (const auto& tag : elysia_tags) {
+        TagQuery query = quality_query();
+        query.required = {tag};
+        query.excluded = {"video"};
+        std::vector<DanbooruImage> pool = post_queries.sample(query, sample_page_size, random, stored);
+        if (pool.empty()) {
+            // As online: without quality posts, any will do
+            query.width = query.height = TagQuery::Range{};
+            pool = post_queries.sample(query, sample_page_size, random, stored);
+        }
+        if (!pool.empty()) {
+            std::cout << "Using " << pool.size() << " stored posts from the local index for " << tag << std::endl;
+            return pool;
+        }
+    }
+    return {};
+}
+
+void MainWindow::show_prefetched(PrefetchResult result) {
+    if (result.no_images) {
+        // Show a message that no image was found
+        show_status_label("No images found with any of the specified tags.\nTry clicking Refresh again.", "info-label");
+        return;
+    }
+    if (!result.texture) {
+        std::cerr << "Error loading image: " << result.error << std::endl;
+        // Show error message in UI
+        show_status_label("Error loading image: " + result.error + "\n\nClick Refresh for new image", "error-label");
+        return;
+    }
+    
+    if (result.is_upgrade) {
+        // Same post, sharper texture: keep the widget and swap what it draws
+        std::cout << "Got sample: " << image_url(result.post, ImageVariant::sample) << std::endl;
+        if (GTK_IS_PICTURE(image_widget) && result.post.id == current_post.id) {
+            gtk_picture_set_paintable(GTK_PICTURE(image_widget), GDK_PAINTABLE(result.texture));
+        }
+        g_object_unref(result.texture);
+        return;
+    }
     
+    std::cout << "Got " << (result.is_preview ? "preview" : "image") << ": "
+              << image_url(result.post, result.is_preview ? ImageVariant::preview : ImageVariant::sample) << std::endl;
+    current_post = result.post;
+    displaying.clear();
+    show_texture(result.texture);
+}
+
+void MainWindow::show_post(const DanbooruImage& post, GdkTexture* thumbnail) {
+    // Back to the single image, with the thumbnail until the sample is in
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(gallery_button), FALSE);
+    current_post = post;
+    displaying = post.id;
+    if (thumbnail) {
+        show_texture(GDK_TEXTURE(g_object_ref(thumbnail)));
+    } else {
+        show_status_label("Loading Elysia image...\nPlease wait...", "loading-label");
+    }
+    
+    try {
+        store.fetch(post, ImageVariant::sample, [this, post](const ImageStore::StoredImage& image, const std::string& error) {
+            if (post.id != displaying) {
+                // Another image was picked meanwhile
+                return;
+            }
+            if (!error.empty()) {
+                std::cerr << "Error loading image: " << error << std::endl;
+                if (!GTK_IS_PICTURE(image_widget)) {
+                    show_status_label("Error loading image: " + error + "\n\nClick Refresh for new image", "error-label");
+                }
+                return;
+            }
+            int width = 0;
+            int height = 0;
+            display_size(width, height);
+            decode_texture_async(image.bytes, width, height, nullptr, on_post_decoded, new PostDecode{this, post.id});
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "Error loading image: " << e.what() << std::endl;
+    }
+}
+
+void MainWindow::show_file(const std::string& path) {
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(library_button), FALSE);
+    // Already saved, so there is nothing for Download to do
+    current_post = DanbooruImage();
+    displaying = path;
+    show_status_label("Loading Elysia image...\nPlease wait...", "loading-label");
+    
+    GError* error = nullptr;
+    GMappedFile* file = g_mapped_file_new(path.c_str(), FALSE, &error);
+    if (!file) {
+        std::cerr << "Error loading image: " << error->message << std::endl;
+        show_status_label("Error loading image: " + std::string(error->message), "error-label");
+        g_error_free(error);
+        return;
+    }
+    GBytes* bytes = g_mapped_file_get_bytes(file);
+    g_mapped_file_unref(file);
+    
+    int width = 0;
+    int height = 0;
+    display_size(width, height);
+    decode_texture_async(bytes, width, height, nullptr, on_post_decoded, new PostDecode{this, path});
+    g_bytes_unref(bytes);
+}
+
+void MainWindow::on_post_decoded(GObject* source_object, GAsyncResult* result, gpointer user_data) {
+    std::unique_ptr<PostDecode> decode(static_cast<PostDecode*>(user_data));
+    MainWindow* self = decode->window;
+    
+    GError* error = nullptr;
+    GdkTexture* texture = decode_texture_finish(result, &error);
+    if (error) {
+        std::cerr << "Failed to decode " << decode->key << ": " << error->message << std::endl;
+        if (decode->key == self->displaying) {
+            self->show_status_label("Error loading image: " + std::string(error->message), "error-label");
+        }
+        g_error_free(error);
+        return;
+    }
+    if (decode->key != self->displaying) {
+        g_object_unref(texture);
+        return;
+    }
+    self->show_texture(texture);
+}
+
+void MainWindow::show_texture(GdkTexture* texture) {
     // Create a new picture widget
-    GtkWidget* new_image_widget = gtk_picture_new();
+    GtkWidget* new_image_widget = gtk_picture_new_for_paintable(GDK_PAINTABLE(texture));
+    g_object_unref(texture);
     gtk_widget_set_hexpand(new_image_widget, TRUE);
     gtk_widget_set_vexpand(new_image_widget, TRUE);
     gtk_widget_add_css_class(new_image_widget, "main-image");
@@ -489,91 +859,67 @@ void MainWindow::set_image_from_url(const std::string& url) {
     // Set size request for better image display
     gtk_widget_set_size_request(new_image_widget, 500, 300);
     
-    // Download the image first, then display it
-    std::string temp_filename = "/tmp/elysia_temp_image.jpg";
-    
-    try {
-        ImageDownloader downloader;
-        if (downloader.download_image(url, temp_filename)) {
-            std::cout << "Image downloaded successfully to temp file" << std::endl;
-            
-            // Now load the downloaded image
-            gtk_picture_set_filename(GTK_PICTURE(new_image_widget), temp_filename.c_str());
-            
-            // Check if the picture has content after loading
-            GdkPaintable* paintable = gtk_picture_get_paintable(GTK_PICTURE(new_image_widget));
-            if (paintable) {
-                std::cout << "Image loaded successfully from local file" << std::endl;
-            } else {
-                std::cout << "Failed to load image from local file" << std::endl;
-                // Show placeholder if loading fails
-                GtkWidget* label = gtk_label_new(("Image downloaded but failed to display.\nURL: " + url + "\n\nClick Refresh for new image").c_str());
-                gtk_widget_set_hexpand(label, TRUE);
-                gtk_widget_set_vexpand(label, TRUE);
-                gtk_label_set_wrap(GTK_LABEL(label), TRUE);
-                gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
-                gtk_widget_add_css_class(label, "error-label");
-                new_image_widget = label;
-            }
-        } else {
-            std::cout << "Failed to download image from URL" << std::endl;
-            // Show placeholder if download fails
-            GtkWidget* label = gtk_label_new(("Failed to download image.\nURL: " + url + "\n\nClick Refresh for new image").c_str());
-            gtk_widget_set_hexpand(label, TRUE);
-            gtk_widget_set_vexpand(label, TRUE);
-            gtk_label_set_wrap(GTK_LABEL(label), TRUE);
-            gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
-            gtk_widget_add_css_class(label, "error-label");
-            new_image_widget = label;
-        }
-    } catch (const std::exception& e) {
-        std::cerr << "Error in set_image_from_url: " << e.what() << std::endl;
-        // Show error message
-        GtkWidget* label = gtk_label_new(("Error loading image: " + std::string(e.what()) + "\n\nClick Refresh for new image").c_str());
-        gtk_widget_set_hexpand(label, TRUE);
-        gtk_widget_set_vexpand(label, TRUE);
-        gtk_label_set_wrap(GTK_LABEL(label), TRUE);
-        gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
-        gtk_widget_add_css_class(label, "error-label");
-        new_image_widget = label;
-    }
-    
+    replace_image_widget(new_image_widget);
+}
+
+void MainWindow::replace_image_widget(GtkWidget* new_widget) {
     // Replace the current image widget inside the image container
     GtkWidget* image_container = gtk_widget_get_parent(image_widget);
     if (image_container) {
         gtk_box_remove(GTK_BOX(image_container), image_widget);
-    image_widget = new_image_widget;
+        image_widget = new_widget;
         gtk_box_append(GTK_BOX(image_container), image_widget);
     }
 }
 
+void MainWindow::show_status_label(const std::string& text, const char* css_class) {
+    GtkWidget* label = gtk_label_new(text.c_str());
+    gtk_widget_set_hexpand(label, TRUE);
+    gtk_widget_set_vexpand(label, TRUE);
+    gtk_label_set_wrap(GTK_LABEL(label), TRUE);
+    gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
+    gtk_widget_add_css_class(label, css_class);
+    replace_image_widget(label);
+}
+
+GtkWidget* MainWindow::build_dialog(const std::string& title, const std::string& text, int width, int height,
+                                    GtkWidget* buttons) {
+    GtkWidget* dialog = gtk_window_new();
+    gtk_window_set_title(GTK_WINDOW(dialog), title.c_str());
+    gtk_window_set_transient_for(GTK_WINDOW(dialog), GTK_WINDOW(window));
+    gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
+    gtk_window_set_default_size(GTK_WINDOW(dialog), width, height);
+    gtk_window_set_resizable(GTK_WINDOW(dialog), FALSE);
+    
+    GtkWidget* box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 20);
+    gtk_widget_set_margin_start(box, 20);
+    gtk_widget_set_margin_end(box, 20);
+    gtk_widget_set_margin_top(box, 20);
+    gtk_widget_set_margin_bottom(box, 20);
+    
+    GtkWidget* label = gtk_label_new(text.c_str());
+    gtk_widget_set_halign(label, GTK_ALIGN_CENTER);
+    gtk_label_set_wrap(GTK_LABEL(label), TRUE);
+    gtk_box_append(GTK_BOX(box), label);
+    
+    gtk_widget_set_halign(buttons, GTK_ALIGN_CENTER);
+    gtk_box_append(GTK_BOX(box), buttons);
+    
+    gtk_window_set_child(GTK_WINDOW(dialog), box);
+    return dialog;
+}
+
+void MainWindow::show_message_dialog(const std::string& title, const std::string& text, int width, int height) {
+    GtkWidget* button = gtk_button_new_with_label("OK");
+    GtkWidget* dialog = build_dialog(title, text, width, height, button);
+    g_signal_connect_swapped(button, "clicked", G_CALLBACK(gtk_window_destroy), dialog);
+    gtk_window_present(GTK_WINDOW(dialog));
+}
+
 void MainWindow::download_current_image() {
-    if (current_image_url.empty()) {
+    if (current_post.file_url.empty()) {
         // Show simple message that no image is loaded
-        GtkWidget* dialog = gtk_window_new();
-        gtk_window_set_title(GTK_WINDOW(dialog), "No Image");
-        gtk_window_set_transient_for(GTK_WINDOW(dialog), GTK_WINDOW(window));
-        gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
-        gtk_window_set_default_size(GTK_WINDOW(dialog), 300, 150);
-        gtk_window_set_resizable(GTK_WINDOW(dialog), FALSE);
-        
-        GtkWidget* box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 20);
-        gtk_widget_set_margin_start(box, 20);
-        gtk_widget_set_margin_end(box, 20);
-        gtk_widget_set_margin_top(box, 20);
-        gtk_widget_set_margin_bottom(box, 20);
-        
-        GtkWidget* label = gtk_label_new("No image loaded. Please click Refresh first.");
-        gtk_widget_set_halign(label, GTK_ALIGN_CENTER);
-        gtk_box_append(GTK_BOX(box), label);
-        
-        GtkWidget* button = gtk_button_new_with_label("OK");
-        gtk_widget_set_halign(button, GTK_ALIGN_CENTER);
-        g_signal_connect_swapped(button, "clicked", G_CALLBACK(gtk_window_destroy), dialog);
-        gtk_box_append(GTK_BOX(box), button);
-        
-        gtk_window_set_child(GTK_WINDOW(dialog), box);
-        gtk_window_present(GTK_WINDOW(dialog));
+        show_message_dialog("No Image", "No image loaded. Please click Refresh first.", 300, 150);
         return;
     }
     
@@ -583,127 +929,88 @@ void MainWindow::download_current_image() {
         return;
     }
     
-    std::string filepath = download_dir + "/" + current_image_filename;
+    std::string filepath = download_dir + "/" + current_post.filename;
+    DanbooruImage post = current_post;
+    
+    // Saving doesn't belong to the current load, so Refresh won't cancel it
+    gtk_widget_set_sensitive(download_button, FALSE);
     
+    // The preview, normally still in the store from being shown, is enough
+    // to recognize a picture that is already saved, under this name or as a
+    // repost under another, before the original is downloaded
     try {
-        ImageDownloader downloader;
-        if (downloader.download_image(current_image_url, filepath)) {
-            std::cout << "Image downloaded successfully to: " << filepath << std::endl;
-            
-            // Show simple success message
-            GtkWidget* dialog = gtk_window_new();
-            gtk_window_set_title(GTK_WINDOW(dialog), "Download Complete");
-            gtk_window_set_transient_for(GTK_WINDOW(dialog), GTK_WINDOW(window));
-            gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
-            gtk_window_set_default_size(GTK_WINDOW(dialog), 400, 200);
-            gtk_window_set_resizable(GTK_WINDOW(dialog), FALSE);
-            
-            GtkWidget* box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 20);
-            gtk_widget_set_margin_start(box, 20);
-            gtk_widget_set_margin_end(box, 20);
-            gtk_widget_set_margin_top(box, 20);
-            gtk_widget_set_margin_bottom(box, 20);
-            
-            std::string success_text = "Image downloaded successfully!\n\nSaved to:\n" + filepath;
-            GtkWidget* label = gtk_label_new(success_text.c_str());
-            gtk_widget_set_halign(label, GTK_ALIGN_CENTER);
-            gtk_label_set_wrap(GTK_LABEL(label), TRUE);
-            gtk_box_append(GTK_BOX(box), label);
-            
-            GtkWidget* button = gtk_button_new_with_label("OK");
-            gtk_widget_set_halign(button, GTK_ALIGN_CENTER);
-            g_signal_connect_swapped(button, "clicked", G_CALLBACK(gtk_window_destroy), dialog);
-            gtk_box_append(GTK_BOX(box), button);
-            
-            gtk_window_set_child(GTK_WINDOW(dialog), box);
-            gtk_window_present(GTK_WINDOW(dialog));
-            
-        } else {
-            std::cerr << "Failed to download image" << std::endl;
-            
-            // Show simple error message
-            GtkWidget* dialog = gtk_window_new();
-            gtk_window_set_title(GTK_WINDOW(dialog), "Download Failed");
-            gtk_window_set_transient_for(GTK_WINDOW(dialog), GTK_WINDOW(window));
-            gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
-            gtk_window_set_default_size(GTK_WINDOW(dialog), 300, 150);
-            gtk_window_set_resizable(GTK_WINDOW(dialog), FALSE);
-            
-            GtkWidget* box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 20);
-            gtk_widget_set_margin_start(box, 20);
-            gtk_widget_set_margin_end(box, 20);
-            gtk_widget_set_margin_top(box, 20);
-            gtk_widget_set_margin_bottom(box, 20);
-            
-            GtkWidget* label = gtk_label_new("Failed to download image. Please try again.");
-            gtk_widget_set_halign(label, GTK_ALIGN_CENTER);
-            gtk_box_append(GTK_BOX(box), label);
-            
-            GtkWidget* button = gtk_button_new_with_label("OK");
-            gtk_widget_set_halign(button, GTK_ALIGN_CENTER);
-            g_signal_connect_swapped(button, "clicked", G_CALLBACK(gtk_window_destroy), dialog);
-            gtk_box_append(GTK_BOX(box), button);
+        store.fetch(post, ImageVariant::preview, [this, post, filepath](const ImageStore::StoredImage& image, const std::string& error) {
+            uint64_t hash = 0;
+            bool hashed = error.empty() && image.bytes && DuplicateFinder::hash_image(image.bytes, hash);
+            DuplicateFinder::Duplicate duplicate;
+            if (hashed && duplicates.find(hash, duplicate)) {
+                gtk_widget_set_sensitive(download_button, TRUE);
+                std::cout << "Post " << post.id << " looks like " << duplicate.path
+                          << " (" << duplicate.distance << " bits apart), not downloading it" << std::endl;
+                confirm_duplicate_save(post, filepath, hash, duplicate);
+                return;
+            }
+            save_post(post, filepath, hashed, hash);
+        });
+    } catch (const std::exception& e) {
+        // Saved unchecked rather than not at all
+        std::cerr << "Failed to fetch preview: " << e.what() << std::endl;
+        save_post(post, filepath, false, 0);
+    }
+}
+
+void MainWindow::save_post(const DanbooruImage& post, const std::string& filepath, bool hashed, uint64_t hash) {
+    gtk_widget_set_sensitive(download_button, FALSE);
+    
+    try {
+        // The displayed image is normally still in the store, in which case
+        // this completes immediately without touching the network
+        store.fetch(post, ImageVariant::original, [this, post, filepath, hashed, hash](const ImageStore::StoredImage& image, const std::string& error) {
+            gtk_widget_set_sensitive(download_button, TRUE);
             
-            gtk_window_set_child(GTK_WINDOW(dialog), box);
-            gtk_window_present(GTK_WINDOW(dialog));
-        }
+            std::string save_error = error;
+            if (save_error.empty() && store.export_to(post, filepath, save_error)) {
+                std::cout << "Image downloaded successfully to: " << filepath << std::endl;
+                if (hashed) {
+                    duplicates.add(filepath, hash);
+                }
+                // Show simple success message
+                show_message_dialog("Download Complete", "Image downloaded successfully!\n\nSaved to:\n" + filepath, 400, 200);
+            } else {
+                std::cerr << "Failed to save image: " << save_error << std::endl;
+                // Show simple error message
+                show_message_dialog("Download Failed", "Failed to download image. Please try again.", 300, 150);
+            }
+        });
     } catch (const std::exception& e) {
         std::cerr << "Error downloading image: " << e.what() << std::endl;
+        gtk_widget_set_sensitive(download_button, TRUE);
         
         // Show simple error message
-        GtkWidget* dialog = gtk_window_new();
-        gtk_window_set_title(GTK_WINDOW(dialog), "Download Error");
-        gtk_window_set_transient_for(GTK_WINDOW(dialog), GTK_WINDOW(window));
-        gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
-        gtk_window_set_default_size(GTK_WINDOW(dialog), 400, 200);
-        gtk_window_set_resizable(GTK_WINDOW(dialog), FALSE);
-        
-        GtkWidget* box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 20);
-        gtk_widget_set_margin_start(box, 20);
-        gtk_widget_set_margin_end(box, 20);
-        gtk_widget_set_margin_top(box, 20);
-        gtk_widget_set_margin_bottom(box, 20);
-        
-        std::string error_text = "Error downloading image:\n" + std::string(e.what());
-        GtkWidget* label = gtk_label_new(error_text.c_str());
-        gtk_widget_set_halign(label, GTK_ALIGN_CENTER);
-        gtk_label_set_wrap(GTK_LABEL(label), TRUE);
-        gtk_box_append(GTK_BOX(box), label);
-        
-        GtkWidget* button = gtk_button_new_with_label("OK");
-        gtk_widget_set_halign(button, GTK_ALIGN_CENTER);
-        g_signal_connect_swapped(button, "clicked", G_CALLBACK(gtk_window_destroy), dialog);
-        gtk_box_append(GTK_BOX(box), button);
-        
-        gtk_window_set_child(GTK_WINDOW(dialog), box);
-        gtk_window_present(GTK_WINDOW(dialog));
+        show_message_dialog("Download Error", "Error downloading image:\n" + std::string(e.what()), 400, 200);
     }
 }
 
-std::string MainWindow::select_download_directory() {
-    // For simplicity, use Downloads directory
-    // In a real application, you'd want to use a proper file chooser dialog
-    const char* home_dir = g_get_home_dir();
-    if (home_dir) {
-        char* downloads_path = g_build_filename(home_dir, "Pictures/Elysia", NULL);
-        std::string path = downloads_path;
-        g_free(downloads_path);
-        
-        // Create directory if it doesn't exist
-        std::error_code ec;
-        if (!std::filesystem::exists(path)) {
-            if (!std::filesystem::create_directories(path, ec)) {
-                // If directory creation fails, fall back to current directory
-                g_warning("Failed to create directory %s: %s", path.c_str(), ec.message().c_str());
-                return std::filesystem::current_path().string();
-            }
-        }
-        
-        return path;
-    }
+void MainWindow::confirm_duplicate_save(const DanbooruImage& post, const std::string& filepath, uint64_t hash,
+                                        const DuplicateFinder::Duplicate& duplicate) {
+    GtkWidget* buttons = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    GtkWidget* cancel = gtk_button_new_with_label("Don't Save");
+    gtk_box_append(GTK_BOX(buttons), cancel);
+    GtkWidget* save = gtk_button_new_with_label("Save Anyway");
+    gtk_box_append(GTK_BOX(buttons), save);
     
-    // Fallback to current directory
-    return std::filesystem::current_path().string();
+    std::string text = duplicate.distance == 0 ? "This image is already saved as:\n" : "A very similar image is already saved as:\n";
+    GtkWidget* dialog = build_dialog("Already Saved", text + duplicate.path, 400, 200, buttons);
+    g_signal_connect_swapped(cancel, "clicked", G_CALLBACK(gtk_window_destroy), dialog);
+    // Owned by the button, so it goes away with the dialog either way
+    g_object_set_data_full(G_OBJECT(save), "duplicate-save", new DuplicateSave{this, post, filepath, hash},
+                           [](gpointer data) { delete static_cast<DuplicateSave*>(data); });
+    g_signal_connect(save, "clicked", G_CALLBACK(on_save_anyway_clicked), dialog);
+    gtk_window_present(GTK_WINDOW(dialog));
+}
+
+std::string MainWindow::select_download_directory() {
+    return default_download_directory();
 }
 
 // Static callback functions
@@ -717,11 +1024,58 @@ void MainWindow::on_download_clicked(GtkButton* button, gpointer user_data) {
     self->download_current_image();
 }
 
+void MainWindow::on_save_anyway_clicked(GtkButton* button, gpointer user_data) {
+    auto* save = static_cast<DuplicateSave*>(g_object_get_data(G_OBJECT(button), "duplicate-save"));
+    save->window->save_post(save->post, save->filepath, true, save->hash);
+    gtk_window_destroy(GTK_WINDOW(user_data));
+}
 
 
 
 
+
+void MainWindow::on_view_toggled(GtkToggleButton* button, gpointer user_data) {
+    MainWindow* self = static_cast<MainWindow*>(user_data);
+    // One browser at a time: turning one on turns the other off
+    if (gtk_toggle_button_get_active(button)) {
+        GtkWidget* other = GTK_WIDGET(button) == self->gallery_button ? self->library_button : self->gallery_button;
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(other), FALSE);
+    }
+    self->update_view();
+}
+
+void MainWindow::update_view() {
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gallery_button))) {
+        gtk_stack_set_visible_child_name(GTK_STACK(view_stack), "gallery");
+        gallery.start();
+    } else if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(library_button))) {
+        gtk_stack_set_visible_child_name(GTK_STACK(view_stack), "library");
+        std::string directory = select_download_directory();
+        library.open(directory);
+        duplicates.scan(directory);
+    } else {
+        gtk_stack_set_visible_child_name(GTK_STACK(view_stack), "single");
+    }
+}
+
 void MainWindow::on_window_destroy(GtkWidget* widget, gpointer user_data) {
+    MainWindow* self = static_cast<MainWindow*>(user_data);
+    // exit() skips destructors, so write out what the cache would on shutdown
+    self->store.flush_index();
+    self->duplicates.flush();
+    ImageCacheStats stats = self->store.stats();
+    std::cout << "Image cache: " << stats.hits << " hits, " << stats.misses << " misses, "
+              << stats.hit_bytes / (1024 * 1024) << " MiB served from disk, "
+              << stats.downloaded_bytes / (1024 * 1024) << " MiB downloaded, "
+              << stats.evictions << " evicted" << std::endl;
+    ThumbnailStats thumbnail_stats = self->thumbnails.stats();
+    if (thumbnail_stats.cached + thumbnail_stats.generated + thumbnail_stats.failed > 0) {
+        std::cout << "Thumbnails: " << thumbnail_stats.cached << " from cache, " << thumbnail_stats.generated
+                  << " made, " << thumbnail_stats.failed << " failed" << std::endl;
+    }
+    TransferTimings::instance().print_summary(std::cout);
+    TransferTimings::instance().write_trace();
+    
     // Exit the application
     exit(0);
 }
@@ -3,6 +3,16 @@
 #include <gtk/gtk.h>
 #include <string>
 #include <vector>
+#include "duplicate_finder.h"
+#include "gallery_view.h"
+#include "image_store.h"
+#include "library_view.h"
+#include "post_index.h"
+#include "prefetch_queue.h"
+#include "search_cache.h"
+#include "tag_query.h"
+#include "tag_sampler.h"
+#include "transfer_engine.h"
 
 class MainWindow {
 public:
@@ -20,22 +30,75 @@ private:
     GtkWidget* button_box;
     GtkWidget* refresh_button;
     GtkWidget* download_button;
+    GtkWidget* gallery_button;
+    GtkWidget* library_button;
+    // Switches between the single image, the gallery and the library
+    GtkWidget* view_stack;
     
-    std::string current_image_url;
-    std::string current_image_filename;
+    // Post on screen; its bytes are in `store` unless removed since
+    DanbooruImage current_post;
+    // Post id or saved file the single view is decoding for, if any
+    std::string displaying;
     bool is_dark_theme;
     GtkCssProvider* theme_provider;
     guint theme_check_id;
     
+    TransferEngine engine;
+    SearchCache search_cache;
+    PostIndex post_index;
+    QueryEngine post_queries;
+    TagSampler sampler;
+    ImageStore store;
+    PrefetchQueue prefetch;
+    GalleryView gallery;
+    ThumbnailPool thumbnails;
+    LibraryView library;
+    DuplicateFinder duplicates;
+    
+    // An image picked in the gallery or library, decoding for the single
+    // image view
+    struct PostDecode {
+        MainWindow* window;
+        std::string key;
+    };
+    
+    // A post held back as a duplicate, for if it is saved anyway
+    struct DuplicateSave {
+        MainWindow* window;
+        DanbooruImage post;
+        std::string filepath;
+        uint64_t hash;
+    };
+    
     static void on_refresh_clicked(GtkButton* button, gpointer user_data);
     static void on_download_clicked(GtkButton* button, gpointer user_data);
+    static void on_save_anyway_clicked(GtkButton* button, gpointer user_data);
+    static void on_view_toggled(GtkToggleButton* button, gpointer user_data);
     static void on_window_destroy(GtkWidget* widget, gpointer user_data);
+    static void on_post_decoded(GObject* source_object, GAsyncResult* result, gpointer user_data);
     
     void setup_ui();
     void setup_css();
     void update_theme_css();
     void detect_and_apply_theme();
     void load_random_image();
-    void set_image_from_url(const std::string& url);
+    void update_display_size();
+    void display_size(int& width, int& height);
+    void search_candidates(PrefetchQueue::CandidatesCallback on_done);
+    std::vector<DanbooruImage> offline_candidates();
+    void show_prefetched(PrefetchResult result);
+    void show_post(const DanbooruImage& post, GdkTexture* thumbnail);
+    void show_file(const std::string& path);
+    void update_view();
+    void show_texture(GdkTexture* texture);
+    void replace_image_widget(GtkWidget* new_widget);
+    void show_status_label(const std::string& text, const char* css_class);
+    // A modal dialog with `text` above the `buttons` widget, not yet presented
+    GtkWidget* build_dialog(const std::string& title, const std::string& text, int width, int height,
+                            GtkWidget* buttons);
+    void show_message_dialog(const std::string& title, const std::string& text, int width, int height);
+    void save_post(const DanbooruImage& post, const std::string& filepath, bool hashed, uint64_t hash);
+    void confirm_duplicate_save(const DanbooruImage& post, const std::string& filepath, uint64_t hash,
+                                const DuplicateFinder::Duplicate& duplicate);
     std::string select_download_directory();
 };
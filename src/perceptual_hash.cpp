@@ -0,0 +1,183 @@
+#include "perceptual_hash.h"
+#include "image_scaler.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define ELYSIA_HAVE_POPCOUNT_PATHS 1
+#endif
+
+namespace {
+
+// Side of the luma grid the DCT runs on, and of the block of its lowest
+// frequencies that make up the hash
+constexpr int grid_size = 32;
+constexpr int kept_size = 8;
+
+// The first rows of the DCT-II basis: cos((2x + 1) u pi / 2N)
+struct Basis {
+    float values[kept_size][grid_size];
+};
+
+const Basis& dct_basis() {
+    static const Basis basis = [] {
+        Basis result;
+        for (int u = 0; u < kept_size; ++u) {
+            for (int x = 0; x < grid_size; ++x) {
+                result.values[u][x] = static_cast<float>(std::cos((2 * x + 1) * u * M_PI / (2 * grid_size)));
+            }
+        }
+        return result;
+    }();
+    return basis;
+}
+
+#if defined(ELYSIA_HAVE_POPCOUNT_PATHS)
+
+// The portable loop, compiled to use the instruction instead of the bit
+// tricks __builtin_popcountll falls back to without -mpopcnt
+__attribute__((target("popcnt")))
+uint8_t hash_distances_popcnt(const uint64_t* hashes, size_t count, uint64_t query, uint8_t* distances) {
+    uint8_t lowest = UINT8_MAX;
+    for (size_t i = 0; i < count; ++i) {
+        distances[i] = static_cast<uint8_t>(__builtin_popcountll(hashes[i] ^ query));
+        lowest = std::min(lowest, distances[i]);
+    }
+    return lowest;
+}
+
+// Sixteen hashes at a time, as four groups of four: each byte's bits are
+// counted by looking up both of its nibbles in a 16-entry table, and
+// _mm256_sad_epu8 sums the eight byte counts of each hash. The counts of
+// the four groups are then packed into one register, transposed into
+// order and stored together.
+__attribute__((target("avx2")))
+uint8_t hash_distances_avx2(const uint64_t* hashes, size_t count, uint64_t query, uint8_t* distances) {
+    const __m256i nibble_bits = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    const __m256i queries = _mm256_set1_epi64x(static_cast<long long>(query));
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low_dwords = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m128i transpose = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    __m128i lowest = _mm_set1_epi8(static_cast<char>(UINT8_MAX));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i packed = zero;
+        for (int group = 0; group < 4; ++group) {
+            __m256i bits = _mm256_xor_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes + i + group * 4)), queries);
+            __m256i low = _mm256_shuffle_epi8(nibble_bits, _mm256_and_si256(bits, low_nibbles));
+            __m256i high = _mm256_shuffle_epi8(nibble_bits, _mm256_and_si256(_mm256_srli_epi16(bits, 4), low_nibbles));
+            // A count of at most 64 in the low byte of each 64-bit lane,
+            // moved to byte `group` of it
+            __m256i sums = _mm256_sad_epu8(_mm256_add_epi8(low, high), zero);
+            packed = _mm256_or_si256(packed, _mm256_sll_epi64(sums, _mm_cvtsi32_si128(group * 8)));
+        }
+        // Lane j now holds hashes j, 4 + j, 8 + j and 12 + j
+        __m128i lanes = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(packed, low_dwords));
+        __m128i ordered = _mm_shuffle_epi8(lanes, transpose);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(distances + i), ordered);
+        lowest = _mm_min_epu8(lowest, ordered);
+    }
+    // Folds the sixteen minimums down to one
+    lowest = _mm_min_epu8(lowest, _mm_srli_si128(lowest, 8));
+    lowest = _mm_min_epu8(lowest, _mm_srli_si128(lowest, 4));
+    lowest = _mm_min_epu8(lowest, _mm_srli_si128(lowest, 2));
+    lowest = _mm_min_epu8(lowest, _mm_srli_si128(lowest, 1));
+    uint8_t result = static_cast<uint8_t>(_mm_cvtsi128_si32(lowest));
+    return std::min(result, hash_distances_popcnt(hashes + i, count - i, query, distances + i));
+}
+
+#endif
+
+} // namespace
+
+uint64_t perceptual_hash(const uint8_t* pixels, int width, int height, size_t stride) {
+    if (width <= 0 || height <= 0) {
+        return 0;
+    }
+
+    // The vectorized area filter does the heavy part, reading every source
+    // pixel once; images smaller than the grid are stretched up afterwards
+    int small_width = std::min(width, grid_size);
+    int small_height = std::min(height, grid_size);
+    std::vector<uint8_t> small(static_cast<size_t>(grid_size) * grid_size * 4);
+    downscale_area(pixels, width, height, stride, small.data(), small_width, small_height, grid_size * 4);
+
+    // Transparent areas count as black, whether or not alpha is premultiplied
+    alignas(32) float luma[grid_size][grid_size];
+    for (int y = 0; y < grid_size; ++y) {
+        const uint8_t* row = small.data() + static_cast<size_t>(y * small_height / grid_size) * grid_size * 4;
+        for (int x = 0; x < grid_size; ++x) {
+            const uint8_t* pixel = row + static_cast<size_t>(x * small_width / grid_size) * 4;
+            float value = 0.299f * pixel[0] + 0.587f * pixel[1] + 0.114f * pixel[2];
+            luma[y][x] = value * pixel[3] / 255.0f;
+        }
+    }
+
+    // Only the lowest frequencies are needed, so the 2D DCT is two narrow
+    // matrix products: columns first, into 8 rows of 32, then those rows.
+    // Both inner loops run over 32 contiguous floats and vectorize.
+    const Basis& basis = dct_basis();
+    alignas(32) float columns[kept_size][grid_size] = {};
+    for (int u = 0; u < kept_size; ++u) {
+        for (int y = 0; y < grid_size; ++y) {
+            float weight = basis.values[u][y];
+            for (int x = 0; x < grid_size; ++x) {
+                columns[u][x] += weight * luma[y][x];
+            }
+        }
+    }
+    float coefficients[kept_size * kept_size];
+    for (int u = 0; u < kept_size; ++u) {
+        for (int v = 0; v < kept_size; ++v) {
+            float sum = 0.0f;
+            for (int x = 0; x < grid_size; ++x) {
+                sum += columns[u][x] * basis.values[v][x];
+            }
+            coefficients[u * kept_size + v] = sum;
+        }
+    }
+
+    // Thresholding at the median sets about half the bits, which keeps
+    // unrelated images far apart
+    float sorted[kept_size * kept_size];
+    std::copy(coefficients, coefficients + kept_size * kept_size, sorted);
+    constexpr int middle = kept_size * kept_size / 2;
+    std::nth_element(sorted, sorted + middle, sorted + kept_size * kept_size);
+    float median = (sorted[middle] + *std::max_element(sorted, sorted + middle)) / 2;
+
+    uint64_t hash = 0;
+    for (int i = 0; i < kept_size * kept_size; ++i) {
+        if (coefficients[i] > median) {
+            hash |= uint64_t(1) << i;
+        }
+    }
+    return hash;
+}
+
+uint8_t hash_distances(const uint64_t* hashes, size_t count, uint64_t query, uint8_t* distances) {
+#if defined(ELYSIA_HAVE_POPCOUNT_PATHS)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    static const bool has_popcnt = __builtin_cpu_supports("popcnt");
+    // AVX2 only pays off once there is a full block of sixteen
+    if (has_avx2 && count >= 16) {
+        return hash_distances_avx2(hashes, count, query, distances);
+    }
+    if (has_popcnt) {
+        return hash_distances_popcnt(hashes, count, query, distances);
+    }
+#endif
+    return hash_distances_scalar(hashes, count, query, distances);
+}
+
+uint8_t hash_distances_scalar(const uint64_t* hashes, size_t count, uint64_t query, uint8_t* distances) {
+    uint8_t lowest = UINT8_MAX;
+    for (size_t i = 0; i < count; ++i) {
+        distances[i] = static_cast<uint8_t>(hash_distance(hashes[i], query));
+        lowest = std::min(lowest, distances[i]);
+    }
+    return lowest;
+}
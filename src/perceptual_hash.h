@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit perceptual hash of an image of 4-byte RGBA pixels, in the style of
+// pHash: the image is squeezed to 32x32 with downscale_area(), turned to
+// luma, and each bit says whether one of the 8x8 lowest frequencies of its
+// DCT is above their median. Resamples, recompressions and small edits of
+// an image land within a few bits of each other, while unrelated images
+// differ in about half of them. Aspect ratio is ignored, so an image and
+// any copy of it hash alike whatever size they were decoded at.
+uint64_t perceptual_hash(const uint8_t* pixels, int width, int height, size_t stride);
+
+// Number of bits in which `a` and `b` differ
+inline int hash_distance(uint64_t a, uint64_t b) {
+    return __builtin_popcountll(a ^ b);
+}
+
+// Writes the distance of `query` to each of `count` hashes into
+// `distances` and returns the smallest, or 255 if `count` is 0. Uses AVX2
+// or the POPCNT instruction where available, with a portable fallback
+// elsewhere.
+uint8_t hash_distances(const uint64_t* hashes, size_t count, uint64_t query, uint8_t* distances);
+
+// Same, without the CPU-specific paths; the reference they must match
+uint8_t hash_distances_scalar(const uint64_t* hashes, size_t count, uint64_t query, uint8_t* distances);
@@ -0,0 +1,594 @@
+#include "post_index.h"
+#include <glib.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+namespace {
+
+constexpr uint32_t format_version = 1;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    // Size of the fixed-size elements the file holds
+    uint32_t element_size;
+};
+static_assert(sizeof(FileHeader) == 16, "index file header must stay 16 bytes");
+
+struct PostRecord {
+    uint64_t id;
+    // Offsets into strings.bin; 0 is the empty string
+    uint64_t file_url;
+    uint64_t large_file_url;
+    uint64_t preview_file_url;
+    // Index of the first tag id in tag_lists.bin
+    uint64_t tags;
+    uint32_t tag_count;
+    uint32_t width;
+    uint32_t height;
+    char rating;
+    uint8_t flags;
+    char file_ext[6];
+    uint8_t md5[16];
+    uint32_t reserved;
+};
+static_assert(sizeof(PostRecord) == 80, "post records are part of the file format");
+
+constexpr uint8_t flag_has_md5 = 1;
+
+// Mappings grow at least this much at a time
+constexpr size_t min_map_growth = 1024 * 1024;
+
+size_t element_size_of(const char* magic) {
+    if (std::strcmp(magic, "ELYPOSTS") == 0) {
+        return sizeof(PostRecord);
+    }
+    if (std::strcmp(magic, "ELYTAGS_") == 0) {
+        return sizeof(uint64_t);
+    }
+    if (std::strcmp(magic, "ELYTAGLS") == 0) {
+        return sizeof(PostIndex::TagId);
+    }
+    return 1;
+}
+
+FileHeader header_of(const char* magic) {
+    FileHeader header{};
+    std::memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = format_version;
+    header.element_size = static_cast<uint32_t>(element_size_of(magic));
+    return header;
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+bool parse_md5(std::string_view text, uint8_t out[16]) {
+    if (text.size() != 32) {
+        return false;
+    }
+    for (size_t i = 0; i < 16; ++i) {
+        int high = hex_digit(text[i * 2]);
+        int low = hex_digit(text[i * 2 + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        out[i] = static_cast<uint8_t>(high << 4 | low);
+    }
+    return true;
+}
+
+// Holds an exclusive flock() on `fd` for as long as it lives
+class DirectoryLock {
+public:
+    explicit DirectoryLock(int fd) : fd(fd) {
+        while (fd >= 0 && flock(fd, LOCK_EX) != 0 && errno == EINTR) {
+        }
+    }
+    ~DirectoryLock() {
+        if (fd >= 0) {
+            flock(fd, LOCK_UN);
+        }
+    }
+
+    DirectoryLock(const DirectoryLock&) = delete;
+    DirectoryLock& operator=(const DirectoryLock&) = delete;
+
+private:
+    int fd;
+};
+
+} // namespace
+
+PostIndex::PostIndex(std::string directory)
+    : directory(std::move(directory)), lock_fd(-1), tag_ids_loaded(false), post_ids_loaded(false) {
+    std::error_code ec;
+    std::filesystem::create_directories(this->directory, ec);
+    lock_fd = open(this->directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (lock_fd < 0) {
+        std::cerr << "Failed to open " << this->directory << ": " << std::strerror(errno) << std::endl;
+    }
+    // Another process may be creating or appending to the same files
+    DirectoryLock lock(lock_fd);
+
+    OpenResult result = open_columns();
+    if (result == OpenResult::wrong_format) {
+        // The files only make sense together, so one bad file resets all four
+        std::cerr << "Post index in " << this->directory << " is from another version, starting over" << std::endl;
+        close_columns();
+        result = start_over() ? open_columns() : OpenResult::failed;
+    }
+    if (result != OpenResult::opened) {
+        // Left as it is for a later run to try again; size() stays 0
+        std::cerr << "Post index in " << this->directory << " can't be used, going without it" << std::endl;
+        close_columns();
+        return;
+    }
+
+    // Offset 0 is the empty string
+    if (strings.fd >= 0 && strings.size == 0) {
+        append(strings, "", 1);
+    }
+}
+
+PostIndex::~PostIndex() {
+    close_columns();
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+}
+
+std::string PostIndex::default_directory() {
+    char* path = g_build_filename(g_get_user_cache_dir(), "elysia", "index", NULL);
+    std::string result = path;
+    g_free(path);
+    return result;
+}
+
+PostIndex::OpenResult PostIndex::open_columns() {
+    OpenResult results[] = {
+        open_column(posts, "posts.bin", "ELYPOSTS"),
+        open_column(strings, "strings.bin", "ELYSTRS_"),
+        open_column(tags, "tags.bin", "ELYTAGS_"),
+        open_column(tag_lists, "tag_lists.bin", "ELYTAGLS"),
+    };
+    OpenResult result = OpenResult::opened;
+    for (OpenResult column : results) {
+        if (column == OpenResult::failed) {
+            return OpenResult::failed;
+        }
+        if (column == OpenResult::wrong_format) {
+            result = OpenResult::wrong_format;
+        }
+    }
+    return result;
+}
+
+PostIndex::OpenResult PostIndex::open_column(Column& column, const char* name, const char* magic) {
+    std::string path = directory + "/" + name;
+    column.name = name;
+    column.fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (column.fd < 0) {
+        std::cerr << "Failed to open " << path << ": " << std::strerror(errno) << std::endl;
+        return OpenResult::failed;
+    }
+
+    FileHeader expected = header_of(magic);
+    struct stat info;
+    if (fstat(column.fd, &info) != 0) {
+        std::cerr << "Failed to read " << path << ": " << std::strerror(errno) << std::endl;
+        return OpenResult::failed;
+    }
+    if (info.st_size == 0) {
+        if (pwrite(column.fd, &expected, sizeof(expected), 0) != static_cast<ssize_t>(sizeof(expected))) {
+            std::cerr << "Failed to write " << path << ": " << std::strerror(errno) << std::endl;
+            return OpenResult::failed;
+        }
+        info.st_size = sizeof(expected);
+    }
+
+    FileHeader header{};
+    if (static_cast<size_t>(info.st_size) < sizeof(header)) {
+        return OpenResult::wrong_format;
+    }
+    if (pread(column.fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+        std::cerr << "Failed to read " << path << ": " << std::strerror(errno) << std::endl;
+        return OpenResult::failed;
+    }
+    if (std::memcmp(&header, &expected, sizeof(header)) != 0) {
+        return OpenResult::wrong_format;
+    }
+
+    // A torn append leaves a partial element at the end; it is ignored
+    column.element_size = expected.element_size;
+    size_t payload = static_cast<size_t>(info.st_size) - sizeof(header);
+    column.size = payload - payload % column.element_size;
+    return map_column(column, column.size) ? OpenResult::opened : OpenResult::failed;
+}
+
+bool PostIndex::start_over() {
+    // Other processes may have the old files mapped, and truncating those
+    // would fault their reads, so empty files are renamed over them
+    // instead. Records go first: stopping part way leaves old data that
+    // nothing points at, never a record pointing into new data.
+    const char* const files[][2] = {
+        {"posts.bin", "ELYPOSTS"},
+        {"tag_lists.bin", "ELYTAGLS"},
+        {"tags.bin", "ELYTAGS_"},
+        {"strings.bin", "ELYSTRS_"},
+    };
+    for (const auto& file : files) {
+        std::string path = directory + "/" + file[0];
+        std::string temporary = path + ".new";
+        FileHeader header = header_of(file[1]);
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && pwrite(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header));
+        if (fd >= 0) {
+            ok = close(fd) == 0 && ok;
+        }
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+            std::cerr << "Failed to replace " << path << ": " << std::strerror(errno) << std::endl;
+            unlink(temporary.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PostIndex::refresh_column(Column& column) {
+    struct stat info;
+    if (column.fd < 0 || fstat(column.fd, &info) != 0) {
+        return false;
+    }
+    // Started over by another process, which renames new files in
+    std::string path = directory + "/" + column.name;
+    struct stat current;
+    if (stat(path.c_str(), &current) != 0 || current.st_dev != info.st_dev || current.st_ino != info.st_ino) {
+        return false;
+    }
+    size_t file_size = static_cast<size_t>(info.st_size);
+    size_t payload = file_size > sizeof(FileHeader) ? file_size - sizeof(FileHeader) : 0;
+    size_t size = payload - payload % column.element_size;
+    if (size < column.size) {
+        // Truncated in place, which older versions did when starting over
+        return false;
+    }
+    if (size > column.size) {
+        if (!map_column(column, size)) {
+            return false;
+        }
+        column.size = size;
+    }
+    return true;
+}
+
+void PostIndex::close_columns() {
+    close_column(posts);
+    close_column(strings);
+    close_column(tags);
+    close_column(tag_lists);
+}
+
+void PostIndex::close_column(Column& column) {
+    if (column.map) {
+        munmap(const_cast<char*>(column.map), column.mapped);
+    }
+    if (column.fd >= 0) {
+        close(column.fd);
+    }
+    column = Column{};
+}
+
+bool PostIndex::map_column(Column& column, size_t needed) {
+    size_t wanted = sizeof(FileHeader) + needed;
+    if (column.map && wanted <= column.mapped) {
+        return true;
+    }
+
+    // Mapping past the end of the file is allowed as long as those pages
+    // aren't touched; reads never go beyond `size`
+    size_t capacity = std::max(wanted * 2, min_map_growth);
+    void* map = mmap(nullptr, capacity, PROT_READ, MAP_SHARED, column.fd, 0);
+    if (map == MAP_FAILED) {
+        std::cerr << "Failed to map post index: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (column.map) {
+        munmap(const_cast<char*>(column.map), column.mapped);
+    }
+    column.map = static_cast<const char*>(map);
+    column.mapped = capacity;
+    return true;
+}
+
+size_t PostIndex::append(Column& column, const void* data, size_t length) {
+    if (column.fd < 0) {
+        return SIZE_MAX;
+    }
+    size_t offset = column.size;
+    const char* bytes = static_cast<const char*>(data);
+    size_t written = 0;
+    while (written < length) {
+        ssize_t result = pwrite(column.fd, bytes + written, length - written,
+                                static_cast<off_t>(sizeof(FileHeader) + offset + written));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            std::cerr << "Failed to write post index: " << std::strerror(errno) << std::endl;
+            return SIZE_MAX;
+        }
+        written += static_cast<size_t>(result);
+    }
+    if (!map_column(column, offset + length)) {
+        return SIZE_MAX;
+    }
+    column.size = offset + length;
+    return offset;
+}
+
+const char* PostIndex::column_data(const Column& column) const {
+    return column.map ? column.map + sizeof(FileHeader) : nullptr;
+}
+
+size_t PostIndex::size() const {
+    return posts.size / sizeof(PostRecord);
+}
+
+size_t PostIndex::tag_count() const {
+    return tags.size / sizeof(uint64_t);
+}
+
+std::string_view PostIndex::string_at(uint64_t offset) const {
+    if (offset >= strings.size) {
+        return {};
+    }
+    const char* start = column_data(strings) + offset;
+    const void* end = std::memchr(start, '\0', strings.size - offset);
+    return end ? std::string_view(start, static_cast<const char*>(end) - start) : std::string_view();
+}
+
+uint64_t PostIndex::add_string(std::string_view text) {
+    if (text.empty()) {
+        return 0;
+    }
+    size_t offset = append(strings, text.data(), text.size());
+    if (offset == SIZE_MAX || append(strings, "", 1) == SIZE_MAX) {
+        return 0;
+    }
+    return offset;
+}
+
+std::string_view PostIndex::tag_name(TagId id) const {
+    if (id >= tag_count()) {
+        return {};
+    }
+    uint64_t offset;
+    std::memcpy(&offset, column_data(tags) + static_cast<size_t>(id) * sizeof(offset), sizeof(offset));
+    return string_at(offset);
+}
+
+void PostIndex::load_tag_ids() const {
+    if (tag_ids_loaded) {
+        return;
+    }
+    tag_ids_loaded = true;
+    size_t count = tag_count();
+    tag_ids.reserve(count);
+    for (size_t id = 0; id < count; ++id) {
+        tag_ids.emplace(std::string(tag_name(static_cast<TagId>(id))), static_cast<TagId>(id));
+    }
+}
+
+bool PostIndex::find_tag(std::string_view name, TagId& id) const {
+    load_tag_ids();
+    auto it = tag_ids.find(std::string(name));
+    if (it == tag_ids.end()) {
+        return false;
+    }
+    id = it->second;
+    return true;
+}
+
+bool PostIndex::intern(std::string_view name, TagId& id) {
+    if (find_tag(name, id)) {
+        return true;
+    }
+    uint64_t offset = add_string(name);
+    if (offset == 0) {
+        return false;
+    }
+    TagId next = static_cast<TagId>(tag_count());
+    if (append(tags, &offset, sizeof(offset)) == SIZE_MAX) {
+        return false;
+    }
+    tag_ids.emplace(std::string(name), next);
+    id = next;
+    return true;
+}
+
+const PostIndex::TagId* PostIndex::tags_of(size_t index, size_t& count) const {
+    count = 0;
+    if (index >= size()) {
+        return nullptr;
+    }
+    const auto* record = reinterpret_cast<const PostRecord*>(column_data(posts)) + index;
+    size_t available = tag_lists.size / sizeof(TagId);
+    if (record->tags > available || record->tag_count > available - record->tags) {
+        return nullptr;
+    }
+    count = record->tag_count;
+    return reinterpret_cast<const TagId*>(column_data(tag_lists)) + record->tags;
+}
+
+bool PostIndex::has_tag(size_t index, TagId tag) const {
+    size_t count = 0;
+    const TagId* list = tags_of(index, count);
+    return list && std::binary_search(list, list + count, tag);
+}
+
+uint32_t PostIndex::width(size_t index) const {
+    return index < size() ? reinterpret_cast<const PostRecord*>(column_data(posts))[index].width : 0;
+}
+
+uint32_t PostIndex::height(size_t index) const {
+    return index < size() ? reinterpret_cast<const PostRecord*>(column_data(posts))[index].height : 0;
+}
+
+char PostIndex::rating(size_t index) const {
+    return index < size() ? reinterpret_cast<const PostRecord*>(column_data(posts))[index].rating : '\0';
+}
+
+DanbooruImage PostIndex::post(size_t index) const {
+    DanbooruImage image{};
+    if (index >= size()) {
+        return image;
+    }
+    const auto* record = reinterpret_cast<const PostRecord*>(column_data(posts)) + index;
+
+    image.id = std::to_string(record->id);
+    image.file_url = std::string(string_at(record->file_url));
+    image.large_file_url = std::string(string_at(record->large_file_url));
+    image.preview_file_url = std::string(string_at(record->preview_file_url));
+    image.width = static_cast<int>(record->width);
+    image.height = static_cast<int>(record->height);
+    if (record->rating) {
+        image.rating = std::string(1, record->rating);
+    }
+    image.file_ext = std::string(record->file_ext, strnlen(record->file_ext, sizeof(record->file_ext)));
+    if (record->flags & flag_has_md5) {
+        static const char digits[] = "0123456789abcdef";
+        for (uint8_t byte : record->md5) {
+            image.md5 += digits[byte >> 4];
+            image.md5 += digits[byte & 0xf];
+        }
+    }
+
+    size_t count = 0;
+    const TagId* list = tags_of(index, count);
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0) {
+            image.tags += ' ';
+        }
+        image.tags += tag_name(list[i]);
+    }
+
+    image.filename = default_filename(image);
+    return image;
+}
+
+size_t PostIndex::add(const PostSet& new_posts) {
+    if (posts.fd < 0) {
+        return 0;
+    }
+
+    DirectoryLock lock(lock_fd);
+    size_t known_posts = size();
+    size_t known_tags = tag_count();
+    // Data before records, as they were written
+    if (!refresh_column(strings) || !refresh_column(tags) || !refresh_column(tag_lists) ||
+        !refresh_column(posts)) {
+        // Whatever the old mappings still show belongs to another index, and
+        // pages past a truncated end fault when touched
+        std::cerr << "Post index in " << directory << " was replaced by another process, going without it"
+                  << std::endl;
+        close_columns();
+        tag_ids.clear();
+        post_ids.clear();
+        return 0;
+    }
+    if (tag_ids_loaded) {
+        for (size_t id = known_tags; id < tag_count(); ++id) {
+            tag_ids.emplace(std::string(tag_name(static_cast<TagId>(id))), static_cast<TagId>(id));
+        }
+    }
+    if (post_ids_loaded) {
+        const auto* records = reinterpret_cast<const PostRecord*>(column_data(posts));
+        for (size_t i = known_posts; i < size(); ++i) {
+            post_ids.insert(records[i].id);
+        }
+    }
+    if (!post_ids_loaded) {
+        post_ids_loaded = true;
+        const auto* records = reinterpret_cast<const PostRecord*>(column_data(posts));
+        post_ids.reserve(size());
+        for (size_t i = 0; i < size(); ++i) {
+            post_ids.insert(records[i].id);
+        }
+    }
+
+    using Field = PostSet::Field;
+    size_t added = 0;
+    std::vector<TagId> tag_list;
+    for (size_t row = 0; row < new_posts.size(); ++row) {
+        uint64_t id = new_posts.id(row);
+        std::string_view file_url = new_posts.text(row, Field::file_url);
+        if (id == 0 || file_url.empty() || post_ids.count(id)) {
+            continue;
+        }
+
+        tag_list.clear();
+        std::string_view rest = new_posts.text(row, Field::tags);
+        bool ok = true;
+        while (ok && !rest.empty()) {
+            size_t space = rest.find(' ');
+            std::string_view name = rest.substr(0, space);
+            rest = space == std::string_view::npos ? std::string_view() : rest.substr(space + 1);
+            TagId tag;
+            if (!name.empty()) {
+                ok = intern(name, tag);
+                tag_list.push_back(tag);
+            }
+        }
+        if (!ok) {
+            return added;
+        }
+        std::sort(tag_list.begin(), tag_list.end());
+        tag_list.erase(std::unique(tag_list.begin(), tag_list.end()), tag_list.end());
+
+        std::string_view large_file_url = new_posts.text(row, Field::large_file_url);
+        std::string_view file_ext = new_posts.text(row, Field::file_ext);
+        PostRecord record{};
+        record.id = id;
+        record.file_url = add_string(file_url);
+        record.large_file_url = large_file_url == file_url ? record.file_url : add_string(large_file_url);
+        record.preview_file_url = add_string(new_posts.text(row, Field::preview_file_url));
+        record.width = static_cast<uint32_t>(std::max(new_posts.width(row), 0));
+        record.height = static_cast<uint32_t>(std::max(new_posts.height(row), 0));
+        record.rating = new_posts.rating(row);
+        file_ext.copy(record.file_ext, std::min(file_ext.size(), sizeof(record.file_ext)));
+        if (parse_md5(new_posts.text(row, Field::md5), record.md5)) {
+            record.flags |= flag_has_md5;
+        }
+
+        record.tags = tag_lists.size / sizeof(TagId);
+        record.tag_count = static_cast<uint32_t>(tag_list.size());
+        if (!tag_list.empty() && append(tag_lists, tag_list.data(), tag_list.size() * sizeof(TagId)) == SIZE_MAX) {
+            return added;
+        }
+
+        // Last, so the record never points at data that isn't written yet
+        if (append(posts, &record, sizeof(record)) == SIZE_MAX) {
+            return added;
+        }
+        post_ids.insert(id);
+        ++added;
+    }
+    return added;
+}
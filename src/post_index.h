@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "danbooru_client.h"
+#include "post_set.h"
+
+// Local copy of the metadata of every post searches and mirror runs have
+// seen, so posts can be picked and filtered without asking the API. The
+// index is four append-only files, used through memory maps as they are:
+//
+//   posts.bin      one fixed-size record per post
+//   strings.bin    NUL-terminated URLs and tag names
+//   tags.bin       interned tags: the string offset of each tag id
+//   tag_lists.bin  the sorted tag ids of each post
+//
+// Opening maps the files without reading them, so startup doesn't slow
+// down as the index grows and only the pages in use stay resident. Each
+// file starts with a magic and format version, and an index written by
+// another version is started over; any other error leaves the index
+// unused for the run. A record is appended after the data it
+// points to, so a crash can leave unreferenced bytes but no dangling record.
+//
+// Several processes can share an index, such as the app and a --mirror
+// run. Appends hold an flock() on the directory and first take in what the
+// others have appended; reads see that once the next add() has run. Files
+// are never truncated while in use, only replaced by renaming new ones in.
+class PostIndex {
+public:
+    using TagId = uint32_t;
+
+    explicit PostIndex(std::string directory);
+    ~PostIndex();
+
+    PostIndex(const PostIndex&) = delete;
+    PostIndex& operator=(const PostIndex&) = delete;
+
+    // $XDG_CACHE_HOME/elysia/index
+    static std::string default_directory();
+
+    size_t size() const;
+    DanbooruImage post(size_t index) const;
+
+    // Single fields of post `index`, read straight from its record
+    uint32_t width(size_t index) const;
+    uint32_t height(size_t index) const;
+    // Danbooru's one-letter rating, or 0 if unknown
+    char rating(size_t index) const;
+
+    // Appends the posts that aren't indexed yet and returns how many there
+    // were. Posts already indexed keep their first recorded metadata.
+    size_t add(const PostSet& posts);
+
+    size_t tag_count() const;
+    bool find_tag(std::string_view name, TagId& id) const;
+    std::string_view tag_name(TagId id) const;
+    // Sorted ids of the tags of post `index`
+    const TagId* tags_of(size_t index, size_t& count) const;
+    bool has_tag(size_t index, TagId tag) const;
+
+private:
+    // One append-only file and its read-only mapping. The mapping reserves
+    // room beyond the end of the file, so most appends don't remap.
+    struct Column {
+        int fd = -1;
+        const char* map = nullptr;
+        size_t mapped = 0;
+        // Bytes after the header
+        size_t size = 0;
+        size_t element_size = 1;
+        const char* name = nullptr;
+    };
+
+    enum class OpenResult { opened, wrong_format, failed };
+
+    std::string directory;
+    // The directory itself, to flock()
+    int lock_fd;
+    Column posts;
+    Column strings;
+    Column tags;
+    Column tag_lists;
+
+    // Built on first use, so opening stays free of any scan
+    mutable std::unordered_map<std::string, TagId> tag_ids;
+    mutable bool tag_ids_loaded;
+    std::unordered_set<uint64_t> post_ids;
+    bool post_ids_loaded;
+
+    OpenResult open_columns();
+    OpenResult open_column(Column& column, const char* name, const char* magic);
+    // Replaces the four files with empty ones
+    bool start_over();
+    void close_columns();
+    void close_column(Column& column);
+    bool map_column(Column& column, size_t needed);
+    // Takes in what other processes appended; false if the file shrank or
+    // was replaced
+    bool refresh_column(Column& column);
+    // Returns the offset of the data within the column, or SIZE_MAX on failure
+    size_t append(Column& column, const void* data, size_t length);
+    const char* column_data(const Column& column) const;
+
+    std::string_view string_at(uint64_t offset) const;
+    uint64_t add_string(std::string_view text);
+    bool intern(std::string_view name, TagId& id);
+    void load_tag_ids() const;
+};
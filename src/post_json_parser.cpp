@@ -0,0 +1,256 @@
+#include "post_json_parser.h"
+#include <cstring>
+
+namespace {
+
+class Scanner {
+public:
+    explicit Scanner(std::string_view json) : p(json.data()), end(json.data() + json.size()) {}
+
+    bool parse(PostJsonHandler& handler) {
+        skip_ws();
+        if (p == end) return false;
+        if (*p == '{') {
+            // Error bodies ({"success":false,...}) are valid JSON with no posts
+            return skip_value();
+        }
+        if (*p != '[') return false;
+        ++p;
+
+        skip_ws();
+        if (p < end && *p == ']') return true;
+
+        while (p < end) {
+            skip_ws();
+            if (p == end) return false;
+            if (*p == '{') {
+                if (!parse_post(handler)) return false;
+            } else if (!skip_value()) {
+                return false;
+            }
+
+            skip_ws();
+            if (p == end) return false;
+            if (*p == ',') { ++p; continue; }
+            if (*p == ']') { ++p; return true; }
+            return false;
+        }
+        return false;
+    }
+
+private:
+    const char* p;
+    const char* end;
+
+    void skip_ws() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) ++p;
+    }
+
+    // Expects p at the opening quote; leaves p past the closing quote.
+    bool scan_string(std::string_view& out, bool& has_escapes) {
+        ++p;
+        const char* start = p;
+        while (p < end) {
+            const char* quote = static_cast<const char*>(std::memchr(p, '"', end - p));
+            if (!quote) return false;
+
+            // A quote is escaped if it is preceded by an odd run of backslashes
+            const char* b = quote;
+            while (b > start && b[-1] == '\\') --b;
+            if (((quote - b) & 1) == 0) {
+                has_escapes = std::memchr(start, '\\', quote - start) != nullptr;
+                out = std::string_view(start, quote - start);
+                p = quote + 1;
+                return true;
+            }
+            p = quote + 1;
+        }
+        return false;
+    }
+
+    bool scan_literal(std::string_view& out) {
+        const char* start = p;
+        while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+               *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t') {
+            ++p;
+        }
+        if (p == start) return false;
+        out = std::string_view(start, p - start);
+        return true;
+    }
+
+    // Skips any value, including nested containers, without reporting it.
+    bool skip_value() {
+        int depth = 0;
+        do {
+            skip_ws();
+            if (p == end) return false;
+            char c = *p;
+            if (c == '"') {
+                std::string_view ignored;
+                bool escapes;
+                if (!scan_string(ignored, escapes)) return false;
+            } else if (c == '{' || c == '[') {
+                ++depth;
+                ++p;
+            } else if (c == '}' || c == ']') {
+                if (depth == 0) return false;
+                --depth;
+                ++p;
+            } else if (c == ',' || c == ':') {
+                if (depth == 0) return false;
+                ++p;
+            } else {
+                std::string_view ignored;
+                if (!scan_literal(ignored)) return false;
+            }
+        } while (depth > 0);
+        return true;
+    }
+
+    bool parse_post(PostJsonHandler& handler) {
+        ++p;
+        handler.begin_post();
+
+        skip_ws();
+        if (p < end && *p == '}') {
+            ++p;
+            handler.end_post();
+            return true;
+        }
+
+        while (p < end) {
+            skip_ws();
+            if (p == end || *p != '"') return false;
+
+            std::string_view key;
+            bool key_escapes;
+            if (!scan_string(key, key_escapes)) return false;
+
+            skip_ws();
+            if (p == end || *p != ':') return false;
+            ++p;
+            skip_ws();
+            if (p == end) return false;
+
+            JsonValue value;
+            if (*p == '"') {
+                value.is_string = true;
+                if (!scan_string(value.text, value.has_escapes)) return false;
+                handler.field(key, value);
+            } else if (*p == '{' || *p == '[') {
+                if (!skip_value()) return false;
+            } else {
+                if (!scan_literal(value.text)) return false;
+                handler.field(key, value);
+            }
+
+            skip_ws();
+            if (p == end) return false;
+            if (*p == ',') { ++p; continue; }
+            if (*p == '}') {
+                ++p;
+                handler.end_post();
+                return true;
+            }
+            return false;
+        }
+        return false;
+    }
+};
+
+void append_utf8(std::string& out, unsigned int cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+bool read_hex4(std::string_view raw, size_t pos, unsigned int& cp) {
+    if (pos + 4 > raw.size()) return false;
+    cp = 0;
+    for (size_t i = pos; i < pos + 4; ++i) {
+        char c = raw[i];
+        cp <<= 4;
+        if (c >= '0' && c <= '9') cp |= c - '0';
+        else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+        else return false;
+    }
+    return true;
+}
+
+} // namespace
+
+std::string JsonValue::to_string() const {
+    if (has_escapes) {
+        return json_unescape(text);
+    }
+    return std::string(text);
+}
+
+bool parse_posts_json(std::string_view json, PostJsonHandler& handler) {
+    Scanner scanner(json);
+    return scanner.parse(handler);
+}
+
+std::string json_unescape(std::string_view raw) {
+    std::string out;
+    out.reserve(raw.size());
+
+    for (size_t i = 0; i < raw.size(); ++i) {
+        char c = raw[i];
+        if (c != '\\' || i + 1 == raw.size()) {
+            out += c;
+            continue;
+        }
+
+        char e = raw[++i];
+        switch (e) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned int cp;
+                if (!read_hex4(raw, i + 1, cp)) {
+                    out += "\\u";
+                    break;
+                }
+                i += 4;
+                // Combine UTF-16 surrogate pairs
+                if (cp >= 0xD800 && cp <= 0xDBFF && i + 2 < raw.size() &&
+                    raw[i + 1] == '\\' && raw[i + 2] == 'u') {
+                    unsigned int low;
+                    if (read_hex4(raw, i + 3, low) && low >= 0xDC00 && low <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    }
+                }
+                append_utf8(out, cp);
+                break;
+            }
+            default:
+                out += '\\';
+                out += e;
+                break;
+        }
+    }
+
+    return out;
+}
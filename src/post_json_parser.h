@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// A scalar value as it appears in the response buffer. For strings, `text` is
+// the raw contents between the quotes (escape sequences left intact); for
+// numbers, booleans and null it is the literal token.
+struct JsonValue {
+    std::string_view text;
+    bool is_string = false;
+    bool has_escapes = false;
+
+    std::string to_string() const;
+};
+
+// Receives the top-level fields of every post in a posts.json array.
+// Nested objects and arrays inside a post (media_asset, variants, ...) are
+// skipped and never reported, so keys like "id" can't be confused with the
+// ids of nested records.
+class PostJsonHandler {
+public:
+    virtual ~PostJsonHandler() = default;
+
+    virtual void begin_post() = 0;
+    virtual void field(std::string_view key, const JsonValue& value) = 0;
+    virtual void end_post() = 0;
+};
+
+// Walks `json` once, calling `handler` for each post. Views handed to the
+// handler point into `json` and are only valid for the duration of the call.
+// A top-level object (e.g. an API error body) yields no posts.
+// Returns false if the input is malformed; posts completed before the error
+// have already been delivered.
+bool parse_posts_json(std::string_view json, PostJsonHandler& handler);
+
+// Decodes JSON string escapes (\" \\ \/ \b \f \n \r \t \uXXXX) into UTF-8.
+std::string json_unescape(std::string_view raw);
@@ -0,0 +1,83 @@
+#include "post_set.h"
+#include "danbooru_client.h"
+
+void PostSet::reserve(size_t posts, size_t text_bytes) {
+    arena.reserve(text_bytes);
+    ids.reserve(posts);
+    widths.reserve(posts);
+    heights.reserve(posts);
+    ratings.reserve(posts);
+    spans.reserve(posts * field_count);
+}
+
+void PostSet::add(uint64_t id, int width, int height, char rating,
+                  const std::array<std::string_view, field_count>& texts) {
+    ids.push_back(id);
+    widths.push_back(width);
+    heights.push_back(height);
+    ratings.push_back(rating);
+    for (std::string_view text : texts) {
+        spans.push_back(Span{static_cast<uint32_t>(arena.size()), static_cast<uint32_t>(text.size())});
+        arena.append(text);
+    }
+}
+
+void PostSet::append(const PostSet& other) {
+    uint32_t base = static_cast<uint32_t>(arena.size());
+    arena.append(other.arena);
+    ids.insert(ids.end(), other.ids.begin(), other.ids.end());
+    widths.insert(widths.end(), other.widths.begin(), other.widths.end());
+    heights.insert(heights.end(), other.heights.begin(), other.heights.end());
+    ratings.insert(ratings.end(), other.ratings.begin(), other.ratings.end());
+    spans.reserve(spans.size() + other.spans.size());
+    for (const Span& span : other.spans) {
+        spans.push_back(Span{base + span.offset, span.length});
+    }
+}
+
+void PostSet::set_page(size_t rows, uint64_t oldest_id) {
+    page_row_count = rows;
+    page_min_id = oldest_id;
+}
+
+std::string_view PostSet::text(size_t row, Field field) const {
+    const Span& span = spans[row * field_count + static_cast<size_t>(field)];
+    return std::string_view(arena).substr(span.offset, span.length);
+}
+
+PostSet::Selection PostSet::all() const {
+    Selection rows(size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+        rows[i] = static_cast<uint32_t>(i);
+    }
+    return rows;
+}
+
+DanbooruImage PostSet::post(size_t row) const {
+    DanbooruImage image;
+    image.id = std::to_string(ids[row]);
+    image.file_url = std::string(text(row, Field::file_url));
+    image.large_file_url = std::string(text(row, Field::large_file_url));
+    image.preview_file_url = std::string(text(row, Field::preview_file_url));
+    image.tags = std::string(text(row, Field::tags));
+    image.rating = ratings[row] ? std::string(1, ratings[row]) : std::string();
+    image.md5 = std::string(text(row, Field::md5));
+    image.file_ext = std::string(text(row, Field::file_ext));
+    image.width = widths[row];
+    image.height = heights[row];
+    image.filename = default_filename(image);
+    return image;
+}
+
+std::vector<DanbooruImage> PostSet::posts(const Selection& rows) const {
+    std::vector<DanbooruImage> result;
+    result.reserve(rows.size());
+    for (uint32_t row : rows) {
+        result.push_back(post(row));
+    }
+    return result;
+}
+
+std::vector<DanbooruImage> PostSet::to_vector() const {
+    return posts(all());
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct DanbooruImage;
+
+// The posts of a search page, stored by column instead of as one
+// DanbooruImage each: all text in a single arena, numbers in flat arrays.
+// A page of a hundred posts is a handful of allocations instead of seven
+// strings per post, copying it is as cheap, and filters run over the
+// columns and return row numbers rather than copies. DanbooruImages are
+// only built for the rows that need one.
+class PostSet {
+public:
+    enum class Field {
+        file_url,
+        large_file_url,
+        preview_file_url,
+        tags,
+        md5,
+        file_ext
+    };
+    static constexpr size_t field_count = 6;
+
+    // Row numbers into a set, in the set's order
+    using Selection = std::vector<uint32_t>;
+
+    void reserve(size_t posts, size_t text_bytes);
+    void add(uint64_t id, int width, int height, char rating,
+             const std::array<std::string_view, field_count>& texts);
+    // Adds every row of `other` after the rows already here
+    void append(const PostSet& other);
+
+    size_t size() const { return ids.size(); }
+    bool empty() const { return ids.empty(); }
+
+    uint64_t id(size_t row) const { return ids[row]; }
+    int width(size_t row) const { return widths[row]; }
+    int height(size_t row) const { return heights[row]; }
+    // Danbooru's one-letter rating, or 0 if unknown
+    char rating(size_t row) const { return ratings[row]; }
+    std::string_view text(size_t row, Field field) const;
+
+    // The search page the set was parsed from, counting the posts dropped
+    // for having no file: how many it held, and the smallest id among them
+    size_t page_rows() const { return page_row_count; }
+    uint64_t page_oldest_id() const { return page_min_id; }
+    void set_page(size_t rows, uint64_t oldest_id);
+
+    // Every row
+    Selection all() const;
+
+    DanbooruImage post(size_t row) const;
+    std::vector<DanbooruImage> posts(const Selection& rows) const;
+    std::vector<DanbooruImage> to_vector() const;
+
+private:
+    struct Span {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    std::string arena;
+    std::vector<uint64_t> ids;
+    std::vector<int> widths;
+    std::vector<int> heights;
+    std::vector<char> ratings;
+    // field_count spans per row
+    std::vector<Span> spans;
+    size_t page_row_count = 0;
+    uint64_t page_min_id = 0;
+};
@@ -0,0 +1,417 @@
+#include "prefetch_queue.h"
+#include "image_scaler.h"
+#include "texture_decoder.h"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace {
+
+// Consecutive failed downloads/decodes before a waiting caller gets an error
+constexpr size_t max_failed_fetches = 3;
+
+// Pools of nothing but recently shown posts asked for before giving in and
+// showing repeats
+constexpr size_t max_repeated_pools = 3;
+
+// Danbooru scales samples down to this width
+constexpr int sample_width = 850;
+
+std::mt19937& random_engine() {
+    static std::mt19937 gen{std::random_device{}()};
+    return gen;
+}
+
+} // namespace
+
+PrefetchQueue::PrefetchQueue(ImageStore& store, CandidateSource source, size_t depth, size_t max_texture_bytes,
+                             size_t no_repeat)
+    : store(store), source(std::move(source)), depth(std::max<size_t>(depth, 1)),
+      max_texture_bytes(max_texture_bytes), display_width(0), display_height(0), ready_bytes(0), reserved_bytes(0),
+      next_serial(1), requesting_candidates(false), failed_fetches(0), repeated_pools(0), allow_repeats(false),
+      no_repeat(no_repeat), upgrade_serial(0),
+      cancellable(g_cancellable_new()) {
+}
+
+PrefetchQueue::~PrefetchQueue() {
+    // Decodes still running on worker threads see the cancellation and drop
+    // their result without touching this object
+    g_cancellable_cancel(cancellable);
+    g_object_unref(cancellable);
+
+    while (!items.empty()) {
+        drop_item(items.begin());
+    }
+    for (auto& image : ready) {
+        g_object_unref(image.texture);
+    }
+}
+
+void PrefetchQueue::set_display_size(int width, int height) {
+    display_width = std::max(width, 0);
+    display_height = std::max(height, 0);
+}
+
+size_t PrefetchQueue::estimate_texture_bytes(const DanbooruImage& post) const {
+    int width = std::max(post.width, 1);
+    int height = std::max(post.height, 1);
+    if (image_url(post, ImageVariant::sample) != post.file_url) {
+        fit_within(width, height, sample_width, 0, width, height);
+    }
+    fit_within(width, height, display_width, display_height, width, height);
+    return static_cast<size_t>(width) * static_cast<size_t>(height) * 4;
+}
+
+void PrefetchQueue::take_next(ReadyCallback on_ready) {
+    waiter = std::move(on_ready);
+    failed_fetches = 0;
+
+    // The caller has moved on from the post whose preview it is showing
+    if (upgrade) {
+        upgrade = nullptr;
+        auto it = items.find(upgrade_serial);
+        if (it != items.end()) {
+            drop_item(it);
+        }
+    }
+
+    if (!ready.empty()) {
+        deliver();
+    }
+    fill();
+
+    if (waiter && ready.empty()) {
+        for (auto& entry : items) {
+            start_preview(entry.first);
+        }
+        deliver();
+    }
+}
+
+void PrefetchQueue::fill() {
+    while (ready.size() + items.size() < depth) {
+        if (failed_fetches >= max_failed_fetches) {
+            if (ready.empty() && items.empty()) {
+                fail_waiter("Failed to download image.", false);
+            }
+            return;
+        }
+        if (candidates.empty()) {
+            request_candidates();
+            return;
+        }
+
+        std::uniform_int_distribution<size_t> dis(0, candidates.size() - 1);
+        size_t index = dis(random_engine());
+        DanbooruImage post = std::move(candidates[index]);
+        candidates[index] = std::move(candidates.back());
+        candidates.pop_back();
+        if (!allow_repeats && is_repeat(post)) {
+            continue;
+        }
+
+        // Always allow one image, however large, so the queue can't stall
+        size_t estimate = estimate_texture_bytes(post);
+        if (ready.size() + items.size() > 0 && ready_bytes + reserved_bytes + estimate > max_texture_bytes) {
+            candidates.push_back(std::move(post));
+            return;
+        }
+
+        start_fetch(std::move(post), estimate);
+    }
+}
+
+void PrefetchQueue::request_candidates() {
+    if (requesting_candidates) {
+        return;
+    }
+    requesting_candidates = true;
+
+    source([this](std::vector<DanbooruImage> new_candidates, const std::string& error) {
+        requesting_candidates = false;
+
+        if (!error.empty()) {
+            fail_waiter(error, false);
+            return;
+        }
+        if (new_candidates.empty()) {
+            if (ready.empty() && items.empty()) {
+                fail_waiter("", true);
+            }
+            return;
+        }
+
+        size_t unseen = std::count_if(new_candidates.begin(), new_candidates.end(),
+                                      [this](const DanbooruImage& post) { return !is_repeat(post); });
+        if (unseen == 0 && ++repeated_pools < max_repeated_pools) {
+            std::cout << "All " << new_candidates.size() << " candidates were shown recently, asking for more" << std::endl;
+            request_candidates();
+            return;
+        }
+        // A tag smaller than the no-repeat window has to repeat eventually
+        allow_repeats = unseen == 0;
+        repeated_pools = 0;
+
+        candidates = std::move(new_candidates);
+        fill();
+    });
+}
+
+bool PrefetchQueue::is_repeat(const DanbooruImage& post) const {
+    if (recent_ids.count(post.id)) {
+        return true;
+    }
+    for (const auto& image : ready) {
+        if (image.post.id == post.id) {
+            return true;
+        }
+    }
+    for (const auto& entry : items) {
+        if (entry.second.post.id == post.id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PrefetchQueue::remember(const DanbooruImage& post) {
+    if (no_repeat == 0 || !recent_ids.insert(post.id).second) {
+        return;
+    }
+    recent.push_back(post.id);
+    if (recent.size() > no_repeat) {
+        recent_ids.erase(recent.front());
+        recent.pop_front();
+    }
+}
+
+void PrefetchQueue::start_fetch(DanbooruImage post, size_t estimate) {
+    guint64 serial = next_serial++;
+    Item& item = items[serial];
+    item.post = std::move(post);
+    item.reserved_bytes = estimate;
+    reserved_bytes += estimate;
+
+    try {
+        // Completes right away for posts that are already stored
+        ImageStore::FetchId id = store.fetch(item.post, ImageVariant::sample,
+            [this, serial](const ImageStore::StoredImage& image, const std::string& error) {
+                auto it = items.find(serial);
+                if (it != items.end()) {
+                    it->second.fetch = 0;
+                }
+                if (!error.empty()) {
+                    finish_item(serial, nullptr);
+                    return;
+                }
+                start_decode(new DecodeJob{this, serial, false}, image.bytes);
+            });
+        auto it = items.find(serial);
+        if (it != items.end()) {
+            it->second.fetch = id;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error prefetching image: " << e.what() << std::endl;
+        auto it = items.find(serial);
+        if (it != items.end()) {
+            drop_item(it);
+        }
+        ++failed_fetches;
+        return;
+    }
+
+    if (waiter && ready.empty()) {
+        start_preview(serial);
+    }
+}
+
+void PrefetchQueue::start_preview(guint64 serial) {
+    auto it = items.find(serial);
+    if (it == items.end() || it->second.preview_requested || it->second.shown) {
+        return;
+    }
+    Item& item = it->second;
+    item.preview_requested = true;
+    // Without a separate thumbnail the "preview" would be the sample itself
+    if (image_url(item.post, ImageVariant::preview) == image_url(item.post, ImageVariant::sample)) {
+        return;
+    }
+
+    try {
+        ImageStore::FetchId id = store.fetch(item.post, ImageVariant::preview,
+            [this, serial](const ImageStore::StoredImage& image, const std::string& error) {
+                auto it = items.find(serial);
+                if (it != items.end()) {
+                    it->second.preview_fetch = 0;
+                }
+                if (error.empty()) {
+                    start_decode(new DecodeJob{this, serial, true}, image.bytes);
+                }
+            });
+        it = items.find(serial);
+        if (it != items.end()) {
+            it->second.preview_fetch = id;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error fetching preview: " << e.what() << std::endl;
+    }
+}
+
+void PrefetchQueue::start_decode(DecodeJob* job, GBytes* bytes) {
+    decode_texture_async(bytes, display_width, display_height, cancellable, on_decoded, job);
+}
+
+void PrefetchQueue::on_decoded(GObject* source_object, GAsyncResult* result, gpointer user_data) {
+    std::unique_ptr<DecodeJob> job(static_cast<DecodeJob*>(user_data));
+
+    GError* error = nullptr;
+    GdkTexture* texture = decode_texture_finish(result, &error);
+    if (error) {
+        bool cancelled = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+        if (cancelled) {
+            // The queue has been destroyed
+            g_error_free(error);
+            return;
+        }
+        std::cerr << "Failed to decode " << (job->is_preview ? "preview" : "image")
+                  << " of post " << job->serial << ": " << error->message << std::endl;
+        g_error_free(error);
+    }
+
+    if (job->is_preview) {
+        job->queue->finish_preview(job->serial, texture);
+    } else {
+        job->queue->finish_item(job->serial, texture);
+    }
+}
+
+void PrefetchQueue::finish_item(guint64 serial, GdkTexture* texture) {
+    auto it = items.find(serial);
+    if (it == items.end()) {
+        // Dropped while decoding
+        if (texture) {
+            g_object_unref(texture);
+        }
+        return;
+    }
+    DanbooruImage post = it->second.post;
+    bool shown = it->second.shown;
+    drop_item(it);
+
+    if (shown) {
+        if (!texture) {
+            std::cerr << "Keeping the preview of post " << post.id << std::endl;
+        } else if (upgrade && upgrade_serial == serial) {
+            ReadyCallback on_upgrade = std::move(upgrade);
+            upgrade = nullptr;
+
+            PrefetchResult result;
+            result.post = std::move(post);
+            result.texture = texture;
+            result.is_upgrade = true;
+            on_upgrade(std::move(result));
+        } else {
+            g_object_unref(texture);
+        }
+        fill();
+        return;
+    }
+
+    if (!texture) {
+        ++failed_fetches;
+        fill();
+        return;
+    }
+
+    size_t bytes = static_cast<size_t>(gdk_texture_get_width(texture)) * gdk_texture_get_height(texture) * 4;
+    ready.push_back(ReadyImage{post, texture, bytes});
+    ready_bytes += bytes;
+    failed_fetches = 0;
+    std::cout << "Prefetched image " << post.id << " (" << ready.size() << " ready, "
+              << ready_bytes / (1024 * 1024) << " MiB of textures)" << std::endl;
+
+    deliver();
+    fill();
+}
+
+void PrefetchQueue::finish_preview(guint64 serial, GdkTexture* texture) {
+    if (!texture) {
+        return;
+    }
+    auto it = items.find(serial);
+    if (it == items.end() || it->second.shown || it->second.preview) {
+        g_object_unref(texture);
+        return;
+    }
+    it->second.preview = texture;
+    deliver();
+}
+
+void PrefetchQueue::drop_item(std::map<guint64, Item>::iterator it) {
+    Item& item = it->second;
+    if (item.fetch) {
+        store.cancel(item.fetch);
+    }
+    if (item.preview_fetch) {
+        store.cancel(item.preview_fetch);
+    }
+    if (item.preview) {
+        g_object_unref(item.preview);
+    }
+    reserved_bytes -= item.reserved_bytes;
+    items.erase(it);
+}
+
+void PrefetchQueue::deliver() {
+    if (!waiter) {
+        return;
+    }
+
+    PrefetchResult result;
+    if (!ready.empty()) {
+        ReadyImage image = std::move(ready.front());
+        ready.pop_front();
+        ready_bytes -= image.bytes;
+
+        result.post = std::move(image.post);
+        result.texture = image.texture;
+    } else {
+        // Nothing ready yet: show a thumbnail while its sample finishes
+        auto it = std::find_if(items.begin(), items.end(), [](const std::pair<const guint64, Item>& entry) {
+            return entry.second.preview && !entry.second.shown;
+        });
+        if (it == items.end()) {
+            return;
+        }
+        Item& item = it->second;
+        item.shown = true;
+        result.post = item.post;
+        result.texture = item.preview;
+        result.is_preview = true;
+        item.preview = nullptr;
+
+        upgrade = waiter;
+        upgrade_serial = it->first;
+    }
+
+    remember(result.post);
+    ReadyCallback on_ready = std::move(waiter);
+    waiter = nullptr;
+    on_ready(std::move(result));
+}
+
+void PrefetchQueue::fail_waiter(const std::string& error, bool no_images) {
+    if (!waiter) {
+        return;
+    }
+
+    ReadyCallback on_ready = std::move(waiter);
+    waiter = nullptr;
+
+    PrefetchResult result;
+    result.error = error;
+    result.no_images = no_images;
+    on_ready(std::move(result));
+}
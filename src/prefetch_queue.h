@@ -0,0 +1,148 @@
+#pragma once
+
+#include <gtk/gtk.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "danbooru_client.h"
+#include "image_store.h"
+
+struct PrefetchResult {
+    DanbooruImage post;
+    // Transfer full: the receiver owns this reference
+    GdkTexture* texture = nullptr;
+    // Set when no image could be produced
+    std::string error;
+    // True if the candidate source had nothing to offer (not an error)
+    bool no_images = false;
+    // `texture` is the post's thumbnail; the sample follows as an upgrade
+    bool is_preview = false;
+    // `texture` replaces the preview delivered earlier for the same post
+    bool is_upgrade = false;
+};
+
+// Keeps up to `depth` posts fetched into the ImageStore and decoded into
+// textures ahead of time, so showing the next image is a swap instead of a
+// round-trip. Textures are scaled down on the decode thread to fit the
+// display size, so only what can be shown is kept in memory. Posts are
+// prefetched as Danbooru's samples, which are plenty for the window;
+// originals are only fetched when saving.
+//
+// When nothing is ready, the posts in flight also fetch their thumbnails.
+// The first thumbnail to decode is delivered right away with `is_preview`,
+// and the same callback is called again with `is_upgrade` once that post's
+// sample is decoded, unless take_next() is called first.
+//
+// Posts delivered within the last `no_repeat` deliveries are skipped when
+// picking candidates, unless the candidate source keeps offering nothing
+// else.
+// Decoding happens on GLib's worker threads; everything else runs on the
+// main context.
+class PrefetchQueue {
+public:
+    using CandidatesCallback = std::function<void(std::vector<DanbooruImage> candidates, const std::string& error)>;
+    // Asked for a fresh pool of posts whenever the current one runs dry
+    using CandidateSource = std::function<void(CandidatesCallback on_done)>;
+    using ReadyCallback = std::function<void(PrefetchResult result)>;
+
+    PrefetchQueue(ImageStore& store, CandidateSource source, size_t depth, size_t max_texture_bytes,
+                  size_t no_repeat);
+    ~PrefetchQueue();
+
+    PrefetchQueue(const PrefetchQueue&) = delete;
+    PrefetchQueue& operator=(const PrefetchQueue&) = delete;
+
+    // Delivers the next image, immediately if one is ready. A later call
+    // replaces a callback that is still waiting.
+    void take_next(ReadyCallback on_ready);
+
+    // Starts fetching until `depth` images are ready or in flight, or the
+    // texture memory budget is used up
+    void fill();
+
+    // Size in device pixels that textures decoded from now on are fitted
+    // into; 0 leaves that direction unbounded
+    void set_display_size(int width, int height);
+
+    // Samples ready to show; previews don't count
+    size_t ready_count() const { return ready.size(); }
+    size_t texture_bytes() const { return ready_bytes; }
+
+private:
+    struct ReadyImage {
+        DanbooruImage post;
+        GdkTexture* texture;
+        size_t bytes;
+    };
+
+    // A post being fetched or decoded
+    struct Item {
+        DanbooruImage post;
+        size_t reserved_bytes = 0;
+        ImageStore::FetchId fetch = 0;
+        ImageStore::FetchId preview_fetch = 0;
+        bool preview_requested = false;
+        // Decoded thumbnail, until it is delivered
+        GdkTexture* preview = nullptr;
+        // The preview has been delivered; the sample goes to `upgrade`
+        bool shown = false;
+    };
+
+    struct DecodeJob {
+        PrefetchQueue* queue;
+        guint64 serial;
+        bool is_preview;
+    };
+
+    ImageStore& store;
+    CandidateSource source;
+    size_t depth;
+    size_t max_texture_bytes;
+    int display_width;
+    int display_height;
+
+    std::deque<ReadyImage> ready;
+    size_t ready_bytes;
+    // Estimated texture size of everything downloading or decoding
+    size_t reserved_bytes;
+    std::map<guint64, Item> items;
+    guint64 next_serial;
+
+    std::vector<DanbooruImage> candidates;
+    bool requesting_candidates;
+    size_t failed_fetches;
+    // Consecutive candidate pools made up only of recently shown posts
+    size_t repeated_pools;
+    // Set when the current pool is used despite holding only repeats
+    bool allow_repeats;
+
+    // Ids of the last `no_repeat` delivered posts, oldest first
+    size_t no_repeat;
+    std::deque<std::string> recent;
+    std::set<std::string> recent_ids;
+
+    ReadyCallback waiter;
+    // Caller whose preview is showing, waiting for the sample of `upgrade_serial`
+    ReadyCallback upgrade;
+    guint64 upgrade_serial;
+    GCancellable* cancellable;
+
+    size_t estimate_texture_bytes(const DanbooruImage& post) const;
+    // Shown recently, or already ready or in flight
+    bool is_repeat(const DanbooruImage& post) const;
+    void remember(const DanbooruImage& post);
+    void request_candidates();
+    void start_fetch(DanbooruImage post, size_t estimate);
+    void start_preview(guint64 serial);
+    void start_decode(DecodeJob* job, GBytes* bytes);
+    void finish_item(guint64 serial, GdkTexture* texture);
+    void finish_preview(guint64 serial, GdkTexture* texture);
+    void drop_item(std::map<guint64, Item>::iterator it);
+    void deliver();
+    void fail_waiter(const std::string& error, bool no_images);
+
+    static void on_decoded(GObject* source_object, GAsyncResult* result, gpointer user_data);
+};
@@ -0,0 +1,85 @@
+#include "rate_limiter.h"
+#include <glib.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+
+// Answers within this long of a cut are taken as part of the same overload
+constexpr std::chrono::milliseconds decrease_interval(1000);
+
+} // namespace
+
+RateLimitOptions RateLimitOptions::from_environment() {
+    RateLimitOptions options;
+    const char* value = g_getenv("ELYSIA_API_RATE");
+    if (value && *value) {
+        double rate = std::atof(value);
+        if (rate > 0) {
+            options.max_rate = rate;
+            options.min_rate = std::min(options.min_rate, rate);
+            options.initial_rate = std::min(options.initial_rate, rate);
+        }
+    }
+    return options;
+}
+
+HostRateLimiter::HostRateLimiter(const RateLimitOptions& options)
+    : options(options), current_rate(options.initial_rate), window(options.initial_concurrency),
+      tokens(options.burst), running(0) {
+}
+
+void HostRateLimiter::refill(Clock::time_point now) {
+    if (now > refilled_at) {
+        std::chrono::duration<double> elapsed = now - refilled_at;
+        tokens = std::min(options.burst, tokens + elapsed.count() * current_rate);
+    }
+    refilled_at = std::max(refilled_at, now);
+}
+
+HostRateLimiter::Clock::duration HostRateLimiter::wait(Clock::time_point now) {
+    if (running >= static_cast<int>(window)) {
+        return Clock::duration::max();
+    }
+    if (paused_until > now) {
+        return paused_until - now;
+    }
+    refill(now);
+    if (tokens >= 1.0) {
+        return Clock::duration::zero();
+    }
+    std::chrono::duration<double> until_token((1.0 - tokens) / current_rate);
+    return std::chrono::ceil<Clock::duration>(until_token);
+}
+
+void HostRateLimiter::started(Clock::time_point now) {
+    refill(now);
+    tokens = std::max(tokens - 1.0, 0.0);
+    ++running;
+}
+
+void HostRateLimiter::finished(Outcome outcome, Clock::time_point now, Clock::duration retry_after) {
+    running = std::max(running - 1, 0);
+
+    switch (outcome) {
+    case Outcome::success:
+        // Additive increase: about one request per second more each second,
+        // and one more in flight per window of completions
+        current_rate = std::min(options.max_rate, current_rate + 1.0 / current_rate);
+        window = std::min(options.max_concurrency, window + 1.0 / window);
+        break;
+    case Outcome::throttled:
+        paused_until = std::max(paused_until, now + retry_after);
+        if (now - decreased_at >= decrease_interval) {
+            decreased_at = now;
+            current_rate = std::max(options.min_rate, current_rate / 2.0);
+            window = std::max(1.0, window / 2.0);
+            refill(now);
+            tokens = 0.0;
+        }
+        break;
+    case Outcome::neutral:
+        break;
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+
+struct RateLimitOptions {
+    // Requests per second the token bucket starts at, and the range it
+    // adapts within
+    double initial_rate = 4.0;
+    double min_rate = 0.25;
+    double max_rate = 10.0;
+    // Requests that may go out back to back after an idle spell
+    double burst = 4.0;
+    // Requests in flight at once, adapted the same way
+    double initial_concurrency = 2.0;
+    double max_concurrency = 8.0;
+
+    // The defaults, with the rate ceiling from $ELYSIA_API_RATE if set
+    static RateLimitOptions from_environment();
+};
+
+// Decides when the next request to one host may start. A token bucket
+// spaces requests out to `rate` per second and a window caps how many are
+// in flight. Both adapt AIMD style: every success grows them a little,
+// about one request per second and one more in flight per round trip,
+// while a throttled answer halves them and, with a Retry-After, pauses the
+// host for that long. Sustained traffic so settles just under the server's
+// limit and keeps probing for more.
+class HostRateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class Outcome {
+        success,
+        // 429, or 503 from an overloaded server
+        throttled,
+        // Network errors and other failures, which say nothing about the
+        // limit; also cancelled requests
+        neutral
+    };
+
+    explicit HostRateLimiter(const RateLimitOptions& options = RateLimitOptions());
+
+    // How long until another request may start: zero if it may start now,
+    // Clock::duration::max() if it has to wait for one to finish
+    Clock::duration wait(Clock::time_point now);
+    // Takes a token and a place in the window; only after wait() was zero
+    void started(Clock::time_point now);
+    // `retry_after` is the server's Retry-After, zero if it sent none
+    void finished(Outcome outcome, Clock::time_point now, Clock::duration retry_after = Clock::duration::zero());
+
+    double rate() const { return current_rate; }
+    double concurrency() const { return window; }
+    int in_flight() const { return running; }
+
+private:
+    RateLimitOptions options;
+    double current_rate;
+    double window;
+    double tokens;
+    int running;
+    Clock::time_point refilled_at;
+    Clock::time_point paused_until;
+    // Several answers to requests sent before a cut are one signal, not many
+    Clock::time_point decreased_at;
+
+    void refill(Clock::time_point now);
+};
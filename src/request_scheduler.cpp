@@ -0,0 +1,215 @@
+#include "request_scheduler.h"
+#include "http_header.h"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+constexpr int max_attempts = 4;
+
+// Backoff before retry n is drawn from [0, min(cap, base * 2^n))
+constexpr std::chrono::milliseconds backoff_base(500);
+constexpr std::chrono::milliseconds backoff_cap(30000);
+
+// A server asking for a longer pause than this gets the error passed on
+// instead, so a refresh doesn't hang
+constexpr std::chrono::seconds max_retry_after(60);
+
+// Failures of the connection rather than of the request
+bool is_transient(CURLcode code) {
+    switch (code) {
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+double seconds(RequestScheduler::Clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+}
+
+} // namespace
+
+RequestScheduler::RequestScheduler(TransferEngine& engine, GMainContext* context, RateLimitOptions options)
+    : engine(engine), context(context), options(options), timer(nullptr), random(std::random_device{}()) {
+}
+
+RequestScheduler::~RequestScheduler() {
+    if (timer) {
+        g_source_destroy(timer);
+        g_source_unref(timer);
+    }
+}
+
+void RequestScheduler::submit(TransferEngine::TransferId id, const std::string& url, RequestFactory make_request,
+                              TransferEngine::Completion on_done) {
+    std::string name(url_origin(url));
+    auto it = hosts.find(name);
+    if (it == hosts.end()) {
+        it = hosts.emplace(name, Host{HostRateLimiter(options), {}}).first;
+    }
+    Request request;
+    request.id = id;
+    request.url = url;
+    request.make_request = std::move(make_request);
+    request.on_done = std::move(on_done);
+    it->second.queue.push_back(std::move(request));
+
+    // Started from the main loop, so a request that fails to start can't
+    // complete before the caller has its id
+    schedule_wakeup(Clock::duration::zero());
+}
+
+bool RequestScheduler::cancel(TransferEngine::TransferId id) {
+    auto on_wire = running.find(id);
+    if (on_wire != running.end()) {
+        hosts.at(on_wire->second).limiter.finished(HostRateLimiter::Outcome::neutral, Clock::now());
+        running.erase(on_wire);
+        schedule_wakeup(Clock::duration::zero());
+        return true;
+    }
+    for (auto& entry : hosts) {
+        auto& queue = entry.second.queue;
+        auto it = std::find_if(queue.begin(), queue.end(), [id](const Request& request) { return request.id == id; });
+        if (it != queue.end()) {
+            queue.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+void RequestScheduler::pump() {
+    Clock::time_point now = Clock::now();
+    Clock::duration next_wakeup = Clock::duration::max();
+
+    for (auto& entry : hosts) {
+        Host& host = entry.second;
+        while (!host.queue.empty()) {
+            // First in line among those not backing off
+            auto ready = std::find_if(host.queue.begin(), host.queue.end(),
+                                      [now](const Request& request) { return request.not_before <= now; });
+            if (ready == host.queue.end()) {
+                auto soonest = std::min_element(host.queue.begin(), host.queue.end(),
+                    [](const Request& a, const Request& b) { return a.not_before < b.not_before; });
+                next_wakeup = std::min(next_wakeup, soonest->not_before - now);
+                break;
+            }
+            // A full window is reopened by the next completion, not a timer
+            Clock::duration wait = host.limiter.wait(now);
+            if (wait != Clock::duration::zero()) {
+                next_wakeup = std::min(next_wakeup, wait);
+                break;
+            }
+            Request request = std::move(*ready);
+            host.queue.erase(ready);
+            start(host, entry.first, std::move(request));
+        }
+    }
+
+    if (next_wakeup != Clock::duration::max()) {
+        schedule_wakeup(next_wakeup);
+    }
+}
+
+void RequestScheduler::start(Host& host, const std::string& name, Request request) {
+    TransferEngine::TransferId id = request.id;
+    host.limiter.started(Clock::now());
+    running[id] = name;
+    try {
+        CURL* handle = request.make_request();
+        auto completion = [this, name, request](const TransferResult& result) {
+            finished(name, request, result);
+        };
+        engine.restart(id, handle, std::move(completion));
+    } catch (const std::exception& e) {
+        running.erase(id);
+        host.limiter.finished(HostRateLimiter::Outcome::neutral, Clock::now());
+        TransferResult result;
+        result.code = CURLE_FAILED_INIT;
+        result.error = e.what();
+        result.id = id;
+        request.on_done(result);
+    }
+}
+
+void RequestScheduler::finished(const std::string& name, Request request, const TransferResult& result) {
+    running.erase(request.id);
+    Host& host = hosts.at(name);
+    Clock::time_point now = Clock::now();
+
+    curl_off_t retry_after_seconds = 0;
+    curl_easy_getinfo(result.easy, CURLINFO_RETRY_AFTER, &retry_after_seconds);
+    Clock::duration retry_after = std::chrono::seconds(std::max<curl_off_t>(retry_after_seconds, 0));
+
+    long status = result.http_status;
+    bool throttled = result.ok() && (status == 429 || status == 503);
+    bool retry = throttled || (result.ok() && status >= 500) || is_transient(result.code);
+    HostRateLimiter::Outcome outcome = HostRateLimiter::Outcome::neutral;
+    if (throttled) {
+        outcome = HostRateLimiter::Outcome::throttled;
+    } else if (result.ok() && status < 400) {
+        outcome = HostRateLimiter::Outcome::success;
+    }
+    host.limiter.finished(outcome, now, retry_after);
+
+    if (retry && request.attempt + 1 < max_attempts && retry_after <= max_retry_after) {
+        Clock::duration delay = std::max(backoff(request.attempt), retry_after);
+        std::ostringstream message;
+        message << std::fixed << std::setprecision(1) << request.url << ": "
+                << (result.ok() ? "HTTP " + std::to_string(status) : result.error) << ", retrying in "
+                << seconds(delay) << " s (" << host.limiter.rate() << " requests/s, "
+                << static_cast<int>(host.limiter.concurrency()) << " at once)";
+        std::cerr << message.str() << std::endl;
+
+        ++request.attempt;
+        request.not_before = now + delay;
+        // Ahead of requests that haven't been tried yet
+        host.queue.push_front(std::move(request));
+    } else {
+        request.on_done(result);
+    }
+    pump();
+}
+
+RequestScheduler::Clock::duration RequestScheduler::backoff(int attempt) {
+    auto ceiling = std::min<std::chrono::milliseconds>(backoff_cap, backoff_base * (1 << std::min(attempt, 16)));
+    std::uniform_int_distribution<long long> dis(0, ceiling.count());
+    return std::chrono::milliseconds(dis(random));
+}
+
+void RequestScheduler::schedule_wakeup(Clock::duration delay) {
+    Clock::time_point due = Clock::now() + delay;
+    if (timer && timer_due <= due) {
+        return;
+    }
+    if (timer) {
+        g_source_destroy(timer);
+        g_source_unref(timer);
+    }
+    timer_due = due;
+    auto delay_ms = std::chrono::ceil<std::chrono::milliseconds>(delay).count();
+    timer = g_timeout_source_new(static_cast<guint>(std::max<long long>(delay_ms, 0)));
+    g_source_set_callback(timer, on_timer, this, nullptr);
+    g_source_attach(timer, context);
+}
+
+gboolean RequestScheduler::on_timer(gpointer user_data) {
+    RequestScheduler* self = static_cast<RequestScheduler*>(user_data);
+    // The main loop drops the source when we return G_SOURCE_REMOVE, and
+    // pump() may set a new one
+    g_source_unref(self->timer);
+    self->timer = nullptr;
+    self->pump();
+    return G_SOURCE_REMOVE;
+}
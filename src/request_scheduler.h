@@ -0,0 +1,69 @@
+#pragma once
+
+#include <curl/curl.h>
+#include <glib.h>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include "rate_limiter.h"
+#include "transfer_engine.h"
+
+// Paces API requests per host through a HostRateLimiter and retries the
+// ones the server turned away: 429 and 5xx answers and dropped
+// connections come back after an exponential backoff with full jitter, or
+// after the server's Retry-After if that is longer. Only the final answer
+// reaches the caller, which still has to check its HTTP status.
+//
+// Owned by a TransferEngine (see TransferEngine::submit); requests waiting
+// here keep their engine id, so TransferEngine::cancel() reaches them too.
+class RequestScheduler {
+public:
+    using Clock = HostRateLimiter::Clock;
+    using RequestFactory = TransferEngine::RequestFactory;
+
+    RequestScheduler(TransferEngine& engine, GMainContext* context, RateLimitOptions options);
+    ~RequestScheduler();
+
+    RequestScheduler(const RequestScheduler&) = delete;
+    RequestScheduler& operator=(const RequestScheduler&) = delete;
+
+    void submit(TransferEngine::TransferId id, const std::string& url, RequestFactory make_request,
+                TransferEngine::Completion on_done);
+    // Drops a queued request or frees the place of a running one; false if
+    // `id` isn't one of ours
+    bool cancel(TransferEngine::TransferId id);
+
+private:
+    struct Request {
+        TransferEngine::TransferId id;
+        std::string url;
+        RequestFactory make_request;
+        TransferEngine::Completion on_done;
+        int attempt = 0;
+        // Set while backing off
+        Clock::time_point not_before;
+    };
+
+    struct Host {
+        HostRateLimiter limiter;
+        std::deque<Request> queue;
+    };
+
+    TransferEngine& engine;
+    GMainContext* context;
+    RateLimitOptions options;
+    std::map<std::string, Host> hosts;
+    // Host of every request that is on the wire
+    std::map<TransferEngine::TransferId, std::string> running;
+    GSource* timer;
+    Clock::time_point timer_due;
+    std::mt19937 random;
+
+    void pump();
+    void start(Host& host, const std::string& name, Request request);
+    void finished(const std::string& name, Request request, const TransferResult& result);
+    Clock::duration backoff(int attempt);
+    void schedule_wakeup(Clock::duration delay);
+    static gboolean on_timer(gpointer user_data);
+};
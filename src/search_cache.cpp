@@ -0,0 +1,245 @@
+#include "search_cache.h"
+#include <glib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
+
+namespace {
+
+constexpr const char* file_header = "elysia-search-cache 1";
+
+// Responses nobody asked for in this long are deleted at startup
+constexpr auto expired_file_age = std::chrono::hours(24 * 7);
+
+// Pages kept parsed in memory
+constexpr size_t max_entries = 64;
+
+struct CacheFile {
+    std::string key;
+    std::string etag;
+    std::string last_modified;
+    std::time_t fetched_at = 0;
+    std::string body;
+};
+
+// A file for the writer thread; without a body, the stored one is kept
+struct Write {
+    std::string path;
+    CacheFile file;
+    bool has_body;
+};
+
+bool read_cache_file(const std::string& path, CacheFile& cache_file) {
+    std::ifstream file(path, std::ios::binary);
+    std::string line;
+    if (!std::getline(file, line) || line != file_header) {
+        return false;
+    }
+
+    // "name value" lines up to a blank line, then the response body
+    while (std::getline(file, line) && !line.empty()) {
+        size_t space = line.find(' ');
+        std::string name = line.substr(0, space);
+        std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+        if (name == "key") {
+            cache_file.key = value;
+        } else if (name == "etag") {
+            cache_file.etag = value;
+        } else if (name == "last-modified") {
+            cache_file.last_modified = value;
+        } else if (name == "fetched") {
+            cache_file.fetched_at = static_cast<std::time_t>(std::atoll(value.c_str()));
+        }
+    }
+
+    std::ostringstream body;
+    body << file.rdbuf();
+    cache_file.body = body.str();
+    return true;
+}
+
+void write_cache_file(const std::string& path, const CacheFile& cache_file) {
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+    // Written to a temp file and renamed, so a crash never leaves half a response
+    std::string temp_path = path + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        file << file_header << "\n"
+             << "key " << cache_file.key << "\n"
+             << "etag " << cache_file.etag << "\n"
+             << "last-modified " << cache_file.last_modified << "\n"
+             << "fetched " << static_cast<long long>(cache_file.fetched_at) << "\n"
+             << "\n"
+             << cache_file.body;
+        if (!file.flush()) {
+            std::cerr << "Failed to write search cache file " << temp_path << std::endl;
+            file.close();
+            unlink(temp_path.c_str());
+            return;
+        }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+    }
+}
+
+void run_write(gpointer data, gpointer) {
+    std::unique_ptr<Write> write(static_cast<Write*>(data));
+    if (!write->has_body) {
+        // Revalidated: same response, new time
+        CacheFile stored;
+        if (!read_cache_file(write->path, stored) || stored.key != write->file.key) {
+            return;
+        }
+        write->file.body = std::move(stored.body);
+    }
+    write_cache_file(write->path, write->file);
+}
+
+} // namespace
+
+SearchCache::SearchCache(std::string directory, int ttl_seconds)
+    : directory(std::move(directory)), ttl_seconds(ttl_seconds), writer(nullptr) {
+    remove_expired_files();
+    writer = g_thread_pool_new(run_write, nullptr, 1, TRUE, nullptr);
+}
+
+SearchCache::~SearchCache() {
+    g_thread_pool_free(writer, FALSE, TRUE);
+}
+
+std::string SearchCache::default_directory() {
+    char* path = g_build_filename(g_get_user_cache_dir(), "elysia", "search", NULL);
+    std::string result = path;
+    g_free(path);
+    return result;
+}
+
+std::string SearchCache::make_key(const std::vector<std::string>& tags, int limit, const std::string& page) {
+    std::set<std::string> normalized;
+    for (const auto& tag : tags) {
+        std::string lower;
+        for (char c : tag) {
+            if (!std::isspace(static_cast<unsigned char>(c))) {
+                lower += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            }
+        }
+        if (!lower.empty()) {
+            normalized.insert(lower);
+        }
+    }
+
+    std::ostringstream key;
+    key << "tags=";
+    bool first = true;
+    for (const auto& tag : normalized) {
+        key << (first ? "" : " ") << tag;
+        first = false;
+    }
+    key << "&limit=" << limit << "&page=" << page;
+    return key.str();
+}
+
+const SearchCache::Entry* SearchCache::find(const std::string& key) {
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        lru.splice(lru.begin(), lru, it->second.used);
+        return &it->second;
+    }
+
+    Entry entry;
+    if (!load(key, entry)) {
+        return nullptr;
+    }
+    return &remember(key, std::move(entry));
+}
+
+bool SearchCache::is_fresh(const Entry& entry) const {
+    return std::time(nullptr) - entry.fetched_at < ttl_seconds;
+}
+
+void SearchCache::store(const std::string& key, std::string body, PostSet posts,
+                        const std::string& etag, const std::string& last_modified) {
+    Entry entry;
+    entry.posts = std::move(posts);
+    entry.etag = etag;
+    entry.last_modified = last_modified;
+    entry.fetched_at = std::time(nullptr);
+    save(key, remember(key, std::move(entry)), std::move(body), true);
+}
+
+void SearchCache::revalidated(const std::string& key) {
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        return;
+    }
+    it->second.fetched_at = std::time(nullptr);
+    save(key, it->second, std::string(), false);
+}
+
+SearchCache::Entry& SearchCache::remember(const std::string& key, Entry entry) {
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        lru.erase(it->second.used);
+        entries.erase(it);
+    }
+    while (entries.size() >= max_entries) {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+    lru.push_front(key);
+    entry.used = lru.begin();
+    return entries[key] = std::move(entry);
+}
+
+std::string SearchCache::file_for(const std::string& key) const {
+    gchar* digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key.c_str(), -1);
+    std::string path = directory + "/" + digest + ".cache";
+    g_free(digest);
+    return path;
+}
+
+bool SearchCache::load(const std::string& key, Entry& entry) const {
+    CacheFile file;
+    if (!read_cache_file(file_for(key), file) || file.key != key) {
+        return false;
+    }
+    entry.etag = std::move(file.etag);
+    entry.last_modified = std::move(file.last_modified);
+    entry.fetched_at = file.fetched_at;
+    entry.posts = DanbooruClient::parse_post_set(file.body);
+    return true;
+}
+
+void SearchCache::save(const std::string& key, const Entry& entry, std::string body, bool has_body) {
+    auto* write = new Write{file_for(key), {}, has_body};
+    write->file.key = key;
+    write->file.etag = entry.etag;
+    write->file.last_modified = entry.last_modified;
+    write->file.fetched_at = entry.fetched_at;
+    write->file.body = std::move(body);
+    g_thread_pool_push(writer, write, nullptr);
+}
+
+void SearchCache::remove_expired_files() const {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    auto now = fs::file_time_type::clock::now();
+    for (auto it = fs::directory_iterator(directory, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        std::error_code time_ec;
+        auto modified = it->last_write_time(time_ec);
+        if (!time_ec && now - modified > expired_file_age) {
+            fs::remove(it->path(), time_ec);
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <glib.h>
+#include <ctime>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "danbooru_client.h"
+
+// Remembers posts.json responses per normalized query. Within `ttl` a
+// search is answered from memory without touching the network; after that
+// the stored ETag / Last-Modified let the server answer 304 instead of
+// resending the page. Responses are also written to `directory`, so the
+// cache survives restarts. Only the parsed posts of the most recently used
+// pages stay in memory; the rest are read back from their files.
+class SearchCache {
+public:
+    struct Entry {
+        PostSet posts;
+        std::string etag;
+        std::string last_modified;
+        std::time_t fetched_at = 0;
+        // Position in `lru`
+        std::list<std::string>::iterator used;
+    };
+
+    SearchCache(std::string directory, int ttl_seconds);
+    // Waits for the files still being written
+    ~SearchCache();
+
+    SearchCache(const SearchCache&) = delete;
+    SearchCache& operator=(const SearchCache&) = delete;
+
+    // $XDG_CACHE_HOME/elysia/search
+    static std::string default_directory();
+
+    // Tags are lowercased, deduplicated and sorted, since Danbooru doesn't
+    // care about their order
+    static std::string make_key(const std::vector<std::string>& tags, int limit, const std::string& page);
+
+    // The stored response for `key`, fresh or not; null if there is none.
+    // Valid until the next find() or store().
+    const Entry* find(const std::string& key);
+    bool is_fresh(const Entry& entry) const;
+
+    void store(const std::string& key, std::string body, PostSet posts,
+               const std::string& etag, const std::string& last_modified);
+
+    // The server confirmed the entry is unchanged (304); restarts its TTL
+    void revalidated(const std::string& key);
+
+private:
+    std::string directory;
+    int ttl_seconds;
+    std::map<std::string, Entry> entries;
+    // Keys of `entries`, most recently used first
+    std::list<std::string> lru;
+    // Writes the files, one at a time and in order
+    GThreadPool* writer;
+
+    Entry& remember(const std::string& key, Entry entry);
+    std::string file_for(const std::string& key) const;
+    bool load(const std::string& key, Entry& entry) const;
+    // Without a body, the one already in the file is kept
+    void save(const std::string& key, const Entry& entry, std::string body, bool has_body);
+    void remove_expired_files() const;
+};
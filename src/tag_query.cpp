@@ -0,0 +1,389 @@
+#include "tag_query.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <sstream>
+#include <string_view>
+#include <utility>
+
+namespace {
+
+bool parse_number(std::string_view text, uint32_t& value) {
+    if (text.empty()) {
+        return false;
+    }
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+// N, >=N, >N, <=N, <N, A..B, A.. or ..B
+bool parse_range(std::string_view text, TagQuery::Range& range) {
+    uint32_t value = 0;
+    if (text.compare(0, 2, ">=") == 0) {
+        return parse_number(text.substr(2), range.min);
+    }
+    if (text.compare(0, 2, "<=") == 0) {
+        return parse_number(text.substr(2), range.max);
+    }
+    if (text.compare(0, 1, ">") == 0) {
+        if (!parse_number(text.substr(1), value) || value == UINT32_MAX) {
+            return false;
+        }
+        range.min = value + 1;
+        return true;
+    }
+    if (text.compare(0, 1, "<") == 0) {
+        if (!parse_number(text.substr(1), value)) {
+            return false;
+        }
+        // "<0" matches nothing: an empty range, min above max
+        range.min = value == 0 ? 1 : range.min;
+        range.max = value == 0 ? 0 : value - 1;
+        return true;
+    }
+    size_t dots = text.find("..");
+    if (dots == std::string_view::npos) {
+        if (!parse_number(text, value)) {
+            return false;
+        }
+        range.min = range.max = value;
+        return true;
+    }
+    std::string_view low = text.substr(0, dots);
+    std::string_view high = text.substr(dots + 2);
+    if (low.empty() && high.empty()) {
+        return false;
+    }
+    return (low.empty() || parse_number(low, range.min)) && (high.empty() || parse_number(high, range.max));
+}
+
+// Narrows `range` to the values both it and `other` allow
+void intersect(TagQuery::Range& range, const TagQuery::Range& other) {
+    range.min = std::max(range.min, other.min);
+    range.max = std::min(range.max, other.max);
+}
+
+void and_in(QueryEngine::Bitset& target, const QueryEngine::Bitset& other) {
+    for (size_t i = 0; i < target.size(); ++i) {
+        target[i] &= other[i];
+    }
+}
+
+void and_not_in(QueryEngine::Bitset& target, const QueryEngine::Bitset& other) {
+    for (size_t i = 0; i < target.size(); ++i) {
+        target[i] &= ~other[i];
+    }
+}
+
+void or_in(QueryEngine::Bitset& target, const QueryEngine::Bitset& other) {
+    for (size_t i = 0; i < target.size(); ++i) {
+        target[i] |= other[i];
+    }
+}
+
+size_t word_count(size_t bits) {
+    return (bits + 63) / 64;
+}
+
+// Danbooru's ratings by letter or full name
+bool parse_rating(std::string_view value, uint8_t& bit) {
+    static const std::pair<std::string_view, char> names[] = {
+        {"g", 'g'}, {"general", 'g'}, {"s", 's'}, {"sensitive", 's'},
+        {"q", 'q'}, {"questionable", 'q'}, {"e", 'e'}, {"explicit", 'e'},
+    };
+    for (const auto& name : names) {
+        if (value == name.first) {
+            bit = TagQuery::rating_bit(name.second);
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+uint8_t TagQuery::rating_bit(char rating) {
+    switch (rating) {
+    case 'g':
+        return 1;
+    case 's':
+        return 2;
+    case 'q':
+        return 4;
+    case 'e':
+        return 8;
+    default:
+        return 16;
+    }
+}
+
+bool TagQuery::parse(const std::string& text, TagQuery& query, std::string& error) {
+    query = TagQuery{};
+    std::istringstream terms(text);
+    std::string term;
+    while (terms >> term) {
+        std::transform(term.begin(), term.end(), term.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+        char prefix = term[0] == '-' || term[0] == '~' ? term[0] : '\0';
+        std::string_view body(term);
+        if (prefix) {
+            body.remove_prefix(1);
+        }
+        if (body.empty()) {
+            error = "Empty term in query: " + term;
+            return false;
+        }
+
+        size_t colon = body.find(':');
+        std::string_view name = colon == std::string_view::npos ? std::string_view() : body.substr(0, colon);
+        std::string_view value = colon == std::string_view::npos ? std::string_view() : body.substr(colon + 1);
+
+        if (name == "rating") {
+            if (prefix == '~' || value.empty()) {
+                error = "Unsupported rating term: " + term;
+                return false;
+            }
+            uint8_t bits = 0;
+            while (true) {
+                size_t comma = value.find(',');
+                uint8_t bit = 0;
+                if (!parse_rating(value.substr(0, comma), bit)) {
+                    error = "Unknown rating in query: " + term;
+                    return false;
+                }
+                bits |= bit;
+                if (comma == std::string_view::npos) {
+                    break;
+                }
+                value.remove_prefix(comma + 1);
+            }
+            query.ratings &= prefix == '-' ? static_cast<uint8_t>(~bits & all_ratings) : bits;
+        } else if (name == "width" || name == "height") {
+            Range range;
+            if (prefix || !parse_range(value, range)) {
+                error = "Unsupported size term: " + term;
+                return false;
+            }
+            intersect(name == "width" ? query.width : query.height, range);
+        } else if (prefix == '-') {
+            query.excluded.emplace_back(body);
+        } else if (prefix == '~') {
+            query.any_of.emplace_back(body);
+        } else {
+            query.required.emplace_back(body);
+        }
+    }
+    return true;
+}
+
+bool TagQuery::matches(const DanbooruImage& post) const {
+    return matches(post.tags, post.rating.empty() ? '\0' : post.rating[0], post.width, post.height);
+}
+
+bool TagQuery::matches(const PostSet& posts, size_t row) const {
+    return matches(posts.text(row, PostSet::Field::tags), posts.rating(row), posts.width(row), posts.height(row));
+}
+
+bool TagQuery::matches(std::string_view tag_string, char rating, int post_width, int post_height) const {
+    // Cheap column checks first; most filters never get to the tags
+    if ((ratings & rating_bit(rating)) == 0 || !width.contains(static_cast<uint32_t>(std::max(post_width, 0))) ||
+        !height.contains(static_cast<uint32_t>(std::max(post_height, 0)))) {
+        return false;
+    }
+    if (required.empty() && excluded.empty() && any_of.empty()) {
+        return true;
+    }
+
+    std::vector<std::string_view> tags;
+    std::string_view rest(tag_string);
+    while (!rest.empty()) {
+        size_t space = rest.find(' ');
+        std::string_view tag = rest.substr(0, space);
+        if (!tag.empty()) {
+            tags.push_back(tag);
+        }
+        rest = space == std::string_view::npos ? std::string_view() : rest.substr(space + 1);
+    }
+    std::sort(tags.begin(), tags.end());
+    auto has = [&tags](const std::string& tag) { return std::binary_search(tags.begin(), tags.end(), tag); };
+
+    return std::all_of(required.begin(), required.end(), has) &&
+           std::none_of(excluded.begin(), excluded.end(), has) &&
+           (any_of.empty() || std::any_of(any_of.begin(), any_of.end(), has));
+}
+
+QueryEngine::QueryEngine(const PostIndex& index) : index(index), covered(0) {
+}
+
+void QueryEngine::catch_up() {
+    size_t total = index.size();
+    if (covered == total) {
+        return;
+    }
+    if (total < covered) {
+        // The index was dropped after another process started it over
+        covered = 0;
+        widths.clear();
+        heights.clear();
+        ratings.clear();
+        tag_sets.clear();
+    }
+
+    widths.reserve(total);
+    heights.reserve(total);
+    ratings.reserve(total);
+    for (size_t i = covered; i < total; ++i) {
+        widths.push_back(index.width(i));
+        heights.push_back(index.height(i));
+        ratings.push_back(TagQuery::rating_bit(index.rating(i)));
+    }
+
+    // New posts only need checking against the tags already tracked
+    for (auto& entry : tag_sets) {
+        entry.second.resize(word_count(total), 0);
+    }
+    if (!tag_sets.empty()) {
+        for (size_t i = covered; i < total; ++i) {
+            size_t count = 0;
+            const PostIndex::TagId* list = index.tags_of(i, count);
+            for (size_t k = 0; k < count; ++k) {
+                auto it = tag_sets.find(list[k]);
+                if (it != tag_sets.end()) {
+                    it->second[i / 64] |= uint64_t{1} << (i % 64);
+                }
+            }
+        }
+    }
+    covered = total;
+}
+
+const QueryEngine::Bitset* QueryEngine::tag_set(const std::string& name) {
+    PostIndex::TagId id;
+    if (!index.find_tag(name, id)) {
+        return nullptr;
+    }
+    auto it = tag_sets.find(id);
+    if (it != tag_sets.end()) {
+        return &it->second;
+    }
+
+    // Tag lists are sorted, so each post costs one binary search
+    Bitset bits(word_count(covered), 0);
+    for (size_t i = 0; i < covered; ++i) {
+        size_t count = 0;
+        const PostIndex::TagId* list = index.tags_of(i, count);
+        if (list && std::binary_search(list, list + count, id)) {
+            bits[i / 64] |= uint64_t{1} << (i % 64);
+        }
+    }
+    return &(tag_sets[id] = std::move(bits));
+}
+
+QueryEngine::Bitset QueryEngine::range_set(const std::vector<uint32_t>& column, const TagQuery::Range& range) const {
+    Bitset bits(word_count(covered), 0);
+    if (range.max < range.min) {
+        return bits;
+    }
+    // One unsigned comparison per value, branch free, so the inner loop
+    // vectorizes
+    uint32_t span = range.max - range.min;
+    for (size_t word = 0; word < bits.size(); ++word) {
+        size_t base = word * 64;
+        size_t end = std::min(base + 64, covered);
+        uint64_t value = 0;
+        for (size_t i = base; i < end; ++i) {
+            value |= static_cast<uint64_t>(column[i] - range.min <= span) << (i - base);
+        }
+        bits[word] = value;
+    }
+    return bits;
+}
+
+QueryEngine::Bitset QueryEngine::rating_set(uint8_t mask) const {
+    Bitset bits(word_count(covered), 0);
+    for (size_t word = 0; word < bits.size(); ++word) {
+        size_t base = word * 64;
+        size_t end = std::min(base + 64, covered);
+        uint64_t value = 0;
+        for (size_t i = base; i < end; ++i) {
+            value |= static_cast<uint64_t>((ratings[i] & mask) != 0) << (i - base);
+        }
+        bits[word] = value;
+    }
+    return bits;
+}
+
+QueryEngine::Bitset QueryEngine::evaluate(const TagQuery& query) {
+    catch_up();
+
+    Bitset result(word_count(covered), ~uint64_t{0});
+    if (covered % 64 != 0) {
+        result.back() = (uint64_t{1} << (covered % 64)) - 1;
+    }
+
+    for (const auto& tag : query.required) {
+        const Bitset* bits = tag_set(tag);
+        if (!bits) {
+            // No indexed post has it
+            return Bitset(result.size(), 0);
+        }
+        and_in(result, *bits);
+    }
+    for (const auto& tag : query.excluded) {
+        if (const Bitset* bits = tag_set(tag)) {
+            and_not_in(result, *bits);
+        }
+    }
+    if (!query.any_of.empty()) {
+        Bitset any(result.size(), 0);
+        for (const auto& tag : query.any_of) {
+            if (const Bitset* bits = tag_set(tag)) {
+                or_in(any, *bits);
+            }
+        }
+        and_in(result, any);
+    }
+    if (query.ratings != TagQuery::all_ratings) {
+        and_in(result, rating_set(query.ratings));
+    }
+    if (query.width.bounded()) {
+        and_in(result, range_set(widths, query.width));
+    }
+    if (query.height.bounded()) {
+        and_in(result, range_set(heights, query.height));
+    }
+    return result;
+}
+
+size_t QueryEngine::count(const Bitset& bits) {
+    size_t total = 0;
+    for (uint64_t word : bits) {
+        total += static_cast<size_t>(__builtin_popcountll(word));
+    }
+    return total;
+}
+
+std::vector<DanbooruImage> QueryEngine::sample(const TagQuery& query, size_t count, std::mt19937& random,
+                                               const std::function<bool(const DanbooruImage&)>& accept) {
+    Bitset bits = evaluate(query);
+    std::vector<size_t> matches;
+    matches.reserve(QueryEngine::count(bits));
+    for (size_t word = 0; word < bits.size(); ++word) {
+        for (uint64_t value = bits[word]; value != 0; value &= value - 1) {
+            matches.push_back(word * 64 + static_cast<size_t>(__builtin_ctzll(value)));
+        }
+    }
+
+    std::vector<DanbooruImage> result;
+    // Partial Fisher-Yates: only as many draws as it takes to fill `count`
+    for (size_t i = 0; i < matches.size() && result.size() < count; ++i) {
+        std::uniform_int_distribution<size_t> dis(i, matches.size() - 1);
+        std::swap(matches[i], matches[dis(random)]);
+        DanbooruImage post = index.post(matches[i]);
+        if (!accept || accept(post)) {
+            result.push_back(std::move(post));
+        }
+    }
+    return result;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "danbooru_client.h"
+#include "post_index.h"
+#include "post_set.h"
+
+// A parsed tag search in Danbooru's syntax, space-separated:
+//
+//   tag           posts must have the tag
+//   -tag          posts must not have it
+//   ~tag ~other   posts must have at least one of the ~ tags
+//   rating:g,s    rating is one of those listed, by letter or name
+//                 (general, sensitive, questionable, explicit); -rating:e
+//                 excludes
+//   width:500..   width/height bounds: N, >=N, >N, <=N, <N, A..B, A.., ..B
+//
+// It can be checked against a single post, or run over a whole PostIndex
+// by a QueryEngine.
+class TagQuery {
+public:
+    struct Range {
+        uint32_t min = 0;
+        uint32_t max = UINT32_MAX;
+
+        bool bounded() const { return min != 0 || max != UINT32_MAX; }
+        bool contains(uint32_t value) const { return value >= min && value <= max; }
+    };
+
+    // Returns false and sets `error` if `text` isn't a valid query
+    static bool parse(const std::string& text, TagQuery& query, std::string& error);
+
+    bool matches(const DanbooruImage& post) const;
+    bool matches(const PostSet& posts, size_t row) const;
+
+    std::vector<std::string> required;
+    std::vector<std::string> excluded;
+    std::vector<std::string> any_of;
+    // Bit per rating (see rating_bit()); posts outside it don't match
+    uint8_t ratings = all_ratings;
+    Range width;
+    Range height;
+
+    static constexpr uint8_t all_ratings = 0x1f;
+    // g, s, q and e get a bit each; anything else shares the last one
+    static uint8_t rating_bit(char rating);
+
+private:
+    bool matches(std::string_view tags, char rating, int width, int height) const;
+};
+
+// Evaluates TagQuery over a PostIndex with bitsets: one bit per post, one
+// set per tag, combined word by word with AND, OR and AND NOT. Tag sets are
+// built the first time a tag is queried, and width, height and rating are
+// copied into flat columns, so later queries touch no post records at
+// all. Both are extended as the index grows.
+class QueryEngine {
+public:
+    using Bitset = std::vector<uint64_t>;
+
+    explicit QueryEngine(const PostIndex& index);
+
+    QueryEngine(const QueryEngine&) = delete;
+    QueryEngine& operator=(const QueryEngine&) = delete;
+
+    // Bit i is set if post i of the index matches
+    Bitset evaluate(const TagQuery& query);
+
+    static size_t count(const Bitset& bits);
+
+    // Up to `count` matching posts, picked at random, skipping those
+    // `accept` rejects
+    std::vector<DanbooruImage> sample(const TagQuery& query, size_t count, std::mt19937& random,
+                                      const std::function<bool(const DanbooruImage&)>& accept = nullptr);
+
+private:
+    const PostIndex& index;
+    // Posts covered by the columns and tag sets so far
+    size_t covered;
+    std::vector<uint32_t> widths;
+    std::vector<uint32_t> heights;
+    std::vector<uint8_t> ratings;
+    std::unordered_map<PostIndex::TagId, Bitset> tag_sets;
+
+    void catch_up();
+    const Bitset* tag_set(const std::string& name);
+    Bitset range_set(const std::vector<uint32_t>& column, const TagQuery::Range& range) const;
+    Bitset rating_set(uint8_t mask) const;
+};
@@ -0,0 +1,91 @@
+#include "tag_sampler.h"
+#include "search_cache.h"
+#include <algorithm>
+#include <iostream>
+
+namespace {
+
+// Danbooru refuses numbered pages past this for regular accounts
+constexpr long max_page = 1000;
+
+std::string join_tags(const std::vector<std::string>& tags) {
+    std::string joined;
+    for (const auto& tag : tags) {
+        joined += (joined.empty() ? "" : " ") + tag;
+    }
+    return joined;
+}
+
+} // namespace
+
+TagSampler::TagSampler(TransferEngine& engine, SearchCache* cache, int page_size, int count_ttl_seconds)
+    : engine(engine), cache(cache), page_size(std::max(page_size, 1)), count_ttl_seconds(count_ttl_seconds),
+      next_id(1), random(std::random_device{}()) {
+}
+
+TagSampler::~TagSampler() {
+    for (auto& entry : active) {
+        engine.cancel(entry.second);
+    }
+}
+
+TagSampler::SampleId TagSampler::sample(const std::vector<std::string>& tags, DanbooruClient::SearchCallback on_done) {
+    SampleId id = next_id++;
+    std::string key = SearchCache::make_key(tags, 0, "");
+
+    auto it = counts.find(key);
+    if (it != counts.end() && std::time(nullptr) - it->second.fetched_at < count_ttl_seconds) {
+        fetch_page(id, tags, random_page(it->second.posts), std::move(on_done));
+        return active.count(id) ? id : 0;
+    }
+
+    active[id] = DanbooruClient::count_posts_async(engine, tags,
+        [this, id, tags, key, on_done](long posts, const std::string& error) {
+            active.erase(id);
+            if (!error.empty()) {
+                // The first page is still worth trying; it may be cached
+                std::cerr << "Counting posts for " << join_tags(tags) << " failed: " << error << std::endl;
+                fetch_page(id, tags, 1, on_done);
+                return;
+            }
+            std::cout << posts << " posts match " << join_tags(tags) << std::endl;
+            counts[key] = Count{posts, std::time(nullptr)};
+            fetch_page(id, tags, random_page(posts), on_done);
+        });
+    return id;
+}
+
+void TagSampler::cancel(SampleId id) {
+    auto it = active.find(id);
+    if (it == active.end()) {
+        return;
+    }
+    engine.cancel(it->second);
+    active.erase(it);
+}
+
+void TagSampler::fetch_page(SampleId id, const std::vector<std::string>& tags, int page,
+                            DanbooruClient::SearchCallback on_done) {
+    auto callback = [this, id, tags, page, on_done](PostSet posts, const std::string& error) {
+        active.erase(id);
+        if (error.empty() && posts.empty() && page > 1) {
+            // Posts were deleted since the count was taken; count again next time
+            counts.erase(SearchCache::make_key(tags, 0, ""));
+            fetch_page(id, tags, 1, on_done);
+            return;
+        }
+        on_done(std::move(posts), error);
+    };
+
+    TransferEngine::TransferId transfer = DanbooruClient::search_images_async(engine, tags, page_size,
+                                                                              std::to_string(page), callback, cache);
+    if (transfer != 0) {
+        active[id] = transfer;
+    }
+}
+
+int TagSampler::random_page(long posts) {
+    long pages = std::clamp((posts + page_size - 1) / page_size, 1L, max_page);
+    std::uniform_int_distribution<long> dis(1, pages);
+    return static_cast<int>(dis(random));
+}
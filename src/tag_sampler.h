@@ -0,0 +1,57 @@
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "danbooru_client.h"
+#include "transfer_engine.h"
+
+class SearchCache;
+
+// Draws uniformly random pages of a tag search, so refreshes range over
+// every post of a tag instead of only the newest ones. Each query's post
+// count is learned once from /counts/posts.json and remembered for
+// `count_ttl_seconds`; after that a sample is one posts.json request for a
+// page of `page_size` posts, however large the tag is.
+class TagSampler {
+public:
+    using SampleId = guint64;
+
+    TagSampler(TransferEngine& engine, SearchCache* cache, int page_size, int count_ttl_seconds);
+    ~TagSampler();
+
+    TagSampler(const TagSampler&) = delete;
+    TagSampler& operator=(const TagSampler&) = delete;
+
+    // Calls `on_done` with the posts of a random page of `tags`. A page
+    // answered from the search cache completes the call before it returns,
+    // in which case the id is 0.
+    SampleId sample(const std::vector<std::string>& tags, DanbooruClient::SearchCallback on_done);
+
+    // Stops a sample; its callback is never called
+    void cancel(SampleId id);
+
+private:
+    struct Count {
+        long posts;
+        std::time_t fetched_at;
+    };
+
+    TransferEngine& engine;
+    SearchCache* cache;
+    int page_size;
+    int count_ttl_seconds;
+    SampleId next_id;
+    std::mt19937 random;
+
+    // Keyed by SearchCache::make_key() of the tags
+    std::map<std::string, Count> counts;
+    // Transfer each unfinished sample is currently waiting on
+    std::map<SampleId, TransferEngine::TransferId> active;
+
+    void fetch_page(SampleId id, const std::vector<std::string>& tags, int page,
+                    DanbooruClient::SearchCallback on_done);
+    int random_page(long posts);
+};
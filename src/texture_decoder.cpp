@@ -0,0 +1,78 @@
+#include "texture_decoder.h"
+#include "image_scaler.h"
+#include <vector>
+
+namespace {
+
+// What a decode thread needs: the encoded image and the size to fit it into
+struct DecodeRequest {
+    GBytes* bytes;
+    int max_width;
+    int max_height;
+};
+
+void free_decode_request(gpointer data) {
+    auto* request = static_cast<DecodeRequest*>(data);
+    g_bytes_unref(request->bytes);
+    delete request;
+}
+
+// Area-averages `texture` down to `width`x`height`
+GdkTexture* scale_texture(GdkTexture* texture, int width, int height) {
+    int src_width = gdk_texture_get_width(texture);
+    int src_height = gdk_texture_get_height(texture);
+    size_t src_stride = static_cast<size_t>(src_width) * 4;
+    // Premultiplied BGRA, so averaging doesn't bleed color out of
+    // transparent pixels
+    std::vector<guchar> pixels(src_stride * src_height);
+    gdk_texture_download(texture, pixels.data(), src_stride);
+
+    size_t stride = static_cast<size_t>(width) * 4;
+    auto* scaled = static_cast<guchar*>(g_malloc(stride * height));
+    downscale_area(pixels.data(), src_width, src_height, src_stride, scaled, width, height, stride);
+
+    GBytes* bytes = g_bytes_new_take(scaled, stride * height);
+    GdkTexture* result = gdk_memory_texture_new(width, height, GDK_MEMORY_DEFAULT, bytes, stride);
+    g_bytes_unref(bytes);
+    return result;
+}
+
+void decode_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable* cancellable) {
+    auto* request = static_cast<DecodeRequest*>(task_data);
+    if (g_cancellable_is_cancelled(cancellable)) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Decode cancelled");
+        return;
+    }
+
+    GError* error = nullptr;
+    GdkTexture* texture = gdk_texture_new_from_bytes(request->bytes, &error);
+
+    if (texture) {
+        int width = 0;
+        int height = 0;
+        fit_within(gdk_texture_get_width(texture), gdk_texture_get_height(texture),
+                   request->max_width, request->max_height, width, height);
+        if (width < gdk_texture_get_width(texture) && !g_cancellable_is_cancelled(cancellable)) {
+            GdkTexture* scaled = scale_texture(texture, width, height);
+            g_object_unref(texture);
+            texture = scaled;
+        }
+        g_task_return_pointer(task, texture, g_object_unref);
+    } else {
+        g_task_return_error(task, error);
+    }
+}
+
+} // namespace
+
+void decode_texture_async(GBytes* bytes, int max_width, int max_height, GCancellable* cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data) {
+    GTask* task = g_task_new(nullptr, cancellable, callback, user_data);
+    g_task_set_task_data(task, new DecodeRequest{g_bytes_ref(bytes), max_width, max_height}, free_decode_request);
+    g_task_run_in_thread(task, decode_thread);
+    g_object_unref(task);
+}
+
+GdkTexture* decode_texture_finish(GAsyncResult* result, GError** error) {
+    return static_cast<GdkTexture*>(g_task_propagate_pointer(G_TASK(result), error));
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <gtk/gtk.h>
+
+// Decodes `bytes` into a texture on one of GLib's worker threads, scaled
+// down with an area filter to fit `max_width`x`max_height` device pixels
+// (0 leaves that direction unbounded; images are never scaled up).
+// `callback` runs on the calling thread's main context, also when
+// `cancellable` was cancelled, in which case the result is an error.
+void decode_texture_async(GBytes* bytes, int max_width, int max_height, GCancellable* cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data);
+
+// The texture of a finished decode_texture_async(), transfer full; null
+// with `error` set if the bytes weren't an image or it was cancelled
+GdkTexture* decode_texture_finish(GAsyncResult* result, GError** error);
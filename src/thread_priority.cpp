@@ -0,0 +1,17 @@
+#include "thread_priority.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+void lower_thread_priority() {
+#ifdef __linux__
+    struct sched_param param = {};
+    sched_setscheduler(0, SCHED_IDLE, &param);
+    // ioprio_set has no glibc wrapper: IOPRIO_WHO_PROCESS with 0 is the
+    // calling thread, and the idle class is 3 shifted by IOPRIO_CLASS_SHIFT
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+}
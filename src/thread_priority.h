@@ -0,0 +1,6 @@
+#pragma once
+
+// Runs the calling thread only when nothing else wants the CPU, and its
+// disk reads only when nothing else is reading. For background work that
+// may take long but must not be noticed; does nothing off Linux.
+void lower_thread_priority();
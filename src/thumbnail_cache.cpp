@@ -0,0 +1,137 @@
+#include "thumbnail_cache.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+constexpr unsigned char png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+// Text chunks larger than this are not thumbnail metadata
+constexpr uint32_t max_text_chunk = 64 * 1024;
+
+uint32_t read_be32(const unsigned char* bytes) {
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+}
+
+} // namespace
+
+int thumbnail_pixels(ThumbnailSize size) {
+    return size == ThumbnailSize::large ? 256 : 128;
+}
+
+ThumbnailCache::ThumbnailCache(std::string root, std::string application)
+    : root_dir(std::move(root)), application(std::move(application)) {
+}
+
+std::string ThumbnailCache::default_root() {
+    char* path = g_build_filename(g_get_user_cache_dir(), "thumbnails", NULL);
+    std::string result = path;
+    g_free(path);
+    return result;
+}
+
+std::string ThumbnailCache::directory(ThumbnailSize size) const {
+    return root_dir + (size == ThumbnailSize::large ? "/large" : "/normal");
+}
+
+std::string ThumbnailCache::failure_directory() const {
+    return root_dir + "/fail/" + application;
+}
+
+bool ThumbnailCache::describe(const std::string& path, ThumbnailSize size, Entry& entry) const {
+    GStatBuf info;
+    if (g_stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+    // The spec's URIs are of absolute paths, escaped as GLib does
+    GError* error = nullptr;
+    char* absolute = g_canonicalize_filename(path.c_str(), nullptr);
+    char* uri = g_filename_to_uri(absolute, nullptr, &error);
+    g_free(absolute);
+    if (!uri) {
+        g_error_free(error);
+        return false;
+    }
+    entry.uri = uri;
+    g_free(uri);
+    entry.mtime = static_cast<long long>(info.st_mtime);
+    entry.size = static_cast<unsigned long long>(info.st_size);
+
+    gchar* digest = g_compute_checksum_for_string(G_CHECKSUM_MD5, entry.uri.c_str(), -1);
+    std::string name = std::string(digest) + ".png";
+    g_free(digest);
+    entry.thumbnail_path = directory(size) + "/" + name;
+    entry.failure_path = failure_directory() + "/" + name;
+    return true;
+}
+
+bool ThumbnailCache::is_current(const std::string& png_path, const Entry& entry) {
+    std::map<std::string, std::string> texts;
+    if (!read_text_chunks(png_path, texts)) {
+        return false;
+    }
+    auto uri = texts.find("Thumb::URI");
+    auto mtime = texts.find("Thumb::MTime");
+    if (uri == texts.end() || mtime == texts.end() || uri->second != entry.uri) {
+        return false;
+    }
+    // Some writers store fractional seconds; only the whole part counts
+    return g_ascii_strtoll(mtime->second.c_str(), nullptr, 10) == entry.mtime;
+}
+
+bool ThumbnailCache::read_text_chunks(const std::string& png_path, std::map<std::string, std::string>& texts) {
+    std::ifstream file(png_path, std::ios::binary);
+    unsigned char signature[8];
+    if (!file.read(reinterpret_cast<char*>(signature), sizeof(signature)) ||
+        std::memcmp(signature, png_signature, sizeof(signature)) != 0) {
+        return false;
+    }
+
+    unsigned char header[8];
+    std::string data;
+    while (file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+        uint32_t length = read_be32(header);
+        std::string type(reinterpret_cast<const char*>(header + 4), 4);
+        if (type == "IDAT" || type == "IEND") {
+            return true;
+        }
+        bool text = type == "tEXt" || type == "iTXt";
+        if (!text || length > max_text_chunk) {
+            // Skip the chunk and its CRC
+            file.seekg(static_cast<std::streamoff>(length) + 4, std::ios::cur);
+            continue;
+        }
+
+        data.resize(length);
+        if (!file.read(&data[0], length)) {
+            return false;
+        }
+        file.seekg(4, std::ios::cur);
+
+        // keyword NUL text; iTXt adds a compression flag and method, a
+        // language tag and a translated keyword ahead of the text
+        size_t end = data.find('\0');
+        if (end == std::string::npos) {
+            continue;
+        }
+        std::string key = data.substr(0, end);
+        size_t value = end + 1;
+        if (type == "iTXt") {
+            if (value + 2 > data.size() || data[value] != 0) {
+                // Compressed, which thumbnail keys never are
+                continue;
+            }
+            size_t language = data.find('\0', value + 2);
+            size_t translated = language == std::string::npos ? language : data.find('\0', language + 1);
+            if (translated == std::string::npos) {
+                continue;
+            }
+            value = translated + 1;
+        }
+        texts[key] = data.substr(value);
+    }
+    // Ran out of file before the image data
+    return false;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+// Sizes of the freedesktop.org thumbnail cache
+enum class ThumbnailSize {
+    // Fits in 128x128, in "normal/"
+    normal,
+    // Fits in 256x256, in "large/"
+    large
+};
+
+int thumbnail_pixels(ThumbnailSize size);
+
+// Lookups in the thumbnail cache shared by file managers and image
+// viewers, laid out as the freedesktop.org Thumbnail Managing Standard
+// says: a thumbnail of file:///a/b.jpg is "<root>/<size>/<md5 of the
+// URI>.png", a PNG whose Thumb::URI and Thumb::MTime text chunks name the
+// file and its modification time. A thumbnail is only used while both
+// still match. Files that couldn't be thumbnailed are remembered the same
+// way under "<root>/fail/<application>/", so they aren't tried again until
+// they change.
+//
+// Only reads; writing thumbnails needs an image encoder (see
+// ThumbnailPool).
+class ThumbnailCache {
+public:
+    // What a lookup needs to know about one file
+    struct Entry {
+        std::string uri;
+        // Modification time in whole seconds, as Thumb::MTime stores it
+        long long mtime = 0;
+        unsigned long long size = 0;
+        std::string thumbnail_path;
+        std::string failure_path;
+    };
+
+    explicit ThumbnailCache(std::string root = default_root(), std::string application = "elysia-downloader");
+
+    // $XDG_CACHE_HOME/thumbnails
+    static std::string default_root();
+
+    const std::string& root() const { return root_dir; }
+    std::string directory(ThumbnailSize size) const;
+    std::string failure_directory() const;
+
+    // Fills `entry` for the file at `path`; false if it can't be stat'ed
+    bool describe(const std::string& path, ThumbnailSize size, Entry& entry) const;
+
+    // Whether `png_path` is a thumbnail of `entry` as it is now
+    static bool is_current(const std::string& png_path, const Entry& entry);
+
+    // The tEXt chunks of a PNG up to its image data, which is never read.
+    // Thumbnailers write their keys ahead of it, so this costs one small
+    // read per thumbnail instead of a decode.
+    static bool read_text_chunks(const std::string& png_path, std::map<std::string, std::string>& texts);
+
+private:
+    std::string root_dir;
+    std::string application;
+};
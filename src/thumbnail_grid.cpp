@@ -0,0 +1,38 @@
+#include "thumbnail_grid.h"
+
+namespace {
+
+void on_setup(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer user_data) {
+    GtkWidget* picture = gtk_picture_new();
+    // A fixed size, so tiles never change the layout as thumbnails arrive
+    gtk_widget_set_size_request(picture, thumbnail_tile_size, thumbnail_tile_size);
+    gtk_picture_set_content_fit(GTK_PICTURE(picture), GTK_CONTENT_FIT_COVER);
+    gtk_picture_set_can_shrink(GTK_PICTURE(picture), TRUE);
+    gtk_widget_add_css_class(picture, "gallery-tile");
+    gtk_list_item_set_child(item, picture);
+}
+
+} // namespace
+
+GtkWidget* new_thumbnail_grid(GListModel* model, GCallback on_bind, GCallback on_unbind, GCallback on_activate,
+                              gpointer user_data, GtkWidget*& scroller) {
+    GtkListItemFactory* factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", G_CALLBACK(on_setup), nullptr);
+    g_signal_connect(factory, "bind", on_bind, user_data);
+    g_signal_connect(factory, "unbind", on_unbind, user_data);
+
+    GtkWidget* grid = gtk_grid_view_new(GTK_SELECTION_MODEL(gtk_no_selection_new(model)), factory);
+    gtk_grid_view_set_min_columns(GTK_GRID_VIEW(grid), 2);
+    gtk_grid_view_set_max_columns(GTK_GRID_VIEW(grid), 8);
+    gtk_grid_view_set_single_click_activate(GTK_GRID_VIEW(grid), TRUE);
+    gtk_widget_add_css_class(grid, "gallery");
+    g_signal_connect(grid, "activate", on_activate, user_data);
+
+    scroller = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroller), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scroller), grid);
+    gtk_widget_set_hexpand(scroller, TRUE);
+    gtk_widget_set_vexpand(scroller, TRUE);
+    g_object_ref_sink(scroller);
+    return grid;
+}
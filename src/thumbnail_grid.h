@@ -0,0 +1,15 @@
+#pragma once
+
+#include <gtk/gtk.h>
+
+// Edge of a grid tile in logical pixels. Danbooru's previews are at most
+// 180 pixels and large thumbnails 256, so neither is scaled up.
+constexpr int thumbnail_tile_size = 140;
+
+// A GtkGridView of fixed-size picture tiles over `model`, whose reference
+// it takes over, in a vertical scroller. The tiles are made here; the
+// handlers fill and empty them and take clicks, all with `user_data`.
+// Returns the grid; `scroller` comes with a reference of its own, for the
+// owner to drop once it has disconnected from both.
+GtkWidget* new_thumbnail_grid(GListModel* model, GCallback on_bind, GCallback on_unbind, GCallback on_activate,
+                              gpointer user_data, GtkWidget*& scroller);
@@ -0,0 +1,233 @@
+#include "thumbnail_pool.h"
+#include "context_call.h"
+#include "thread_priority.h"
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+namespace {
+
+// Writes `pixbuf` to `destination` with the keys the spec asks for,
+// through a temporary file so readers never see half a PNG
+bool save_thumbnail(GdkPixbuf* pixbuf, const std::string& destination, const ThumbnailCache::Entry& entry,
+                    int image_width, int image_height) {
+    std::string directory = destination.substr(0, destination.rfind('/'));
+    if (g_mkdir_with_parents(directory.c_str(), 0700) != 0) {
+        return false;
+    }
+    std::string temp_path = destination + ".XXXXXX";
+    int fd = g_mkstemp_full(&temp_path[0], O_WRONLY, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+
+    std::string mtime = std::to_string(entry.mtime);
+    std::string size = std::to_string(entry.size);
+    std::string width = std::to_string(image_width);
+    std::string height = std::to_string(image_height);
+    GError* error = nullptr;
+    bool saved = gdk_pixbuf_save(pixbuf, temp_path.c_str(), "png", &error,
+                                 "tEXt::Thumb::URI", entry.uri.c_str(),
+                                 "tEXt::Thumb::MTime", mtime.c_str(),
+                                 "tEXt::Thumb::Size", size.c_str(),
+                                 "tEXt::Thumb::Image::Width", width.c_str(),
+                                 "tEXt::Thumb::Image::Height", height.c_str(),
+                                 "tEXt::Software", "Elysia Downloader",
+                                 NULL);
+    if (!saved) {
+        std::cerr << "Failed to save thumbnail " << destination << ": " << error->message << std::endl;
+        g_error_free(error);
+    } else if (g_rename(temp_path.c_str(), destination.c_str()) != 0) {
+        saved = false;
+    }
+    if (!saved) {
+        g_unlink(temp_path.c_str());
+    }
+    return saved;
+}
+
+// GdkPixbuf's unpremultiplied RGB(A) as a texture, without a copy
+GdkTexture* texture_for_pixbuf(GdkPixbuf* pixbuf) {
+    GBytes* pixels = gdk_pixbuf_read_pixel_bytes(pixbuf);
+    GdkTexture* texture = gdk_memory_texture_new(gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf),
+                                                 gdk_pixbuf_get_has_alpha(pixbuf) ? GDK_MEMORY_R8G8B8A8
+                                                                                  : GDK_MEMORY_R8G8B8,
+                                                 pixels, gdk_pixbuf_get_rowstride(pixbuf));
+    g_bytes_unref(pixels);
+    return texture;
+}
+
+} // namespace
+
+ThumbnailPool::Job::~Job() {
+    if (texture) {
+        g_object_unref(texture);
+    }
+    g_object_unref(alive);
+}
+
+ThumbnailPool::ThumbnailPool(ThumbnailCache cache, ThumbnailSize size, int threads)
+    : cache(std::move(cache)), size(size), context(g_main_context_ref_thread_default()),
+      alive(g_cancellable_new()), next_id(1), cached_count(0), generated_count(0), failed_count(0) {
+    if (threads <= 0) {
+        threads = std::max<int>(1, g_get_num_processors() / 2);
+    }
+    // Exclusive, so lowering the priority of its threads doesn't slow
+    // down the GLib workers that decode what is being shown
+    workers = g_thread_pool_new(run_job, nullptr, threads, TRUE, nullptr);
+    g_thread_pool_set_sort_function(workers, newest_first, nullptr);
+}
+
+ThumbnailPool::~ThumbnailPool() {
+    g_cancellable_cancel(alive);
+    for (auto& entry : pending) {
+        entry.second.first->cancelled = true;
+    }
+    pending.clear();
+    // Waits for the thumbnails being made; queued requests are skipped
+    g_thread_pool_free(workers, FALSE, TRUE);
+    g_object_unref(alive);
+    g_main_context_unref(context);
+}
+
+ThumbnailPool::RequestId ThumbnailPool::request(const std::string& path, ReadyCallback on_ready) {
+    RequestId id = next_id++;
+    Job* job = new Job;
+    job->pool = this;
+    job->id = id;
+    job->path = path;
+    job->alive = G_CANCELLABLE(g_object_ref(alive));
+    pending.emplace(id, std::make_pair(job, std::move(on_ready)));
+    g_thread_pool_push(workers, job, nullptr);
+    return id;
+}
+
+void ThumbnailPool::cancel(RequestId id) {
+    auto it = pending.find(id);
+    if (it != pending.end()) {
+        // The job itself is freed when it comes back
+        it->second.first->cancelled = true;
+        pending.erase(it);
+    }
+}
+
+ThumbnailStats ThumbnailPool::stats() const {
+    ThumbnailStats result;
+    result.cached = cached_count;
+    result.generated = generated_count;
+    result.failed = failed_count;
+    return result;
+}
+
+void ThumbnailPool::run_job(gpointer data, gpointer user_data) {
+    Job* job = static_cast<Job*>(data);
+    static thread_local bool lowered = false;
+    if (!lowered) {
+        lower_thread_priority();
+        lowered = true;
+    }
+
+    // Scrolled past, or the pool is going away, before we got to it
+    if (!job->cancelled && !g_cancellable_is_cancelled(job->alive)) {
+        job->texture = job->pool->thumbnail(job->path);
+    }
+    call_on_context(job->pool->context, deliver, job, G_PRIORITY_DEFAULT_IDLE);
+}
+
+gint ThumbnailPool::newest_first(gconstpointer a, gconstpointer b, gpointer user_data) {
+    RequestId first = static_cast<const Job*>(a)->id;
+    RequestId second = static_cast<const Job*>(b)->id;
+    return first > second ? -1 : (first < second ? 1 : 0);
+}
+
+gboolean ThumbnailPool::deliver(gpointer data) {
+    std::unique_ptr<Job> job(static_cast<Job*>(data));
+    if (g_cancellable_is_cancelled(job->alive)) {
+        // The pool has been destroyed
+        return G_SOURCE_REMOVE;
+    }
+    ThumbnailPool* pool = job->pool;
+    auto it = pool->pending.find(job->id);
+    if (it == pool->pending.end()) {
+        return G_SOURCE_REMOVE;
+    }
+    ReadyCallback on_ready = std::move(it->second.second);
+    pool->pending.erase(it);
+
+    GdkTexture* texture = job->texture;
+    job->texture = nullptr;
+    on_ready(texture);
+    return G_SOURCE_REMOVE;
+}
+
+GdkTexture* ThumbnailPool::thumbnail(const std::string& path) {
+    ThumbnailCache::Entry entry;
+    if (!cache.describe(path, size, entry)) {
+        ++failed_count;
+        return nullptr;
+    }
+
+    if (ThumbnailCache::is_current(entry.thumbnail_path, entry)) {
+        GdkTexture* texture = gdk_texture_new_from_filename(entry.thumbnail_path.c_str(), nullptr);
+        if (texture) {
+            ++cached_count;
+            return texture;
+        }
+        // Unreadable after all; made again below
+    }
+    if (ThumbnailCache::is_current(entry.failure_path, entry)) {
+        ++failed_count;
+        return nullptr;
+    }
+
+    GdkPixbuf* pixbuf = generate(path, entry);
+    if (!pixbuf) {
+        mark_failed(entry);
+        ++failed_count;
+        return nullptr;
+    }
+    ++generated_count;
+    GdkTexture* texture = texture_for_pixbuf(pixbuf);
+    g_object_unref(pixbuf);
+    return texture;
+}
+
+GdkPixbuf* ThumbnailPool::generate(const std::string& path, const ThumbnailCache::Entry& entry) {
+    int width = 0;
+    int height = 0;
+    if (!gdk_pixbuf_get_file_info(path.c_str(), &width, &height) || width <= 0 || height <= 0) {
+        return nullptr;
+    }
+
+    // Loaders that can, JPEG's among them, decode straight to the reduced
+    // size instead of decoding everything and scaling it down
+    int pixels = thumbnail_pixels(size);
+    GError* error = nullptr;
+    GdkPixbuf* loaded = (width <= pixels && height <= pixels)
+                            ? gdk_pixbuf_new_from_file(path.c_str(), &error)
+                            : gdk_pixbuf_new_from_file_at_scale(path.c_str(), pixels, pixels, TRUE, &error);
+    if (!loaded) {
+        std::cerr << "Failed to thumbnail " << path << ": " << error->message << std::endl;
+        g_error_free(error);
+        return nullptr;
+    }
+    // Upright, as the EXIF orientation says
+    GdkPixbuf* pixbuf = gdk_pixbuf_apply_embedded_orientation(loaded);
+    g_object_unref(loaded);
+
+    // Still shown if the cache can't be written, just made again next time
+    save_thumbnail(pixbuf, entry.thumbnail_path, entry, width, height);
+    return pixbuf;
+}
+
+void ThumbnailPool::mark_failed(const ThumbnailCache::Entry& entry) {
+    // An empty pixel carrying the keys, as the spec has it
+    GdkPixbuf* pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, 1, 1);
+    gdk_pixbuf_fill(pixbuf, 0);
+    save_thumbnail(pixbuf, entry.failure_path, entry, 0, 0);
+    g_object_unref(pixbuf);
+}
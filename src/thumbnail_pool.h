@@ -0,0 +1,84 @@
+#pragma once
+
+#include <gtk/gtk.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include "thumbnail_cache.h"
+
+struct ThumbnailStats {
+    // Thumbnails read back from the cache, made and saved, and given up on
+    size_t cached = 0;
+    size_t generated = 0;
+    size_t failed = 0;
+};
+
+// Produces thumbnails of local image files on a pool of its own threads,
+// running at idle CPU and I/O priority so a library being thumbnailed for
+// the first time doesn't slow down anything else. Each request is answered
+// from the ThumbnailCache when it holds a current thumbnail; otherwise the
+// image is decoded at reduced size (JPEGs are scaled while decoding),
+// turned upright and saved there as a PNG, for the next launch and for
+// every other program that reads the cache.
+//
+// The most recent requests run first, which are the ones for what is on
+// screen now. Results are delivered on the main context of the thread
+// that created the pool.
+class ThumbnailPool {
+public:
+    using RequestId = guint64;
+    // `texture` is transfer full, null if the file couldn't be thumbnailed
+    using ReadyCallback = std::function<void(GdkTexture* texture)>;
+
+    // `threads` of 0 uses half the processors
+    ThumbnailPool(ThumbnailCache cache, ThumbnailSize size, int threads = 0);
+    ~ThumbnailPool();
+
+    ThumbnailPool(const ThumbnailPool&) = delete;
+    ThumbnailPool& operator=(const ThumbnailPool&) = delete;
+
+    // `on_ready` is always called later from the main loop, never from
+    // within this call
+    RequestId request(const std::string& path, ReadyCallback on_ready);
+    // The request's callback won't be called; if a worker hasn't picked it
+    // up yet it is skipped
+    void cancel(RequestId id);
+
+    ThumbnailStats stats() const;
+
+private:
+    struct Job {
+        ThumbnailPool* pool;
+        RequestId id;
+        std::string path;
+        std::atomic<bool> cancelled{false};
+        // Owned by the job; set by the worker
+        GdkTexture* texture = nullptr;
+        GCancellable* alive;
+
+        ~Job();
+    };
+
+    ThumbnailCache cache;
+    ThumbnailSize size;
+    GMainContext* context;
+    GThreadPool* workers;
+    // Cancelled when the pool goes away, for results still on their way
+    GCancellable* alive;
+    RequestId next_id;
+    std::map<RequestId, std::pair<Job*, ReadyCallback>> pending;
+
+    std::atomic<size_t> cached_count;
+    std::atomic<size_t> generated_count;
+    std::atomic<size_t> failed_count;
+
+    GdkTexture* thumbnail(const std::string& path);
+    // Decodes, orients and saves a thumbnail of `path`; null on failure
+    GdkPixbuf* generate(const std::string& path, const ThumbnailCache::Entry& entry);
+    void mark_failed(const ThumbnailCache::Entry& entry);
+
+    static void run_job(gpointer data, gpointer user_data);
+    static gint newest_first(gconstpointer a, gconstpointer b, gpointer user_data);
+    static gboolean deliver(gpointer data);
+};
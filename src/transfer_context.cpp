@@ -0,0 +1,125 @@
+#include "transfer_context.h"
+#include "transfer_timings.h"
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// Idle handles beyond this are cleaned up instead of pooled
+constexpr size_t max_idle_handles = 16;
+
+} // namespace
+
+TransferContext& TransferContext::instance() {
+    static TransferContext context;
+    return context;
+}
+
+TransferContext::TransferContext() {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    share = curl_share_init();
+    if (!share) {
+        throw std::runtime_error("Failed to initialize CURL share handle");
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_callback);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_callback);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+TransferContext::~TransferContext() {
+    for (CURL* handle : idle_handles) {
+        curl_easy_cleanup(handle);
+    }
+    curl_share_cleanup(share);
+    curl_global_cleanup();
+}
+
+CURL* TransferContext::acquire() {
+    CURL* handle = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!idle_handles.empty()) {
+            handle = idle_handles.back();
+            idle_handles.pop_back();
+        }
+    }
+
+    if (!handle) {
+        handle = curl_easy_init();
+        if (!handle) {
+            throw std::runtime_error("Failed to initialize CURL");
+        }
+    }
+
+    curl_easy_setopt(handle, CURLOPT_SHARE, share);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    // HTTP/2 where TLS negotiates it. A transfer starting while a
+    // connection to its host is still being set up waits to find out
+    // whether it can share it instead of opening its own.
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+    return handle;
+}
+
+void TransferContext::release(CURL* handle) {
+    if (!handle) {
+        return;
+    }
+
+    // Resetting keeps the handle's connections, caches and session IDs
+    curl_easy_reset(handle);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (idle_handles.size() < max_idle_handles) {
+        idle_handles.push_back(handle);
+        return;
+    }
+    curl_easy_cleanup(handle);
+}
+
+void TransferContext::record_transfer(CURL* handle, CURLcode code) {
+    TransferTimings::instance().record(handle, code);
+    if (code != CURLE_OK) {
+        return;
+    }
+
+    // NUM_CONNECTS counts connections this transfer had to open; zero means
+    // it ran over one that was already there
+    long new_connections = 0;
+    curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &new_connections);
+
+    ConnectionStats snapshot;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++connection_stats.transfers;
+        if (new_connections == 0) {
+            ++connection_stats.reused;
+        }
+        snapshot = connection_stats;
+    }
+
+    std::ostringstream message;
+    message << "Connection " << (new_connections == 0 ? "reused" : "opened")
+            << " (reuse rate " << std::fixed << std::setprecision(1) << snapshot.reuse_rate() * 100.0
+            << "% over " << snapshot.transfers << " transfers)";
+    std::cout << message.str() << std::endl;
+}
+
+ConnectionStats TransferContext::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return connection_stats;
+}
+
+void TransferContext::lock_callback(CURL* handle, curl_lock_data data, curl_lock_access access, void* userp) {
+    static_cast<TransferContext*>(userp)->share_locks[data].lock();
+}
+
+void TransferContext::unlock_callback(CURL* handle, curl_lock_data data, void* userp) {
+    static_cast<TransferContext*>(userp)->share_locks[data].unlock();
+}
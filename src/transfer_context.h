@@ -0,0 +1,49 @@
+#pragma once
+
+#include <curl/curl.h>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+struct ConnectionStats {
+    size_t transfers = 0;
+    size_t reused = 0;
+
+    double reuse_rate() const { return transfers ? static_cast<double>(reused) / transfers : 0.0; }
+};
+
+// Process-wide curl state: the single curl_global_init, a share object
+// holding the DNS cache, TLS sessions and connection cache, and a pool of
+// easy handles. Handles borrowed from here keep their connections alive
+// across requests, so repeat requests skip DNS, TCP and TLS setup.
+class TransferContext {
+public:
+    static TransferContext& instance();
+
+    TransferContext(const TransferContext&) = delete;
+    TransferContext& operator=(const TransferContext&) = delete;
+
+    // Returns a reset easy handle attached to the share object
+    CURL* acquire();
+    // Gives a handle back to the pool; it must not be attached to a multi handle
+    void release(CURL* handle);
+
+    // Records the phase timings of a finished transfer with TransferTimings
+    // and, if it succeeded, counts it towards the connection reuse statistics
+    void record_transfer(CURL* handle, CURLcode code);
+    ConnectionStats stats() const;
+
+private:
+    TransferContext();
+    ~TransferContext();
+
+    CURLSH* share;
+    std::mutex share_locks[CURL_LOCK_DATA_LAST];
+
+    mutable std::mutex mutex;
+    std::vector<CURL*> idle_handles;
+    ConnectionStats connection_stats;
+
+    static void lock_callback(CURL* handle, curl_lock_data data, curl_lock_access access, void* userp);
+    static void unlock_callback(CURL* handle, curl_lock_data data, void* userp);
+};
@@ -0,0 +1,247 @@
+#include "transfer_engine.h"
+#include "request_scheduler.h"
+#include "transfer_context.h"
+#include <glib-unix.h>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+// Streams on one HTTP/2 connection, below the 100 most servers allow. A
+// limit per connection, not per host: past it curl opens another one.
+constexpr long max_streams_per_connection = 64;
+
+} // namespace
+
+TransferEngine::TransferEngine(GMainContext* context)
+    : multi(nullptr), context(context), timer_source(nullptr), next_id(1) {
+    multi = curl_multi_init();
+    if (!multi) {
+        throw std::runtime_error("Failed to initialize CURL multi handle");
+    }
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+    curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+
+    // Transfers to a host that speaks HTTP/2 become streams on one
+    // connection instead of a connection each. Connections per host are
+    // left unbounded, so HTTP/1.1 runs as many transfers as were started.
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_streams_per_connection);
+}
+
+TransferEngine::~TransferEngine() {
+    // Queued requests are dropped without their callbacks, like running ones
+    scheduler.reset();
+
+    for (auto& entry : transfers) {
+        curl_multi_remove_handle(multi, entry.second.easy);
+        TransferContext::instance().release(entry.second.easy);
+    }
+    transfers.clear();
+
+    curl_multi_cleanup(multi);
+
+    // Anything curl didn't report as removed during cleanup
+    while (!watches.empty()) {
+        remove_watch(*watches.begin());
+    }
+    if (timer_source) {
+        g_source_destroy(timer_source);
+        g_source_unref(timer_source);
+    }
+}
+
+TransferEngine::TransferId TransferEngine::start(CURL* easy, Completion on_done) {
+    TransferId id = next_id++;
+    add(id, easy, std::move(on_done));
+    return id;
+}
+
+void TransferEngine::restart(TransferId id, CURL* easy, Completion on_done) {
+    if (transfers.count(id)) {
+        TransferContext::instance().release(easy);
+        throw std::runtime_error("Transfer " + std::to_string(id) + " is still running");
+    }
+    add(id, easy, std::move(on_done));
+}
+
+void TransferEngine::add(TransferId id, CURL* easy, Completion on_done) {
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, reinterpret_cast<void*>(static_cast<uintptr_t>(id)));
+    transfers[id] = Transfer{easy, std::move(on_done)};
+
+    CURLMcode rc = curl_multi_add_handle(multi, easy);
+    if (rc != CURLM_OK) {
+        transfers.erase(id);
+        TransferContext::instance().release(easy);
+        throw std::runtime_error("Failed to start transfer: " + std::string(curl_multi_strerror(rc)));
+    }
+}
+
+TransferEngine::TransferId TransferEngine::submit(const std::string& url, RequestFactory make_request,
+                                                 Completion on_done) {
+    if (!scheduler) {
+        scheduler = std::make_unique<RequestScheduler>(*this, context, RateLimitOptions::from_environment());
+    }
+    TransferId id = next_id++;
+    scheduler->submit(id, url, std::move(make_request), std::move(on_done));
+    return id;
+}
+
+void TransferEngine::cancel(TransferId id) {
+    if (scheduler) {
+        scheduler->cancel(id);
+    }
+    auto it = transfers.find(id);
+    if (it == transfers.end()) {
+        return;
+    }
+    CURL* easy = it->second.easy;
+    transfers.erase(it);
+    curl_multi_remove_handle(multi, easy);
+    TransferContext::instance().release(easy);
+}
+
+int TransferEngine::socket_callback(CURL* easy, curl_socket_t fd, int what, void* userp, void* socketp) {
+    TransferEngine* self = static_cast<TransferEngine*>(userp);
+    SocketWatch* watch = static_cast<SocketWatch*>(socketp);
+
+    if (what == CURL_POLL_REMOVE) {
+        if (watch) {
+            curl_multi_assign(self->multi, fd, nullptr);
+            self->remove_watch(watch);
+        }
+        return 0;
+    }
+
+    if (watch) {
+        // Interest changed: replace the source with one for the new condition
+        g_source_destroy(watch->source);
+        g_source_unref(watch->source);
+    } else {
+        watch = new SocketWatch{self, fd, nullptr};
+        self->watches.insert(watch);
+        curl_multi_assign(self->multi, fd, watch);
+    }
+
+    int condition = G_IO_ERR | G_IO_HUP;
+    if (what & CURL_POLL_IN) condition |= G_IO_IN;
+    if (what & CURL_POLL_OUT) condition |= G_IO_OUT;
+
+    watch->source = g_unix_fd_source_new(fd, static_cast<GIOCondition>(condition));
+    g_source_set_callback(watch->source, G_SOURCE_FUNC(on_socket_ready), watch, nullptr);
+    g_source_attach(watch->source, self->context);
+    return 0;
+}
+
+int TransferEngine::timer_callback(CURLM* multi, long timeout_ms, void* userp) {
+    TransferEngine* self = static_cast<TransferEngine*>(userp);
+
+    if (self->timer_source) {
+        g_source_destroy(self->timer_source);
+        g_source_unref(self->timer_source);
+        self->timer_source = nullptr;
+    }
+
+    // -1 means curl has no pending timeout; 0 means "act as soon as possible",
+    // which we still defer to the main loop to avoid re-entering curl here
+    if (timeout_ms >= 0) {
+        self->timer_source = g_timeout_source_new(static_cast<guint>(timeout_ms));
+        g_source_set_callback(self->timer_source, on_timeout, self, nullptr);
+        g_source_attach(self->timer_source, self->context);
+    }
+    return 0;
+}
+
+gboolean TransferEngine::on_socket_ready(gint fd, GIOCondition condition, gpointer user_data) {
+    SocketWatch* watch = static_cast<SocketWatch*>(user_data);
+    TransferEngine* self = watch->engine;
+
+    int event_mask = 0;
+    if (condition & G_IO_IN) event_mask |= CURL_CSELECT_IN;
+    if (condition & G_IO_OUT) event_mask |= CURL_CSELECT_OUT;
+    if (condition & (G_IO_ERR | G_IO_HUP)) event_mask |= CURL_CSELECT_ERR;
+
+    // `watch` may be freed by socket_callback during this call
+    self->socket_action(fd, event_mask);
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean TransferEngine::on_timeout(gpointer user_data) {
+    TransferEngine* self = static_cast<TransferEngine*>(user_data);
+
+    // The main loop drops the source when we return G_SOURCE_REMOVE; curl may
+    // install a new timer while we are still inside this call
+    g_source_unref(self->timer_source);
+    self->timer_source = nullptr;
+
+    self->socket_action(CURL_SOCKET_TIMEOUT, 0);
+    return G_SOURCE_REMOVE;
+}
+
+void TransferEngine::socket_action(curl_socket_t fd, int event_mask) {
+    int running = 0;
+    CURLMcode rc = curl_multi_socket_action(multi, fd, event_mask, &running);
+    if (rc != CURLM_OK) {
+        std::cerr << "curl_multi_socket_action failed: " << curl_multi_strerror(rc) << std::endl;
+    }
+    dispatch_completed();
+}
+
+void TransferEngine::dispatch_completed() {
+    CURLMsg* msg;
+    int messages_left = 0;
+
+    while ((msg = curl_multi_info_read(multi, &messages_left))) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        CURL* easy = msg->easy_handle;
+        CURLcode code = msg->data.result;
+
+        char* priv = nullptr;
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, &priv);
+        TransferId id = static_cast<TransferId>(reinterpret_cast<uintptr_t>(priv));
+
+        curl_multi_remove_handle(multi, easy);
+
+        Completion on_done;
+        auto it = transfers.find(id);
+        if (it != transfers.end()) {
+            on_done = std::move(it->second.on_done);
+            transfers.erase(it);
+        }
+
+        TransferResult result;
+        result.code = code;
+        result.easy = easy;
+        result.id = id;
+        if (code != CURLE_OK) {
+            result.error = curl_easy_strerror(code);
+        }
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &result.http_status);
+        TransferContext::instance().record_transfer(easy, code);
+
+        // Completions run from a GLib callback, so nothing may propagate out
+        if (on_done) {
+            try {
+                on_done(result);
+            } catch (const std::exception& e) {
+                std::cerr << "Error in transfer completion: " << e.what() << std::endl;
+            }
+        }
+
+        TransferContext::instance().release(easy);
+    }
+}
+
+void TransferEngine::remove_watch(SocketWatch* watch) {
+    watches.erase(watch);
+    if (watch->source) {
+        g_source_destroy(watch->source);
+        g_source_unref(watch->source);
+    }
+    delete watch;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <curl/curl.h>
+#include <glib.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+class RequestScheduler;
+
+struct TransferResult {
+    CURLcode code = CURLE_OK;
+    long http_status = 0;
+    std::string error;
+    // Only valid inside the completion callback, for curl_easy_getinfo()
+    CURL* easy = nullptr;
+    // Engine id of the finished transfer, see TransferEngine::restart()
+    guint64 id = 0;
+
+    bool ok() const { return code == CURLE_OK; }
+};
+
+// Runs many curl transfers concurrently on one thread. Sockets and timeouts
+// are watched through GSources attached to a GMainContext, so transfers make
+// progress while the main loop keeps rendering frames.
+class TransferEngine {
+public:
+    using TransferId = guint64;
+    using Completion = std::function<void(const TransferResult& result)>;
+    // Makes a configured handle from TransferContext for one attempt of a
+    // request; anything the previous attempt wrote must be reset by it
+    using RequestFactory = std::function<CURL*()>;
+
+    // Attaches to `context`, or to the global default context if null
+    explicit TransferEngine(GMainContext* context = nullptr);
+    ~TransferEngine();
+
+    TransferEngine(const TransferEngine&) = delete;
+    TransferEngine& operator=(const TransferEngine&) = delete;
+
+    // Takes ownership of a configured easy handle from TransferContext.
+    // `on_done` runs from the main context once the transfer finishes; the
+    // handle goes back to the pool right after it returns.
+    TransferId start(CURL* easy, Completion on_done);
+
+    // Like start(), but reuses the id of a transfer whose completion is
+    // running right now. Retries issued this way stay cancellable through
+    // the id the caller was originally given.
+    void restart(TransferId id, CURL* easy, Completion on_done);
+
+    // For API requests: queues the request behind the rate limiter of
+    // `url`'s host and retries it while the server turns it away (see
+    // RequestScheduler). `on_done` gets the final attempt only.
+    TransferId submit(const std::string& url, RequestFactory make_request, Completion on_done);
+
+    // Aborts a running or queued transfer; its completion callback is never
+    // called. Unknown or finished ids are ignored.
+    void cancel(TransferId id);
+
+    size_t active_count() const { return transfers.size(); }
+
+private:
+    struct Transfer {
+        CURL* easy;
+        Completion on_done;
+    };
+
+    struct SocketWatch {
+        TransferEngine* engine;
+        curl_socket_t fd;
+        GSource* source;
+    };
+
+    CURLM* multi;
+    GMainContext* context;
+    GSource* timer_source;
+    TransferId next_id;
+    std::map<TransferId, Transfer> transfers;
+    std::set<SocketWatch*> watches;
+    // Created by the first submit()
+    std::unique_ptr<RequestScheduler> scheduler;
+
+    static int socket_callback(CURL* easy, curl_socket_t fd, int what, void* userp, void* socketp);
+    static int timer_callback(CURLM* multi, long timeout_ms, void* userp);
+    static gboolean on_socket_ready(gint fd, GIOCondition condition, gpointer user_data);
+    static gboolean on_timeout(gpointer user_data);
+
+    void add(TransferId id, CURL* easy, Completion on_done);
+    void socket_action(curl_socket_t fd, int event_mask);
+    void dispatch_completed();
+    void remove_watch(SocketWatch* watch);
+};
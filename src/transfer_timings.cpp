@@ -0,0 +1,311 @@
+#include "transfer_timings.h"
+#include "http_header.h"
+#include <glib.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+
+namespace {
+
+constexpr size_t max_event_name = 96;
+
+// What the trace viewer labels a transfer with: the URL without its host
+std::string event_name(const std::string& url) {
+    std::string name = url.substr(url_origin(url).size());
+    if (name.size() > max_event_name) {
+        name.resize(max_event_name - 3);
+        name += "...";
+    }
+    return name.empty() ? "/" : name;
+}
+
+const char* http_version_name(long version) {
+    switch (version) {
+    case CURL_HTTP_VERSION_1_0:
+        return "1.0";
+    case CURL_HTTP_VERSION_1_1:
+        return "1.1";
+    case CURL_HTTP_VERSION_2_0:
+        return "2";
+    case CURL_HTTP_VERSION_3:
+        return "3";
+    default:
+        return "";
+    }
+}
+
+void write_json_string(std::ostream& out, const std::string& text) {
+    out << '"';
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec
+                << std::setfill(' ');
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+void write_event(std::ostream& out, const char* name, const char* category, int64_t start, int64_t duration,
+                 size_t lane) {
+    out << ",\n{\"name\":\"" << name << "\",\"cat\":\"" << category << "\",\"ph\":\"X\",\"ts\":" << start
+        << ",\"dur\":" << duration << ",\"pid\":1,\"tid\":" << lane << "}";
+}
+
+} // namespace
+
+void LatencyHistogram::add(int64_t us) {
+    us = std::max<int64_t>(us, 0);
+    ++buckets[bucket_for(us)];
+    ++total;
+    sum += us;
+    max = std::max(max, us);
+}
+
+int64_t LatencyHistogram::percentile(double p) const {
+    if (total == 0) {
+        return 0;
+    }
+    size_t rank = std::max<size_t>(1, static_cast<size_t>(std::ceil(p * total)));
+    size_t seen = 0;
+    for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+        seen += buckets[bucket];
+        if (seen >= rank) {
+            return std::min(bucket_middle(bucket), max);
+        }
+    }
+    return max;
+}
+
+size_t LatencyHistogram::bucket_for(int64_t us) {
+    // Values below sub_buckets get a bucket each; above, every power of two
+    // is split into sub_buckets equal parts
+    if (us < sub_buckets) {
+        return static_cast<size_t>(us);
+    }
+    int octave = 63 - __builtin_clzll(static_cast<unsigned long long>(us));
+    size_t sub = static_cast<size_t>(us >> (octave - 3)) - sub_buckets;
+    size_t bucket = sub_buckets * static_cast<size_t>(octave - 2) + sub;
+    return std::min(bucket, std::tuple_size<decltype(buckets)>::value - 1);
+}
+
+int64_t LatencyHistogram::bucket_middle(size_t bucket) {
+    if (bucket < sub_buckets) {
+        return static_cast<int64_t>(bucket);
+    }
+    int octave = static_cast<int>(bucket / sub_buckets) + 2;
+    int64_t width = int64_t{1} << (octave - 3);
+    int64_t low = static_cast<int64_t>(sub_buckets + bucket % sub_buckets) * width;
+    return low + width / 2;
+}
+
+void TimingSummary::add(const TransferTiming& timing) {
+    ++transfers;
+    bytes += timing.bytes;
+    if (timing.code != CURLE_OK) {
+        // A timeout says nothing about how long responses take
+        ++failed;
+        return;
+    }
+    if (timing.http_version == CURL_HTTP_VERSION_2_0) {
+        ++multiplexed;
+    }
+    if (timing.reused) {
+        ++reused;
+    } else {
+        dns.add(timing.dns_us);
+        connect.add(timing.connect_us);
+    }
+    if (timing.tls_us > 0) {
+        tls.add(timing.tls_us);
+    }
+    first_byte.add(timing.first_byte_us());
+    total.add(timing.total_us);
+}
+
+TransferTimings& TransferTimings::instance() {
+    static TransferTimings timings;
+    return timings;
+}
+
+TransferTimings::TransferTimings() : epoch(std::chrono::steady_clock::now()) {
+    const char* path = g_getenv("ELYSIA_TRACE");
+    if (path && *path) {
+        trace_path = path;
+    }
+}
+
+void TransferTimings::record(CURL* handle, CURLcode code) {
+    curl_off_t name_lookup = 0, connect = 0, app_connect = 0, pre_transfer = 0, start_transfer = 0, total = 0;
+    curl_off_t bytes = 0;
+    long new_connections = 0;
+    long http_status = 0;
+    long http_version = 0;
+    char* url = nullptr;
+    curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &name_lookup);
+    curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &app_connect);
+    curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pre_transfer);
+    curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &start_transfer);
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &new_connections);
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_status);
+    curl_easy_getinfo(handle, CURLINFO_HTTP_VERSION, &http_version);
+    curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url);
+
+    // curl's timers are cumulative from the start of the transfer, and the
+    // ones for phases a failed transfer never reached stay at zero
+    TransferTiming timing;
+    timing.url = url ? url : "";
+    timing.code = code;
+    timing.http_status = http_status;
+    timing.http_version = http_version;
+    timing.reused = new_connections == 0 && pre_transfer > 0;
+    timing.bytes = bytes;
+
+    int64_t connected = std::max(connect, name_lookup);
+    int64_t set_up = std::max<int64_t>(app_connect, connected);
+    int64_t first_byte = std::max<int64_t>(start_transfer > 0 ? start_transfer : total, set_up);
+    timing.dns_us = name_lookup;
+    timing.connect_us = connected - name_lookup;
+    timing.tls_us = set_up - connected;
+    timing.wait_us = first_byte - set_up;
+    timing.total_us = std::max<int64_t>(total, first_byte);
+    timing.receive_us = timing.total_us - first_byte;
+
+    auto now = std::chrono::steady_clock::now();
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - epoch).count();
+    timing.start_us = std::max<int64_t>(0, elapsed - timing.total_us);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    hosts[std::string(url_origin(timing.url))].add(timing);
+    if (!trace_path.empty() && traced.size() < max_traced) {
+        traced.push_back(std::move(timing));
+    }
+}
+
+std::map<std::string, TimingSummary> TransferTimings::summaries() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hosts;
+}
+
+void TransferTimings::print_summary(std::ostream& out) const {
+    const std::pair<const char*, LatencyHistogram TimingSummary::*> phases[] = {
+        {"dns", &TimingSummary::dns},
+        {"connect", &TimingSummary::connect},
+        {"tls", &TimingSummary::tls},
+        {"first byte", &TimingSummary::first_byte},
+        {"total", &TimingSummary::total},
+    };
+    for (const auto& entry : summaries()) {
+        const TimingSummary& summary = entry.second;
+        out << std::fixed << std::setprecision(2) << "Transfers to " << entry.first << ": " << summary.transfers
+            << " (" << summary.reused << " reused, " << summary.multiplexed << " over HTTP/2, "
+            << summary.failed << " failed, "
+            << summary.bytes / (1024.0 * 1024.0) << " MiB)\n";
+        if (summary.total.count() == 0) {
+            continue;
+        }
+        out << "  " << std::left << std::setw(12) << "ms" << std::right << std::setw(10) << "p50"
+            << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max" << std::setw(8) << "n"
+            << "\n";
+        for (const auto& phase : phases) {
+            const LatencyHistogram& histogram = summary.*phase.second;
+            if (histogram.count() == 0) {
+                continue;
+            }
+            out << "  " << std::left << std::setw(12) << phase.first << std::right << std::setw(10)
+                << histogram.percentile(0.5) / 1000.0 << std::setw(10) << histogram.percentile(0.9) / 1000.0
+                << std::setw(10) << histogram.percentile(0.99) / 1000.0 << std::setw(10)
+                << histogram.max_us() / 1000.0 << std::setw(8) << histogram.count() << "\n";
+        }
+    }
+    out.flush();
+}
+
+void TransferTimings::set_trace_path(std::string path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    trace_path = std::move(path);
+    if (trace_path.empty()) {
+        traced.clear();
+    }
+}
+
+bool TransferTimings::write_trace() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (trace_path.empty()) {
+        return true;
+    }
+
+    // Each transfer goes on the first row that is free by the time it
+    // starts, so overlapping transfers sit on separate rows
+    std::vector<size_t> order(traced.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+              [this](size_t a, size_t b) { return traced[a].start_us < traced[b].start_us; });
+    std::vector<size_t> lanes(traced.size());
+    std::vector<int64_t> lane_free_at;
+    for (size_t index : order) {
+        const TransferTiming& timing = traced[index];
+        size_t lane = 0;
+        while (lane < lane_free_at.size() && lane_free_at[lane] > timing.start_us) {
+            ++lane;
+        }
+        if (lane == lane_free_at.size()) {
+            lane_free_at.push_back(0);
+        }
+        lane_free_at[lane] = timing.start_us + timing.total_us;
+        lanes[index] = lane + 1;
+    }
+
+    std::ofstream out(trace_path);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+        << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ElysiaDownloader transfers\"}}";
+    for (size_t lane = 1; lane <= lane_free_at.size(); ++lane) {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << lane
+            << ",\"args\":{\"name\":\"transfer " << lane << "\"}}";
+    }
+    for (size_t index : order) {
+        const TransferTiming& timing = traced[index];
+        size_t lane = lanes[index];
+        out << ",\n{\"name\":";
+        write_json_string(out, event_name(timing.url));
+        out << ",\"cat\":\"transfer\",\"ph\":\"X\",\"ts\":" << timing.start_us << ",\"dur\":" << timing.total_us
+            << ",\"pid\":1,\"tid\":" << lane << ",\"args\":{\"url\":";
+        write_json_string(out, timing.url);
+        out << ",\"status\":" << timing.http_status
+            << ",\"http\":\"" << http_version_name(timing.http_version) << "\""
+            << ",\"bytes\":" << timing.bytes
+            << ",\"reused\":" << (timing.reused ? "true" : "false") << ",\"result\":";
+        write_json_string(out, curl_easy_strerror(timing.code));
+        out << "}}";
+
+        // The phases nest under the transfer, back to back
+        const std::pair<const char*, int64_t> phases[] = {
+            {"dns", timing.dns_us},   {"connect", timing.connect_us}, {"tls", timing.tls_us},
+            {"wait", timing.wait_us}, {"receive", timing.receive_us},
+        };
+        int64_t at = timing.start_us;
+        for (const auto& phase : phases) {
+            if (phase.second > 0) {
+                write_event(out, phase.first, "phase", at, phase.second, lane);
+                at += phase.second;
+            }
+        }
+    }
+    out << "\n]}\n";
+
+    if (!out.flush()) {
+        std::cerr << "Failed to write transfer trace " << trace_path << std::endl;
+        return false;
+    }
+    std::cout << "Wrote " << traced.size() << " transfers to " << trace_path << std::endl;
+    return true;
+}
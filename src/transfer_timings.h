@@ -0,0 +1,120 @@
+#pragma once
+
+#include <curl/curl.h>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Where one finished transfer spent its time, split out of curl's
+// cumulative phase timers. All durations are in microseconds.
+struct TransferTiming {
+    std::string url;
+    CURLcode code = CURLE_OK;
+    long http_status = 0;
+    // CURL_HTTP_VERSION_1_1, CURL_HTTP_VERSION_2_0, ...; 0 if no response
+    long http_version = 0;
+    // Ran over a connection that was already open; dns, connect and tls
+    // are then zero
+    bool reused = false;
+    curl_off_t bytes = 0;
+    // Since TransferTimings was created
+    int64_t start_us = 0;
+
+    int64_t dns_us = 0;
+    int64_t connect_us = 0;
+    // Zero for plain HTTP
+    int64_t tls_us = 0;
+    // Request sent until the first response byte
+    int64_t wait_us = 0;
+    int64_t receive_us = 0;
+    int64_t total_us = 0;
+
+    // From the start of the transfer until the first response byte
+    int64_t first_byte_us() const { return total_us - receive_us; }
+};
+
+// Latencies in buckets eight to a power of two, so percentiles are
+// accurate to about 12% whatever the scale, in a fixed amount of memory
+class LatencyHistogram {
+public:
+    void add(int64_t us);
+
+    size_t count() const { return total; }
+    double mean_us() const { return total ? static_cast<double>(sum) / total : 0.0; }
+    int64_t max_us() const { return max; }
+    // Middle of the bucket holding the `p` quantile, 0 <= p <= 1
+    int64_t percentile(double p) const;
+
+private:
+    static constexpr int sub_buckets = 8;
+    // Up to 2^40 us, about 12 days
+    std::array<size_t, sub_buckets * 38> buckets{};
+    size_t total = 0;
+    int64_t sum = 0;
+    int64_t max = 0;
+
+    static size_t bucket_for(int64_t us);
+    static int64_t bucket_middle(size_t bucket);
+};
+
+struct TimingSummary {
+    size_t transfers = 0;
+    size_t reused = 0;
+    // Streams on an HTTP/2 connection, reused or not
+    size_t multiplexed = 0;
+    size_t failed = 0;
+    curl_off_t bytes = 0;
+    // Failed transfers are only counted. Only connections that had to be
+    // opened count towards dns and connect, and only TLS handshakes towards tls
+    LatencyHistogram dns;
+    LatencyHistogram connect;
+    LatencyHistogram tls;
+    LatencyHistogram first_byte;
+    LatencyHistogram total;
+
+    void add(const TransferTiming& timing);
+};
+
+// Process-wide record of transfer timings. Every transfer is summarized
+// per host; with a trace path set, each one is also kept so the whole run
+// can be written as a Chrome trace-event file, which Perfetto and
+// chrome://tracing show as a timeline with one row per concurrent transfer.
+class TransferTimings {
+public:
+    static TransferTimings& instance();
+
+    TransferTimings(const TransferTimings&) = delete;
+    TransferTimings& operator=(const TransferTimings&) = delete;
+
+    // Reads the timers of a transfer that just finished on `handle`
+    void record(CURL* handle, CURLcode code);
+
+    // Keyed by "scheme://host"
+    std::map<std::string, TimingSummary> summaries() const;
+    void print_summary(std::ostream& out) const;
+
+    // Starts keeping transfers for write_trace(). $ELYSIA_TRACE sets a path
+    // at startup; an empty path stops tracing.
+    void set_trace_path(std::string path);
+    // Writes the transfers kept so far to the trace path. True if there was
+    // nothing to do.
+    bool write_trace() const;
+
+private:
+    TransferTimings();
+
+    // Enough for a long session; later transfers are only summarized
+    static constexpr size_t max_traced = 200000;
+
+    const std::chrono::steady_clock::time_point epoch;
+    mutable std::mutex mutex;
+    std::map<std::string, TimingSummary> hosts;
+    std::string trace_path;
+    std::vector<TransferTiming> traced;
+};
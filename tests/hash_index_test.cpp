@@ -0,0 +1,140 @@
+// Checks HashIndex::nearest() against a linear scan over random adds,
+// replacements and removals, through several rebuilds of its tables.
+
+#include "hash_index.h"
+#include "perceptual_hash.h"
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct Entry {
+    std::string name;
+    uint64_t hash;
+    bool removed;
+};
+
+// What nearest() should find: the closest within `max_distance`, ties to
+// the one added first
+bool linear_nearest(const std::vector<Entry>& entries, uint64_t hash, int max_distance, HashIndex::Match& match) {
+    int best = max_distance + 1;
+    for (const Entry& entry : entries) {
+        if (entry.removed) {
+            continue;
+        }
+        int distance = hash_distance(entry.hash, hash);
+        if (distance < best) {
+            best = distance;
+            match.name = entry.name;
+            match.hash = entry.hash;
+            match.distance = distance;
+        }
+    }
+    return best <= max_distance;
+}
+
+// A hash `flips` random bits away from `hash`
+uint64_t near(uint64_t hash, int flips, std::mt19937_64& random) {
+    for (int i = 0; i < flips; ++i) {
+        hash ^= uint64_t(1) << (random() % 64);
+    }
+    return hash;
+}
+
+} // namespace
+
+int main() {
+    std::mt19937_64 random(1);
+    HashIndex index;
+    // In the order added, which a replacement counts as
+    std::vector<Entry> entries;
+    std::unordered_map<std::string, size_t> positions;
+    // Names of the entries not removed
+    std::vector<std::string> live;
+    std::unordered_map<std::string, size_t> live_positions;
+    size_t failures = 0;
+    size_t next_name = 0;
+
+    auto erase = [&](const std::string& name) {
+        auto it = positions.find(name);
+        if (it == positions.end()) {
+            return;
+        }
+        entries[it->second].removed = true;
+        positions.erase(it);
+        size_t slot = live_positions[name];
+        live[slot] = live.back();
+        live_positions[live[slot]] = slot;
+        live.pop_back();
+        live_positions.erase(name);
+    };
+    auto any_live = [&]() -> const Entry& { return entries[positions[live[random() % live.size()]]]; };
+
+    for (size_t step = 0; step < 80000; ++step) {
+        // Every third stretch mostly removes, so removed items become the
+        // majority and are compacted away
+        bool shrinking = step / 10000 % 3 == 2;
+        unsigned adds = shrinking ? 15 : 55;
+        unsigned removes = shrinking ? 60 : 20;
+        unsigned action = random() % 100;
+        if (action < adds || live.empty()) {
+            // Hashes in clusters, so there is something to find nearby
+            uint64_t hash =
+                live.empty() || random() % 4 == 0 ? random() : near(any_live().hash, random() % 12, random);
+            std::string name =
+                random() % 10 == 0 && !live.empty() ? any_live().name : std::to_string(next_name++);
+            index.add(name, hash);
+            auto it = positions.find(name);
+            if (it != positions.end() && entries[it->second].hash == hash) {
+                continue;
+            }
+            erase(name);
+            entries.push_back({name, hash, false});
+            positions[name] = entries.size() - 1;
+            live_positions[name] = live.size();
+            live.push_back(name);
+        } else if (action < adds + removes) {
+            std::string name = any_live().name;
+            index.remove(name);
+            erase(name);
+        } else {
+            uint64_t query = random() % 3 == 0 ? random() : near(any_live().hash, random() % 16, random);
+            int max_distance = static_cast<int>(random() % 24);
+            HashIndex::Match expected;
+            HashIndex::Match found;
+            bool want = linear_nearest(entries, query, max_distance, expected);
+            bool got = index.nearest(query, max_distance, found);
+            if (want != got ||
+                (want && (found.name != expected.name || found.hash != expected.hash ||
+                          found.distance != expected.distance))) {
+                if (++failures <= 10) {
+                    std::cerr << "Step " << step << ": nearest within " << max_distance << " of " << std::hex << query
+                              << std::dec << " gave " << (got ? "'" + found.name + "'" : "nothing") << ", expected "
+                              << (want ? "'" + expected.name + "'" : "nothing") << std::endl;
+                }
+            }
+        }
+
+        if (index.size() != live.size()) {
+            std::cerr << "Step " << step << ": " << index.size() << " hashes indexed, expected " << live.size()
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    for (const std::string& name : live) {
+        if (!index.contains(name)) {
+            std::cerr << "Lost '" << name << "'" << std::endl;
+            ++failures;
+        }
+    }
+    if (failures > 0) {
+        std::cerr << failures << " failures" << std::endl;
+        return 1;
+    }
+    return 0;
+}